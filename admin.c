@@ -0,0 +1,429 @@
+#define _GNU_SOURCE /* accept4(), pipe2() and struct ucred */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "dict.h"
+
+static const struct {
+	const char *name;
+	int min;
+	int max;
+	const char *help;
+} SETTING[CONFIG_SETTINGS] = {
+	{"timeout", 5, 86400, "seconds without anything from a connection before it's dropped"},
+	{"maxusers", 0, INT_MAX, "most connections at once"},
+	{"grace", 0, 86400, "seconds a disconnected player keeps their seat"},
+	{"rate", 0, 100000, "connections a second from each address, 0 for any"},
+	{"burst", 1, 100000, "connections at once from each address"},
+	{"backlog", 1, 65535, "connections the kernel queues before they're accepted"},
+	{"lobbytick", 10, 60000, "ms between the lobby forming rooms"},
+	{"sleep", 0, 1000000, "us the main loop sleeps each pass"},
+	{"overlap", 1, DICT_GRAM_MAX, "letters each word starts with from the end of the last, in rooms formed after"}
+};
+
+int config_find(const char *name) {
+	int i;
+
+	for(i = 0; i < CONFIG_SETTINGS; i++) {
+		if(strcmp(SETTING[i].name, name) == 0)
+			return(i);
+	}
+
+	return(-1);
+}
+
+const char *config_name(int setting) {
+	return(SETTING[setting].name);
+}
+
+Admin *admin_init(const char *path, const Config *initial, int connections) {
+	Admin *a;
+	struct sockaddr_un addr;
+	int i;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "admin_init(): %s is too long.\n", path);
+		goto aerror0;
+	}
+
+	a = malloc(sizeof(Admin));
+	if(a == NULL) {
+		fprintf(stderr, "admin_init(): Couldn't allocate memory.\n");
+		goto aerror0;
+	}
+	a->path = strdup(path);
+	a->current = malloc(sizeof(Config));
+	a->rtt = malloc(sizeof(AdminRtt) * (connections > 0 ? connections : 1));
+	if(a->path == NULL || a->current == NULL || a->rtt == NULL) {
+		fprintf(stderr, "admin_init(): Couldn't allocate memory.\n");
+		goto aerror1;
+	}
+	memcpy(a->current, initial, sizeof(Config));
+	a->current->retired = NULL;
+	a->applied = a->current->generation;
+	a->retired = NULL;
+	a->changes = 0;
+	a->started = 0;
+	a->maxrtt = connections;
+	a->rtts = 0;
+	a->rttasked = 0;
+	a->rttanswered = 0;
+	for(i = 0; i < CONFIG_SETTINGS; i++) {
+		a->min[i] = SETTING[i].min;
+		a->max[i] = SETTING[i].max;
+	}
+
+	if(pipe2(a->stop, O_CLOEXEC) == -1) {
+		perror("admin_init(): pipe2()");
+		goto aerror1;
+	}
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	a->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(a->sock == -1) {
+		perror("admin_init(): socket()");
+		goto aerror2;
+	}
+	unlink(path);
+	if(bind(a->sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+		perror("admin_init(): bind()");
+		goto aerror3;
+	}
+	/* connections are checked as well, this just keeps everyone else from trying */
+	if(chmod(path, 0600) == -1 || listen(a->sock, 4) == -1) {
+		perror("admin_init(): listen()");
+		unlink(path);
+		goto aerror3;
+	}
+
+	return(a);
+
+aerror3:
+	close(a->sock);
+aerror2:
+	close(a->stop[0]);
+	close(a->stop[1]);
+aerror1:
+	free(a->rtt);
+	free(a->current);
+	free(a->path);
+	free(a);
+aerror0:
+	return(NULL);
+}
+
+void admin_bound(Admin *a, int setting, int min, int max) {
+	a->min[setting] = min;
+	a->max[setting] = max;
+}
+
+const Config *admin_config(Admin *a) {
+	return(__atomic_load_n(&(a->current), __ATOMIC_ACQUIRE));
+}
+
+void admin_applied(Admin *a, unsigned int generation) {
+	__atomic_store_n(&(a->applied), generation, __ATOMIC_RELEASE);
+}
+
+/* Frees versions nobody can be using any more, only from the thread. */
+static void admin_reclaim(Admin *a) {
+	Config **prev, *cfg;
+	unsigned int applied;
+
+	applied = __atomic_load_n(&(a->applied), __ATOMIC_ACQUIRE);
+	for(prev = &(a->retired); *prev != NULL; ) {
+		cfg = *prev;
+		if((int)(applied - cfg->generation) > 0) {
+			*prev = cfg->retired;
+			free(cfg);
+		} else {
+			prev = &(cfg->retired);
+		}
+	}
+}
+
+/* Swaps in a version with one setting changed, then waits a while for it to be picked up. */
+static int admin_set(Admin *a, int setting, int value) {
+	struct timespec idletime;
+	Config *cfg, *old;
+	int waited;
+
+	old = a->current; /* only this thread changes it */
+	cfg = malloc(sizeof(Config));
+	if(cfg == NULL) {
+		fprintf(stderr, "admin_set(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+	memcpy(cfg, old, sizeof(Config));
+	cfg->generation = old->generation + 1;
+	cfg->value[setting] = value;
+	cfg->retired = NULL;
+	__atomic_store_n(&(a->current), cfg, __ATOMIC_RELEASE);
+	old->retired = a->retired;
+	a->retired = old;
+	a->changes++;
+
+	idletime.tv_sec = 0;
+	idletime.tv_nsec = 1000000;
+	for(waited = 0; waited < ADMIN_APPLY_MS; waited++) {
+		if((int)(__atomic_load_n(&(a->applied), __ATOMIC_ACQUIRE) - cfg->generation) >= 0)
+			break;
+		nanosleep(&idletime, NULL);
+	}
+	admin_reclaim(a);
+
+	return(waited < ADMIN_APPLY_MS ? 1 : 0);
+}
+
+void admin_answer_rtt(Admin *a, const Server *s) {
+	const Connection *c;
+	unsigned int asked;
+	int i;
+
+	asked = __atomic_load_n(&(a->rttasked), __ATOMIC_ACQUIRE);
+	if(asked == a->rttanswered) /* only the server changes it */
+		return;
+
+	a->rtts = 0;
+	for(i = 0; i < s->connections && a->rtts < a->maxrtt; i++) {
+		c = s->connection[i];
+		if(c->type != CLIENT || c->rttsamples == 0)
+			continue;
+		a->rtt[a->rtts].conn = i;
+		a->rtt[a->rtts].rtt = c->rtt;
+		a->rtt[a->rtts].srtt = c->srtt;
+		a->rtt[a->rtts].rttvar = c->rttvar;
+		a->rtt[a->rtts].samples = c->rttsamples;
+		a->rtts++;
+	}
+	__atomic_store_n(&(a->rttanswered), asked, __ATOMIC_RELEASE);
+}
+
+/* Asks the server for round trip times, then waits a while for them. */
+static int admin_rtt(Admin *a) {
+	struct timespec idletime;
+	unsigned int asked;
+	int waited;
+
+	asked = a->rttasked + 1;
+	__atomic_store_n(&(a->rttasked), asked, __ATOMIC_RELEASE);
+
+	idletime.tv_sec = 0;
+	idletime.tv_nsec = 1000000;
+	for(waited = 0; waited < ADMIN_APPLY_MS; waited++) {
+		if(__atomic_load_n(&(a->rttanswered), __ATOMIC_ACQUIRE) == asked)
+			return(0);
+		nanosleep(&idletime, NULL);
+	}
+
+	return(-1);
+}
+
+static int admin_reply(int sock, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int admin_reply(int sock, const char *fmt, ...) {
+	char buf[ADMIN_LINE * 2];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	return(send(sock, buf, len, MSG_NOSIGNAL) == len ? 0 : -1);
+}
+
+static int admin_command(Admin *a, int sock, char *line) {
+	const Config *cfg;
+	char *cmd, *name, *value, *end, *save;
+	long v;
+	int setting, retval;
+	int i;
+
+	cmd = strtok_r(line, " \t", &save);
+	name = cmd != NULL ? strtok_r(NULL, " \t", &save) : NULL;
+	value = name != NULL ? strtok_r(NULL, " \t", &save) : NULL;
+	if(cmd == NULL)
+		return(0);
+
+	cfg = a->current;
+	if(strcmp(cmd, "get") == 0) {
+		if(name == NULL) {
+			for(i = 0; i < CONFIG_SETTINGS; i++) {
+				if(admin_reply(sock, "%s %i\n", SETTING[i].name, cfg->value[i]) == -1)
+					return(-1);
+			}
+			return(admin_reply(sock, "ok\n"));
+		}
+		setting = config_find(name);
+		if(setting == -1)
+			return(admin_reply(sock, "error no such setting %s\n", name));
+		return(admin_reply(sock, "%s %i\nok\n", name, cfg->value[setting]));
+	} else if(strcmp(cmd, "set") == 0) {
+		if(name == NULL || value == NULL)
+			return(admin_reply(sock, "error usage: set <setting> <value>\n"));
+		setting = config_find(name);
+		if(setting == -1)
+			return(admin_reply(sock, "error no such setting %s\n", name));
+		errno = 0;
+		v = strtol(value, &end, 10);
+		if(errno != 0 || *end != '\0' || v < a->min[setting] || v > a->max[setting])
+			return(admin_reply(sock, "error %s must be from %i to %i\n", name, a->min[setting], a->max[setting]));
+		retval = admin_set(a, setting, v);
+		if(retval == -1)
+			return(admin_reply(sock, "error out of memory\n"));
+		fprintf(stderr, "Admin set %s to %li.\n", name, v);
+		return(admin_reply(sock, retval == 1 ? "ok\n" : "ok, not picked up yet\n"));
+	} else if(strcmp(cmd, "rtt") == 0) {
+		/* what the server copied stays put until the next rtt, which only
+		 * this thread asks for */
+		if(admin_rtt(a) == -1)
+			return(admin_reply(sock, "error not answered yet, try again\n"));
+		for(i = 0; i < a->rtts; i++) {
+			if(admin_reply(sock, "%i %.1f %.1f %.1f %i\n", a->rtt[i].conn, a->rtt[i].rtt / 1000.0, a->rtt[i].srtt / 1000.0,
+			               a->rtt[i].rttvar / 1000.0, a->rtt[i].samples) == -1)
+				return(-1);
+		}
+		return(admin_reply(sock, "ok\n"));
+	} else if(strcmp(cmd, "help") == 0) {
+		for(i = 0; i < CONFIG_SETTINGS; i++) {
+			if(admin_reply(sock, "%s\t%i to %i\t%s\n", SETTING[i].name, a->min[i], a->max[i], SETTING[i].help) == -1)
+				return(-1);
+		}
+		if(admin_reply(sock, "rtt\tconnection, last, smoothed and variance of round trip times in ms, and samples\n") == -1)
+			return(-1);
+		return(admin_reply(sock, "ok\n"));
+	}
+
+	return(admin_reply(sock, "error unknown command %s, try help\n", cmd));
+}
+
+/* Only the user the server runs as, or root. */
+static int admin_allowed(int sock) {
+	struct ucred cred;
+	socklen_t len;
+
+	len = sizeof(struct ucred);
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		perror("admin_allowed(): getsockopt()");
+		return(0);
+	}
+
+	return(cred.uid == 0 || cred.uid == geteuid());
+}
+
+/* Talks to one admin until they go away, go quiet or the thread is told to stop. */
+static void admin_session(Admin *a, int sock) {
+	struct pollfd pfd[2];
+	char line[ADMIN_LINE];
+	int used, n;
+	char *nl;
+
+	used = 0;
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = a->stop[0];
+	pfd[1].events = POLLIN;
+	for(;;) {
+		if(poll(pfd, 2, ADMIN_TIMEOUT * 1000) <= 0 || pfd[1].revents)
+			return;
+		n = recv(sock, &(line[used]), sizeof(line) - 1 - used, 0);
+		if(n <= 0)
+			return;
+		used += n;
+		line[used] = '\0';
+		while((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			if(nl > line && nl[-1] == '\r')
+				nl[-1] = '\0';
+			if(admin_command(a, sock, line) == -1)
+				return;
+			used -= nl + 1 - line;
+			memmove(line, nl + 1, used + 1);
+		}
+		if(used == sizeof(line) - 1) {
+			admin_reply(sock, "error line too long\n");
+			return;
+		}
+	}
+}
+
+static void *admin_thread(void *arg) {
+	Admin *a = arg;
+	struct pollfd pfd[2];
+	int sock;
+
+	pfd[0].fd = a->sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = a->stop[0];
+	pfd[1].events = POLLIN;
+	for(;;) {
+		if(poll(pfd, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("admin_thread(): poll()");
+			break;
+		}
+		if(pfd[1].revents)
+			break;
+		sock = accept4(a->sock, NULL, NULL, SOCK_CLOEXEC);
+		if(sock == -1)
+			continue;
+		if(admin_allowed(sock))
+			admin_session(a, sock);
+		else
+			admin_reply(sock, "error not allowed\n");
+		close(sock);
+		admin_reclaim(a);
+	}
+
+	return(NULL);
+}
+
+int admin_start(Admin *a) {
+	if(pthread_create(&(a->thread), NULL, admin_thread, a) != 0) {
+		fprintf(stderr, "admin_start(): Couldn't start admin thread.\n");
+		return(-1);
+	}
+	a->started = 1;
+
+	return(0);
+}
+
+void admin_free(Admin *a, int unlinkpath) {
+	Config *cfg;
+
+	if(a->started && write(a->stop[1], "", 1) == 1)
+		pthread_join(a->thread, NULL);
+	close(a->sock);
+	if(unlinkpath)
+		unlink(a->path);
+	close(a->stop[0]);
+	close(a->stop[1]);
+	while(a->retired != NULL) {
+		cfg = a->retired;
+		a->retired = cfg->retired;
+		free(cfg);
+	}
+	free(a->rtt);
+	free(a->current);
+	free(a->path);
+	free(a);
+}
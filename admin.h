@@ -0,0 +1,167 @@
+#ifndef __ADMIN_H
+#define __ADMIN_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "net.h"
+
+#define ADMIN_LINE			(256) /* longest command line */
+#define ADMIN_TIMEOUT		(30) /* seconds an idle admin connection stays open */
+#define ADMIN_APPLY_MS		(1000) /* longest a change waits to be picked up before answering */
+
+/*
+ * Settings which can be changed while the server runs.  Anything sized when
+ * the server starts, like how many connections there's room for or how big a
+ * command can be, can only be lowered within that.
+ */
+typedef enum {
+	CONFIG_TIMEOUT, /* seconds without anything from a connection before it's dropped */
+	CONFIG_MAXUSERS, /* most connections at once */
+	CONFIG_GRACE, /* seconds a disconnected player keeps their seat */
+	CONFIG_RATE, /* connections a second from each address, 0 for any */
+	CONFIG_BURST, /* connections at once from each address */
+	CONFIG_BACKLOG, /* connections the kernel queues before they're accepted */
+	CONFIG_LOBBYTICK, /* ms between the lobby forming rooms */
+	CONFIG_SLEEP, /* us the main loop sleeps each pass */
+	CONFIG_OVERLAP, /* letters each word starts with from the end of the last, in rooms formed after */
+	CONFIG_SETTINGS
+} config_setting;
+
+/* One connection's round trip times, in microseconds. */
+typedef struct {
+	int conn;
+	long rtt; /* last sample */
+	long srtt; /* smoothed */
+	long rttvar;
+	int samples;
+} AdminRtt;
+
+/*
+ * One version of the settings.  A new one is made for every change and
+ * swapped in whole, so a reader always sees one consistent version without
+ * locking, and never has a version freed under it until it says it's moved on.
+ */
+typedef struct Config {
+	unsigned int generation;
+	int value[CONFIG_SETTINGS];
+	struct Config *retired; /* next older version waiting to be freed */
+} Config;
+
+/*
+ * A Unix socket taking text commands, one a line, from the same user the
+ * server runs as or root: "get", "get <setting>", "set <setting> <value>",
+ * "rtt" and "help".  It's served by its own thread, so it answers however busy
+ * the server is.
+ */
+typedef struct {
+	int sock;
+	char *path;
+	int stop[2]; /* pipe telling the thread to finish */
+	pthread_t thread;
+	int started;
+
+	Config *current; /* atomic */
+	unsigned int applied; /* atomic, newest generation the server has moved on to */
+	Config *retired; /* newest first, only touched by the thread */
+
+	int min[CONFIG_SETTINGS];
+	int max[CONFIG_SETTINGS];
+
+	/* round trip times, copied out by the server when the thread asks */
+	AdminRtt *rtt;
+	int maxrtt;
+	int rtts;
+	unsigned int rttasked; /* atomic, only the thread changes it */
+	unsigned int rttanswered; /* atomic, only the server changes it */
+
+	long changes;
+} Admin;
+
+/*
+ * Finds a setting by name.
+ *
+ * name		Name, terminated.
+ *
+ * returns	config_setting or -1 if there's no such setting.
+ */
+int config_find(const char *name);
+
+/*
+ * Gets a setting's name.
+ *
+ * setting	config_setting.
+ *
+ * returns	Name.
+ */
+const char *config_name(int setting);
+
+/*
+ * Listens on an admin socket, anything left at the path is removed first.
+ * The thread isn't started until admin_start().
+ *
+ * path		Unix socket path.
+ * initial	Settings to start with, copied.
+ * connections	Most connections the server has, for rtt.
+ *
+ * returns	New Admin or NULL on error.
+ */
+Admin *admin_init(const char *path, const Config *initial, int connections);
+
+/*
+ * Limits the values a setting can be changed to.
+ *
+ * a		Admin.
+ * setting	config_setting.
+ * min		Lowest allowed.
+ * max		Highest allowed.
+ */
+void admin_bound(Admin *a, int setting, int min, int max);
+
+/*
+ * Starts answering admin connections.
+ *
+ * a		Admin.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int admin_start(Admin *a);
+
+/*
+ * Stops the thread, closes and removes the socket, and frees everything.
+ *
+ * a		Admin to free.
+ * unlinkpath	Remove the socket file, unless another server has it now.
+ */
+void admin_free(Admin *a, int unlinkpath);
+
+/*
+ * Gets the current settings, without locking.  They stay valid until
+ * admin_applied() is called with a newer generation.
+ *
+ * a		Admin.
+ *
+ * returns	Current Config.
+ */
+const Config *admin_config(Admin *a);
+
+/*
+ * Says the caller has moved on to a version of the settings, so anything
+ * older can be freed.
+ *
+ * a		Admin.
+ * generation	Generation of the Config now in use.
+ */
+void admin_applied(Admin *a, unsigned int generation);
+
+/*
+ * Answers an rtt command if one is waiting, copying out the round trip times
+ * of every connection which has any.  Called from the server's loop, without
+ * locking.
+ *
+ * a		Admin.
+ * s		Server whose connections to copy.
+ */
+void admin_answer_rtt(Admin *a, const Server *s);
+
+#endif
@@ -0,0 +1,478 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "cluster.h"
+#include "normalize.h"
+#include "util.h"
+
+#ifndef MAX_COMMAND
+#error MAX_COMMAND must be defined!
+#endif
+
+#define MAX_NODES (32) /* fits in the bits of a room's node mask */
+#define MAX_PLAYERS (4096) /* across the whole cluster */
+#define MAX_ROOMS (4096) /* power of 2, room ids are a slot and a generation */
+#define TIMEOUT (60)
+
+/* which node every identified player is on */
+typedef struct {
+	char name[MAX_NAME_LEN + 1];
+	unsigned int hash;
+	int node; /* -1 if unused */
+} Presence;
+
+/* a player none of the nodes could find a room for on their own */
+typedef struct {
+	char name[MAX_NAME_LEN + 1];
+	int node;
+} Waiter;
+
+typedef struct {
+	unsigned int id; /* 0 if unused */
+	unsigned int nodes; /* bit for each node with players in the room */
+} SharedRoom;
+
+int running;
+void signalhandler(int signum);
+
+static Presence presence[MAX_PLAYERS * 2];
+static const unsigned int presencemask = MAX_PLAYERS * 2 - 1;
+static Waiter waiting[LANGS_MAX][MAX_PLAYERS];
+static int waiters[LANGS_MAX];
+static SharedRoom room[MAX_ROOMS];
+static unsigned int roomgen;
+
+static Batch *out[MAX_NODES];
+
+static Presence *presence_find(const char *name) {
+	unsigned int h, i;
+
+	h = fnv1a(name, strlen(name));
+	for(i = h & presencemask; presence[i].node != -1; i = (i + 1) & presencemask) {
+		if(presence[i].hash == h && strcmp(presence[i].name, name) == 0)
+			return(&(presence[i]));
+	}
+
+	return(NULL);
+}
+
+static int presence_add(const char *name, int node) {
+	Presence *p;
+	unsigned int h, i, n;
+
+	if(strlen(name) > MAX_NAME_LEN)
+		return(-1);
+	p = presence_find(name);
+	if(p != NULL)
+		return(p->node == node ? 0 : -1);
+
+	h = fnv1a(name, strlen(name));
+	for(i = h & presencemask, n = 0; presence[i].node != -1; i = (i + 1) & presencemask) {
+		if(++n == presencemask) /* full */
+			return(-1);
+	}
+	strcpy(presence[i].name, name);
+	presence[i].hash = h;
+	presence[i].node = node;
+
+	return(0);
+}
+
+static void presence_remove(Presence *p) {
+	unsigned int i, j, home;
+
+	i = p - presence;
+	presence[i].node = -1;
+	for(j = (i + 1) & presencemask; presence[j].node != -1; j = (j + 1) & presencemask) {
+		home = presence[j].hash & presencemask;
+		if(((j - home) & presencemask) >= ((j - i) & presencemask)) {
+			presence[i] = presence[j];
+			presence[j].node = -1;
+			i = j;
+		}
+	}
+}
+
+static void waiting_remove(const char *name, int node) {
+	int lang, i, j;
+
+	for(lang = 0; lang < LANGS_MAX; lang++) {
+		for(i = 0, j = 0; i < waiters[lang]; i++) {
+			if(waiting[lang][i].node == node && (name == NULL || strcmp(waiting[lang][i].name, name) == 0))
+				continue;
+			waiting[lang][j++] = waiting[lang][i];
+		}
+		waiters[lang] = j;
+	}
+}
+
+static SharedRoom *room_find(unsigned int id) {
+	SharedRoom *r;
+
+	r = &(room[id & (MAX_ROOMS - 1)]);
+	if(id == 0 || r->id != id) /* gone, and maybe reused since */
+		return(NULL);
+
+	return(r);
+}
+
+static SharedRoom *room_new() {
+	int i;
+
+	for(i = 0; i < MAX_ROOMS; i++) {
+		if(room[i].id == 0) {
+			room[i].id = (roomgen++ * MAX_ROOMS) | i;
+			if(room[i].id == 0)
+				room[i].id = (roomgen++ * MAX_ROOMS) | i;
+			room[i].nodes = 0;
+			return(&(room[i]));
+		}
+	}
+
+	return(NULL);
+}
+
+static void room_node_left(SharedRoom *r, int node) {
+	r->nodes &= ~(1u << node);
+	if(r->nodes == 0)
+		r->id = 0;
+}
+
+/* Forgets everything about a node. */
+static void node_lost(Server *s, int node) {
+	int i;
+
+	for(i = 0; i <= (int)presencemask; i++) {
+		while(presence[i].node == node) /* removing shifts the next one in here */
+			presence_remove(&(presence[i]));
+	}
+	waiting_remove(NULL, node);
+	for(i = 0; i < MAX_ROOMS; i++) {
+		if(room[i].id != 0 && (room[i].nodes & (1u << node)))
+			room_node_left(&(room[i]), node);
+	}
+	out[node]->used = 0;
+	connection_disconnect(s->connection[node]);
+}
+
+/* Queues a command for a node, making room by flushing if it has to.  A node
+ * that can't take it is dropped rather than left missing what it was sent. */
+static int node_send(Server *s, int node, int cmd, const char *data, int datalen) {
+	if(s->connection[node]->type != CLIENT)
+		return(-1);
+	if(batch_add(out[node], cmd, data, datalen) == 0)
+		return(0);
+	if(batch_flush(out[node], s->connection[node]) == 0 && batch_add(out[node], cmd, data, datalen) == 0)
+		return(0);
+
+	fprintf(stderr, "Node %i isn't keeping up, %s dropped, disconnected.\n", node, COMMANDS[cmd].name);
+	node_lost(s, node);
+	return(-1);
+}
+
+/* Puts everyone waiting for a language in to rooms, telling each node involved. */
+static int match(Server *s, int lang) {
+	char data[MAX_COMMAND];
+	SharedRoom *r;
+	Waiter *w;
+	unsigned int nodes;
+	int formed, len, i;
+
+	formed = 0;
+	while(waiters[lang] >= ROOM_SIZE) {
+		r = room_new();
+		if(r == NULL)
+			break;
+
+		w = waiting[lang];
+		len = snprintf(data, MAX_COMMAND, "%u%c%i", r->id, '\0', lang);
+		for(i = 0; i < ROOM_SIZE; i++) {
+			len += snprintf(&(data[len]), MAX_COMMAND - len, "%c%s", '\0', w[i].name);
+			r->nodes |= 1u << w[i].node;
+		}
+		memmove(w, &(w[ROOM_SIZE]), sizeof(Waiter) * (waiters[lang] - ROOM_SIZE));
+		waiters[lang] -= ROOM_SIZE;
+		formed++;
+
+		/* after they're out of the queue, as a node dropped for not keeping
+		 * up takes its players out of it and the room */
+		nodes = r->nodes;
+		for(i = 0; i < MAX_NODES; i++) {
+			if(nodes & (1u << i))
+				node_send(s, i, CMD_ROOM, data, len);
+		}
+	}
+
+	return(formed);
+}
+
+int main(int argc, char **argv) {
+	Server *s;
+	Connection *c;
+	Presence *p;
+	SharedRoom *r;
+	struct sigaction sa;
+	struct timespec idletime;
+	char addrtext[INET6_ADDRSTRLEN];
+	CMDBuffer **bufs;
+	char *cmdbuf;
+	char *databuf;
+	char *field[3];
+	char reply[MAX_COMMAND];
+	int command;
+	short unsigned int cmdlen, datalen;
+	int retval, len, lang, fields;
+	int accepted[ACCEPT_BATCH];
+	char *unixpath;
+	int i, j;
+
+	unixpath = NULL;
+	while((retval = getopt(argc, argv, "L:")) != -1) {
+		if(retval == 'L')
+			unixpath = optarg;
+		else
+			break;
+	}
+	if(retval != -1 || argc - optind != 1) {
+		fprintf(stderr, "Usage: %s [-L <local socket>] <port>\n", argv[0]);
+		goto error0;
+	}
+
+	s = server_init(argv[optind], MAX_NODES, TIMEOUT, 0);
+	if(s == NULL) {
+		fprintf(stderr, "main(): couldn't initialize server.\n");
+		goto error0;
+	}
+	/* for nodes on the same host */
+	if(unixpath != NULL) {
+		if(server_listen_unix(s, unixpath) == -1) {
+			fprintf(stderr, "main(): couldn't listen on %s.\n", unixpath);
+			goto error1;
+		}
+		fprintf(stderr, "Listening for local nodes on %s.\n", unixpath);
+	}
+
+	sa.sa_handler = signalhandler;
+	sigemptyset(&(sa.sa_mask));
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	bufs = malloc(sizeof(CMDBuffer *) * s->connections);
+	if(bufs == NULL)
+		goto error1;
+	for(i = 0; i < s->connections; i++) {
+		bufs[i] = cmdbuffer_init(MAX_COMMAND);
+		if(bufs[i] == NULL)
+			break;
+		connection_add_buffer(s->connection[i], bufs[i]);
+	}
+	if(i < s->connections) {
+		for(i--; i >= 0; i--)
+			cmdbuffer_free(bufs[i]);
+		goto error2;
+	}
+
+	for(i = 0; i < s->connections; i++) {
+		out[i] = batch_init(CLUSTER_BATCH);
+		if(out[i] == NULL)
+			break;
+	}
+	if(i < s->connections) {
+		for(i--; i >= 0; i--)
+			batch_free(out[i]);
+		goto error3;
+	}
+
+	for(i = 0; i <= (int)presencemask; i++)
+		presence[i].node = -1;
+	for(i = 0; i < MAX_ROOMS; i++)
+		room[i].id = 0;
+	roomgen = 1;
+
+	running = 1;
+	while(running) {
+		retval = connection_accept(s, accepted, ACCEPT_BATCH);
+		if(retval == -1) {
+			fprintf(stderr, "Error accepting connection.\n");
+			goto error4;
+		}
+		for(j = 0; j < retval; j++) {
+			i = accepted[j];
+			fprintf(stderr, "Node %i connected from %s.\n", i, connection_address(s->connection[i], addrtext, sizeof(addrtext)));
+			out[i]->used = 0;
+		}
+
+		for(i = 0; i < s->connections; i++) {
+			c = s->connection[i];
+			/* take everything the node sent this tick */
+			while(c->type == CLIENT && (retval = connection_next_command(c)) == 0) {
+				command = command_parse(&cmdbuf, &cmdlen, &databuf, &datalen, c->buf->cmd, c->buf->cmdhave);
+				switch(command) {
+					case -2:
+					case -1:
+						fprintf(stderr, "Bad command from node %i, disconnected.\n", i);
+						node_lost(s, i);
+						break;
+					case CMD_ERROR:
+						fprintf(stderr, "A command from node %i has been dropped.\n", i);
+						break;
+					case CMD_PING:
+						node_send(s, i, CMD_PONG, databuf, datalen);
+						break;
+					case CMD_PONG:
+						connection_pong_received(c, databuf, datalen);
+						break;
+					case CMD_NODE:
+						len = snprintf(reply, MAX_COMMAND, "%i", i);
+						node_send(s, i, CMD_NODE, reply, len);
+						break;
+					case CMD_HERE:
+						cluster_fields(databuf, datalen, field, 1);
+						if(strlen(field[0]) > MAX_NAME_LEN)
+							fprintf(stderr, "Node %i has a player whose name is too long, ignored.\n", i);
+						else if(presence_add(field[0], i) == -1)
+							fprintf(stderr, "Node %i has %s, but they're already elsewhere or there's no room.\n", i, field[0]);
+						break;
+					case CMD_GONE:
+						cluster_fields(databuf, datalen, field, 1);
+						p = presence_find(field[0]);
+						if(p != NULL && p->node == i)
+							presence_remove(p);
+						waiting_remove(field[0], i);
+						break;
+					case CMD_WAIT: /* name\0language, or just name to withdraw */
+						fields = cluster_fields(databuf, datalen, field, 2);
+						/* only the latest offer for a player counts */
+						waiting_remove(field[0], i);
+						if(fields != 2)
+							break;
+						lang = atoi(field[1]);
+						if(lang < 0 || lang >= LANGS_MAX || strlen(field[0]) > MAX_NAME_LEN)
+							break;
+						if(waiters[lang] == MAX_PLAYERS)
+							break;
+						strcpy(waiting[lang][waiters[lang]].name, field[0]);
+						waiting[lang][waiters[lang]].node = i;
+						waiters[lang]++;
+						break;
+					case CMD_ROUTE: /* to\0from\0message */
+						if(cluster_fields(databuf, datalen, field, 3) != 3)
+							break;
+						p = presence_find(field[0]);
+						if(p != NULL && p->node != i) {
+							node_send(s, p->node, CMD_ROUTE, databuf, datalen);
+						} else {
+							len = snprintf(reply, MAX_COMMAND, "%s%cSERVER%cNo such player.", field[1], '\0', '\0');
+							node_send(s, i, CMD_ROUTE, reply, len);
+						}
+						break;
+					case CMD_RMSG: /* room\0from\0message */
+						if(cluster_fields(databuf, datalen, field, 2) != 2)
+							break;
+						r = room_find(strtoul(field[0], NULL, 10));
+						if(r == NULL)
+							break;
+						for(j = 0; j < MAX_NODES; j++) {
+							if(j != i && (r->nodes & (1u << j)))
+								node_send(s, j, CMD_RMSG, databuf, datalen);
+						}
+						break;
+					case CMD_LEFT:
+						cluster_fields(databuf, datalen, field, 1);
+						r = room_find(strtoul(field[0], NULL, 10));
+						if(r != NULL)
+							room_node_left(r, i);
+						break;
+					default:
+						fprintf(stderr, "Unexpected command %s from node %i.\n", COMMANDS[command].name, i);
+				}
+				cmdbuffer_reset(c->buf);
+			}
+			if(c->type != CLIENT)
+				continue;
+			if(retval == -1) {
+				fprintf(stderr, "Error reading from node %i, disconnected.\n", i);
+				node_lost(s, i);
+				continue;
+			}
+
+		}
+
+		for(lang = 0; lang < LANGS_MAX; lang++) {
+			retval = match(s, lang);
+			if(retval > 0)
+				fprintf(stderr, "%i shared rooms formed.\n", retval);
+		}
+
+		/* everything for a node goes out in one write per tick */
+		for(i = 0; i < s->connections; i++) {
+			c = s->connection[i];
+			if(c->type != CLIENT)
+				continue;
+			if(batch_flush(out[i], c) == -1) {
+				fprintf(stderr, "Error writing to node %i, disconnected.\n", i);
+				node_lost(s, i);
+				continue;
+			}
+
+			retval = connection_liveness_check(c);
+			if(retval == -2 || connection_timeout_check(c, 0)) {
+				fprintf(stderr, "Node %i stopped answering, disconnected.\n", i);
+				node_lost(s, i);
+			} else if(retval == 1 && out[i]->used == 0) { /* pings don't go through the batch */
+				connection_ping(c);
+			}
+		}
+
+		idletime.tv_sec = 0;
+		idletime.tv_nsec = 1000000;
+		nanosleep(&idletime, NULL);
+	}
+
+	for(i = 0; i < s->connections; i++)
+		batch_free(out[i]);
+	for(i = 0; i < s->connections; i++)
+		cmdbuffer_free(bufs[i]);
+	free(bufs);
+	server_free(s);
+	if(unixpath != NULL)
+		unlink(unixpath);
+	exit(EXIT_SUCCESS);
+
+error4:
+	for(i = 0; i < s->connections; i++)
+		batch_free(out[i]);
+error3:
+	for(i = 0; i < s->connections; i++)
+		cmdbuffer_free(bufs[i]);
+error2:
+	free(bufs);
+error1:
+	server_free(s);
+	if(unixpath != NULL)
+		unlink(unixpath);
+error0:
+	exit(EXIT_FAILURE);
+}
+
+void signalhandler(int signum) {
+	fprintf(stderr, "\n\nSignal %i received.\n", signum);
+	running = 0;
+	return;
+}
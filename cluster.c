@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cluster.h"
+
+#ifndef MAX_COMMAND
+#error MAX_COMMAND must be defined!
+#endif
+
+Batch *batch_init(int size) {
+	Batch *b;
+
+	b = malloc(sizeof(Batch));
+	if(b == NULL)
+		return(NULL);
+
+	b->buf = malloc(size);
+	if(b->buf == NULL) {
+		free(b);
+		return(NULL);
+	}
+	b->size = size;
+	b->used = 0;
+
+	return(b);
+}
+
+void batch_free(Batch *b) {
+	free(b->buf);
+	free(b);
+}
+
+int batch_add(Batch *b, int cmd, const char *data, int datalen) {
+	int len;
+
+	len = command_generate(&(b->buf[b->used]), b->size - b->used < MAX_COMMAND ? b->size - b->used : MAX_COMMAND,
+	                       COMMANDS[cmd].name, COMMANDS[cmd].length, data, datalen);
+	if(len == -1)
+		return(-1);
+	b->used += len;
+
+	return(0);
+}
+
+int batch_flush(Batch *b, Connection *c) {
+	int written;
+
+	if(b->used == 0)
+		return(0);
+
+	written = connection_write(c, b->buf, b->used);
+	if(written == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return(0);
+		return(-1);
+	}
+	/* the socket's buffer filled up, keep the rest for next time */
+	memmove(b->buf, &(b->buf[written]), b->used - written);
+	b->used -= written;
+
+	return(0);
+}
+
+Cluster *cluster_connect(char *host, char *port, int timeout) {
+	Cluster *cl;
+
+	cl = malloc(sizeof(Cluster));
+	if(cl == NULL)
+		goto clerror0;
+
+	cl->c = connection_init(timeout);
+	if(cl->c == NULL)
+		goto clerror1;
+
+	cl->in = cmdbuffer_init(MAX_COMMAND);
+	if(cl->in == NULL)
+		goto clerror2;
+	connection_add_buffer(cl->c, cl->in);
+
+	cl->out = batch_init(CLUSTER_BATCH);
+	if(cl->out == NULL)
+		goto clerror3;
+
+	if((port != NULL ? connection_connect(cl->c, host, port, timeout) : connection_connect_unix(cl->c, host, timeout)) == -1) {
+		fprintf(stderr, "cluster_connect(): Couldn't connect to broker.\n");
+		goto clerror4;
+	}
+	if(fd_nonblocking(cl->c->sock) == -1)
+		goto clerror4;
+
+	cl->node = -1;
+	if(cluster_send(cl, CMD_NODE, NULL, 0) == -1 || cluster_flush(cl) == -1)
+		goto clerror4;
+
+	return(cl);
+
+clerror4:
+	batch_free(cl->out);
+clerror3:
+	cmdbuffer_free(cl->in);
+clerror2:
+	connection_free(cl->c);
+clerror1:
+	free(cl);
+clerror0:
+	return(NULL);
+}
+
+void cluster_free(Cluster *cl) {
+	connection_free(cl->c);
+	cmdbuffer_free(cl->in);
+	batch_free(cl->out);
+	free(cl);
+}
+
+int cluster_send(Cluster *cl, int cmd, const char *data, int datalen) {
+	if(batch_add(cl->out, cmd, data, datalen) == -1) {
+		/* full, so make room now rather than lose it */
+		if(batch_flush(cl->out, cl->c) == -1)
+			return(-1);
+		if(batch_add(cl->out, cmd, data, datalen) == -1) {
+			fprintf(stderr, "cluster_send(): Broker isn't keeping up, %s dropped.\n", COMMANDS[cmd].name);
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+int cluster_flush(Cluster *cl) {
+	return(batch_flush(cl->out, cl->c));
+}
+
+int cluster_next(Cluster *cl, char **data, unsigned short int *datalen) {
+	char *cmd;
+	unsigned short int cmdlen;
+	int retval;
+
+	retval = connection_next_command(cl->c);
+	if(retval == -1)
+		return(-1);
+	if(retval > 0)
+		return(-2);
+
+	retval = command_parse(&cmd, &cmdlen, data, datalen, cl->in->cmd, cl->in->cmdhave);
+	if(retval < 0) { /* nodes and the broker should always understand each other */
+		fprintf(stderr, "cluster_next(): Bad command from broker.\n");
+		return(-1);
+	}
+
+	return(retval);
+}
+
+int cluster_fields(char *data, int datalen, char **field, int maxfields) {
+	int fields, i;
+
+	data[datalen] = '\0';
+	field[0] = data;
+	fields = 1;
+	for(i = 0; i < datalen && fields < maxfields; i++) {
+		if(data[i] == '\0')
+			field[fields++] = &(data[i + 1]);
+	}
+
+	return(fields);
+}
@@ -0,0 +1,130 @@
+#ifndef __CLUSTER_H
+#define __CLUSTER_H
+
+#include "net.h"
+
+/* these have to be the same on every node and the broker */
+#define MAX_NAME_LEN		(32)
+#define ROOM_SIZE			(2) /* players per room */
+
+#define CLUSTER_BATCH		(65536) /* bytes of commands held for the next flush */
+
+/*
+ * Commands waiting to be sent, written all at once when flushed.  Whatever
+ * doesn't get written is kept for the next flush.
+ */
+typedef struct {
+	char *buf;
+	int size;
+	int used;
+} Batch;
+
+/*
+ * A node's connection to the broker.
+ */
+typedef struct {
+	Connection *c;
+	CMDBuffer *in;
+	Batch *out;
+
+	int node; /* number given by the broker, -1 until it's answered */
+} Cluster;
+
+/*
+ * Initializes a new Batch.
+ *
+ * size		Bytes to hold.
+ *
+ * returns	New Batch or NULL on error.
+ */
+Batch *batch_init(int size);
+
+void batch_free(Batch *b);
+
+/*
+ * Adds a command to a batch.
+ *
+ * b		Batch to add to.
+ * cmd		Command number.
+ * data		Data block, or NULL to exclude.
+ * datalen	Data block size.
+ *
+ * returns	0 on success, -1 if it doesn't fit.
+ */
+int batch_add(Batch *b, int cmd, const char *data, int datalen);
+
+/*
+ * Writes as much of a batch to a connection as it'll take.
+ *
+ * b		Batch to send.
+ * c		Connection to send to.
+ *
+ * returns	0 on success (even if some is left), -1 on error.
+ */
+int batch_flush(Batch *b, Connection *c);
+
+/*
+ * Connects to a broker and introduces this node.
+ *
+ * host		Broker hostname or IP, or Unix socket path.
+ * port		Broker port, or NULL if host is a Unix socket path.
+ * timeout	Seconds of silence before the broker is given up on.
+ *
+ * returns	New Cluster or NULL on error.
+ */
+Cluster *cluster_connect(char *host, char *port, int timeout);
+
+/*
+ * Disconnects from the broker and frees a Cluster.
+ *
+ * cl		Cluster to free.
+ */
+void cluster_free(Cluster *cl);
+
+/*
+ * Queues a command for the broker, sent on the next cluster_flush().
+ *
+ * cl		Cluster to send on.
+ * cmd		Command number.
+ * data		Data block, or NULL to exclude.
+ * datalen	Data block size.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int cluster_send(Cluster *cl, int cmd, const char *data, int datalen);
+
+/*
+ * Sends everything queued for the broker.  Meant to be called once per tick.
+ *
+ * cl		Cluster to flush.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int cluster_flush(Cluster *cl);
+
+/*
+ * Gets the next command from the broker.  Call cmdbuffer_reset(cl->in) when
+ * done with it.
+ *
+ * cl		Cluster to read from.
+ * data		Data block is written here.
+ * datalen	Data block size is written here.
+ *
+ * returns	Command number, -2 if none is waiting, -1 on error.
+ */
+int cluster_next(Cluster *cl, char **data, unsigned short int *datalen);
+
+/*
+ * Splits a data block in to fields separated by \0, terminating each.  The
+ * block must have room for one byte past its end.
+ *
+ * data		Data block.
+ * datalen	Data block size.
+ * field	Pointers to the fields are written here.
+ * maxfields	Most fields to split off, the last gets the rest.
+ *
+ * returns	Number of fields.
+ */
+int cluster_fields(char *data, int datalen, char **field, int maxfields);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "complete.h"
+#include "util.h"
+
+Completer *completer_init(int maxconns) {
+	Completer *cm;
+
+	cm = malloc(sizeof(Completer));
+	if(cm == NULL)
+		goto cerror0;
+
+	cm->req = calloc(maxconns, sizeof(CompleteRequest));
+	if(cm->req == NULL)
+		goto cerror1;
+	cm->cache = calloc(COMPLETE_CACHE_SIZE, sizeof(CompleteCacheEntry));
+	if(cm->cache == NULL)
+		goto cerror2;
+
+	cm->maxconns = maxconns;
+	cm->requests = 0;
+	cm->answered = 0;
+	cm->hits = 0;
+
+	return(cm);
+
+cerror2:
+	free(cm->req);
+cerror1:
+	free(cm);
+cerror0:
+	return(NULL);
+}
+
+void completer_free(Completer *cm) {
+	free(cm->cache);
+	free(cm->req);
+	free(cm);
+}
+
+int completer_request(Completer *cm, int conn, const char *prefix, int len) {
+	CompleteRequest *req = &(cm->req[conn]);
+	long now;
+
+	if(len <= 0 || len > COMPLETE_MAX_PREFIX)
+		return(-1);
+
+	now = now_ms();
+	if(!req->pending) {
+		req->pending = 1;
+		req->first = now;
+	}
+	req->last = now;
+	memcpy(req->prefix, prefix, len);
+	req->len = len;
+	cm->requests++;
+
+	return(0);
+}
+
+void completer_cancel(Completer *cm, int conn) {
+	cm->req[conn].pending = 0;
+}
+
+int completer_due(Completer *cm, int conn) {
+	CompleteRequest *req = &(cm->req[conn]);
+	long now;
+
+	if(!req->pending)
+		return(0);
+
+	now = now_ms();
+	return(now - req->last >= COMPLETE_DEBOUNCE_MS || now - req->first >= COMPLETE_MAX_WAIT_MS);
+}
+
+/* The prefix's hash, mixed with what else the answer depends on. */
+static unsigned int cache_hash(int room, unsigned int generation, unsigned int serial, const char *prefix, int len) {
+	unsigned int h = fnv1a(prefix, len);
+
+	h ^= room * 0x9E3779B1 ^ generation * 0x85EBCA77 ^ serial * 0xC2B2AE3D;
+
+	return(h ^ (h >> 16));
+}
+
+int completer_answer(Completer *cm, int conn, const Dict *d, int room, const Match *m, char *buf, int bufsize) {
+	CompleteRequest *req = &(cm->req[conn]);
+	CompleteCacheEntry *e;
+	char norm[COMPLETE_MAX_PREFIX];
+	unsigned int serial;
+	const char *word;
+	int len, wordlen, pos, i;
+
+	if(!req->pending)
+		return(-1);
+	req->pending = 0;
+	cm->answered++;
+
+	if(req->len + 1 > bufsize)
+		return(-1);
+	memcpy(buf, req->prefix, req->len);
+	pos = req->len;
+
+	len = norm_word(norm, COMPLETE_MAX_PREFIX, req->prefix, req->len);
+	if(len <= 0) /* not valid UTF-8, nothing can start with it */
+		return(pos);
+
+	serial = m != NULL ? m->serial : 0;
+	e = &(cm->cache[cache_hash(room, d->generation, serial, norm, len) & (COMPLETE_CACHE_SIZE - 1)]);
+	if(e->valid && e->room == room && e->generation == d->generation && e->serial == serial &&
+	   e->len == len && memcmp(e->prefix, norm, len) == 0) {
+		cm->hits++;
+	} else {
+		e->count = dict_complete(d, norm, len, m != NULL ? m->need : NULL, m != NULL ? m->needlen : 0, m != NULL ? m->used : NULL, e->ids, COMPLETE_WORDS);
+		e->valid = 1;
+		e->room = room;
+		e->generation = d->generation;
+		e->serial = serial;
+		e->len = len;
+		memcpy(e->prefix, norm, len);
+	}
+
+	for(i = 0; i < e->count; i++) {
+		word = dict_word(d, e->ids[i], &wordlen);
+		if(pos + 1 + wordlen > bufsize)
+			break;
+		buf[pos] = '\0';
+		memcpy(&(buf[pos + 1]), word, wordlen);
+		pos += 1 + wordlen;
+	}
+
+	return(pos);
+}
@@ -0,0 +1,106 @@
+#ifndef __COMPLETE_H
+#define __COMPLETE_H
+
+#include "game.h"
+
+#define COMPLETE_MAX_PREFIX		(64) /* bytes */
+#define COMPLETE_WORDS			(DICT_COMPLETE_K) /* most words sent back */
+#define COMPLETE_DEBOUNCE_MS	(50) /* answer once a player stops typing for this long */
+#define COMPLETE_MAX_WAIT_MS	(200) /* or after this long, if they don't */
+#define COMPLETE_CACHE_SIZE		(1024) /* power of 2 */
+
+typedef struct {
+	int pending;
+	char prefix[COMPLETE_MAX_PREFIX];
+	int len;
+	long first; /* ms, when the oldest unanswered request came in */
+	long last; /* ms, when the newest did */
+} CompleteRequest;
+
+typedef struct {
+	int valid;
+	int room; /* -1 for players not in a room */
+	unsigned int generation; /* of the dictionary */
+	unsigned int serial; /* of the room's Match, 0 without one */
+	int len;
+	char prefix[COMPLETE_MAX_PREFIX]; /* normalized */
+
+	int count;
+	int32_t ids[COMPLETE_WORDS];
+} CompleteCacheEntry;
+
+/*
+ * Answers COMPLETE requests.  Only the latest request from each connection is
+ * kept, and it's only answered once the player pauses, so typing a word costs
+ * one or two lookups instead of one for each letter.  Answers are cached by
+ * room and prefix until the room's game moves on, so players in the same game
+ * typing the same thing share them.
+ */
+typedef struct {
+	int maxconns;
+	CompleteRequest *req; /* by connection index */
+	CompleteCacheEntry *cache;
+
+	long requests;
+	long answered;
+	long hits;
+} Completer;
+
+/*
+ * Initializes a new Completer.
+ *
+ * maxconns	Number of connections.
+ *
+ * returns	New Completer or NULL on error.
+ */
+Completer *completer_init(int maxconns);
+
+void completer_free(Completer *cm);
+
+/*
+ * Takes a request, replacing any that hasn't been answered yet.
+ *
+ * cm		Completer to use.
+ * conn		Connection index the request came from.
+ * prefix	What the player has typed so far.
+ * len		Length of prefix.
+ *
+ * returns	0 on success, -1 if the prefix is empty or too long.
+ */
+int completer_request(Completer *cm, int conn, const char *prefix, int len);
+
+/*
+ * Drops any request waiting on a connection, for when it goes away.
+ *
+ * cm		Completer to use.
+ * conn		Connection index.
+ */
+void completer_cancel(Completer *cm, int conn);
+
+/*
+ * Checks whether a connection's request should be answered now.
+ *
+ * cm		Completer to check.
+ * conn		Connection index.
+ *
+ * returns	1 if it should, 0 if not.
+ */
+int completer_due(Completer *cm, int conn);
+
+/*
+ * Answers a connection's request, from the cache if it can.  The answer is the
+ * prefix as it was sent followed by the words, all separated by \0.
+ *
+ * cm		Completer to use.
+ * conn		Connection index.
+ * d		Dictionary to complete from.
+ * room		ID of the room the player is in, -1 if none.
+ * m		The room's Match, to leave out used words and ones that start wrong, or NULL.
+ * buf		Answer is written here.
+ * bufsize	Space in buf.
+ *
+ * returns	Length of the answer, -1 if there was no request or it didn't fit.
+ */
+int completer_answer(Completer *cm, int conn, const Dict *d, int room, const Match *m, char *buf, int bufsize);
+
+#endif
@@ -0,0 +1,1773 @@
+#define _GNU_SOURCE /* qsort_r() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dict.h"
+
+#define DICT_ALIGN(x)	(((x) + 7) & ~((uint64_t)7))
+#define FNV_OFFSET		(0xCBF29CE484222325ULL)
+#define FNV_PRIME		(0x100000001B3ULL)
+
+static uint64_t checksum_update(uint64_t h, const void *buf, size_t len) {
+	const unsigned char *b = buf;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= b[i];
+		h *= FNV_PRIME;
+	}
+
+	return(h);
+}
+
+static int word_compare(const char *a, int alen, const char *b, int blen) {
+	int retval;
+
+	retval = memcmp(a, b, alen < blen ? alen : blen);
+	if(retval != 0)
+		return(retval);
+
+	return(alen - blen);
+}
+
+/* Looks a gram up in one of the tables, which always has an empty slot to stop at. */
+static const DictGram *gram_find(const DictGram *table, uint32_t mask, const uint32_t *unit, int len) {
+	uint32_t key[DICT_GRAM_MAX];
+	uint32_t i;
+
+	if(len < 1 || len > DICT_GRAM_MAX)
+		return(NULL);
+	for(i = 0; i < DICT_GRAM_MAX; i++) {
+		key[i] = i < (uint32_t)len ? unit[i] : 0;
+		if(i < (uint32_t)len && key[i] == 0)
+			return(NULL);
+	}
+
+	for(i = dict_gram_hash(key) & mask; table[i].hi != 0; i = (i + 1) & mask) {
+		if(memcmp(table[i].unit, key, sizeof(key)) == 0)
+			return(&(table[i]));
+	}
+
+	return(NULL);
+}
+
+/* Checks a gram table can be probed safely and only points at words there are. */
+static int gram_verify(const DictGram *table, uint64_t size, int words) {
+	uint64_t slots, i;
+	int empty;
+
+	slots = size / sizeof(DictGram);
+	if(size % sizeof(DictGram) != 0 || slots == 0 || (slots & (slots - 1)) != 0 || slots > UINT32_MAX)
+		return(-1);
+	empty = 0;
+	for(i = 0; i < slots; i++) {
+		if(table[i].hi == 0)
+			empty = 1;
+		else if(table[i].lo >= table[i].hi || table[i].hi > (uint32_t)words || table[i].unit[0] == 0)
+			return(-1);
+	}
+
+	return(empty ? 0 : -1);
+}
+
+static int dict_verify(Dict *d) {
+	const DictHeader *hdr = d->hdr;
+	const DictSection *sec;
+	uint64_t strsize;
+	int i;
+
+	if(memcmp(hdr->magic, DICT_MAGIC, sizeof(DICT_MAGIC)) != 0) {
+		fprintf(stderr, "dict_verify(): Not a dictionary file.\n");
+		return(-1);
+	}
+	if(hdr->version != DICT_VERSION) {
+		fprintf(stderr, "dict_verify(): Unsupported version %u, compile it again.\n", hdr->version);
+		return(-1);
+	}
+	if(hdr->language >= LANGS_MAX || hdr->words >= INT_MAX ||
+	   hdr->sections < DICT_SECTIONS || hdr->sections > DICT_SECTIONS_MAX) {
+		fprintf(stderr, "dict_verify(): Bad header.\n");
+		return(-1);
+	}
+
+	for(i = 0; i < (int)hdr->sections; i++) {
+		sec = &(hdr->section[i]);
+		if(sec->offset < sizeof(DictHeader) || sec->offset % 8 != 0 ||
+		   sec->offset > d->mapsize || sec->size > d->mapsize - sec->offset) {
+			fprintf(stderr, "dict_verify(): Section %i out of bounds.\n", i);
+			return(-1);
+		}
+	}
+	if(hdr->section[DICT_SEC_OFFSETS].size != ((uint64_t)hdr->words + 1) * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_FREQ].size != (uint64_t)hdr->words * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_UNITS].size != (uint64_t)hdr->words * 2 * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_HEADS].size != (uint64_t)hdr->words * DICT_GRAM_MAX * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_TAILS].size != (uint64_t)hdr->words * DICT_GRAM_MAX * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_BYHEAD].size != (uint64_t)hdr->words * sizeof(uint32_t) ||
+	   hdr->section[DICT_SEC_BYTAIL].size != (uint64_t)hdr->words * sizeof(uint32_t)) {
+		fprintf(stderr, "dict_verify(): Bad section sizes.\n");
+		return(-1);
+	}
+
+	if(checksum_update(FNV_OFFSET, (const char *)hdr + sizeof(DictHeader), d->mapsize - sizeof(DictHeader)) != hdr->checksum) {
+		fprintf(stderr, "dict_verify(): Bad checksum.\n");
+		return(-1);
+	}
+
+	strsize = hdr->section[DICT_SEC_STRINGS].size;
+	if(d->offset[0] != 0 || d->offset[d->words] != strsize) {
+		fprintf(stderr, "dict_verify(): Bad word offsets.\n");
+		return(-1);
+	}
+	for(i = 0; i < d->words; i++) {
+		if(d->offset[i + 1] <= d->offset[i]) {
+			fprintf(stderr, "dict_verify(): Bad word offsets.\n");
+			return(-1);
+		}
+		if(i > 0 && word_compare(&(d->strings[d->offset[i - 1]]), d->offset[i] - d->offset[i - 1],
+		                         &(d->strings[d->offset[i]]), d->offset[i + 1] - d->offset[i]) >= 0) {
+			fprintf(stderr, "dict_verify(): Words aren't sorted at %i.\n", i);
+			return(-1);
+		}
+		if(d->heads[i * DICT_GRAM_MAX] == 0 || d->tails[i * DICT_GRAM_MAX] == 0 ||
+		   d->byhead[i] >= (uint32_t)d->words || d->bytail[i] >= (uint32_t)d->words) {
+			fprintf(stderr, "dict_verify(): Bad gram index at %i.\n", i);
+			return(-1);
+		}
+	}
+	if(gram_verify(d->headgram, hdr->section[DICT_SEC_HEADGRAMS].size, d->words) == -1 ||
+	   gram_verify(d->tailgram, hdr->section[DICT_SEC_TAILGRAMS].size, d->words) == -1) {
+		fprintf(stderr, "dict_verify(): Bad gram tables.\n");
+		return(-1);
+	}
+
+	return(0);
+}
+
+Dict *dict_load(const char *path) {
+	Dict *d;
+	struct stat st;
+	int fd;
+	void *map;
+
+	d = malloc(sizeof(Dict));
+	if(d == NULL) {
+		fprintf(stderr, "dict_load(): Couldn't allocate memory.\n");
+		goto derror0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		perror("dict_load(): open()");
+		goto derror1;
+	}
+	if(fstat(fd, &st) == -1) {
+		perror("dict_load(): fstat()");
+		goto derror2;
+	}
+	if((size_t)st.st_size < sizeof(DictHeader)) {
+		fprintf(stderr, "dict_load(): %s is too small.\n", path);
+		goto derror2;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("dict_load(): mmap()");
+		goto derror2;
+	}
+	close(fd);
+
+	d->hdr = map;
+	d->mapsize = st.st_size;
+	d->language = d->hdr->language;
+	d->words = d->hdr->words;
+	d->offset = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_OFFSETS].offset);
+	d->freq = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_FREQ].offset);
+	d->units = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_UNITS].offset);
+	d->strings = (const char *)map + d->hdr->section[DICT_SEC_STRINGS].offset;
+	d->heads = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_HEADS].offset);
+	d->tails = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_TAILS].offset);
+	d->byhead = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_BYHEAD].offset);
+	d->bytail = (const uint32_t *)((const char *)map + d->hdr->section[DICT_SEC_BYTAIL].offset);
+	d->headgram = (const DictGram *)((const char *)map + d->hdr->section[DICT_SEC_HEADGRAMS].offset);
+	d->tailgram = (const DictGram *)((const char *)map + d->hdr->section[DICT_SEC_TAILGRAMS].offset);
+	d->headmask = d->hdr->section[DICT_SEC_HEADGRAMS].size / sizeof(DictGram) - 1;
+	d->tailmask = d->hdr->section[DICT_SEC_TAILGRAMS].size / sizeof(DictGram) - 1;
+	d->complete = NULL;
+	d->completenodes = 0;
+	d->refs = 1;
+	d->generation = 0;
+
+	if(dict_verify(d) == -1) {
+		fprintf(stderr, "dict_load(): %s failed verification.\n", path);
+		goto derror3;
+	}
+
+	return(d);
+
+derror3:
+	munmap(map, st.st_size);
+	free(d);
+	return(NULL);
+derror2:
+	close(fd);
+derror1:
+	free(d);
+derror0:
+	return(NULL);
+}
+
+void dict_free(Dict *d) {
+	free(d->complete);
+	munmap((void *)d->hdr, d->mapsize);
+	free(d);
+}
+
+Dict *dict_ref(Dict *d) {
+	__atomic_add_fetch(&(d->refs), 1, __ATOMIC_SEQ_CST);
+
+	return(d);
+}
+
+void dict_release(Dict *d) {
+	if(d == NULL)
+		return;
+
+	__atomic_sub_fetch(&(d->refs), 1, __ATOMIC_SEQ_CST);
+}
+
+int dict_lookup(const Dict *d, const char *word, int len) {
+	int lo, hi, mid, retval;
+
+	lo = 0;
+	hi = d->words - 1;
+	while(lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		retval = word_compare(&(d->strings[d->offset[mid]]), d->offset[mid + 1] - d->offset[mid], word, len);
+		if(retval == 0)
+			return(mid);
+		if(retval < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return(-1);
+}
+
+const char *dict_word(const Dict *d, int id, int *len) {
+	*len = d->offset[id + 1] - d->offset[id];
+
+	return(&(d->strings[d->offset[id]]));
+}
+
+/* Multiplied through, the top bits depend on every unit. */
+uint32_t dict_gram_hash(const uint32_t *unit) {
+	uint64_t h;
+	int i;
+
+	h = 0;
+	for(i = 0; i < DICT_GRAM_MAX; i++)
+		h = (h ^ unit[i]) * 0x9E3779B97F4A7C15ULL;
+
+	return(h >> 32);
+}
+
+const DictGram *dict_starting(const Dict *d, const uint32_t *unit, int len) {
+	return(gram_find(d->headgram, d->headmask, unit, len));
+}
+
+const DictGram *dict_ending(const Dict *d, const uint32_t *unit, int len) {
+	return(gram_find(d->tailgram, d->tailmask, unit, len));
+}
+
+int dict_need(const Dict *d, int id, int overlap, uint32_t *need) {
+	const uint32_t *tail = &(d->tails[id * DICT_GRAM_MAX]);
+	int n, i;
+
+	for(n = 0; n < overlap && n < DICT_GRAM_MAX && tail[n] != 0; n++);
+	for(i = 0; i < n; i++)
+		need[i] = tail[n - 1 - i];
+
+	return(n);
+}
+
+int dict_starts(const Dict *d, int id, const uint32_t *need, int needlen) {
+	const uint32_t *head = &(d->heads[id * DICT_GRAM_MAX]);
+	int i;
+
+	for(i = 0; i < needlen; i++) {
+		if(head[i] != need[i])
+			return(0);
+	}
+
+	return(1);
+}
+
+#define SUGGEST_MAX_LEN		(64) /* longest word suggestions are made for, in letters */
+#define SUGGEST_BUDGET		(20000) /* most prefixes looked at for one word */
+
+/*
+ * The sorted dictionary is walked as a trie, every run of words sharing a
+ * prefix being a node, with one row of the edit distance table to the word per
+ * node.  Runs are found by binary search, so the cost depends on the number of
+ * prefixes close enough to the word rather than the size of the dictionary.
+ */
+typedef struct {
+	const Dict *d;
+	uint32_t q[SUGGEST_MAX_LEN];
+	int qlen;
+	int band; /* maxdist */
+	int limit; /* furthest distance still worth looking at */
+	const uint32_t *need;
+	int needlen;
+	const uint64_t *used;
+
+	int32_t *ids;
+	int dist[DICT_SUGGEST_MAX];
+	int k;
+	int found;
+	int budget;
+
+	int row[SUGGEST_MAX_LEN + DICT_SUGGEST_MAX_DIST + 1][SUGGEST_MAX_LEN + 1];
+} Suggest;
+
+/* Letters are compared as their UTF-8 bytes packed together, which is enough
+ * to tell them apart without decoding. */
+static int symbol_len(unsigned char c) {
+	if(c < 0xC0)
+		return(1);
+	if(c < 0xE0)
+		return(2);
+	if(c < 0xF0)
+		return(3);
+
+	return(4);
+}
+
+static uint32_t symbol_get(const char *s, int len) {
+	uint32_t c;
+	int i;
+
+	c = 0;
+	for(i = 0; i < len; i++)
+		c = (c << 8) | (unsigned char)s[i];
+
+	return(c);
+}
+
+static void suggest_add(Suggest *s, int id, int dist) {
+	const Dict *d = s->d;
+	int i;
+
+	if(!dict_starts(d, id, s->need, s->needlen))
+		return;
+	if(s->used != NULL && (s->used[id / 64] >> (id % 64)) & 1)
+		return;
+
+	/* closest first, then most common */
+	for(i = s->found; i > 0; i--) {
+		if(s->dist[i - 1] < dist || (s->dist[i - 1] == dist && d->freq[s->ids[i - 1]] >= d->freq[id]))
+			break;
+	}
+	if(i >= s->k)
+		return;
+	if(s->found < s->k)
+		s->found++;
+	memmove(&(s->ids[i + 1]), &(s->ids[i]), sizeof(int32_t) * (s->found - 1 - i));
+	memmove(&(s->dist[i + 1]), &(s->dist[i]), sizeof(int) * (s->found - 1 - i));
+	s->ids[i] = id;
+	s->dist[i] = dist;
+
+	/* once full, nothing further away can get in */
+	if(s->found == s->k)
+		s->limit = s->dist[s->found - 1];
+}
+
+static void suggest_walk(Suggest *s, int lo, int hi, int pos, int depth, int firstknown) {
+	const Dict *d = s->d;
+	const int *prev = s->row[depth];
+	int *row = s->row[depth + 1];
+	const char *w;
+	uint32_t c;
+	unsigned int unit[DICT_GRAM_MAX];
+	int len, start, end, mid, min, cost, i, from, to, known, units;
+
+	/* the word that is just the prefix sorts before the rest */
+	if(d->offset[lo + 1] - d->offset[lo] == (uint32_t)pos) {
+		if(abs(s->qlen - depth) <= s->band && prev[s->qlen] <= s->limit)
+			suggest_add(s, lo, prev[s->qlen]);
+		lo++;
+	}
+	/* anything longer differs by more than maxdist, and would need a row
+	 * past the end of the table */
+	if(depth >= s->qlen + s->band)
+		return;
+
+	/* only the cells within maxdist of the diagonal can be close enough */
+	from = depth + 1 - s->band;
+	if(from < 1)
+		from = 1;
+	to = depth + 1 + s->band;
+	if(to > s->qlen)
+		to = s->qlen;
+
+	while(lo < hi && s->budget > 0) {
+		s->budget--;
+
+		w = &(d->strings[d->offset[lo] + pos]);
+		len = symbol_len(w[0]);
+		c = symbol_get(w, len);
+		/* runs are mostly short, so gallop out from the start before
+		 * searching */
+		start = lo + 1;
+		for(i = 1; start + i < hi && memcmp(&(d->strings[d->offset[start + i - 1] + pos]), w, len) == 0; i *= 2)
+			start += i;
+		end = start + i < hi ? start + i : hi;
+		while(start < end) {
+			mid = start + (end - start) / 2;
+			if(memcmp(&(d->strings[d->offset[mid] + pos]), w, len) == 0)
+				start = mid + 1;
+			else
+				end = mid;
+		}
+
+		/* every word under a prefix starts with the same units as far as
+		 * the prefix has them, so whole runs starting wrong can be skipped */
+		known = firstknown;
+		if(!known && s->needlen > 0) {
+			units = norm_first_units(&(d->strings[d->offset[lo]]), pos + len, d->language, unit, s->needlen);
+			for(i = 0; i < units && unit[i] == s->need[i]; i++);
+			if(i < units) {
+				lo = end;
+				continue;
+			}
+			known = units == s->needlen;
+		}
+
+		row[0] = prev[0] + 1;
+		min = row[0];
+		if(from > 1)
+			row[from - 1] = s->band + 1;
+		for(i = from; i <= to; i++) {
+			cost = prev[i - 1] + (s->q[i - 1] != c);
+			if(prev[i] + 1 < cost)
+				cost = prev[i] + 1;
+			if(row[i - 1] + 1 < cost)
+				cost = row[i - 1] + 1;
+			row[i] = cost;
+			if(cost < min)
+				min = cost;
+		}
+		if(to < s->qlen)
+			row[to + 1] = s->band + 1;
+		if(min <= s->limit)
+			suggest_walk(s, lo, end, pos + len, depth + 1, known);
+		lo = end;
+	}
+}
+
+int dict_suggest(const Dict *d, const char *word, int len, int maxdist, const uint32_t *need, int needlen, const uint64_t *used, int32_t *ids, int k) {
+	Suggest s;
+	int i, symlen;
+
+	if(maxdist < 0 || maxdist > DICT_SUGGEST_MAX_DIST || k < 1 || needlen < 0 || needlen > DICT_GRAM_MAX)
+		return(-1);
+	if(k > DICT_SUGGEST_MAX)
+		k = DICT_SUGGEST_MAX;
+
+	s.qlen = 0;
+	for(i = 0; i < len; i += symlen) {
+		if(s.qlen == SUGGEST_MAX_LEN)
+			return(-1);
+		symlen = symbol_len(word[i]);
+		if(symlen > len - i)
+			symlen = len - i;
+		s.q[s.qlen++] = symbol_get(&(word[i]), symlen);
+	}
+	if(d->words == 0)
+		return(0);
+
+	s.d = d;
+	s.band = maxdist;
+	s.limit = maxdist;
+	s.need = need;
+	s.needlen = needlen;
+	s.used = used;
+	s.ids = ids;
+	s.k = k;
+	s.found = 0;
+	s.budget = SUGGEST_BUDGET;
+	for(i = 0; i <= s.qlen; i++)
+		s.row[0][i] = i;
+	suggest_walk(&s, 0, d->words, 0, 0, 0);
+
+	return(s.found);
+}
+
+#define COMPLETE_SCAN_MAX	(4096) /* most words scanned to make up for filtered ones */
+
+static int word_len(const Dict *d, int id) {
+	return(d->offset[id + 1] - d->offset[id]);
+}
+
+/* Adds a word to a list kept most common first, returns the new count. */
+static int top_insert(const Dict *d, int32_t *ids, int count, int k, int32_t id) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		if(ids[i] == id)
+			return(count);
+	}
+	for(i = count; i > 0; i--) {
+		if(d->freq[ids[i - 1]] > d->freq[id] || (d->freq[ids[i - 1]] == d->freq[id] && ids[i - 1] < id))
+			break;
+	}
+	if(i >= k)
+		return(count);
+	if(count < k)
+		count++;
+	memmove(&(ids[i + 1]), &(ids[i]), sizeof(int32_t) * (count - 1 - i));
+	ids[i] = id;
+
+	return(count);
+}
+
+/* First word at or after lo whose byte at pos isn't c, all those from lo up to
+ * it having it. */
+static int byte_run_end(const Dict *d, int lo, int hi, int pos, unsigned char c) {
+	int mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if((unsigned char)d->strings[d->offset[mid] + pos] == c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return(lo);
+}
+
+typedef struct {
+	DictCompleteNode *node;
+	int nodes;
+	int maxnodes;
+} CompleteBuild;
+
+/* Finds the most common words from lo to hi - 1, keeping a node for them if
+ * there are too many to just sort when asked. */
+static int complete_build(const Dict *d, CompleteBuild *b, int lo, int hi, int32_t *top) {
+	DictCompleteNode *node;
+	int32_t child[DICT_COMPLETE_K];
+	const char *first, *last;
+	int n, count, childcount, lcp, max, start, end, i;
+
+	count = 0;
+	if(hi - lo <= DICT_COMPLETE_K) {
+		for(i = lo; i < hi; i++)
+			count = top_insert(d, top, count, DICT_COMPLETE_K, i);
+		return(count);
+	}
+
+	if(b->nodes == b->maxnodes) {
+		node = realloc(b->node, sizeof(DictCompleteNode) * b->maxnodes * 2);
+		if(node == NULL)
+			return(-1);
+		b->node = node;
+		b->maxnodes *= 2;
+	}
+	/* taken before the children, so nodes end up in order */
+	n = b->nodes++;
+
+	/* sorted, so what the first and last share, everything in between does */
+	first = &(d->strings[d->offset[lo]]);
+	last = &(d->strings[d->offset[hi - 1]]);
+	max = word_len(d, lo) < word_len(d, hi - 1) ? word_len(d, lo) : word_len(d, hi - 1);
+	for(lcp = 0; lcp < max && first[lcp] == last[lcp]; lcp++);
+
+	start = lo;
+	if(word_len(d, lo) == lcp) {
+		count = top_insert(d, top, count, DICT_COMPLETE_K, lo);
+		lo++;
+	}
+	while(lo < hi) {
+		end = byte_run_end(d, lo, hi, lcp, d->strings[d->offset[lo] + lcp]);
+		childcount = complete_build(d, b, lo, end, child);
+		if(childcount == -1)
+			return(-1);
+		for(i = 0; i < childcount; i++)
+			count = top_insert(d, top, count, DICT_COMPLETE_K, child[i]);
+		lo = end;
+	}
+
+	node = &(b->node[n]);
+	node->lo = start;
+	node->hi = hi;
+	for(i = 0; i < DICT_COMPLETE_K; i++)
+		node->top[i] = i < count ? top[i] : -1;
+
+	return(count);
+}
+
+int dict_complete_index(Dict *d) {
+	CompleteBuild b;
+	int32_t top[DICT_COMPLETE_K];
+
+	b.maxnodes = 64;
+	b.nodes = 0;
+	b.node = malloc(sizeof(DictCompleteNode) * b.maxnodes);
+	if(b.node == NULL) {
+		fprintf(stderr, "dict_complete_index(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+	if(complete_build(d, &b, 0, d->words, top) == -1) {
+		fprintf(stderr, "dict_complete_index(): Couldn't allocate memory.\n");
+		free(b.node);
+		return(-1);
+	}
+
+	free(d->complete);
+	d->complete = b.node;
+	d->completenodes = b.nodes;
+
+	return(0);
+}
+
+static const DictCompleteNode *complete_node(const Dict *d, uint32_t lo, uint32_t hi) {
+	int nlo, nhi, mid;
+	const DictCompleteNode *node;
+
+	nlo = 0;
+	nhi = d->completenodes - 1;
+	while(nlo <= nhi) {
+		mid = nlo + (nhi - nlo) / 2;
+		node = &(d->complete[mid]);
+		if(node->lo == lo && node->hi == hi)
+			return(node);
+		if(node->lo < lo || (node->lo == lo && node->hi > hi))
+			nlo = mid + 1;
+		else
+			nhi = mid - 1;
+	}
+
+	return(NULL);
+}
+
+static int complete_allowed(const Dict *d, int id, const uint32_t *need, int needlen, const uint64_t *used) {
+	if(!dict_starts(d, id, need, needlen))
+		return(0);
+	if(used != NULL && (used[id / 64] >> (id % 64)) & 1)
+		return(0);
+
+	return(1);
+}
+
+int dict_complete(const Dict *d, const char *prefix, int len, const uint32_t *need, int needlen, const uint64_t *used, int32_t *ids, int k) {
+	const DictCompleteNode *node;
+	int lo, hi, mid, count, i;
+
+	if(k > DICT_COMPLETE_K)
+		k = DICT_COMPLETE_K;
+	if(needlen > DICT_GRAM_MAX)
+		return(0);
+
+	/* first word not before the prefix */
+	lo = 0;
+	hi = d->words;
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(word_compare(&(d->strings[d->offset[mid]]), word_len(d, mid), prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* and the first after it that doesn't start with it */
+	hi = d->words;
+	for(i = lo; i < hi; ) {
+		mid = i + (hi - i) / 2;
+		if(word_len(d, mid) >= len && memcmp(&(d->strings[d->offset[mid]]), prefix, len) == 0)
+			i = mid + 1;
+		else
+			hi = mid;
+	}
+
+	count = 0;
+	node = NULL;
+	if(d->complete != NULL && hi - lo > DICT_COMPLETE_K)
+		node = complete_node(d, lo, hi);
+	if(node != NULL) {
+		for(i = 0; i < DICT_COMPLETE_K && count < k; i++) {
+			if(complete_allowed(d, node->top[i], need, needlen, used))
+				ids[count++] = node->top[i];
+		}
+		if(count == k)
+			return(count);
+	}
+
+	/* few enough to sort, or too many of the common ones filtered out */
+	if(hi - lo > COMPLETE_SCAN_MAX)
+		hi = lo + COMPLETE_SCAN_MAX;
+	for(i = lo; i < hi; i++) {
+		if(complete_allowed(d, i, need, needlen, used))
+			count = top_insert(d, ids, count, k, i);
+	}
+
+	return(count);
+}
+
+#define BATCH_LANES	(16)
+
+WordArena *wordarena_init(int maxwords, int datasize) {
+	WordArena *a;
+
+	a = malloc(sizeof(WordArena));
+	if(a == NULL)
+		goto aerror0;
+
+	a->data = malloc(datasize);
+	if(a->data == NULL)
+		goto aerror1;
+
+	a->offset = malloc(sizeof(uint32_t) * maxwords);
+	if(a->offset == NULL)
+		goto aerror2;
+
+	a->len = malloc(sizeof(uint32_t) * maxwords);
+	if(a->len == NULL)
+		goto aerror3;
+
+	a->datasize = datasize;
+	a->maxwords = maxwords;
+	wordarena_reset(a);
+
+	return(a);
+
+aerror3:
+	free(a->offset);
+aerror2:
+	free(a->data);
+aerror1:
+	free(a);
+aerror0:
+	return(NULL);
+}
+
+void wordarena_free(WordArena *a) {
+	free(a->len);
+	free(a->offset);
+	free(a->data);
+	free(a);
+}
+
+int wordarena_add(WordArena *a, const char *word, int len) {
+	if(a->words == a->maxwords || len > a->datasize - a->dataused)
+		return(-1);
+
+	memcpy(&(a->data[a->dataused]), word, len);
+	a->offset[a->words] = a->dataused;
+	a->len[a->words] = len;
+	a->words++;
+	a->dataused += len;
+
+	return(0);
+}
+
+void wordarena_reset(WordArena *a) {
+	a->words = 0;
+	a->dataused = 0;
+}
+
+static void normalize_batch(WordArena *a, int32_t *ids) {
+	int i, pos, done, end, retval;
+
+	/* Fold everything up to the first byte that isn't ASCII in one go, then
+	 * only the word it's in has to go through norm_word() before carrying on
+	 * after it. */
+	i = 0;
+	pos = 0;
+	while(i < a->words) {
+		done = pos + norm_fold_ascii(&(a->data[pos]), a->dataused - pos);
+		for(; i < a->words && a->offset[i] + a->len[i] <= (uint32_t)done; i++)
+			ids[i] = 0;
+		if(i == a->words)
+			break;
+
+		end = a->offset[i] + a->len[i];
+		retval = norm_word(&(a->data[a->offset[i]]), a->len[i], &(a->data[a->offset[i]]), a->len[i]);
+		if(retval == -1) {
+			ids[i] = DICT_WORD_INVALID;
+		} else {
+			ids[i] = 0;
+			a->len[i] = retval;
+		}
+		pos = end;
+		i++;
+	}
+}
+
+int dict_validate_batch(const Dict *d, WordArena *a, int32_t *ids) {
+	int pos[BATCH_LANES];
+	int base, lanes, found;
+	int i, k, n, half, len;
+	const char *word;
+
+	normalize_batch(a, ids);
+
+	found = 0;
+	for(base = 0; base < a->words; base += BATCH_LANES) {
+		lanes = a->words - base < BATCH_LANES ? a->words - base : BATCH_LANES;
+		if(d->words == 0) {
+			for(k = 0; k < lanes; k++)
+				if(ids[base + k] != DICT_WORD_INVALID)
+					ids[base + k] = -1;
+			continue;
+		}
+
+		/* Every search takes the same number of steps, so they can all be
+		 * stepped together: fetch every lane's next word, then compare them
+		 * all, then fetch every lane's next offset for the step after. */
+		for(k = 0; k < lanes; k++)
+			pos[k] = 0;
+		n = d->words;
+		while(n > 1) {
+			half = n / 2;
+			for(k = 0; k < lanes; k++)
+				__builtin_prefetch(&(d->strings[d->offset[pos[k] + half]]));
+			for(k = 0; k < lanes; k++) {
+				i = base + k;
+				word = dict_word(d, pos[k] + half, &len);
+				if(word_compare(word, len, &(a->data[a->offset[i]]), a->len[i]) <= 0)
+					pos[k] += half;
+				__builtin_prefetch(&(d->offset[pos[k] + (n - half) / 2]));
+			}
+			n -= half;
+		}
+
+		for(k = 0; k < lanes; k++) {
+			i = base + k;
+			if(ids[i] == DICT_WORD_INVALID)
+				continue;
+			word = dict_word(d, pos[k], &len);
+			if(word_compare(word, len, &(a->data[a->offset[i]]), a->len[i]) == 0) {
+				ids[i] = pos[k];
+				found++;
+			} else {
+				ids[i] = -1;
+			}
+		}
+	}
+
+	return(found);
+}
+
+/*
+ * Compiling runs in three stages so memory stays bounded however large the word
+ * list is.  Threads take turns reading blocks of whole lines, normalize them in
+ * parallel and sort what they have in to runs, written to temporary files.  The
+ * runs are then merged, merging duplicates, with each section streamed out to
+ * its own temporary file as words come out in order, and finally the sections
+ * are copied in to the dictionary behind the header.
+ *
+ * The gram index is sorted and filled in through the temporary files mapped,
+ * so it doesn't need any more memory than the kernel can spare for them.
+ */
+#define COMPILE_BLOCK		(4 * 1024 * 1024) /* read at a time by each thread */
+#define COMPILE_MEMORY		(256 * 1024 * 1024) /* words waiting to be sorted, across all threads */
+#define COMPILE_WORD_GUESS	(8) /* average length of a word, for sizing runs */
+#define COMPILE_MAX_THREADS	(64)
+
+typedef struct {
+	uint64_t key; /* first 8 bytes, big endian and zero padded, which sorts the same as the word */
+	uint32_t offset;
+	uint32_t len;
+	uint32_t freq;
+} CompileWord;
+
+typedef struct {
+	norm_language lang;
+	size_t runbytes; /* strings each thread collects before sorting */
+	int runwords;
+
+	pthread_mutex_t lock; /* for everything below */
+	int fd;
+	char *carry; /* start of a line left over from the last block */
+	int carrylen;
+	int skipline; /* in the middle of a line longer than a block */
+	int eof;
+	int error;
+	FILE **run;
+	int runs;
+	int maxruns;
+} Compile;
+
+typedef struct {
+	Compile *c;
+	pthread_t thread;
+	char *block;
+	char *strings;
+	size_t strused;
+	CompileWord *words;
+	int nwords;
+	CompileWord *temp; /* for sorting */
+	uint32_t *count;
+} CompileWorker;
+
+typedef struct {
+	FILE *f;
+	char word[UINT16_MAX];
+	uint16_t len;
+	uint32_t freq;
+} CompileRun;
+
+static uint64_t compile_key(const char *word, int len) {
+	uint64_t key;
+	int i;
+
+	key = 0;
+	for(i = 0; i < 8; i++)
+		key = (key << 8) | (i < len ? (unsigned char)word[i] : 0);
+
+	return(key);
+}
+
+static int compile_compare(const void *a, const void *b, void *strings) {
+	const CompileWord *wa = a, *wb = b;
+
+	if(wa->key != wb->key)
+		return(wa->key < wb->key ? -1 : 1);
+	return(word_compare(&(((char *)strings)[wa->offset]), wa->len, &(((char *)strings)[wb->offset]), wb->len));
+}
+
+/* Gets the next block of whole lines, returns its length, 0 at the end, -1 on error. */
+static int compile_read(Compile *c, char *block) {
+	char *nl;
+	int have, begin, end;
+	ssize_t n;
+
+	pthread_mutex_lock(&(c->lock));
+	for(;;) {
+		if(c->error) {
+			have = -1;
+			break;
+		}
+		memcpy(block, c->carry, c->carrylen);
+		have = c->carrylen;
+		c->carrylen = 0;
+		while(!c->eof && have < COMPILE_BLOCK) {
+			n = read(c->fd, &(block[have]), COMPILE_BLOCK - have);
+			if(n == -1) {
+				if(errno == EINTR)
+					continue;
+				perror("dict_compile(): read()");
+				c->error = 1;
+				break;
+			}
+			if(n == 0)
+				c->eof = 1;
+			have += n;
+		}
+		if(c->error || have == 0) {
+			have = c->error ? -1 : 0;
+			break;
+		}
+
+		begin = 0;
+		if(c->skipline) {
+			nl = memchr(block, '\n', have);
+			if(nl == NULL) {
+				if(c->eof)
+					c->skipline = 0;
+				continue;
+			}
+			begin = nl - block + 1;
+			c->skipline = 0;
+		}
+		end = have;
+		if(!c->eof) {
+			for(end = have; end > begin && block[end - 1] != '\n'; end--);
+			if(end == begin) { /* far too long to be a word */
+				c->skipline = 1;
+				continue;
+			}
+			memcpy(c->carry, &(block[end]), have - end);
+			c->carrylen = have - end;
+		}
+		memmove(block, &(block[begin]), end - begin);
+		have = end - begin;
+		if(have > 0)
+			break;
+	}
+	pthread_mutex_unlock(&(c->lock));
+
+	return(have);
+}
+
+/* Radix sorts by key, 16 bits at a time, then words sharing a key by the whole word. */
+static void compile_sort(CompileWord *words, CompileWord *temp, uint32_t *count, int n, char *strings) {
+	CompileWord *src, *dst, *t;
+	uint32_t sum, c;
+	int shift;
+	int i, j;
+
+	if(n == 0)
+		return;
+	src = words;
+	dst = temp;
+	for(shift = 0; shift < 64; shift += 16) {
+		memset(count, 0, sizeof(uint32_t) * 65536);
+		for(i = 0; i < n; i++)
+			count[(src[i].key >> shift) & 0xFFFF]++;
+		if(count[(src[0].key >> shift) & 0xFFFF] == (uint32_t)n) /* all the same, like the end of short words */
+			continue;
+		sum = 0;
+		for(i = 0; i < 65536; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for(i = 0; i < n; i++)
+			dst[count[(src[i].key >> shift) & 0xFFFF]++] = src[i];
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if(src != words)
+		memcpy(words, src, sizeof(CompileWord) * n);
+
+	for(i = 0; i < n; i = j) {
+		for(j = i + 1; j < n && words[j].key == words[i].key; j++);
+		if(j - i > 1)
+			qsort_r(&(words[i]), j - i, sizeof(CompileWord), compile_compare, strings);
+	}
+}
+
+/* Sorts what a thread has collected and writes it out as a run, duplicates merged. */
+static int compile_flush(CompileWorker *w) {
+	Compile *c = w->c;
+	FILE *f, **newrun;
+	uint64_t freq;
+	uint16_t len;
+	int i, j;
+
+	if(w->nwords == 0)
+		return(0);
+	compile_sort(w->words, w->temp, w->count, w->nwords, w->strings);
+
+	f = tmpfile();
+	if(f == NULL) {
+		perror("dict_compile(): tmpfile()");
+		return(-1);
+	}
+	for(i = 0; i < w->nwords; i = j) {
+		freq = w->words[i].freq;
+		for(j = i + 1; j < w->nwords && compile_compare(&(w->words[i]), &(w->words[j]), w->strings) == 0; j++)
+			freq += w->words[j].freq;
+		if(freq > UINT32_MAX)
+			freq = UINT32_MAX;
+		w->words[i].freq = freq;
+		len = w->words[i].len;
+		if(fwrite(&(w->words[i].freq), sizeof(uint32_t), 1, f) != 1 ||
+		   fwrite(&len, sizeof(uint16_t), 1, f) != 1 ||
+		   fwrite(&(w->strings[w->words[i].offset]), 1, len, f) != len) {
+			perror("dict_compile(): fwrite()");
+			fclose(f);
+			return(-1);
+		}
+	}
+	w->nwords = 0;
+	w->strused = 0;
+
+	pthread_mutex_lock(&(c->lock));
+	if(c->runs == c->maxruns) {
+		newrun = realloc(c->run, sizeof(FILE *) * (c->maxruns == 0 ? 16 : c->maxruns * 2));
+		if(newrun == NULL) {
+			pthread_mutex_unlock(&(c->lock));
+			fprintf(stderr, "dict_compile(): Couldn't allocate memory.\n");
+			fclose(f);
+			return(-1);
+		}
+		c->run = newrun;
+		c->maxruns = c->maxruns == 0 ? 16 : c->maxruns * 2;
+	}
+	c->run[c->runs] = f;
+	c->runs++;
+	pthread_mutex_unlock(&(c->lock));
+
+	return(0);
+}
+
+static void *compile_worker(void *arg) {
+	CompileWorker *w = arg;
+	Compile *c = w->c;
+	char *line, *next, *tab, *end;
+	int blocklen, linelen, len;
+	unsigned long freq;
+
+	while((blocklen = compile_read(c, w->block)) > 0) {
+		end = &(w->block[blocklen]);
+		for(line = w->block; line < end; line = next) {
+			next = memchr(line, '\n', end - line);
+			linelen = next != NULL ? next - line : end - line;
+			next = next != NULL ? next + 1 : end;
+			while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+				linelen--;
+			freq = 0;
+			tab = memchr(line, '\t', linelen);
+			if(tab != NULL) {
+				for(len = tab - line + 1; len < linelen && line[len] >= '0' && line[len] <= '9'; len++)
+					freq = freq * 10 + (line[len] - '0') > UINT32_MAX ? UINT32_MAX : freq * 10 + (line[len] - '0');
+				linelen = tab - line;
+			}
+			if(linelen == 0 || linelen > UINT16_MAX)
+				continue;
+
+			if(w->strused + linelen > c->runbytes || w->nwords == c->runwords) {
+				if(compile_flush(w) == -1)
+					goto werror;
+			}
+			len = norm_word(&(w->strings[w->strused]), linelen, line, linelen);
+			if(len <= 0 || norm_first_unit(&(w->strings[w->strused]), len, c->lang) == 0)
+				continue;
+			w->words[w->nwords].key = compile_key(&(w->strings[w->strused]), len);
+			w->words[w->nwords].offset = w->strused;
+			w->words[w->nwords].len = len;
+			w->words[w->nwords].freq = freq;
+			w->nwords++;
+			w->strused += len;
+		}
+	}
+	if(blocklen == -1 || compile_flush(w) == -1)
+		goto werror;
+
+	return(NULL);
+
+werror:
+	pthread_mutex_lock(&(c->lock));
+	c->error = 1;
+	pthread_mutex_unlock(&(c->lock));
+	return(NULL);
+}
+
+/* Reads a run's next word, returns 0, 1 at the end, -1 on error.  Only one thread is left by now, so stdio needn't lock. */
+static int run_next(CompileRun *r) {
+	if(fread_unlocked(&(r->freq), sizeof(uint32_t), 1, r->f) != 1)
+		return(ferror(r->f) ? -1 : 1);
+	if(fread_unlocked(&(r->len), sizeof(uint16_t), 1, r->f) != 1 ||
+	   fread_unlocked(r->word, 1, r->len, r->f) != r->len)
+		return(-1);
+
+	return(0);
+}
+
+static int run_less(const CompileRun *a, const CompileRun *b) {
+	return(word_compare(a->word, a->len, b->word, b->len) < 0);
+}
+
+static void heap_down(CompileRun **heap, int n, int i) {
+	CompileRun *t;
+	int child;
+
+	for(;;) {
+		child = i * 2 + 1;
+		if(child >= n)
+			break;
+		if(child + 1 < n && run_less(heap[child + 1], heap[child]))
+			child++;
+		if(!run_less(heap[child], heap[i]))
+			break;
+		t = heap[i];
+		heap[i] = heap[child];
+		heap[child] = t;
+		i = child;
+	}
+}
+
+/* Writes a word out to each section's file. */
+static int compile_emit(FILE **sec, const char *word, int len, uint32_t freq, uint64_t *pos, norm_language lang) {
+	uint32_t offset, units[2];
+	uint32_t head[DICT_GRAM_MAX], tail[DICT_GRAM_MAX];
+	int flags;
+
+	if(*pos + len > UINT32_MAX) {
+		fprintf(stderr, "dict_compile(): Word list is too large.\n");
+		return(-1);
+	}
+	offset = *pos;
+	memset(head, 0, sizeof(head));
+	memset(tail, 0, sizeof(tail));
+	norm_first_units(word, len, lang, head, DICT_GRAM_MAX);
+	norm_last_units(word, len, lang, tail, DICT_GRAM_MAX, &flags);
+	units[0] = head[0];
+	units[1] = tail[0];
+	if(flags & NORM_LOSING)
+		units[1] |= DICT_UNIT_LOSING;
+	if(fwrite_unlocked(&offset, sizeof(uint32_t), 1, sec[DICT_SEC_OFFSETS]) != 1 ||
+	   fwrite_unlocked(&freq, sizeof(uint32_t), 1, sec[DICT_SEC_FREQ]) != 1 ||
+	   fwrite_unlocked(units, sizeof(uint32_t), 2, sec[DICT_SEC_UNITS]) != 2 ||
+	   fwrite_unlocked(word, 1, len, sec[DICT_SEC_STRINGS]) != (size_t)len ||
+	   fwrite_unlocked(head, sizeof(uint32_t), DICT_GRAM_MAX, sec[DICT_SEC_HEADS]) != DICT_GRAM_MAX ||
+	   fwrite_unlocked(tail, sizeof(uint32_t), DICT_GRAM_MAX, sec[DICT_SEC_TAILS]) != DICT_GRAM_MAX) {
+		perror("dict_compile(): fwrite()");
+		return(-1);
+	}
+	*pos += len;
+
+	return(0);
+}
+
+/* Merges the runs in to the sections, returns the number of words or -1 on error. */
+static int compile_merge(Compile *c, FILE **sec) {
+	CompileRun *run, **heap;
+	CompileRun *cur;
+	uint64_t pos, freq;
+	uint32_t offset;
+	int n, words, have, retval;
+	int i;
+
+	run = malloc(sizeof(CompileRun) * (c->runs + 1));
+	heap = malloc(sizeof(CompileRun *) * (c->runs + 1));
+	if(run == NULL || heap == NULL) {
+		fprintf(stderr, "dict_compile(): Couldn't allocate memory.\n");
+		goto merror0;
+	}
+	cur = &(run[c->runs]); /* the word being merged */
+
+	n = 0;
+	for(i = 0; i < c->runs; i++) {
+		run[i].f = c->run[i];
+		rewind(run[i].f);
+		retval = run_next(&(run[i]));
+		if(retval == -1)
+			goto merror1;
+		if(retval == 0)
+			heap[n++] = &(run[i]);
+	}
+	for(i = n / 2 - 1; i >= 0; i--)
+		heap_down(heap, n, i);
+
+	words = 0;
+	pos = 0;
+	freq = 0;
+	have = 0;
+	while(n > 0) {
+		if(have && word_compare(heap[0]->word, heap[0]->len, cur->word, cur->len) == 0) {
+			freq += heap[0]->freq;
+		} else {
+			if(have) {
+				if(compile_emit(sec, cur->word, cur->len, freq > UINT32_MAX ? UINT32_MAX : freq, &pos, c->lang) == -1)
+					goto merror1;
+				words++;
+			}
+			memcpy(cur->word, heap[0]->word, heap[0]->len);
+			cur->len = heap[0]->len;
+			freq = heap[0]->freq;
+			have = 1;
+		}
+		retval = run_next(heap[0]);
+		if(retval == -1)
+			goto merror1;
+		if(retval == 1)
+			heap[0] = heap[--n];
+		heap_down(heap, n, 0);
+	}
+	if(have) {
+		if(compile_emit(sec, cur->word, cur->len, freq > UINT32_MAX ? UINT32_MAX : freq, &pos, c->lang) == -1)
+			goto merror1;
+		words++;
+	}
+
+	offset = pos;
+	if(fwrite(&offset, sizeof(uint32_t), 1, sec[DICT_SEC_OFFSETS]) != 1) {
+		perror("dict_compile(): fwrite()");
+		goto merror1;
+	}
+
+	free(heap);
+	free(run);
+	return(words);
+
+merror1:
+	fprintf(stderr, "dict_compile(): Couldn't merge words.\n");
+merror0:
+	free(heap);
+	free(run);
+	return(-1);
+}
+
+/* Orders word IDs by the units kept for them, then by ID. */
+static int gram_compare(const void *a, const void *b, void *units) {
+	const uint32_t *ua, *ub;
+	uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+	int i;
+
+	ua = &(((const uint32_t *)units)[ia * DICT_GRAM_MAX]);
+	ub = &(((const uint32_t *)units)[ib * DICT_GRAM_MAX]);
+	for(i = 0; i < DICT_GRAM_MAX; i++) {
+		if(ua[i] != ub[i])
+			return(ua[i] < ub[i] ? -1 : 1);
+	}
+
+	return(ia < ib ? -1 : ia > ib);
+}
+
+/* Maps a temporary file, made size bytes long first if it's to be written. */
+static void *compile_map(FILE *f, size_t size, int writable) {
+	void *map;
+
+	if(fflush(f) == EOF || (writable && ftruncate(fileno(f), size) == -1)) {
+		perror("dict_compile(): ftruncate()");
+		return(NULL);
+	}
+	map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileno(f), 0);
+	if(map == MAP_FAILED) {
+		perror("dict_compile(): mmap()");
+		return(NULL);
+	}
+
+	return(map);
+}
+
+/*
+ * Sorts the word IDs by the units at one end and makes the gram table for the
+ * ranges, returns 0 or -1 on error.  Sorted, every gram a word has is shared
+ * with the words either side of it until it changes, so each is one run.
+ */
+static int compile_grams(FILE *unitsec, FILE *bysec, FILE *gramsec, int words) {
+	const uint32_t *units, *u;
+	uint32_t *by;
+	DictGram *table, *cur[DICT_GRAM_MAX];
+	uint64_t grams, slots;
+	uint32_t key[DICT_GRAM_MAX], mask, h;
+	int i, k;
+
+	units = NULL;
+	by = NULL;
+	if(words > 0) {
+		units = compile_map(unitsec, (size_t)words * DICT_GRAM_MAX * sizeof(uint32_t), 0);
+		if(units == NULL)
+			goto gerror0;
+		by = compile_map(bysec, (size_t)words * sizeof(uint32_t), 1);
+		if(by == NULL)
+			goto gerror1;
+	}
+	for(i = 0; i < words; i++)
+		by[i] = i;
+	qsort_r(by, words, sizeof(uint32_t), gram_compare, (void *)units);
+
+	/* at most two thirds full, so probes stay short and there's always an empty slot */
+	grams = 0;
+	for(i = 0; i < words; i++) {
+		u = &(units[by[i] * DICT_GRAM_MAX]);
+		for(k = 0; k < DICT_GRAM_MAX && u[k] != 0; k++) {
+			if(i == 0 || memcmp(u, &(units[by[i - 1] * DICT_GRAM_MAX]), sizeof(uint32_t) * (k + 1)) != 0)
+				grams++;
+		}
+	}
+	for(slots = 8; slots * 2 < grams * 3; slots *= 2);
+	if(slots > UINT32_MAX) {
+		fprintf(stderr, "dict_compile(): Too many grams.\n");
+		goto gerror2;
+	}
+	mask = slots - 1;
+	table = compile_map(gramsec, slots * sizeof(DictGram), 1);
+	if(table == NULL)
+		goto gerror2;
+
+	for(k = 0; k < DICT_GRAM_MAX; k++)
+		cur[k] = NULL;
+	for(i = 0; i < words; i++) {
+		u = &(units[by[i] * DICT_GRAM_MAX]);
+		for(k = 0; k < DICT_GRAM_MAX && u[k] != 0; k++) {
+			if(cur[k] == NULL || memcmp(cur[k]->unit, u, sizeof(uint32_t) * (k + 1)) != 0) {
+				memset(key, 0, sizeof(key));
+				memcpy(key, u, sizeof(uint32_t) * (k + 1));
+				for(h = dict_gram_hash(key) & mask; table[h].hi != 0; h = (h + 1) & mask);
+				cur[k] = &(table[h]);
+				memcpy(cur[k]->unit, key, sizeof(key));
+				cur[k]->lo = i;
+			}
+			cur[k]->hi = i + 1;
+		}
+		/* a shorter word ends the longer grams before it */
+		for(; k < DICT_GRAM_MAX; k++)
+			cur[k] = NULL;
+	}
+
+	munmap(table, slots * sizeof(DictGram));
+	if(words > 0) {
+		munmap(by, (size_t)words * sizeof(uint32_t));
+		munmap((void *)units, (size_t)words * DICT_GRAM_MAX * sizeof(uint32_t));
+	}
+
+	return(0);
+
+gerror2:
+	if(by != NULL)
+		munmap(by, (size_t)words * sizeof(uint32_t));
+gerror1:
+	if(units != NULL)
+		munmap((void *)units, (size_t)words * DICT_GRAM_MAX * sizeof(uint32_t));
+gerror0:
+	fprintf(stderr, "dict_compile(): Couldn't index grams.\n");
+	return(-1);
+}
+
+/* Copies a section in from a temporary file, padded to 8 bytes. */
+static int copy_section(FILE *out, uint64_t *checksum, uint64_t *pos, DictSection *sec, FILE *in, char *buf, size_t bufsize) {
+	static const char zeros[8] = {0};
+	size_t len, n, pad;
+
+	sec->offset = *pos;
+	len = 0;
+	rewind(in);
+	while((n = fread(buf, 1, bufsize, in)) > 0) {
+		if(fwrite(buf, 1, n, out) != n)
+			return(-1);
+		*checksum = checksum_update(*checksum, buf, n);
+		len += n;
+	}
+	if(ferror(in))
+		return(-1);
+	sec->size = len;
+	pad = DICT_ALIGN(len) - len;
+	if(pad > 0 && fwrite(zeros, 1, pad, out) != pad)
+		return(-1);
+	*checksum = checksum_update(*checksum, zeros, pad);
+	*pos += len + pad;
+
+	return(0);
+}
+
+int dict_compile(const char *outpath, const char *inpath, norm_language lang, int threads) {
+	Compile c;
+	CompileWorker *w;
+	FILE *sec[DICT_SECTIONS];
+	FILE *out;
+	DictHeader hdr;
+	uint64_t pos;
+	size_t share;
+	char *buf;
+	int words, started;
+	int i;
+
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads < 1)
+		threads = 1;
+	if(threads > COMPILE_MAX_THREADS)
+		threads = COMPILE_MAX_THREADS;
+
+	memset(&c, 0, sizeof(Compile));
+	c.lang = lang;
+	/* each thread's share goes on the words and two arrays pointing at them, for sorting */
+	share = COMPILE_MEMORY / threads;
+	c.runbytes = share / (COMPILE_WORD_GUESS + sizeof(CompileWord) * 2) * COMPILE_WORD_GUESS;
+	c.runwords = c.runbytes / COMPILE_WORD_GUESS;
+	if(strcmp(inpath, "-") == 0) {
+		c.fd = STDIN_FILENO;
+	} else {
+		c.fd = open(inpath, O_RDONLY);
+		if(c.fd == -1) {
+			perror("dict_compile(): open()");
+			goto cerror0;
+		}
+	}
+	pthread_mutex_init(&(c.lock), NULL);
+	c.carry = malloc(COMPILE_BLOCK);
+	w = calloc(threads, sizeof(CompileWorker));
+	if(c.carry == NULL || w == NULL) {
+		fprintf(stderr, "dict_compile(): Couldn't allocate memory.\n");
+		goto cerror1;
+	}
+	for(i = 0; i < threads; i++) {
+		w[i].c = &c;
+		w[i].block = malloc(COMPILE_BLOCK);
+		w[i].strings = malloc(c.runbytes);
+		w[i].words = malloc(sizeof(CompileWord) * c.runwords);
+		w[i].temp = malloc(sizeof(CompileWord) * c.runwords);
+		w[i].count = malloc(sizeof(uint32_t) * 65536);
+		if(w[i].block == NULL || w[i].strings == NULL || w[i].words == NULL || w[i].temp == NULL || w[i].count == NULL) {
+			fprintf(stderr, "dict_compile(): Couldn't allocate memory.\n");
+			goto cerror2;
+		}
+	}
+
+	/* read, normalize and sort in to runs */
+	for(started = 0; started < threads; started++) {
+		if(pthread_create(&(w[started].thread), NULL, compile_worker, &(w[started])) != 0) {
+			fprintf(stderr, "dict_compile(): Couldn't start thread.\n");
+			pthread_mutex_lock(&(c.lock));
+			c.error = 1;
+			pthread_mutex_unlock(&(c.lock));
+			break;
+		}
+	}
+	for(i = 0; i < started; i++)
+		pthread_join(w[i].thread, NULL);
+	for(i = 0; i < threads; i++) {
+		free(w[i].block);
+		free(w[i].strings);
+		free(w[i].words);
+		free(w[i].temp);
+		free(w[i].count);
+		w[i].block = NULL;
+		w[i].strings = NULL;
+		w[i].words = NULL;
+		w[i].temp = NULL;
+		w[i].count = NULL;
+	}
+	if(c.error)
+		goto cerror2;
+
+	/* merge the runs in to sections */
+	for(i = 0; i < DICT_SECTIONS; i++)
+		sec[i] = NULL;
+	for(i = 0; i < DICT_SECTIONS; i++) {
+		sec[i] = tmpfile();
+		if(sec[i] == NULL) {
+			perror("dict_compile(): tmpfile()");
+			goto cerror3;
+		}
+	}
+	words = compile_merge(&c, sec);
+	if(words == -1)
+		goto cerror3;
+	if(compile_grams(sec[DICT_SEC_HEADS], sec[DICT_SEC_BYHEAD], sec[DICT_SEC_HEADGRAMS], words) == -1 ||
+	   compile_grams(sec[DICT_SEC_TAILS], sec[DICT_SEC_BYTAIL], sec[DICT_SEC_TAILGRAMS], words) == -1)
+		goto cerror3;
+
+	/* and put them together */
+	buf = malloc(COMPILE_BLOCK);
+	if(buf == NULL) {
+		fprintf(stderr, "dict_compile(): Couldn't allocate memory.\n");
+		goto cerror3;
+	}
+	out = fopen(outpath, "w");
+	if(out == NULL) {
+		perror("dict_compile(): fopen()");
+		goto cerror4;
+	}
+
+	memset(&hdr, 0, sizeof(DictHeader));
+	memcpy(hdr.magic, DICT_MAGIC, sizeof(DICT_MAGIC));
+	hdr.version = DICT_VERSION;
+	hdr.language = lang;
+	hdr.words = words;
+	hdr.sections = DICT_SECTIONS;
+	hdr.checksum = FNV_OFFSET;
+	if(fwrite(&hdr, 1, sizeof(DictHeader), out) != sizeof(DictHeader))
+		goto cerror5;
+
+	pos = sizeof(DictHeader);
+	for(i = 0; i < DICT_SECTIONS; i++) {
+		if(copy_section(out, &(hdr.checksum), &pos, &(hdr.section[i]), sec[i], buf, COMPILE_BLOCK) == -1)
+			goto cerror5;
+	}
+
+	/* now that everything is known, fill in the header */
+	if(fseek(out, 0, SEEK_SET) == -1 || fwrite(&hdr, 1, sizeof(DictHeader), out) != sizeof(DictHeader))
+		goto cerror5;
+	if(fclose(out) == EOF) {
+		perror("dict_compile(): fclose()");
+		goto cerror4;
+	}
+
+	free(buf);
+	for(i = 0; i < DICT_SECTIONS; i++)
+		fclose(sec[i]);
+	for(i = 0; i < c.runs; i++)
+		fclose(c.run[i]);
+	free(c.run);
+	free(w);
+	free(c.carry);
+	pthread_mutex_destroy(&(c.lock));
+	if(c.fd != STDIN_FILENO)
+		close(c.fd);
+
+	return(words);
+
+cerror5:
+	perror("dict_compile(): fwrite()");
+	fclose(out);
+cerror4:
+	free(buf);
+cerror3:
+	for(i = 0; i < DICT_SECTIONS; i++) {
+		if(sec[i] != NULL)
+			fclose(sec[i]);
+	}
+cerror2:
+	for(i = 0; i < threads; i++) {
+		free(w[i].block);
+		free(w[i].strings);
+		free(w[i].words);
+		free(w[i].temp);
+		free(w[i].count);
+	}
+	for(i = 0; i < c.runs; i++)
+		fclose(c.run[i]);
+	free(c.run);
+cerror1:
+	free(w);
+	free(c.carry);
+	pthread_mutex_destroy(&(c.lock));
+	if(c.fd != STDIN_FILENO)
+		close(c.fd);
+cerror0:
+	return(-1);
+}
+
+DictStore *dict_store_init(const char *path) {
+	DictStore *s;
+
+	s = malloc(sizeof(DictStore));
+	if(s == NULL) {
+		fprintf(stderr, "dict_store_init(): Couldn't allocate memory.\n");
+		goto serror0;
+	}
+
+	s->path = strdup(path);
+	if(s->path == NULL) {
+		fprintf(stderr, "dict_store_init(): Couldn't allocate memory.\n");
+		goto serror1;
+	}
+
+	s->current = dict_load(path); /* the store keeps this first reference */
+	if(s->current == NULL)
+		goto serror2;
+	s->generation = 1;
+	s->current->generation = s->generation;
+	dict_complete_index(s->current);
+
+	s->state = DICT_IDLE;
+	s->pending = NULL;
+	s->acquiring = 0;
+	s->retired = NULL;
+	s->nretired = 0;
+	s->maxretired = 0;
+
+	return(s);
+
+serror2:
+	free(s->path);
+serror1:
+	free(s);
+serror0:
+	return(NULL);
+}
+
+void dict_store_free(DictStore *s) {
+	int i;
+
+	if(__atomic_load_n(&(s->state), __ATOMIC_SEQ_CST) != DICT_IDLE) {
+		pthread_join(s->loader, NULL);
+		if(s->pending != NULL)
+			dict_free(s->pending);
+	}
+	for(i = 0; i < s->nretired; i++)
+		dict_free(s->retired[i]);
+	free(s->retired);
+	dict_free(s->current);
+	free(s->path);
+	free(s);
+}
+
+Dict *dict_acquire(DictStore *s) {
+	Dict *d;
+
+	/* dict_store_poll() won't free anything while someone is in here, so d
+	 * can't go away between loading it and referencing it. */
+	__atomic_add_fetch(&(s->acquiring), 1, __ATOMIC_SEQ_CST);
+	d = __atomic_load_n(&(s->current), __ATOMIC_SEQ_CST);
+	dict_ref(d);
+	__atomic_sub_fetch(&(s->acquiring), 1, __ATOMIC_SEQ_CST);
+
+	return(d);
+}
+
+static void *dict_loader(void *arg) {
+	DictStore *s = arg;
+
+	s->pending = dict_load(s->path);
+	if(s->pending != NULL)
+		dict_complete_index(s->pending);
+	__atomic_store_n(&(s->state), s->pending == NULL ? DICT_FAILED : DICT_LOADED, __ATOMIC_SEQ_CST);
+
+	return(NULL);
+}
+
+int dict_store_reload(DictStore *s) {
+	if(__atomic_load_n(&(s->state), __ATOMIC_SEQ_CST) != DICT_IDLE)
+		return(-2);
+
+	s->pending = NULL;
+	__atomic_store_n(&(s->state), DICT_LOADING, __ATOMIC_SEQ_CST);
+	if(pthread_create(&(s->loader), NULL, dict_loader, s) != 0) {
+		fprintf(stderr, "dict_store_reload(): Couldn't start loader thread.\n");
+		__atomic_store_n(&(s->state), DICT_IDLE, __ATOMIC_SEQ_CST);
+		return(-1);
+	}
+
+	return(0);
+}
+
+int dict_store_poll(DictStore *s) {
+	Dict *old, **temp;
+	int retval;
+	int i, j;
+
+	retval = 0;
+	switch(__atomic_load_n(&(s->state), __ATOMIC_SEQ_CST)) {
+		case DICT_LOADED:
+			if(s->nretired == s->maxretired) {
+				temp = realloc(s->retired, sizeof(Dict *) * (s->maxretired + 4));
+				if(temp == NULL) { /* try again next time */
+					fprintf(stderr, "dict_store_poll(): Couldn't allocate memory.\n");
+					return(0);
+				}
+				s->retired = temp;
+				s->maxretired += 4;
+			}
+			pthread_join(s->loader, NULL);
+			s->generation++;
+			s->pending->generation = s->generation;
+			old = __atomic_exchange_n(&(s->current), s->pending, __ATOMIC_SEQ_CST);
+			s->pending = NULL;
+			s->retired[s->nretired] = old;
+			s->nretired++;
+			dict_release(old); /* the store's reference */
+			__atomic_store_n(&(s->state), DICT_IDLE, __ATOMIC_SEQ_CST);
+			retval = 1;
+			break;
+		case DICT_FAILED:
+			pthread_join(s->loader, NULL);
+			__atomic_store_n(&(s->state), DICT_IDLE, __ATOMIC_SEQ_CST);
+			retval = -1;
+			break;
+		default:
+			break;
+	}
+
+	/* Anyone who could still be picking up a retired Dict is done once nobody
+	 * is in dict_acquire(), after that only the reference counts matter. */
+	if(s->nretired > 0 && __atomic_load_n(&(s->acquiring), __ATOMIC_SEQ_CST) == 0) {
+		for(i = 0, j = 0; i < s->nretired; i++) {
+			if(__atomic_load_n(&(s->retired[i]->refs), __ATOMIC_SEQ_CST) == 0)
+				dict_free(s->retired[i]);
+			else
+				s->retired[j++] = s->retired[i];
+		}
+		s->nretired = j;
+	}
+
+	return(retval);
+}
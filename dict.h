@@ -0,0 +1,424 @@
+#ifndef __DICT_H
+#define __DICT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "normalize.h"
+
+/*
+ * Compiled dictionary file layout.  Everything is in host byte order and every
+ * section starts 8 byte aligned, so the file can be used straight from mmap().
+ *
+ * Words are normalized and sorted bytewise, a word's ID is its position in the
+ * sorted list.
+ *
+ * For rules chaining on more than one unit, each word's first and last
+ * DICT_GRAM_MAX units are kept, and the word IDs are kept twice more, once in
+ * order of the units they start with and once in order of the units they end
+ * with, last first.  Every run of units a word can start or end with, up to
+ * DICT_GRAM_MAX long, then covers one range of one of those lists, which is
+ * found through a hash table of grams.
+ */
+#define DICT_MAGIC			"SHRDICT"
+#define DICT_VERSION		(2)
+
+#define DICT_SEC_OFFSETS	(0) /* uint32_t[words + 1], offset of each word in strings */
+#define DICT_SEC_FREQ		(1) /* uint32_t[words], frequency of each word */
+#define DICT_SEC_UNITS		(2) /* uint32_t[words * 2], first and last unit of each word */
+#define DICT_SEC_STRINGS	(3) /* words, not terminated */
+#define DICT_SEC_HEADS		(4) /* uint32_t[words * DICT_GRAM_MAX], first units of each word, 0 past the end */
+#define DICT_SEC_TAILS		(5) /* uint32_t[words * DICT_GRAM_MAX], last units of each word, last first, 0 past the start */
+#define DICT_SEC_BYHEAD		(6) /* uint32_t[words], word IDs ordered by their heads, then ID */
+#define DICT_SEC_BYTAIL		(7) /* uint32_t[words], word IDs ordered by their tails, then ID */
+#define DICT_SEC_HEADGRAMS	(8) /* DictGram[power of 2], ranges of byhead */
+#define DICT_SEC_TAILGRAMS	(9) /* DictGram[power of 2], ranges of bytail */
+#define DICT_SECTIONS		(10)
+#define DICT_SECTIONS_MAX	(16)
+
+#define DICT_UNIT_LOSING	(0x80000000) /* set on last unit if NORM_LOSING */
+#define DICT_UNIT_MASK		(0x001FFFFF)
+
+#define DICT_GRAM_MAX		(3) /* most units kept from each end of a word */
+
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+} DictSection;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t language;
+	uint32_t words;
+	uint32_t sections;
+	uint64_t checksum; /* of everything after the header */
+	DictSection section[DICT_SECTIONS_MAX];
+} DictHeader;
+
+/*
+ * The words starting, or ending, with from 1 to DICT_GRAM_MAX units, being
+ * byhead or bytail from lo to hi - 1.  Units past the gram's length are 0.
+ * Kept in an open addressed hash table by dict_gram_hash(), probing linearly,
+ * with hi of 0 for an empty slot.
+ */
+typedef struct {
+	uint32_t unit[DICT_GRAM_MAX];
+	uint32_t lo;
+	uint32_t hi;
+} DictGram;
+
+#define DICT_COMPLETE_K		(8) /* most common words kept for each prefix */
+
+/*
+ * A prefix shared by more than DICT_COMPLETE_K words, the words having it
+ * being lo to hi - 1.  Only prefixes where the words branch apart are kept,
+ * ordered by lo then longest range first.
+ */
+typedef struct {
+	uint32_t lo;
+	uint32_t hi;
+	int32_t top[DICT_COMPLETE_K]; /* most common first */
+} DictCompleteNode;
+
+typedef struct {
+	const DictHeader *hdr;
+	size_t mapsize;
+
+	norm_language language;
+	int words;
+	const uint32_t *offset;
+	const uint32_t *freq;
+	const uint32_t *units;
+	const char *strings;
+	const uint32_t *heads;
+	const uint32_t *tails;
+	const uint32_t *byhead;
+	const uint32_t *bytail;
+	const DictGram *headgram;
+	const DictGram *tailgram;
+	uint32_t headmask; /* slots - 1 */
+	uint32_t tailmask;
+
+	DictCompleteNode *complete; /* prefix index, NULL until dict_complete_index() */
+	int completenodes;
+
+	int refs; /* atomic */
+	unsigned int generation;
+} Dict;
+
+/*
+ * Words packed end to end in one buffer, for checking many at once.
+ */
+typedef struct {
+	char *data;
+	int datasize;
+	int dataused;
+
+	uint32_t *offset; /* start of each word in data */
+	uint32_t *len; /* length of each word, updated when normalized */
+	int maxwords;
+	int words;
+} WordArena;
+
+#define DICT_WORD_INVALID	(-2) /* dict_validate_batch() result for words that aren't valid UTF-8 */
+
+#define DICT_SUGGEST_MAX	(16) /* most suggestions dict_suggest() gives */
+#define DICT_SUGGEST_MAX_DIST	(3) /* furthest dict_suggest() will look */
+
+typedef enum {
+	DICT_IDLE, DICT_LOADING, DICT_LOADED, DICT_FAILED
+} dict_load_state;
+
+/*
+ * Holds the current dictionary and swaps in new ones without stopping anyone
+ * using the old one.  Readers take a reference with dict_acquire() which never
+ * blocks; the owner starts reloads with dict_store_reload() and finishes them
+ * with dict_store_poll() from its main loop.
+ */
+typedef struct {
+	Dict *current; /* atomic */
+	char *path;
+
+	pthread_t loader;
+	int state; /* atomic dict_load_state */
+	Dict *pending;
+
+	int acquiring; /* atomic, readers between loading current and referencing it */
+	Dict **retired;
+	int nretired;
+	int maxretired;
+
+	unsigned int generation;
+} DictStore;
+
+/*
+ * Maps and verifies a compiled dictionary file.  The DictStore functions also
+ * build the prefix index, a Dict loaded by itself doesn't have one.
+ *
+ * path		File to load.
+ *
+ * returns	New Dict with 1 reference or NULL on error.
+ */
+Dict *dict_load(const char *path);
+
+/*
+ * Unmaps and frees a Dict regardless of references.
+ *
+ * d		Dict to free.
+ */
+void dict_free(Dict *d);
+
+/*
+ * Takes another reference on a Dict.
+ *
+ * d		Dict to reference.
+ *
+ * returns	d
+ */
+Dict *dict_ref(Dict *d);
+
+/*
+ * Drops a reference on a Dict.  A DictStore frees its dictionaries once they're
+ * retired and unreferenced, a Dict from dict_load() used on its own should be
+ * freed with dict_free().
+ *
+ * d		Dict to release, may be NULL.
+ */
+void dict_release(Dict *d);
+
+/*
+ * Finds a normalized word.
+ *
+ * d		Dict to search.
+ * word		Normalized word.
+ * len		Length of word.
+ *
+ * returns	Word ID or -1 if not found.
+ */
+int dict_lookup(const Dict *d, const char *word, int len);
+
+/*
+ * Gets a word by ID.
+ *
+ * d		Dict to get word from.
+ * id		Word ID.
+ * len		Length of the word is written here.
+ *
+ * returns	Pointer to the word, not terminated.
+ */
+const char *dict_word(const Dict *d, int id, int *len);
+
+/*
+ * Finds the words closest to a word that isn't in the dictionary, by the number
+ * of letters added, removed or changed, closest and then most common first.
+ * Bounded in the work it does, so it may miss some on very large dictionaries.
+ *
+ * d		Dict to search.
+ * word		Normalized word.
+ * len		Length of word.
+ * maxdist	Most letters a suggestion can differ by, up to DICT_SUGGEST_MAX_DIST.
+ * need		Units suggestions must start with.
+ * needlen	Number of units in need, 0 for any.
+ * used		Bitset of word IDs which can't be suggested, or NULL.
+ * ids		Word IDs of the suggestions are written here.
+ * k		Most suggestions to find, up to DICT_SUGGEST_MAX.
+ *
+ * returns	Number of suggestions found, -1 if the word is too long or arguments are out of range.
+ */
+int dict_suggest(const Dict *d, const char *word, int len, int maxdist, const uint32_t *need, int needlen, const uint64_t *used, int32_t *ids, int k);
+
+/*
+ * Builds the index dict_complete() uses, for each prefix the words most common
+ * first.  Without it, dict_complete() still works but has to scan.
+ *
+ * d		Dict to index.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int dict_complete_index(Dict *d);
+
+/*
+ * Finds the most common words starting with a prefix.  Words that are filtered
+ * out are made up for from a limited scan, so on large dictionaries with many
+ * used words some may be missed.
+ *
+ * d		Dict to search.
+ * prefix	Normalized prefix.
+ * len		Length of prefix.
+ * need		Units words must start with.
+ * needlen	Number of units in need, 0 for any.
+ * used		Bitset of word IDs which can't be given, or NULL.
+ * ids		Word IDs found are written here, most common first.
+ * k		Most words to find, up to DICT_COMPLETE_K.
+ *
+ * returns	Number of words found.
+ */
+int dict_complete(const Dict *d, const char *prefix, int len, const uint32_t *need, int needlen, const uint64_t *used, int32_t *ids, int k);
+
+/*
+ * Hashes a gram the way the tables in the file are laid out.
+ *
+ * unit		DICT_GRAM_MAX units, 0 past the gram's length.
+ *
+ * returns	Hash.
+ */
+uint32_t dict_gram_hash(const uint32_t *unit);
+
+/*
+ * Finds the words starting with some units, in constant time.
+ *
+ * d		Dict to search.
+ * unit		Units, in order.
+ * len		Number of units, 1 to DICT_GRAM_MAX.
+ *
+ * returns	The gram, the words being d->byhead from lo to hi - 1, or NULL if no word starts with them.
+ */
+const DictGram *dict_starting(const Dict *d, const uint32_t *unit, int len);
+
+/*
+ * Finds the words ending with some units, in constant time.
+ *
+ * d		Dict to search.
+ * unit		Units, the last first.
+ * len		Number of units, 1 to DICT_GRAM_MAX.
+ *
+ * returns	The gram, the words being d->bytail from lo to hi - 1, or NULL if no word ends with them.
+ */
+const DictGram *dict_ending(const Dict *d, const uint32_t *unit, int len);
+
+/*
+ * Finds the units the next word has to start with after a word, when words
+ * chain on their last few units.  A word with fewer units than that passes on
+ * all of them.
+ *
+ * d		Dict the word is from.
+ * id		Word ID.
+ * overlap	Units words chain on, 1 to DICT_GRAM_MAX.
+ * need		Units are written here, in order, room for DICT_GRAM_MAX.
+ *
+ * returns	Number of units written.
+ */
+int dict_need(const Dict *d, int id, int overlap, uint32_t *need);
+
+/*
+ * Checks a word starts with some units, in constant time.
+ *
+ * d		Dict the word is from.
+ * id		Word ID.
+ * need		Units, in order.
+ * needlen	Number of units in need, up to DICT_GRAM_MAX, 0 for any.
+ *
+ * returns	1 if it does, 0 if not.
+ */
+int dict_starts(const Dict *d, int id, const uint32_t *need, int needlen);
+
+/*
+ * Initializes a new WordArena.
+ *
+ * maxwords	Maximum number of words.
+ * datasize	Space for all the words together.
+ *
+ * returns	New WordArena or NULL on error.
+ */
+WordArena *wordarena_init(int maxwords, int datasize);
+
+/*
+ * Free a WordArena.
+ *
+ * a		WordArena to free.
+ */
+void wordarena_free(WordArena *a);
+
+/*
+ * Adds a word to a WordArena.
+ *
+ * a		WordArena to add to.
+ * word		Word to add, doesn't need to be normalized.
+ * len		Length of word.
+ *
+ * returns	0 on success, -1 if the arena is full.
+ */
+int wordarena_add(WordArena *a, const char *word, int len);
+
+/*
+ * Empties a WordArena.
+ *
+ * a		WordArena to empty.
+ */
+void wordarena_reset(WordArena *a);
+
+/*
+ * Normalizes every word in an arena in place and looks them all up.  Words are
+ * looked up several at a time, interleaved, so the memory fetches for each
+ * step of each search overlap instead of waiting one after another.
+ *
+ * d		Dict to search.
+ * a		Words to look up, normalized in place.
+ * ids		Word ID, -1 if not found or DICT_WORD_INVALID for each word is written here.
+ *
+ * returns	Number of words found.
+ */
+int dict_validate_batch(const Dict *d, WordArena *a, int32_t *ids);
+
+/*
+ * Compiles a word list in to a dictionary file.  One word per line, optionally
+ * followed by a tab and its frequency.  Words are normalized, words which
+ * don't normalize or have no units are skipped, and duplicates are merged,
+ * adding up their frequencies.  The list is streamed through a fixed amount of
+ * memory, spilling sorted runs to temporary files, so it can be any size.
+ *
+ * outpath	File to write.
+ * inpath	Word list to read, "-" for standard input.
+ * lang		Language of the words.
+ * threads	Threads to normalize and sort with, 0 for one for each CPU.
+ *
+ * returns	Number of words written, -1 on error.
+ */
+int dict_compile(const char *outpath, const char *inpath, norm_language lang, int threads);
+
+/*
+ * Initializes a DictStore, loading the first dictionary.
+ *
+ * path		Dictionary file, reloads read the same path.
+ *
+ * returns	New DictStore or NULL on error.
+ */
+DictStore *dict_store_init(const char *path);
+
+/*
+ * Frees a DictStore.  Everyone should have released their references.
+ *
+ * s		DictStore to free.
+ */
+void dict_store_free(DictStore *s);
+
+/*
+ * Gets a reference to the current dictionary, never blocks.
+ *
+ * s		DictStore to get dictionary from.
+ *
+ * returns	Current Dict, release with dict_release().
+ */
+Dict *dict_acquire(DictStore *s);
+
+/*
+ * Starts loading and verifying the dictionary file again in the background.
+ *
+ * s		DictStore to reload.
+ *
+ * returns	0 if started, -1 on error, -2 if a reload is already running.
+ */
+int dict_store_reload(DictStore *s);
+
+/*
+ * Publishes a finished reload and frees dictionaries nobody uses anymore.
+ * Should be called regularly by the owner of the store.
+ *
+ * s		DictStore to update.
+ *
+ * returns	1 if a new dictionary was published, 0 if nothing happened, -1 if a reload failed.
+ */
+int dict_store_poll(DictStore *s);
+
+#endif
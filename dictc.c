@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dict.h"
+
+/* Words with at least overlap units that nothing can follow when words chain on
+ * that many, found from the grams they end with rather than word by word. */
+static long dead_ends(const Dict *d, int overlap) {
+	const DictGram *g;
+	uint32_t need[DICT_GRAM_MAX];
+	long dead;
+	uint32_t i;
+	int len, j;
+
+	dead = 0;
+	for(i = 0; i <= d->tailmask; i++) {
+		g = &(d->tailgram[i]);
+		for(len = 0; len < DICT_GRAM_MAX && g->unit[len] != 0; len++);
+		if(g->hi == 0 || len != overlap)
+			continue;
+		for(j = 0; j < len; j++)
+			need[j] = g->unit[len - 1 - j];
+		if(dict_starting(d, need, len) == NULL)
+			dead += g->hi - g->lo;
+	}
+
+	return(dead);
+}
+
+int main(int argc, char **argv) {
+	Dict *d;
+	int lang;
+	int words;
+	int threads;
+	int retval;
+
+	threads = 0;
+	while((retval = getopt(argc, argv, "j:")) != -1) {
+		if(retval == 'j')
+			threads = atoi(optarg);
+		else
+			break;
+	}
+	if(retval != -1 || argc - optind != 3 || threads < 0) {
+		fprintf(stderr, "Usage: %s [-j threads] <language> <word list, - for standard input> <output>\n", argv[0]);
+		goto error0;
+	}
+
+	lang = norm_language_find(argv[optind]);
+	if(lang == -1) {
+		fprintf(stderr, "main(): Unknown language %s.\n", argv[optind]);
+		goto error0;
+	}
+
+	words = dict_compile(argv[optind + 2], argv[optind + 1], lang, threads);
+	if(words == -1) {
+		fprintf(stderr, "main(): Couldn't compile dictionary.\n");
+		goto error0;
+	}
+	fprintf(stderr, "Wrote %i words to %s.\n", words, argv[optind + 2]);
+
+	d = dict_load(argv[optind + 2]);
+	if(d == NULL) {
+		fprintf(stderr, "main(): Couldn't load the dictionary back.\n");
+		goto error0;
+	}
+	fprintf(stderr, "Words nothing can follow, chaining on 1 to %i letters:", DICT_GRAM_MAX);
+	for(retval = 1; retval <= DICT_GRAM_MAX; retval++)
+		fprintf(stderr, " %li", dead_ends(d, retval));
+	fprintf(stderr, ".\n");
+	dict_free(d);
+
+	exit(EXIT_SUCCESS);
+
+error0:
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dict.h"
+
+#define QUERY_LEN	(64) /* SUGGEST_MAX_LEN, the longest query dict_suggest() takes */
+
+static void fill(char *buf, int len, char c) {
+	memset(buf, c, len);
+	buf[len] = '\0';
+}
+
+/* Words well past the longest query, reached at the furthest distance. */
+static int test_suggest_longest(const char *dir) {
+	char list[256], out[256];
+	char word[128];
+	int32_t ids[DICT_SUGGEST_MAX];
+	FILE *f;
+	Dict *d;
+	int count, len, i;
+	int near, far;
+
+	snprintf(list, sizeof(list), "%s/longest.txt", dir);
+	snprintf(out, sizeof(out), "%s/longest.dict", dir);
+	f = fopen(list, "w");
+	if(f == NULL) {
+		perror("test_suggest_longest(): fopen()");
+		return(-1);
+	}
+	for(len = QUERY_LEN - DICT_SUGGEST_MAX_DIST - 1; len <= QUERY_LEN + DICT_SUGGEST_MAX_DIST + 8; len++) {
+		fill(word, len, 'a');
+		fprintf(f, "%s\n", word);
+	}
+	fclose(f);
+	if(dict_compile(out, list, LANG_LATIN, 1) == -1)
+		return(-1);
+	d = dict_load(out);
+	if(d == NULL)
+		return(-1);
+
+	fill(word, QUERY_LEN, 'a');
+	count = dict_suggest(d, word, QUERY_LEN, DICT_SUGGEST_MAX_DIST, NULL, 0, NULL, ids, DICT_SUGGEST_MAX);
+	near = 0;
+	far = 0;
+	for(i = 0; i < count; i++) {
+		dict_word(d, ids[i], &len);
+		if(abs(len - QUERY_LEN) <= DICT_SUGGEST_MAX_DIST)
+			near++;
+		else
+			far++;
+	}
+	dict_free(d);
+	unlink(list);
+	unlink(out);
+
+	if(count != DICT_SUGGEST_MAX_DIST * 2 + 1 || near != count || far != 0) {
+		fprintf(stderr, "test_suggest_longest(): %i suggestions, %i near and %i too far.\n", count, near, far);
+		return(-1);
+	}
+
+	return(0);
+}
+
+int main(void) {
+	char dir[] = "/tmp/dicttestXXXXXX";
+	int failed;
+
+	if(mkdtemp(dir) == NULL) {
+		perror("main(): mkdtemp()");
+		return(EXIT_FAILURE);
+	}
+
+	failed = 0;
+	if(test_suggest_longest(dir) == -1) {
+		fprintf(stderr, "FAIL suggest at the longest query and furthest distance\n");
+		failed++;
+	}
+	rmdir(dir);
+
+	if(failed > 0)
+		return(EXIT_FAILURE);
+	printf("All dictionary tests passed.\n");
+
+	return(EXIT_SUCCESS);
+}
@@ -1,6 +1,15 @@
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
 
 #include "game.h"
+#include "util.h"
+
+#ifndef MAX_COMMAND
+#error MAX_COMMAND must be defined!
+#endif
 
 Player *player_init(int maxname) {
 	Player *p;
@@ -14,13 +23,35 @@ Player *player_init(int maxname) {
 		free(p);
 		return(NULL);
 	}
+	p->backlog = malloc(PLAYER_BACKLOG);
+	if(p->backlog == NULL) {
+		free(p->name);
+		free(p);
+		return(NULL);
+	}
+	p->name[0] = '\0';
 	p->c = NULL;
 	p->maxname = maxname;
+	p->seat = -1;
+	p->namehash = 0;
+	p->conn = -1;
+	p->state = PLAYER_EMPTY;
+	p->detached = 0;
+	p->backlogstart = 0;
+	p->backlogused = 0;
+	p->room = NULL;
+	p->historyseen = 0;
+	p->rating = DEFAULT_RATING;
+	p->language = LANG_LATIN;
+	p->queueseq = 0;
+	p->offerseq = 0;
+	p->offered = 0;
 
 	return(p);
 }
 
 void player_free(Player *p) {
+	free(p->backlog);
 	free(p->name);
 	free(p);
 }
@@ -31,9 +62,84 @@ void player_disconnect(Player *p) {
 
 	connection_disconnect(p->c);
 	p->c = NULL;
+	p->conn = -1;
+	p->state = PLAYER_DETACHED;
+	p->detached = time(NULL);
+	if(p->room != NULL)
+		p->historyseen = p->room->eventseq;
 }
 
-Game *game_init(int maxplayers, int maxname) {
+/* Copies in to or out of the backlog ring starting at pos, wrapping around. */
+static void backlog_copy(char *ring, int pos, char *buf, int len, int in) {
+	int first;
+
+	pos %= PLAYER_BACKLOG;
+	first = PLAYER_BACKLOG - pos < len ? PLAYER_BACKLOG - pos : len;
+	if(in) {
+		memcpy(&(ring[pos]), buf, first);
+		memcpy(ring, &(buf[first]), len - first);
+	} else {
+		memcpy(buf, &(ring[pos]), first);
+		memcpy(&(buf[first]), ring, len - first);
+	}
+}
+
+int player_send(Player *p, const char *buf, int len) {
+	unsigned char hdr[2];
+	int framelen;
+
+	if(p->c != NULL) {
+		if(connection_write(p->c, buf, len) == -1)
+			return(-1);
+		return(0);
+	}
+
+	if(len > PLAYER_BACKLOG)
+		return(-1);
+	/* make room by dropping the oldest frames */
+	while(PLAYER_BACKLOG - p->backlogused < len) {
+		backlog_copy(p->backlog, p->backlogstart, (char *)hdr, 2, 0);
+		framelen = (hdr[0] << 8) | hdr[1];
+		p->backlogstart = (p->backlogstart + framelen) % PLAYER_BACKLOG;
+		p->backlogused -= framelen;
+	}
+	backlog_copy(p->backlog, p->backlogstart + p->backlogused, (char *)buf, len, 1);
+	p->backlogused += len;
+
+	return(0);
+}
+
+int player_send_command(Player *p, int cmd, const char *data, int datalen) {
+	char buf[MAX_COMMAND];
+	int len;
+
+	len = command_generate(buf, MAX_COMMAND, COMMANDS[cmd].name, COMMANDS[cmd].length, data, datalen);
+	if(len == -1)
+		return(-1);
+
+	return(player_send(p, buf, len));
+}
+
+int player_replay(Player *p) {
+	char buf[MAX_COMMAND];
+	unsigned char hdr[2];
+	int framelen;
+
+	while(p->backlogused > 0) {
+		backlog_copy(p->backlog, p->backlogstart, (char *)hdr, 2, 0);
+		framelen = (hdr[0] << 8) | hdr[1];
+		backlog_copy(p->backlog, p->backlogstart, buf, framelen, 0);
+		p->backlogstart = (p->backlogstart + framelen) % PLAYER_BACKLOG;
+		p->backlogused -= framelen;
+		if(connection_write(p->c, buf, framelen) == -1)
+			return(-1);
+	}
+	p->backlogstart = 0;
+
+	return(0);
+}
+
+Game *game_init(int maxplayers, int maxname, int maxconns) {
 	Game *g;
 	int i;
 
@@ -49,18 +155,49 @@ Game *game_init(int maxplayers, int maxname) {
 		g->player[i] = player_init(maxname);
 		if(g->player[i] == NULL)
 			break;
+		g->player[i]->seat = i;
 	}
 	if(i < maxplayers) {
-		for(; i >= 0; i++)
+		for(i--; i >= 0; i--)
 			player_free(g->player[i]);
 		goto gerror2;
 	}
 
+	g->conn = malloc(sizeof(Player *) * maxconns);
+	if(g->conn == NULL)
+		goto gerror3;
+	for(i = 0; i < maxconns; i++)
+		g->conn[i] = NULL;
+
+	/* at most half full so probes stay short */
+	for(g->tokenmask = 1; g->tokenmask < (unsigned int)maxplayers * 2; g->tokenmask <<= 1);
+	g->token = malloc(sizeof(Player *) * g->tokenmask);
+	if(g->token == NULL)
+		goto gerror4;
+	for(i = 0; i < (int)g->tokenmask; i++)
+		g->token[i] = NULL;
+	g->tokenmask--;
+
+	g->namemask = g->tokenmask;
+	g->name = malloc(sizeof(Player *) * (g->namemask + 1));
+	if(g->name == NULL)
+		goto gerror5;
+	for(i = 0; i <= (int)g->namemask; i++)
+		g->name[i] = NULL;
+
 	g->maxplayers = maxplayers;
+	g->maxconns = maxconns;
 	g->maxname = maxname;
 
 	return(g);
 
+gerror5:
+	free(g->token);
+gerror4:
+	free(g->conn);
+gerror3:
+	for(i = 0; i < maxplayers; i++)
+		player_free(g->player[i]);
 gerror2:
 	free(g->player);
 gerror1:
@@ -75,5 +212,1053 @@ void game_free(Game *g) {
 	for(i = 0; i < g->maxplayers; i++)
 		player_free(g->player[i]);
 	free(g->player);
+	free(g->conn);
+	free(g->token);
+	free(g->name);
 	free(g);
 }
+
+Match *match_init(const Dict *d, int players, long turnms) {
+	Match *m;
+
+	m = malloc(sizeof(Match));
+	if(m == NULL)
+		goto merror0;
+
+	m->used = calloc(d->words / 64 + 1, sizeof(uint64_t));
+	if(m->used == NULL)
+		goto merror1;
+	m->history = malloc(sizeof(int32_t) * (d->words + 1));
+	if(m->history == NULL)
+		goto merror2;
+
+	m->dict = d;
+	m->players = players;
+	m->turnms = turnms;
+	m->overlap = 1;
+	m->moves = 0;
+	m->serial = 0;
+	match_start(m, 0);
+
+	return(m);
+
+merror2:
+	free(m->used);
+merror1:
+	free(m);
+merror0:
+	return(NULL);
+}
+
+void match_free(Match *m) {
+	free(m->history);
+	free(m->used);
+	free(m);
+}
+
+void match_start(Match *m, long now) {
+	int i;
+
+	/* only the words played need clearing, which is far less than the whole dictionary */
+	for(i = 0; i < m->moves; i++)
+		m->used[m->history[i] / 64] &= ~((uint64_t)1 << (m->history[i] % 64));
+	m->moves = 0;
+	m->serial++;
+	m->turn = 0;
+	m->needlen = 0;
+	m->deadline = now + m->turnms;
+	m->over = 0;
+	m->loser = -1;
+	m->reason = PLAY_OK;
+}
+
+static void match_lose(Match *m, play_result reason) {
+	m->over = 1;
+	m->loser = m->turn;
+	m->reason = reason;
+}
+
+int match_check_time(Match *m, long now) {
+	if(!m->over && now > m->deadline)
+		match_lose(m, PLAY_TIMEOUT);
+
+	return(m->over);
+}
+
+static int match_chains(const Match *m, int id) {
+	return(dict_starts(m->dict, id, m->need, m->needlen));
+}
+
+/* Plays a word that's been checked, for whoever's turn it is. */
+static play_result match_commit(Match *m, int id, long now) {
+	uint32_t last;
+
+	last = m->dict->units[id * 2 + 1];
+	m->used[id / 64] |= (uint64_t)1 << (id % 64);
+	m->history[m->moves++] = id;
+	m->serial++;
+	if(last & DICT_UNIT_LOSING) {
+		match_lose(m, PLAY_LOSING);
+		return(PLAY_LOSING);
+	}
+
+	m->needlen = dict_need(m->dict, id, m->overlap, m->need);
+	m->turn = (m->turn + 1) % m->players;
+	m->deadline = now + m->turnms;
+
+	return(PLAY_OK);
+}
+
+play_result match_play_id(Match *m, int id, long now) {
+	if(m->over)
+		return(PLAY_OVER);
+	if(match_check_time(m, now))
+		return(PLAY_TIMEOUT);
+	if(id < 0)
+		return(PLAY_UNKNOWN);
+
+	if(!match_chains(m, id))
+		return(PLAY_WRONG_START);
+	if(match_used(m, id))
+		return(PLAY_USED);
+
+	return(match_commit(m, id, now));
+}
+
+play_result match_play(Match *m, const char *word, int len, long now) {
+	char norm[MATCH_MAX_WORD];
+
+	if(len > MATCH_MAX_WORD)
+		return(PLAY_INVALID);
+	len = norm_word(norm, MATCH_MAX_WORD, word, len);
+	if(len == -1)
+		return(PLAY_INVALID);
+
+	return(match_play_id(m, dict_lookup(m->dict, norm, len), now));
+}
+
+void match_resign(Match *m) {
+	if(!m->over)
+		match_lose(m, PLAY_RESIGN);
+}
+
+int match_used(const Match *m, int id) {
+	return((m->used[id / 64] >> (id % 64)) & 1);
+}
+
+int match_suggest(const Match *m, const char *word, int len, int32_t *ids, int k) {
+	char norm[MATCH_MAX_WORD];
+
+	if(len > MATCH_MAX_WORD)
+		return(-1);
+	len = norm_word(norm, MATCH_MAX_WORD, word, len);
+	if(len == -1)
+		return(-1);
+
+	return(dict_suggest(m->dict, norm, len, MATCH_SUGGEST_DIST, m->need, m->needlen, m->used, ids, k));
+}
+
+Room *room_init(int id, int maxplayers) {
+	Room *r;
+
+	r = malloc(sizeof(Room));
+	if(r == NULL)
+		return(NULL);
+
+	r->player = malloc(sizeof(Player *) * maxplayers);
+	if(r->player == NULL) {
+		free(r);
+		return(NULL);
+	}
+	r->history = malloc(ROOM_HISTORY_BYTES);
+	if(r->history == NULL) {
+		free(r->player);
+		free(r);
+		return(NULL);
+	}
+	r->order = malloc(sizeof(Player *) * maxplayers);
+	r->ordername = malloc((MAX_NAME_LEN + 1) * maxplayers);
+	if(r->order == NULL || r->ordername == NULL) {
+		free(r->ordername);
+		free(r->order);
+		free(r->history);
+		free(r->player);
+		free(r);
+		return(NULL);
+	}
+	r->id = id;
+	r->maxplayers = maxplayers;
+	r->players = 0;
+	r->language = LANG_LATIN;
+	r->overlap = 1;
+	r->cluster = 0;
+	r->dict = NULL;
+	r->match = NULL;
+	r->playing = 0;
+	r->eventfirst = 0;
+	r->events = 0;
+	r->eventseq = 0;
+	r->orders = 0;
+	r->plays = NULL;
+	r->timer = -1;
+	r->due = 0;
+
+	return(r);
+}
+
+static void timer_remove(Plays *ps, Room *r);
+
+void room_free(Room *r) {
+	int i;
+
+	for(i = 0; i < r->players; i++)
+		r->player[i]->room = NULL;
+	if(r->timer != -1)
+		timer_remove(r->plays, r);
+	if(r->match != NULL)
+		match_free(r->match);
+	dict_release(r->dict);
+	free(r->ordername);
+	free(r->order);
+	free(r->history);
+	free(r->player);
+	free(r);
+}
+
+int room_join(Room *r, Player *p) {
+	if(r->players == r->maxplayers)
+		return(-1);
+
+	room_leave(p);
+	r->player[r->players] = p;
+	r->players++;
+	p->room = r;
+	room_catch_up(r, p, r->eventseq, ROOM_CATCHUP_EVENTS);
+
+	return(0);
+}
+
+void room_leave(Player *p) {
+	Room *r = p->room;
+	int i;
+
+	if(r == NULL)
+		return;
+
+	for(i = 0; i < r->players; i++) {
+		if(r->player[i] == p) {
+			r->players--;
+			r->player[i] = r->player[r->players];
+			break;
+		}
+	}
+	/* leaving a game loses it, and it's wrapped up as soon as the timers are looked at */
+	for(i = 0; i < r->orders; i++) {
+		if(r->order[i] != p)
+			continue;
+		r->order[i] = NULL;
+		if(r->playing && r->match != NULL && !r->match->over) {
+			r->match->turn = i;
+			match_lose(r->match, PLAY_RESIGN);
+			r->match->serial++;
+			if(r->plays != NULL)
+				plays_schedule(r->plays, r, 0);
+		}
+	}
+	if(r->players == 0) {
+		if(r->orders == 0) /* otherwise once it's been wrapped up */
+			r->playing = 0;
+		r->eventfirst = 0;
+		r->events = 0;
+	}
+	p->room = NULL;
+}
+
+void room_record(Room *r, const char *buf, int len) {
+	RoomEvent *e;
+	int end, pos;
+
+	if(len > ROOM_HISTORY_BYTES)
+		return;
+
+	end = 0;
+	if(r->events > 0) {
+		e = ROOM_EVENT(r, r->events - 1);
+		end = e->offset + e->len;
+	}
+	pos = ROOM_HISTORY_BYTES - end < len ? 0 : end;
+
+	/* going on from the end of the newest frame, frames are oldest first, so
+	 * dropping the oldest clears the way: up to len past the end, or, going
+	 * back to the start, the rest of history and then len from the start */
+	while(r->events > 0) {
+		e = ROOM_EVENT(r, 0);
+		if(r->events < ROOM_HISTORY_EVENTS &&
+		   (pos == end ? e->offset < end || e->offset >= end + len :
+		                 e->offset < end && e->offset >= len))
+			break;
+		r->eventfirst = (r->eventfirst + 1) & (ROOM_HISTORY_EVENTS - 1);
+		r->events--;
+	}
+
+	e = ROOM_EVENT(r, r->events);
+	e->offset = pos;
+	e->len = len;
+	memcpy(&(r->history[pos]), buf, len);
+	r->events++;
+	r->eventseq++;
+}
+
+int room_send_command(Room *r, int cmd, const char *data, int datalen) {
+	char buf[MAX_COMMAND];
+	int len;
+	int i;
+
+	len = command_generate(buf, MAX_COMMAND, COMMANDS[cmd].name, COMMANDS[cmd].length, data, datalen);
+	if(len == -1)
+		return(-1);
+
+	for(i = 0; i < r->players; i++)
+		player_send(r->player[i], buf, len);
+	room_record(r, buf, len);
+
+	return(0);
+}
+
+int room_catch_up(Room *r, Player *p, unsigned int before, int max) {
+	struct iovec iov[ROOM_HISTORY_EVENTS];
+	RoomEvent *e;
+	unsigned int oldest;
+	int first, count, iovs;
+	int i;
+
+	/* frames from before the oldest still kept are gone */
+	oldest = r->eventseq - r->events;
+	if(before - oldest > (unsigned int)r->events || before == oldest)
+		return(0);
+	count = before - oldest;
+	first = count > max ? count - max : 0;
+
+	if(p->c == NULL) {
+		for(i = first; i < count; i++) {
+			e = ROOM_EVENT(r, i);
+			if(player_send(p, &(r->history[e->offset]), e->len) == -1)
+				return(-1);
+		}
+		return(count - first);
+	}
+
+	/* frames next to each other in history go in one piece */
+	iovs = 0;
+	for(i = first; i < count; i++) {
+		e = ROOM_EVENT(r, i);
+		if(iovs > 0 && (char *)iov[iovs - 1].iov_base + iov[iovs - 1].iov_len == &(r->history[e->offset])) {
+			iov[iovs - 1].iov_len += e->len;
+		} else {
+			iov[iovs].iov_base = &(r->history[e->offset]);
+			iov[iovs].iov_len = e->len;
+			iovs++;
+		}
+	}
+	if(connection_writev(p->c, iov, iovs) == -1)
+		return(-1);
+
+	return(count - first);
+}
+
+int room_set_dict(Room *r, Dict *d) {
+	if(r->match != NULL) {
+		match_free(r->match);
+		r->match = NULL;
+	}
+	dict_release(r->dict);
+	r->dict = d;
+	if(d == NULL)
+		return(0);
+
+	r->match = match_init(d, r->maxplayers, TURN_MS);
+	if(r->match == NULL)
+		return(-1);
+
+	return(0);
+}
+
+static const char *PLAY_STAGE_NAME[PLAY_STAGES] = {"turn", "normalize", "lookup", "used", "chain", "commit", "broadcast"};
+
+Plays *plays_init(int maxplays, int maxrooms, void (*onover)(Room *r, void *priv), void *priv) {
+	Plays *ps;
+
+	ps = malloc(sizeof(Plays));
+	if(ps == NULL)
+		goto perror0;
+	ps->play = malloc(sizeof(Play) * maxplays);
+	if(ps->play == NULL)
+		goto perror1;
+	ps->heap = malloc(sizeof(Room *) * maxrooms);
+	if(ps->heap == NULL)
+		goto perror2;
+
+	ps->plays = 0;
+	ps->maxplays = maxplays;
+	ps->timers = 0;
+	ps->maxtimers = maxrooms;
+	ps->onover = onover;
+	ps->priv = priv;
+	memset(ps->hist, 0, sizeof(ps->hist));
+	memset(ps->spent, 0, sizeof(ps->spent));
+	ps->batches = 0;
+	ps->accepted = 0;
+	ps->rejected = 0;
+	ps->games = 0;
+
+	return(ps);
+
+perror2:
+	free(ps->play);
+perror1:
+	free(ps);
+perror0:
+	return(NULL);
+}
+
+void plays_free(Plays *ps) {
+	int i;
+
+	for(i = 0; i < ps->timers; i++) {
+		ps->heap[i]->timer = -1;
+		ps->heap[i]->plays = NULL;
+	}
+	free(ps->heap);
+	free(ps->play);
+	free(ps);
+}
+
+static void heap_put(Plays *ps, int i, Room *r) {
+	ps->heap[i] = r;
+	r->timer = i;
+}
+
+static void heap_up(Plays *ps, int i) {
+	Room *r = ps->heap[i];
+
+	while(i > 0 && ps->heap[(i - 1) / 2]->due > r->due) {
+		heap_put(ps, i, ps->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_put(ps, i, r);
+}
+
+static void heap_down(Plays *ps, int i) {
+	Room *r = ps->heap[i];
+	int child;
+
+	for(;;) {
+		child = i * 2 + 1;
+		if(child >= ps->timers)
+			break;
+		if(child + 1 < ps->timers && ps->heap[child + 1]->due < ps->heap[child]->due)
+			child++;
+		if(ps->heap[child]->due >= r->due)
+			break;
+		heap_put(ps, i, ps->heap[child]);
+		i = child;
+	}
+	heap_put(ps, i, r);
+}
+
+static void timer_remove(Plays *ps, Room *r) {
+	Room *last;
+	int i = r->timer;
+
+	r->timer = -1;
+	ps->timers--;
+	if(i == ps->timers)
+		return;
+	/* the last one fills the gap, then goes whichever way it needs to */
+	last = ps->heap[ps->timers];
+	heap_put(ps, i, last);
+	heap_up(ps, i);
+	heap_down(ps, last->timer);
+}
+
+int plays_schedule(Plays *ps, Room *r, long due) {
+	if(r->timer == -1) {
+		if(ps->timers == ps->maxtimers)
+			return(-1);
+		r->plays = ps;
+		r->due = due;
+		heap_put(ps, ps->timers, r);
+		ps->timers++;
+		heap_up(ps, r->timer);
+		return(0);
+	}
+
+	r->due = due;
+	heap_up(ps, r->timer);
+	heap_down(ps, r->timer);
+
+	return(0);
+}
+
+/* Extra time whoever's turn it is gets for the time their word spends on the wire. */
+static long turn_allowance(const Room *r) {
+	const Player *p = r->order[r->match->turn];
+
+	if(p == NULL || p->c == NULL)
+		return(0);
+
+	return(connection_latency_allowance(p->c));
+}
+
+static void room_message(Room *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Sends a message from SERVER to everyone in a room, kept in its history. */
+static void room_message(Room *r, const char *fmt, ...) {
+	char msg[MAX_COMMAND];
+	va_list ap;
+	int len;
+
+	len = sprintf(msg, "SERVER%c", '\0');
+	va_start(ap, fmt);
+	len += vsnprintf(&(msg[len]), MAX_COMMAND - len, fmt, ap);
+	va_end(ap);
+	if(len >= MAX_COMMAND)
+		len = MAX_COMMAND - 1;
+
+	room_send_command(r, CMD_MSG, msg, len);
+}
+
+static const char *order_name(const Room *r, int turn) {
+	return(&(r->ordername[(MAX_NAME_LEN + 1) * turn]));
+}
+
+/* Starts a game in a room with enough players and a dictionary, taking turns in the order they're in. */
+static void game_begin(Plays *ps, Room *r, long now) {
+	Match *m = r->match;
+	int connected, i;
+
+	/* games aren't played across nodes */
+	if(r->players < 2 || m == NULL || r->cluster != 0)
+		return;
+	/* nobody plays against someone who's gone, but they may yet be back */
+	for(i = 0, connected = 0; i < r->players; i++)
+		connected += r->player[i]->c != NULL;
+	if(connected < 2) {
+		plays_schedule(ps, r, now + GAME_BREAK_MS);
+		return;
+	}
+
+	m->players = r->players;
+	m->overlap = r->overlap;
+	match_start(m, now);
+	for(i = 0; i < r->players; i++) {
+		r->order[i] = r->player[i];
+		strncpy(&(r->ordername[(MAX_NAME_LEN + 1) * i]), r->player[i]->name, MAX_NAME_LEN);
+		r->ordername[(MAX_NAME_LEN + 1) * i + MAX_NAME_LEN] = '\0';
+	}
+	r->orders = r->players;
+	r->playing = 1;
+
+	if(r->overlap > 1)
+		room_message(r, "A new game is starting, each word starts with the last %i letters of the one before, %s goes first with any word.",
+		             r->overlap, order_name(r, 0));
+	else
+		room_message(r, "A new game is starting, %s goes first with any word.", order_name(r, 0));
+	plays_schedule(ps, r, m->deadline + turn_allowance(r) + 1);
+}
+
+/* Tells everyone how a game ended and lets the server record it. */
+static void game_end(Plays *ps, Room *r, long now) {
+	const Match *m = r->match;
+	const char *loser;
+
+	loser = order_name(r, m->loser);
+	if(r->players > 0) {
+		if(m->reason == PLAY_LOSING)
+			room_message(r, "%s played a word nothing starts with and loses, after %i words.", loser, m->moves);
+		else if(m->reason == PLAY_TIMEOUT)
+			room_message(r, "%s ran out of time and loses, after %i words.", loser, m->moves);
+		else
+			room_message(r, "%s left and loses, after %i words.", loser, m->moves);
+	}
+	if(ps->onover != NULL)
+		ps->onover(r, ps->priv);
+
+	r->playing = 0;
+	r->orders = 0;
+	ps->games++;
+	if(r->players > 0)
+		plays_schedule(ps, r, now + GAME_BREAK_MS);
+}
+
+int plays_expire(Plays *ps, long now) {
+	Room *r;
+	Match *m;
+	long allowance;
+	int fired;
+
+	fired = 0;
+	while(ps->timers > 0 && ps->heap[0]->due <= now) {
+		r = ps->heap[0];
+		timer_remove(ps, r);
+		fired++;
+
+		if(!r->playing) {
+			game_begin(ps, r, now);
+			continue;
+		}
+		m = r->match;
+		if(!m->over) {
+			/* a slow connection can have had its word on the way all this time */
+			allowance = turn_allowance(r);
+			if(!match_check_time(m, now - allowance)) {
+				plays_schedule(ps, r, m->deadline + allowance + 1);
+				continue;
+			}
+		}
+		game_end(ps, r, now);
+	}
+
+	return(fired);
+}
+
+int plays_queue(Plays *ps, Player *p, const char *word, int len, long at) {
+	Play *pl;
+
+	if(ps->plays == ps->maxplays)
+		return(-1);
+
+	pl = &(ps->play[ps->plays]);
+	pl->room = p->room;
+	pl->player = p;
+	pl->at = at;
+	pl->len = len; /* anything too long is turned away by normalization */
+	memcpy(pl->word, word, len < MATCH_MAX_WORD ? len : MATCH_MAX_WORD);
+	pl->id = -1;
+	pl->result = PLAY_OK;
+	ps->plays++;
+
+	return(0);
+}
+
+/* Adds how long a stage took to its histogram, shared out between the plays that went through it. */
+static void stage_done(Plays *ps, play_stage stage, int64_t *mark, int n) {
+	int64_t now, each;
+	int bucket;
+
+	now = now_ns();
+	if(n > 0) {
+		each = (now - *mark) / n;
+		for(bucket = 0; bucket < PLAY_HIST_BUCKETS - 1 && each >> (bucket + 1) > 0; bucket++);
+		ps->hist[stage][bucket] += n;
+		ps->spent[stage] += now - *mark;
+	}
+	*mark = now;
+}
+
+/* Tells a player why their word wasn't played, with a few that could have been. */
+static void play_rejected(const Play *pl) {
+	char msg[MAX_COMMAND];
+	int32_t ids[PLAY_SUGGESTIONS];
+	const char *word;
+	int len, wordlen, n, i;
+
+	wordlen = pl->len < MATCH_MAX_WORD ? pl->len : MATCH_MAX_WORD;
+	len = sprintf(msg, "SERVER%c", '\0');
+	switch(pl->result) {
+		case PLAY_INVALID:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "That can't be played.");
+			break;
+		case PLAY_UNKNOWN:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "%.*s isn't in the dictionary.", wordlen, pl->word);
+			break;
+		case PLAY_USED:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "%.*s has already been played.", wordlen, pl->word);
+			break;
+		case PLAY_WRONG_START:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "%.*s doesn't start where the last word ended.", wordlen, pl->word);
+			break;
+		case PLAY_TIMEOUT:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "Too late, you ran out of time.");
+			break;
+		case PLAY_NOT_YOURS:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "It's not your turn.");
+			break;
+		default:
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "There's no game going on.");
+	}
+
+	if(pl->result == PLAY_UNKNOWN || pl->result == PLAY_USED || pl->result == PLAY_WRONG_START) {
+		n = match_suggest(pl->room->match, pl->word, wordlen, ids, PLAY_SUGGESTIONS);
+		for(i = 0; i < n && len < MAX_COMMAND; i++) {
+			word = dict_word(pl->room->match->dict, ids[i], &wordlen);
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "%s %.*s", i == 0 ? "  Maybe" : ",", wordlen, word);
+		}
+		if(n > 0 && len < MAX_COMMAND)
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "?");
+	}
+	if(len >= MAX_COMMAND)
+		len = MAX_COMMAND - 1;
+
+	player_send_command(pl->player, CMD_MSG, msg, len);
+}
+
+int plays_run(Plays *ps, long now) {
+	char data[MAX_COMMAND];
+	Play *pl;
+	Room *r;
+	Match *m;
+	const char *word;
+	int64_t mark;
+	int n, len, wordlen;
+	int i;
+
+	if(ps->plays == 0)
+		return(0);
+	mark = now_ns();
+
+	/* each stage for the whole batch, then the next, only for what's still going */
+	for(i = 0, n = 0; i < ps->plays; i++, n++) {
+		pl = &(ps->play[i]);
+		r = pl->room;
+		if(r == NULL || !r->playing || r->match->over) {
+			pl->result = PLAY_OVER;
+		} else if(r->order[r->match->turn] != pl->player) {
+			pl->result = PLAY_NOT_YOURS;
+		} else if(match_check_time(r->match, pl->at)) {
+			pl->result = PLAY_TIMEOUT;
+			plays_schedule(ps, r, now);
+		} else {
+			pl->serial = r->match->serial;
+		}
+	}
+	stage_done(ps, PLAY_STAGE_TURN, &mark, n);
+
+	for(i = 0, n = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK)
+			continue;
+		n++;
+		pl->normlen = pl->len > MATCH_MAX_WORD ? -1 : norm_word(pl->norm, MATCH_MAX_WORD, pl->word, pl->len);
+		if(pl->normlen == -1)
+			pl->result = PLAY_INVALID;
+	}
+	stage_done(ps, PLAY_STAGE_NORMALIZE, &mark, n);
+
+	for(i = 0, n = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK)
+			continue;
+		n++;
+		pl->id = dict_lookup(pl->room->match->dict, pl->norm, pl->normlen);
+		if(pl->id == -1)
+			pl->result = PLAY_UNKNOWN;
+	}
+	stage_done(ps, PLAY_STAGE_LOOKUP, &mark, n);
+
+	for(i = 0, n = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK)
+			continue;
+		n++;
+		if(match_used(pl->room->match, pl->id))
+			pl->result = PLAY_USED;
+	}
+	stage_done(ps, PLAY_STAGE_USED, &mark, n);
+
+	for(i = 0, n = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK)
+			continue;
+		n++;
+		if(!match_chains(pl->room->match, pl->id))
+			pl->result = PLAY_WRONG_START;
+	}
+	stage_done(ps, PLAY_STAGE_CHAIN, &mark, n);
+
+	/* the only stage that changes anything, a word played earlier in the batch moves the turn on */
+	for(i = 0, n = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK)
+			continue;
+		n++;
+		r = pl->room;
+		m = r->match;
+		if(m->serial != pl->serial) {
+			pl->result = PLAY_NOT_YOURS;
+			continue;
+		}
+		pl->result = match_commit(m, pl->id, now);
+		plays_schedule(ps, r, m->over ? now : m->deadline + turn_allowance(r) + 1);
+	}
+	stage_done(ps, PLAY_STAGE_COMMIT, &mark, n);
+
+	for(i = 0; i < ps->plays; i++) {
+		pl = &(ps->play[i]);
+		if(pl->result != PLAY_OK && pl->result != PLAY_LOSING) {
+			play_rejected(pl);
+			ps->rejected++;
+			continue;
+		}
+		/* name\0word, and the next player's name while the game goes on */
+		r = pl->room;
+		m = r->match;
+		word = dict_word(m->dict, pl->id, &wordlen);
+		if(m->over)
+			len = snprintf(data, MAX_COMMAND, "%s%c%.*s", pl->player->name, '\0', wordlen, word);
+		else
+			len = snprintf(data, MAX_COMMAND, "%s%c%.*s%c%s", pl->player->name, '\0', wordlen, word, '\0', order_name(r, m->turn));
+		if(len < MAX_COMMAND)
+			room_send_command(r, CMD_PLAY, data, len);
+		ps->accepted++;
+	}
+	stage_done(ps, PLAY_STAGE_BROADCAST, &mark, ps->plays);
+
+	n = ps->plays;
+	ps->plays = 0;
+	ps->batches++;
+
+	return(n);
+}
+
+int64_t plays_quantile(const Plays *ps, play_stage stage, double q) {
+	uint64_t total, seen;
+	int i;
+
+	total = 0;
+	for(i = 0; i < PLAY_HIST_BUCKETS; i++)
+		total += ps->hist[stage][i];
+	if(total == 0)
+		return(0);
+
+	seen = 0;
+	for(i = 0; i < PLAY_HIST_BUCKETS - 1; i++) {
+		seen += ps->hist[stage][i];
+		if(seen >= q * total)
+			break;
+	}
+
+	return((int64_t)1 << (i + 1));
+}
+
+const char *play_stage_name(play_stage stage) {
+	return(PLAY_STAGE_NAME[stage]);
+}
+
+/* Tokens are random, so their first bytes are as good a hash as any. */
+static unsigned int token_hash(const unsigned char *token) {
+	unsigned int h;
+
+	memcpy(&h, token, sizeof(h));
+
+	return(h);
+}
+
+static void token_insert(Game *g, Player *p) {
+	unsigned int i;
+
+	for(i = token_hash(p->token) & g->tokenmask; g->token[i] != NULL; i = (i + 1) & g->tokenmask);
+	g->token[i] = p;
+}
+
+static void token_remove(Game *g, Player *p) {
+	unsigned int i, j, home;
+
+	for(i = token_hash(p->token) & g->tokenmask; g->token[i] != p; i = (i + 1) & g->tokenmask) {
+		if(g->token[i] == NULL)
+			return;
+	}
+	g->token[i] = NULL;
+
+	/* shift back anything further along the probe run that can now be found sooner */
+	for(j = (i + 1) & g->tokenmask; g->token[j] != NULL; j = (j + 1) & g->tokenmask) {
+		home = token_hash(g->token[j]->token) & g->tokenmask;
+		if(((j - home) & g->tokenmask) >= ((j - i) & g->tokenmask)) {
+			g->token[i] = g->token[j];
+			g->token[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static Player *token_find(Game *g, const unsigned char *token) {
+	unsigned int i;
+
+	for(i = token_hash(token) & g->tokenmask; g->token[i] != NULL; i = (i + 1) & g->tokenmask) {
+		if(memcmp(g->token[i]->token, token, RESUME_TOKEN_LEN) == 0)
+			return(g->token[i]);
+	}
+
+	return(NULL);
+}
+
+/* p->namehash must be set. */
+static void name_insert(Game *g, Player *p) {
+	unsigned int i;
+
+	for(i = p->namehash & g->namemask; g->name[i] != NULL; i = (i + 1) & g->namemask);
+	g->name[i] = p;
+}
+
+static void name_remove(Game *g, Player *p) {
+	unsigned int i, j, home;
+
+	for(i = p->namehash & g->namemask; g->name[i] != p; i = (i + 1) & g->namemask) {
+		if(g->name[i] == NULL)
+			return;
+	}
+	g->name[i] = NULL;
+
+	for(j = (i + 1) & g->namemask; g->name[j] != NULL; j = (j + 1) & g->namemask) {
+		home = g->name[j]->namehash & g->namemask;
+		if(((j - home) & g->namemask) >= ((j - i) & g->namemask)) {
+			g->name[i] = g->name[j];
+			g->name[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static Player *name_find(Game *g, const char *name) {
+	unsigned int h, i;
+
+	h = fnv1a(name, strlen(name));
+	for(i = h & g->namemask; g->name[i] != NULL; i = (i + 1) & g->namemask) {
+		/* hashes differ for nearly every other name, so that's usually the only compare */
+		if(g->name[i]->namehash == h && strcmp(g->name[i]->name, name) == 0)
+			return(g->name[i]);
+	}
+
+	return(NULL);
+}
+
+static void attach(Game *g, Player *p, int conn, Connection *c) {
+	p->c = c;
+	p->conn = conn;
+	p->state = PLAYER_ACTIVE;
+	g->conn[conn] = p;
+}
+
+Player *game_identify(Game *g, int conn, Connection *c, const char *name) {
+	Player *p, *q;
+	int i;
+
+	p = g->conn[conn];
+	q = name_find(g, name);
+	if(q != NULL && q != p)
+		return(NULL);
+
+	if(p == NULL) {
+		for(i = 0; i < g->maxplayers; i++) {
+			if(g->player[i]->state == PLAYER_EMPTY)
+				break;
+		}
+		if(i == g->maxplayers)
+			return(NULL);
+		p = g->player[i];
+
+		if(getrandom(p->token, RESUME_TOKEN_LEN, 0) != RESUME_TOKEN_LEN)
+			return(NULL);
+		p->backlogstart = 0;
+		p->backlogused = 0;
+		token_insert(g, p);
+		attach(g, p, conn, c);
+	} else {
+		name_remove(g, p);
+	}
+
+	strncpy(p->name, name, p->maxname);
+	p->name[p->maxname] = '\0';
+	p->namehash = fnv1a(p->name, strlen(p->name));
+	name_insert(g, p);
+
+	return(p);
+}
+
+Player *game_resume(Game *g, int conn, Connection *c, const unsigned char *token) {
+	Player *p;
+
+	p = token_find(g, token);
+	if(p == NULL)
+		return(NULL);
+
+	if(p->c != NULL && p->c != c) { /* the old connection hasn't noticed it's dead yet */
+		g->conn[p->conn] = NULL;
+		player_disconnect(p);
+	}
+	if(g->conn[conn] != NULL && g->conn[conn] != p) { /* was someone else on this connection */
+		g->conn[conn]->c = NULL;
+		g->conn[conn]->conn = -1;
+		g->conn[conn]->state = PLAYER_DETACHED;
+		g->conn[conn]->detached = time(NULL);
+	}
+	attach(g, p, conn, c);
+
+	return(p);
+}
+
+void game_connection_lost(Game *g, int conn, Connection *c) {
+	Player *p;
+
+	p = g->conn[conn];
+	if(p != NULL) {
+		g->conn[conn] = NULL;
+		player_disconnect(p);
+	} else {
+		connection_disconnect(c);
+	}
+}
+
+int game_expire(Game *g, int grace, void (*onexpire)(Player *p, void *priv), void *priv) {
+	Player *p;
+	time_t now;
+	int i, expired;
+
+	now = time(NULL);
+	expired = 0;
+	for(i = 0; i < g->maxplayers; i++) {
+		p = g->player[i];
+		if(p->state == PLAYER_DETACHED && now - p->detached > grace) {
+			if(onexpire != NULL)
+				onexpire(p, priv);
+			token_remove(g, p);
+			name_remove(g, p);
+			room_leave(p);
+			p->queueseq++; /* drops them from any lobby queue */
+			p->state = PLAYER_EMPTY;
+			p->name[0] = '\0';
+			p->backlogstart = 0;
+			p->backlogused = 0;
+			expired++;
+		}
+	}
+
+	return(expired);
+}
+
+Player *game_find_player(Game *g, const char *name) {
+	return(name_find(g, name));
+}
+
+void game_reindex(Game *g) {
+	Player *p;
+	int i;
+
+	for(i = 0; i < g->maxconns; i++)
+		g->conn[i] = NULL;
+	for(i = 0; i <= (int)g->tokenmask; i++)
+		g->token[i] = NULL;
+	for(i = 0; i <= (int)g->namemask; i++)
+		g->name[i] = NULL;
+
+	for(i = 0; i < g->maxplayers; i++) {
+		p = g->player[i];
+		if(p->state == PLAYER_EMPTY)
+			continue;
+		token_insert(g, p);
+		p->namehash = fnv1a(p->name, strlen(p->name));
+		name_insert(g, p);
+		if(p->state == PLAYER_ACTIVE && p->conn >= 0 && p->conn < g->maxconns)
+			g->conn[p->conn] = p;
+	}
+}
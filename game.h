@@ -1,16 +1,213 @@
+#ifndef __GAME_H
+#define __GAME_H
+
+#include <time.h>
+
 #include "net.h"
+#include "dict.h"
+#include "cluster.h"
+
+#define RESUME_TOKEN_LEN	(16) /* bytes, sent as twice as many hex digits */
+#define PLAYER_BACKLOG		(4096) /* bytes of frames kept for a detached player */
+
+#define DEFAULT_RATING		(1000)
+
+#define MATCH_MAX_WORD		(256) /* bytes, longer words can't be played */
+#define MATCH_SUGGEST_DIST	(2) /* most letters a suggestion can differ by */
+#define TURN_MS				(30000) /* how long players in rooms get for each word */
+#define GAME_BREAK_MS		(5000) /* between a room filling or a game ending and the next game */
+
+#define PLAY_SUGGESTIONS	(3) /* words suggested with a rejected one */
+#define PLAY_HIST_BUCKETS	(32) /* bucket i has plays taking from 2^i to 2^(i+1) ns */
+
+#define ROOM_HISTORY_BYTES	(8192) /* frames each room keeps for catching up anyone joining */
+#define ROOM_HISTORY_EVENTS	(64) /* most frames kept, a power of 2 */
+#define ROOM_CATCHUP_EVENTS	(32) /* most frames sent to catch someone up */
+
+typedef enum {
+	PLAYER_EMPTY, PLAYER_ACTIVE, PLAYER_DETACHED
+} player_state;
+
+struct Room;
+struct Plays;
 
 typedef struct {
 	char *name;
 	Connection *c;
 
 	int maxname;
+
+	int seat;
+	unsigned int namehash;
+	int conn; /* index of the connection the player is on, -1 if detached */
+	player_state state;
+	unsigned char token[RESUME_TOKEN_LEN];
+	time_t detached;
+
+	/* ring of frames sent while detached, replayed on resume */
+	char *backlog;
+	int backlogstart;
+	int backlogused;
+
+	struct Room *room; /* room the player is in, NULL while in the lobby */
+	unsigned int historyseen; /* room's eventseq when the player detached */
+	int rating;
+	norm_language language;
+	unsigned int queueseq; /* changes whenever the player leaves or rejoins a lobby queue */
+	unsigned int offerseq; /* queueseq when offered to the cluster, stale if they've moved on */
+	int offered; /* the broker may still be holding an offer for them */
 } Player;
 
 typedef struct {
+	int offset; /* in history */
+	int len;
+} RoomEvent;
+
+/*
+ * A room is where a game is actually played, players are put in one by the
+ * lobby.
+ *
+ * Frames sent to everyone in a room are kept as they were sent, end to end in
+ * history, so anyone joining can be caught up with one writev() of them.  A
+ * frame which doesn't fit before the end goes back to the start, overwriting
+ * the oldest, so each is in one piece and at most two pieces cover them all.
+ */
+typedef struct Room {
+	int id;
 	int maxplayers;
+	int players;
 	Player **player;
 
+	norm_language language;
+	int overlap; /* units words chain on in its games, from 1 to DICT_GRAM_MAX */
+	unsigned int cluster; /* id of the room across the cluster if it has players on other nodes, else 0 */
+	Dict *dict; /* dictionary version this room is pinned to, may be NULL */
+	struct Match *match; /* game on that dictionary, NULL without one */
+	int playing; /* a game in progress keeps its dictionary until it's over */
+
+	char *history; /* ROOM_HISTORY_BYTES */
+	RoomEvent event[ROOM_HISTORY_EVENTS]; /* ring, oldest at eventfirst */
+	int eventfirst;
+	int events;
+	unsigned int eventseq; /* frames ever kept, the newest is eventseq - 1 */
+
+	/* the game being played, whose turn is which is fixed when it starts */
+	Player **order; /* NULL for anyone who's left */
+	char *ordername; /* names when it started, MAX_NAME_LEN + 1 each */
+	int orders;
+
+	struct Plays *plays; /* timing the room, NULL until it is */
+	int timer; /* place in plays' timer heap, -1 for none */
+	long due; /* ms the timer goes off */
+} Room;
+
+/* The ith oldest frame kept in a room's history. */
+#define ROOM_EVENT(r, i)	(&((r)->event[((r)->eventfirst + (i)) & (ROOM_HISTORY_EVENTS - 1)]))
+
+typedef enum {
+	PLAY_OK,
+	PLAY_INVALID, /* not valid UTF-8 or too long */
+	PLAY_UNKNOWN, /* not in the dictionary */
+	PLAY_WRONG_START, /* doesn't start with the units the last word ended with */
+	PLAY_USED, /* already played this game */
+	PLAY_LOSING, /* ends in a unit nothing starts with, the player loses */
+	PLAY_TIMEOUT, /* turn ran out, the player loses */
+	PLAY_RESIGN, /* gave up, usually with nothing left to play */
+	PLAY_OVER, /* game already over, or none being played */
+	PLAY_NOT_YOURS /* someone else's turn */
+} play_result;
+
+/*
+ * The rules of one game, with nothing about who's playing or how they're
+ * connected.  Time is whatever clock the caller uses, in milliseconds, so the
+ * same rules can run against a virtual one.
+ */
+typedef struct Match {
+	const Dict *dict;
+	int players;
+
+	int turn; /* who has to play next */
+	int overlap; /* units from the end of each word the next has to start with, 1 to DICT_GRAM_MAX */
+	uint32_t need[DICT_GRAM_MAX]; /* units the next word has to start with */
+	int needlen; /* 0 for anything */
+	long turnms;
+	long deadline;
+
+	uint64_t *used; /* bit for each word in the dictionary */
+	int32_t *history; /* words played in order, also what needs clearing for the next game */
+	int moves;
+	unsigned int serial; /* changes whenever a word is used or the game restarts */
+
+	int over;
+	int loser;
+	play_result reason; /* why the loser lost */
+} Match;
+
+/*
+ * The steps a word goes through to be played, in order.  Words stopped at one
+ * don't go through the rest, except to be told why.
+ */
+typedef enum {
+	PLAY_STAGE_TURN, PLAY_STAGE_NORMALIZE, PLAY_STAGE_LOOKUP, PLAY_STAGE_USED, PLAY_STAGE_CHAIN, PLAY_STAGE_COMMIT, PLAY_STAGE_BROADCAST,
+	PLAY_STAGES
+} play_stage;
+
+typedef struct {
+	Room *room;
+	Player *player;
+	long at; /* ms it counts as played at, allowing for the time it spent on the wire */
+	unsigned int serial; /* match's serial when the turn was checked */
+
+	char word[MATCH_MAX_WORD]; /* as the player gave it */
+	int len;
+	char norm[MATCH_MAX_WORD];
+	int normlen;
+	int32_t id;
+	play_result result;
+} Play;
+
+/*
+ * Plays words for every room.  Words arriving during a pass of the main loop
+ * are queued, then the whole batch goes through each stage together, so each
+ * stage's code and the tables it uses stay in cache for the lot.  Nothing is
+ * allocated once it's set up.
+ *
+ * Turn deadlines, and the breaks between games, are timers in a heap of rooms
+ * by when they're due, so only rooms with something due are looked at.
+ */
+typedef struct Plays {
+	Play *play;
+	int plays;
+	int maxplays;
+
+	Room **heap; /* soonest first */
+	int timers;
+	int maxtimers;
+
+	void (*onover)(Room *r, void *priv);
+	void *priv;
+
+	uint64_t hist[PLAY_STAGES][PLAY_HIST_BUCKETS]; /* plays by ns spent in each stage */
+	int64_t spent[PLAY_STAGES]; /* ns */
+	long batches;
+	long accepted;
+	long rejected;
+	long games;
+} Plays;
+
+typedef struct {
+	int maxplayers;
+	Player **player; /* by seat */
+
+	int maxconns;
+	Player **conn; /* player identified on each connection, by connection index */
+
+	Player **token; /* hash table of players by resume token */
+	unsigned int tokenmask;
+
+	Player **name; /* hash table of identified players by name */
+	unsigned int namemask;
+
 	int maxname;
 } Game;
 
@@ -18,8 +215,354 @@ Player *player_init(int maxname);
 
 void player_free(Player *p);
 
+/*
+ * Disconnects a player's connection but keeps their seat so they can resume.
+ *
+ * p		Player to disconnect.
+ */
 void player_disconnect(Player *p);
 
-Game *game_init(int maxplayers, int maxname);
+/*
+ * Sends a frame to a player, or keeps it to be replayed if they're detached.  If
+ * the backlog fills up, the oldest frames are dropped.
+ *
+ * p		Player to send to.
+ * buf		Frame made by command_generate().
+ * len		Length of frame.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int player_send(Player *p, const char *buf, int len);
+
+/*
+ * Generates a command and sends it with player_send().
+ *
+ * p		Player to send to.
+ * cmd		Command number.
+ * data		Data block, or NULL to exclude.
+ * datalen	Data block size.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int player_send_command(Player *p, int cmd, const char *data, int datalen);
+
+/*
+ * Sends everything in a player's backlog to their connection and empties it.
+ *
+ * p		Player to replay to.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int player_replay(Player *p);
+
+Game *game_init(int maxplayers, int maxname, int maxconns);
 
 void game_free(Game *g);
+
+Room *room_init(int id, int maxplayers);
+
+void room_free(Room *r);
+
+/*
+ * Puts a player in a room and catches them up on what's happened in it.
+ *
+ * r		Room to join.
+ * p		Player joining.
+ *
+ * returns	0 on success, -1 if the room is full.
+ */
+int room_join(Room *r, Player *p);
+
+/*
+ * Takes a player out of whatever room they're in.  The room's history is
+ * forgotten once everyone has left.
+ *
+ * p		Player leaving.
+ */
+void room_leave(Player *p);
+
+/*
+ * Keeps a frame in a room's history, dropping the oldest to make room.
+ *
+ * r		Room.
+ * buf		Frame made by command_generate().
+ * len		Length of frame, frames longer than ROOM_HISTORY_BYTES aren't kept.
+ */
+void room_record(Room *r, const char *buf, int len);
+
+/*
+ * Generates a command once, sends it to everyone in a room with player_send()
+ * and keeps it in the room's history.
+ *
+ * r		Room to send to.
+ * cmd		Command number.
+ * data		Data block, or NULL to exclude.
+ * datalen	Data block size.
+ *
+ * returns	0 on success, -1 if it couldn't be generated.
+ */
+int room_send_command(Room *r, int cmd, const char *data, int datalen);
+
+/*
+ * Sends a player the latest frames from a room's history, in one write if
+ * they're connected.
+ *
+ * r		Room.
+ * p		Player to catch up.
+ * before	Only frames kept before the room's eventseq was this.
+ * max		Most frames to send.
+ *
+ * returns	Number of frames sent, -1 on error.
+ */
+int room_catch_up(Room *r, Player *p, unsigned int before, int max);
+
+/*
+ * Pins a room to a dictionary, releasing the one it had, and sets up a Match
+ * for it.
+ *
+ * r		Room to update.
+ * d		Dict to use, the caller's reference is taken over.  May be NULL.
+ *
+ * returns	0 on success, -1 if the Match couldn't be made, leaving the room without one.
+ */
+int room_set_dict(Room *r, Dict *d);
+
+/*
+ * Identifies a connection as a player, giving it a seat and a resume token, or
+ * renames the player already on it.
+ *
+ * g		Game to join.
+ * conn		Index of the connection.
+ * c		The connection.
+ * name		Name of player, terminated.
+ *
+ * returns	Player, NULL if there are no free seats or someone else has the name.
+ */
+Player *game_identify(Game *g, int conn, Connection *c, const char *name);
+
+/*
+ * Moves a player with the given resume token on to a connection.  If the player
+ * is still on another connection, that one is disconnected.
+ *
+ * g		Game to search.
+ * conn		Index of the connection.
+ * c		The connection.
+ * token	Resume token.
+ *
+ * returns	Player, NULL if no player has that token.
+ */
+Player *game_resume(Game *g, int conn, Connection *c, const unsigned char *token);
+
+/*
+ * Disconnects a connection, detaching the player on it if there is one.
+ *
+ * g		Game connection belongs to.
+ * conn		Index of the connection.
+ * c		The connection.
+ */
+void game_connection_lost(Game *g, int conn, Connection *c);
+
+/*
+ * Frees the seats of players who have been detached for too long.
+ *
+ * g		Game to check.
+ * grace	Seconds a player may stay detached.
+ * onexpire	If not NULL, called with each player before their seat is freed.
+ * priv		Passed to onexpire.
+ *
+ * returns	Number of players removed.
+ */
+int game_expire(Game *g, int grace, void (*onexpire)(Player *p, void *priv), void *priv);
+
+/*
+ * Initializes a new Match for a dictionary, chaining on one unit until overlap
+ * is changed.  Call match_start() before playing.
+ *
+ * d		Dictionary to play with, must outlive the Match.
+ * players	Number of players taking turns.
+ * turnms	Time each player has for their turn in milliseconds.
+ *
+ * returns	New Match or NULL on error.
+ */
+Match *match_init(const Dict *d, int players, long turnms);
+
+void match_free(Match *m);
+
+/*
+ * Starts a new game, forgetting the last one.
+ *
+ * m		Match to start.
+ * now		Current time in milliseconds.
+ */
+void match_start(Match *m, long now);
+
+/*
+ * Plays a word for whoever's turn it is.  Nothing changes unless the result is
+ * PLAY_OK, PLAY_LOSING or PLAY_TIMEOUT.
+ *
+ * m		Match to play in.
+ * id		Word ID in the match's dictionary, or -1 if it wasn't found.
+ * now		Current time in milliseconds.
+ *
+ * returns	play_result.
+ */
+play_result match_play_id(Match *m, int id, long now);
+
+/*
+ * Normalizes and looks up a word, then plays it with match_play_id().
+ *
+ * m		Match to play in.
+ * word		Word as the player gave it.
+ * len		Length of word.
+ * now		Current time in milliseconds.
+ *
+ * returns	play_result.
+ */
+play_result match_play(Match *m, const char *word, int len, long now);
+
+/*
+ * Ends the game with whoever's turn it is losing because they ran out of time,
+ * if they have.
+ *
+ * m		Match to check.
+ * now		Current time in milliseconds.
+ *
+ * returns	1 if the game is over, 0 if not.
+ */
+int match_check_time(Match *m, long now);
+
+/*
+ * Ends the game with whoever's turn it is giving up.
+ *
+ * m		Match to end.
+ */
+void match_resign(Match *m);
+
+/*
+ * Checks whether a word has been played this game.
+ *
+ * m		Match to check.
+ * id		Word ID.
+ *
+ * returns	1 if it has, 0 if not.
+ */
+int match_used(const Match *m, int id);
+
+/*
+ * Suggests words that could be played instead of one that was rejected, ones
+ * that start right and haven't been used.
+ *
+ * m		Match being played.
+ * word		Word that was rejected, doesn't need to be normalized.
+ * len		Length of word.
+ * ids		Word IDs of the suggestions are written here, best first.
+ * k		Most suggestions to find.
+ *
+ * returns	Number of suggestions found, -1 on error.
+ */
+int match_suggest(const Match *m, const char *word, int len, int32_t *ids, int k);
+
+/*
+ * Initializes a new Plays.
+ *
+ * maxplays	Most words queued each pass, one for each connection is enough.
+ * maxrooms	Most rooms with timers at once.
+ * onover	If not NULL, called with each room whose game has ended, before
+ * 			anything is reset.  The room's order and ordername say who played.
+ * priv		Passed to onover.
+ *
+ * returns	New Plays or NULL on error.
+ */
+Plays *plays_init(int maxplays, int maxrooms, void (*onover)(Room *r, void *priv), void *priv);
+
+void plays_free(Plays *ps);
+
+/*
+ * Queues a word to be played by plays_run().
+ *
+ * ps		Plays.
+ * p		Player playing it, in whatever room they're in.
+ * word		Word as the player gave it.
+ * len		Length of word.
+ * at		ms it counts as played at.
+ *
+ * returns	0 on success, -1 if the batch is full.
+ */
+int plays_queue(Plays *ps, Player *p, const char *word, int len, long at);
+
+/*
+ * Plays everything queued: turn, normalization, dictionary lookup, used word
+ * and chain checks, then the word is played and everyone in the room told, or
+ * the player told why not.  The time each stage takes is kept in ps->hist.
+ *
+ * ps		Plays.
+ * now		Current time in ms.
+ *
+ * returns	Number of words played or rejected.
+ */
+int plays_run(Plays *ps, long now);
+
+/*
+ * Sets a room's timer, moving it if it's already set.  When it goes off a room
+ * that isn't playing starts a game if it's full, and one that is loses
+ * whoever's turn it is if they're out of time.
+ *
+ * ps		Plays.
+ * r		Room.
+ * due		ms the timer goes off.
+ *
+ * returns	0 on success, -1 if there are too many timers.
+ */
+int plays_schedule(Plays *ps, Room *r, long due);
+
+/*
+ * Goes through the timers that are due, starting games, ending ones which ran
+ * out of time and wrapping up any that have ended.
+ *
+ * ps		Plays.
+ * now		Current time in ms.
+ *
+ * returns	Number of timers which went off.
+ */
+int plays_expire(Plays *ps, long now);
+
+/*
+ * Estimates how long a stage takes from its histogram.
+ *
+ * ps		Plays.
+ * stage	play_stage.
+ * q		Fraction of plays which took no longer, 0 to 1.
+ *
+ * returns	ns, the top of the bucket the quantile is in, 0 if nothing has been timed.
+ */
+int64_t plays_quantile(const Plays *ps, play_stage stage, double q);
+
+/*
+ * Gets a stage's name.
+ *
+ * stage	play_stage.
+ *
+ * returns	Name.
+ */
+const char *play_stage_name(play_stage stage);
+
+/*
+ * Finds an identified player by name, detached players included.
+ *
+ * g		Game to search.
+ * name		Name to find, terminated.
+ *
+ * returns	Player or NULL if not found.
+ */
+Player *game_find_player(Game *g, const char *name);
+
+/*
+ * Rebuilds the tables players are found by from their seats, for when seats
+ * have been filled in directly, like when a game is handed over from another
+ * process.
+ *
+ * g		Game to rebuild.
+ */
+void game_reindex(Game *g);
+
+#endif
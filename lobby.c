@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lobby.h"
+#include "util.h"
+
+#ifndef MAX_COMMAND
+#error MAX_COMMAND must be defined!
+#endif
+
+Lobby *lobby_init(int maxplayers, int maxrooms, int roomsize, int tickms) {
+	Lobby *l;
+	int i, j;
+
+	l = malloc(sizeof(Lobby));
+	if(l == NULL)
+		goto lerror0;
+
+	for(i = 0; i < LANGS_MAX; i++) {
+		for(j = 0; j < LOBBY_TIERS; j++)
+			l->queue[i][j].entry = NULL;
+	}
+	for(i = 0; i < LANGS_MAX; i++) {
+		for(j = 0; j < LOBBY_TIERS; j++) {
+			l->queue[i][j].entry = malloc(sizeof(LobbyEntry) * maxplayers);
+			if(l->queue[i][j].entry == NULL)
+				goto lerror1;
+			l->queue[i][j].size = maxplayers;
+			l->queue[i][j].head = 0;
+			l->queue[i][j].count = 0;
+		}
+	}
+
+	l->pool = malloc(sizeof(LobbyEntry) * maxplayers);
+	if(l->pool == NULL)
+		goto lerror1;
+
+	l->room = malloc(sizeof(Room *) * maxrooms);
+	if(l->room == NULL)
+		goto lerror2;
+	for(i = 0; i < maxrooms; i++) {
+		l->room[i] = room_init(i, roomsize);
+		if(l->room[i] == NULL)
+			break;
+	}
+	if(i < maxrooms) {
+		for(i--; i >= 0; i--)
+			room_free(l->room[i]);
+		goto lerror3;
+	}
+
+	l->maxrooms = maxrooms;
+	l->roomsize = roomsize;
+	l->tickms = tickms;
+	l->lasttick = now_ms();
+
+	return(l);
+
+lerror3:
+	free(l->room);
+lerror2:
+	free(l->pool);
+lerror1:
+	for(i = 0; i < LANGS_MAX; i++) {
+		for(j = 0; j < LOBBY_TIERS; j++)
+			free(l->queue[i][j].entry);
+	}
+	free(l);
+lerror0:
+	return(NULL);
+}
+
+void lobby_free(Lobby *l) {
+	int i, j;
+
+	for(i = 0; i < l->maxrooms; i++)
+		room_free(l->room[i]);
+	free(l->room);
+	free(l->pool);
+	for(i = 0; i < LANGS_MAX; i++) {
+		for(j = 0; j < LOBBY_TIERS; j++)
+			free(l->queue[i][j].entry);
+	}
+	free(l);
+}
+
+static int entry_valid(const LobbyEntry *e) {
+	return(e->seq == e->p->queueseq && e->p->state != PLAYER_EMPTY && e->p->room == NULL);
+}
+
+/* Drops stale entries, keeping the rest in order. */
+static void queue_compact(LobbyQueue *q) {
+	int i, kept;
+	LobbyEntry *e;
+
+	kept = 0;
+	for(i = 0; i < q->count; i++) {
+		e = &(q->entry[(q->head + i) % q->size]);
+		if(entry_valid(e))
+			q->entry[(q->head + kept++) % q->size] = *e;
+	}
+	q->count = kept;
+}
+
+int lobby_enqueue(Lobby *l, Player *p) {
+	LobbyQueue *q;
+	int tier;
+
+	tier = p->rating / LOBBY_TIER_WIDTH;
+	if(tier < 0)
+		tier = 0;
+	else if(tier >= LOBBY_TIERS)
+		tier = LOBBY_TIERS - 1;
+	q = &(l->queue[p->language][tier]);
+
+	if(q->count == q->size) {
+		queue_compact(q);
+		if(q->count == q->size)
+			return(-1);
+	}
+
+	p->queueseq++; /* any older entry for this player is stale now */
+	q->entry[(q->head + q->count) % q->size].p = p;
+	q->entry[(q->head + q->count) % q->size].seq = p->queueseq;
+	q->entry[(q->head + q->count) % q->size].since = now_ms();
+	q->count++;
+
+	return(0);
+}
+
+Room *lobby_free_room(Lobby *l) {
+	int i;
+
+	for(i = 0; i < l->maxrooms; i++) {
+		if(l->room[i]->players == 0)
+			return(l->room[i]);
+	}
+
+	return(NULL);
+}
+
+static void announce(Room *r) {
+	char msg[MAX_COMMAND];
+	int len, i, j;
+
+	for(i = 0; i < r->players; i++) {
+		len = snprintf(msg, MAX_COMMAND, "SERVER%cYou're in room %i with", '\0', r->id);
+		for(j = 0; j < r->players; j++) {
+			if(j != i && len < MAX_COMMAND)
+				len += snprintf(&(msg[len]), MAX_COMMAND - len, " %s", r->player[j]->name);
+		}
+		if(len >= MAX_COMMAND)
+			len = MAX_COMMAND - 1;
+		player_send_command(r->player[i], CMD_MSG, msg, len);
+	}
+}
+
+/* Puts the first roomsize entries in a room, returns -1 if there are no rooms free. */
+static int form_room(Lobby *l, LobbyEntry *e, norm_language lang) {
+	Room *r;
+	int i;
+
+	r = lobby_free_room(l);
+	if(r == NULL)
+		return(-1);
+
+	r->language = lang;
+	r->cluster = 0;
+	for(i = 0; i < l->roomsize; i++) {
+		e[i].p->queueseq++;
+		room_join(r, e[i].p);
+	}
+	announce(r);
+
+	return(0);
+}
+
+int lobby_take_waiting(Lobby *l, long waited, Player **p, int max) {
+	LobbyQueue *q;
+	LobbyEntry *e;
+	long now;
+	int taken, lang, tier, i;
+
+	now = now_ms();
+	taken = 0;
+	for(lang = 0; lang < LANGS_MAX; lang++) {
+		for(tier = 0; tier < LOBBY_TIERS; tier++) {
+			q = &(l->queue[lang][tier]);
+			for(i = 0; i < q->count && taken < max; i++) {
+				e = &(q->entry[(q->head + i) % q->size]);
+				if(entry_valid(e) && now - e->since >= waited) {
+					e->p->queueseq++; /* compacted out next tick */
+					p[taken++] = e->p;
+				}
+			}
+		}
+	}
+
+	return(taken);
+}
+
+int lobby_tick(Lobby *l) {
+	LobbyQueue *q;
+	LobbyEntry *e;
+	long now;
+	int formed, pooled;
+	int lang, tier, i;
+
+	now = now_ms();
+	if(now - l->lasttick < l->tickms)
+		return(0);
+	l->lasttick = now;
+
+	formed = 0;
+	for(lang = 0; lang < LANGS_MAX; lang++) {
+		/* fill rooms from within each tier first */
+		for(tier = 0; tier < LOBBY_TIERS; tier++) {
+			q = &(l->queue[lang][tier]);
+			queue_compact(q);
+			while(q->count >= l->roomsize) {
+				/* a room's worth might wrap around the end of the ring */
+				for(i = 0; i < l->roomsize; i++)
+					l->pool[i] = q->entry[(q->head + i) % q->size];
+				if(form_room(l, l->pool, lang) == -1)
+					return(formed);
+				q->head = (q->head + l->roomsize) % q->size;
+				q->count -= l->roomsize;
+				formed++;
+			}
+		}
+
+		/* then whoever's been waiting too long is matched with the tiers
+		 * around them, tiers are visited in order so neighbours end up together */
+		pooled = 0;
+		for(tier = 0; tier < LOBBY_TIERS; tier++) {
+			q = &(l->queue[lang][tier]);
+			for(i = 0; i < q->count; i++) {
+				e = &(q->entry[(q->head + i) % q->size]);
+				if(now - e->since >= LOBBY_WIDEN_MS)
+					l->pool[pooled++] = *e;
+			}
+		}
+		for(i = 0; i + l->roomsize <= pooled; i += l->roomsize) {
+			if(form_room(l, &(l->pool[i]), lang) == -1)
+				return(formed);
+			formed++;
+		}
+	}
+
+	return(formed);
+}
@@ -0,0 +1,102 @@
+#ifndef __LOBBY_H
+#define __LOBBY_H
+
+#include "game.h"
+
+#define LOBBY_TIERS			(5)
+#define LOBBY_TIER_WIDTH	(200) /* rating points per skill tier */
+#define LOBBY_WIDEN_MS		(3000) /* after waiting this long, neighbouring tiers are matched together */
+
+typedef struct {
+	Player *p;
+	unsigned int seq; /* entry is stale if the player's queueseq has moved on */
+	long since; /* ms */
+} LobbyEntry;
+
+typedef struct {
+	LobbyEntry *entry;
+	int size;
+	int head;
+	int count;
+} LobbyQueue;
+
+/*
+ * Players waiting for a room, queued by language and skill tier.  Joining only
+ * appends to one queue; the matcher runs every tickms and forms as many rooms
+ * as it can from all of them at once.
+ */
+typedef struct {
+	LobbyQueue queue[LANGS_MAX][LOBBY_TIERS];
+	LobbyEntry *pool; /* scratch space for matching across tiers */
+
+	Room **room;
+	int maxrooms;
+	int roomsize;
+
+	int tickms;
+	long lasttick;
+} Lobby;
+
+/*
+ * Initializes a new Lobby and its rooms.
+ *
+ * maxplayers	Most players that can be waiting at once.
+ * maxrooms		Number of rooms.
+ * roomsize		Players per room.
+ * tickms		How often to form rooms in milliseconds.
+ *
+ * returns		New Lobby or NULL on error.
+ */
+Lobby *lobby_init(int maxplayers, int maxrooms, int roomsize, int tickms);
+
+/*
+ * Frees a Lobby and its rooms.
+ *
+ * l		Lobby to free.
+ */
+void lobby_free(Lobby *l);
+
+/*
+ * Puts a player in the queue for their language and rating.  A player already
+ * queued is moved.
+ *
+ * l		Lobby to wait in.
+ * p		Player to queue.
+ *
+ * returns	0 on success, -1 if the queue is full.
+ */
+int lobby_enqueue(Lobby *l, Player *p);
+
+/*
+ * Takes players who have been waiting a long time out of the queues, so they
+ * can be matched somewhere else.
+ *
+ * l		Lobby to take from.
+ * waited	Milliseconds a player must have been waiting.
+ * p		Players taken are written here.
+ * max		Most players to take.
+ *
+ * returns	Number of players taken.
+ */
+int lobby_take_waiting(Lobby *l, long waited, Player **p, int max);
+
+/*
+ * Finds an empty room.
+ *
+ * l		Lobby to search.
+ *
+ * returns	Room or NULL if all are in use.
+ */
+Room *lobby_free_room(Lobby *l);
+
+/*
+ * Forms rooms from the waiting players if it's time to.  Players put in a room
+ * are told which room and who with.
+ *
+ * l		Lobby to match players in.
+ *
+ * returns	Number of rooms formed.
+ */
+int lobby_tick(Lobby *l);
+
+#endif
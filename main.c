@@ -30,6 +30,7 @@ int main(int argc, char **argv) {
 	Connection *c;
 	struct sigaction sa;
 	struct timespec idletime;
+	char addrtext[INET6_ADDRSTRLEN];
 	int retval;
 	char outbuf[MAX_COMMAND];
 	char *cmdbuf;
@@ -37,12 +38,13 @@ int main(int argc, char **argv) {
 	int command;
 	short unsigned int cmdlen, datalen;
 	CMDBuffer *buf;
+	int len, i;
 
 	char prompt[PROMPT_LEN];
 	int curend;
 
-	if(argc != 3) {
-		fprintf(stderr, "Usage: %s <host> <port>\n", argv[0]);
+	if(argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <host> <port> | %s <local socket>\n", argv[0], argv[0]);
 		goto error0;
 	}
 
@@ -70,11 +72,32 @@ int main(int argc, char **argv) {
 	sigaction(SIGUSR1, &sa, NULL);
 	sigaction(SIGUSR2, &sa, NULL);
 
-	retval = connection_connect(c, argv[1], argv[2], 0);
-	if(retval == -1) {
-		goto error2;
+	if(argc == 2) {
+		/* a server on this host, which can skip the network altogether */
+		if(connection_connect_unix(c, argv[1], 0) == -1) {
+			goto error2;
+		}
+		retval = connection_request_shared_memory(c);
+		if(retval == -1) {
+			goto error2;
+		}
+		fprintf(stderr, "Successfully connected to %s%s.\n", c->hostname, retval == 0 ? " over shared memory" : "");
+	} else {
+		if(connection_connect_start(c, argv[1], argv[2], 0) == -1) {
+			goto error2;
+		}
+		/* wait here rather than in connection_connect() so a signal can give up */
+		running = 1;
+		while(running && (retval = connection_connect_poll(c)) == -2) {
+			idletime.tv_sec = 0;
+			idletime.tv_nsec = 1000000;
+			nanosleep(&idletime, NULL);
+		}
+		if(retval != 0) {
+			goto error2;
+		}
+		fprintf(stderr, "Successfully connected to %s(%s).\n", c->hostname, connection_address(c, addrtext, sizeof(addrtext)));
 	}
-	fprintf(stderr, "Successfully connected to %s(%s).\n", c->hostname, inet_ntoa(((struct sockaddr_in *)&(c->address))->sin_addr));
 
 	rawterm_init();
 	rawterm_set();
@@ -102,7 +125,7 @@ int main(int argc, char **argv) {
 					break;
 				case CMD_PING:
 					PRINT_ERROR("Ping? ");
-					if(connection_pong(c) == -1) {
+					if(connection_pong(c, databuf, datalen) == -1) {
 						PRINT_ERROR("Error!\n");
 						connection_disconnect(c);
 					} else {
@@ -110,8 +133,47 @@ int main(int argc, char **argv) {
 					}
 					break;
 				case CMD_PONG:
-					c->pinged = 0;
-					PRINT_ERROR("Pong received from server.\n");
+					if(connection_pong_received(c, databuf, datalen) == 0) {
+						PRINT_ERROR("Pong received from server, rtt %.1f ms, smoothed %.1f ms.\n", c->rtt / 1000.0, c->srtt / 1000.0);
+					}
+					break;
+				case CMD_MSG:
+					/* name\0message */
+					for(i = 0; i < datalen && databuf[i] != '\0'; i++);
+					PRINT_ERROR("<%.*s> %.*s\n", i, databuf, i < datalen ? datalen - i - 1 : 0, &(databuf[i + 1]));
+					break;
+				case CMD_PLAY:
+					/* name\0word, then whose turn it is unless that was the end */
+					for(i = 0; i < datalen && databuf[i] != '\0'; i++);
+					for(len = i + 1; len < datalen && databuf[len] != '\0'; len++);
+					PRINT_ERROR("%.*s played %.*s", i, databuf, len < datalen ? len - i - 1 : datalen - i - 1, &(databuf[i + 1]));
+					if(len < datalen) {
+						PRINT_ERROR(", %.*s is next", datalen - len - 1, &(databuf[len + 1]));
+					}
+					PRINT_ERROR(".\n");
+					break;
+				case CMD_TOKEN:
+					PRINT_ERROR("Resume token: %.*s\n", datalen, databuf);
+					break;
+				case CMD_COMPLETE:
+					/* prefix\0word\0word... */
+					for(i = 0; i < datalen && databuf[i] != '\0'; i++);
+					PRINT_ERROR("Words starting with %.*s:", i, databuf);
+					while(i < datalen) {
+						len = ++i;
+						for(; i < datalen && databuf[i] != '\0'; i++);
+						PRINT_ERROR(" %.*s", i - len, &(databuf[len]));
+					}
+					PRINT_ERROR("\n");
+					break;
+				case CMD_RANKINGS:
+					/* name\0rating\0games\0wins\0longest for each, best first */
+					PRINT_ERROR("Rankings:\n");
+					for(i = 0, len = 0; i < datalen; i++) {
+						if(databuf[i] == '\0')
+							databuf[i] = ++len % 5 == 0 ? '\n' : '\t';
+					}
+					PRINT_ERROR("%.*s\n", datalen, databuf);
 					break;
 				default:
 					PRINT_ERROR("Unimplemented command %s!\n", COMMANDS[command].name);
@@ -119,10 +181,19 @@ int main(int argc, char **argv) {
 			cmdbuffer_reset(c->buf);
 		}
 		if(c->type == SERVER) { /* make sure we didn't disconnect it already */
-			if(connection_timeout_check(c, 0)) {
+			retval = connection_liveness_check(c);
+			if(retval == -2) {
+				connection_disconnect(c);
+				PRINT_ERROR("Server didn't answer a ping in %li ms, disconnected.\n", connection_rto(c));
+			} else if(connection_timeout_check(c, 0)) {
 				/* disconnect connection who hasn't responded or sent any data in a while */
 				connection_disconnect(c);
 				PRINT_ERROR("Server connection had no activity in %lu seconds, disconnected.\n", time(NULL) - c->last_message);
+			} else if(retval == 1) {
+				if(connection_ping(c) == -1) {
+					connection_disconnect(c);
+					PRINT_ERROR("Failed to ping server, disconnected.\n");
+				}
 			}
 		}
 		if(c->type == NOTCONNECTED) {
@@ -135,16 +206,28 @@ int main(int argc, char **argv) {
 			running = 0;
 		} else if(retval > 0) {
 			if(prompt[retval] == '\0') {
-				PRINT_ERROR("%s\n", prompt);
+				/* a finished line is a word to play */
+				if(retval > 1) {
+					len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_PLAY].name, COMMANDS[CMD_PLAY].length, &(prompt[1]), retval - 1);
+					if(len == -1 || connection_write(c, outbuf, len) == -1) {
+						PRINT_ERROR("Failed to play %s.\n", &(prompt[1]));
+					}
+				}
 				curend = 0;
 			} else {
+				if(retval != curend) {
+					/* the server waits for a pause in typing, so ask every time */
+					len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_COMPLETE].name, COMMANDS[CMD_COMPLETE].length, &(prompt[1]), retval);
+					if(len != -1 && connection_write(c, outbuf, len) == -1) {
+						PRINT_ERROR("Failed to ask server for completions.\n");
+					}
+				}
 				curend = retval;
 			}
 		}
 
-		idletime.tv_sec = 0;
-		idletime.tv_nsec = 1000000;
-		nanosleep(&idletime, NULL);
+		/* the keyboard is looked at again after this at most */
+		connection_wait(c, 1000000);
 	}
 
 	rawterm_unset();
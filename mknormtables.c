@@ -0,0 +1,207 @@
+/*
+ * Build-time generator for the normalization lookup tables used by normalize.c.
+ *
+ * The rules below are written as codepoint ranges because that's how they're
+ * easiest to read and check against the Unicode charts, but looking up a range
+ * list on every character of every word is wasteful, so they get expanded here
+ * in to flat arrays which are written out as normtables.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LATIN_MAX	(0x180)
+#define KANA_BASE	(0x3040)
+#define KANA_MAX	(0xC0)
+
+#define KANA_LOSING	(1)
+
+typedef struct {
+	unsigned int lo, hi;
+	char first, last; /* unit used at the start or end of a word, 0 to skip */
+} LatinRule;
+
+typedef struct {
+	unsigned int lo, hi;
+	int step; /* 1 for runs of upper/lower, 2 for alternating pairs */
+	int upperodd; /* in pairs, upper case is on the odd codepoint */
+} FoldRule;
+
+typedef struct {
+	unsigned int from, to; /* to of 0 means skip */
+	int flags;
+} KanaRule;
+
+/* Base letters of precomposed Latin letters, for chaining é on to e and so on. */
+static const LatinRule latin_rules[] = {
+	{0x0030, 0x0039, 0,   0  }, /* digits are handled below, as themselves */
+	{0x0041, 0x005A, 0,   0  },
+	{0x0061, 0x007A, 0,   0  },
+	{0x00AA, 0x00AA, 'a', 'a'},
+	{0x00BA, 0x00BA, 'o', 'o'},
+	{0x00C0, 0x00C5, 'a', 'a'}, {0x00E0, 0x00E5, 'a', 'a'},
+	{0x00C6, 0x00C6, 'a', 'e'}, {0x00E6, 0x00E6, 'a', 'e'},
+	{0x00C7, 0x00C7, 'c', 'c'}, {0x00E7, 0x00E7, 'c', 'c'},
+	{0x00C8, 0x00CB, 'e', 'e'}, {0x00E8, 0x00EB, 'e', 'e'},
+	{0x00CC, 0x00CF, 'i', 'i'}, {0x00EC, 0x00EF, 'i', 'i'},
+	{0x00D0, 0x00D0, 'd', 'd'}, {0x00F0, 0x00F0, 'd', 'd'},
+	{0x00D1, 0x00D1, 'n', 'n'}, {0x00F1, 0x00F1, 'n', 'n'},
+	{0x00D2, 0x00D6, 'o', 'o'}, {0x00F2, 0x00F6, 'o', 'o'},
+	{0x00D8, 0x00D8, 'o', 'o'}, {0x00F8, 0x00F8, 'o', 'o'},
+	{0x00D9, 0x00DC, 'u', 'u'}, {0x00F9, 0x00FC, 'u', 'u'},
+	{0x00DD, 0x00DD, 'y', 'y'}, {0x00FD, 0x00FD, 'y', 'y'}, {0x00FF, 0x00FF, 'y', 'y'},
+	{0x00DE, 0x00DE, 't', 'h'}, {0x00FE, 0x00FE, 't', 'h'},
+	{0x00DF, 0x00DF, 's', 's'},
+	{0x0100, 0x0105, 'a', 'a'},
+	{0x0106, 0x010D, 'c', 'c'},
+	{0x010E, 0x0111, 'd', 'd'},
+	{0x0112, 0x011B, 'e', 'e'},
+	{0x011C, 0x0123, 'g', 'g'},
+	{0x0124, 0x0127, 'h', 'h'},
+	{0x0128, 0x0131, 'i', 'i'},
+	{0x0132, 0x0133, 'i', 'j'},
+	{0x0134, 0x0135, 'j', 'j'},
+	{0x0136, 0x0138, 'k', 'k'},
+	{0x0139, 0x0142, 'l', 'l'},
+	{0x0143, 0x014B, 'n', 'n'},
+	{0x014C, 0x0151, 'o', 'o'},
+	{0x0152, 0x0153, 'o', 'e'},
+	{0x0154, 0x0159, 'r', 'r'},
+	{0x015A, 0x0161, 's', 's'},
+	{0x0162, 0x0167, 't', 't'},
+	{0x0168, 0x0173, 'u', 'u'},
+	{0x0174, 0x0175, 'w', 'w'},
+	{0x0176, 0x0178, 'y', 'y'},
+	{0x0179, 0x017E, 'z', 'z'},
+	{0x017F, 0x017F, 's', 's'}
+};
+#define LATIN_RULES (sizeof(latin_rules) / sizeof(LatinRule))
+
+static const FoldRule fold_rules[] = {
+	{0x0041, 0x005A, 1, 0},
+	{0x00C0, 0x00D6, 1, 0},
+	{0x00D8, 0x00DE, 1, 0},
+	{0x0100, 0x012F, 2, 0},
+	{0x0132, 0x0137, 2, 0},
+	{0x0139, 0x0148, 2, 1},
+	{0x014A, 0x0177, 2, 0},
+	{0x0179, 0x017E, 2, 1}
+};
+#define FOLD_RULES (sizeof(fold_rules) / sizeof(FoldRule))
+
+/* Everything in the hiragana and katakana blocks not mentioned here is a unit
+ * by itself.  Katakana is folded to hiragana before these are looked up, but
+ * the katakana-only characters are still listed. */
+static const KanaRule kana_rules[] = {
+	{0x3041, 0x3042, 0}, /* small a */
+	{0x3043, 0x3044, 0},
+	{0x3045, 0x3046, 0},
+	{0x3047, 0x3048, 0},
+	{0x3049, 0x304A, 0},
+	{0x3063, 0x3064, 0}, /* small tsu */
+	{0x3083, 0x3084, 0}, /* small ya */
+	{0x3085, 0x3086, 0},
+	{0x3087, 0x3088, 0},
+	{0x308E, 0x308F, 0}, /* small wa */
+	{0x3093, 0x3093, KANA_LOSING}, /* n */
+	{0x3095, 0x304B, 0}, /* small ka */
+	{0x3096, 0x3051, 0}, /* small ke */
+	{0x3097, 0,      0}, /* unassigned */
+	{0x3098, 0,      0},
+	{0x3099, 0,      0}, /* combining and spacing voicing marks */
+	{0x309A, 0,      0},
+	{0x309B, 0,      0},
+	{0x309C, 0,      0},
+	{0x309D, 0,      0}, /* iteration marks repeat the previous unit */
+	{0x309E, 0,      0},
+	{0x309F, 0,      0},
+	{0x30A0, 0,      0},
+	{0x30F3, 0x3093, KANA_LOSING}, /* katakana n, in case it isn't folded */
+	{0x30F5, 0x304B, 0},
+	{0x30F6, 0x3051, 0},
+	{0x30FB, 0,      0}, /* middle dot */
+	{0x30FC, 0,      0}, /* prolonged sound mark takes the unit before it */
+	{0x30FD, 0,      0},
+	{0x30FE, 0,      0},
+	{0x30FF, 0,      0}
+};
+#define KANA_RULES (sizeof(kana_rules) / sizeof(KanaRule))
+
+static void print_table(const char *type, const char *name, const char *size, const unsigned int *t, int len) {
+	int i;
+
+	printf("static const %s %s[%s] = {", type, name, size);
+	for(i = 0; i < len; i++) {
+		if(i > 0)
+			printf(",");
+		printf(i % 8 == 0 ? "\n\t" : " ");
+		printf("0x%04X", t[i]);
+	}
+	printf("\n};\n\n");
+}
+
+int main() {
+	unsigned int fold[LATIN_MAX];
+	unsigned int first[LATIN_MAX];
+	unsigned int last[LATIN_MAX];
+	unsigned int kana[KANA_MAX];
+	unsigned int kanaflags[KANA_MAX];
+	unsigned int i, j, upper;
+
+	for(i = 0; i < LATIN_MAX; i++) {
+		fold[i] = i;
+		first[i] = 0;
+		last[i] = 0;
+	}
+
+	for(i = 0; i < FOLD_RULES; i++) {
+		for(j = fold_rules[i].lo; j <= fold_rules[i].hi; j++) {
+			if(fold_rules[i].step == 1) {
+				fold[j] = j + 0x20;
+			} else {
+				upper = fold_rules[i].upperodd ? (j & 1) : !(j & 1);
+				if(upper)
+					fold[j] = j + 1;
+			}
+		}
+	}
+	/* The odd ones out. */
+	fold[0x0130] = 'i';
+	fold[0x0178] = 0x00FF;
+	fold[0x017F] = 's';
+
+	for(i = 0; i < LATIN_RULES; i++) {
+		for(j = latin_rules[i].lo; j <= latin_rules[i].hi; j++) {
+			if(latin_rules[i].first == 0) { /* ASCII letters and digits */
+				first[j] = fold[j];
+				last[j] = fold[j];
+			} else {
+				first[j] = latin_rules[i].first;
+				last[j] = latin_rules[i].last;
+			}
+		}
+	}
+
+	for(i = 0; i < KANA_MAX; i++) {
+		kana[i] = KANA_BASE + i;
+		kanaflags[i] = 0;
+	}
+	kana[0] = 0; /* unassigned */
+	for(i = 0; i < KANA_RULES; i++) {
+		kana[kana_rules[i].from - KANA_BASE] = kana_rules[i].to;
+		kanaflags[kana_rules[i].from - KANA_BASE] = kana_rules[i].flags;
+	}
+
+	printf("/* Generated by mknormtables, do not edit. */\n\n");
+	printf("#define NORM_LATIN_MAX\t\t(0x%X)\n", LATIN_MAX);
+	printf("#define NORM_KANA_BASE\t\t(0x%X)\n", KANA_BASE);
+	printf("#define NORM_KANA_MAX\t\t(0x%X)\n", KANA_MAX);
+	printf("#define NORM_KANA_LOSING\t(%i)\n\n", KANA_LOSING);
+	print_table("unsigned short int", "norm_latin_fold", "NORM_LATIN_MAX", fold, LATIN_MAX);
+	print_table("unsigned char", "norm_latin_first", "NORM_LATIN_MAX", first, LATIN_MAX);
+	print_table("unsigned char", "norm_latin_last", "NORM_LATIN_MAX", last, LATIN_MAX);
+	print_table("unsigned short int", "norm_kana_unit", "NORM_KANA_MAX", kana, KANA_MAX);
+	print_table("unsigned char", "norm_kana_flags", "NORM_KANA_MAX", kanaflags, KANA_MAX);
+
+	exit(EXIT_SUCCESS);
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* getaddrinfo_a(), accept4(), memfd_create(), ppoll() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,8 +12,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 
 #include "net.h"
+#include "uring.h"
+#include "util.h"
 
 #ifndef MAX_COMMAND
 #error MAX_COMMAND must be defined!
@@ -21,10 +30,615 @@ const  Command COMMANDS[] = {{"MSG",	3},
                              {"PING",	4},
                              {"PONG",	4},
                              {"USER",	4},
-                             {"ERROR",	5}};
+                             {"JOIN",	4},
+                             {"NODE",	4},
+                             {"HERE",	4},
+                             {"GONE",	4},
+                             {"WAIT",	4},
+                             {"ROOM",	4},
+                             {"RMSG",	4},
+                             {"LEFT",	4},
+                             {"PLAY",	4},
+                             {"ERROR",	5},
+                             {"TOKEN",	5},
+                             {"ROUTE",	5},
+                             {"RESUME",	6},
+                             {"COMPLETE",	8},
+                             {"SHAREMEM",	8},
+                             {"RANKINGS",	8}};
 
 static char outbuf[MAX_COMMAND];
 
+struct ConnectAttempt {
+	struct gaicb req;
+	struct addrinfo hints;
+	char *host;
+	char *port;
+	int resolving;
+
+	struct addrinfo *addr[CONNECT_RACE_MAX]; /* in the order they'll be tried */
+	int addrs;
+	int nextaddr;
+	int fd[CONNECT_RACE_MAX];
+
+	struct timespec started;
+	struct timespec laststart;
+};
+
+/* what each request is, kept in the top byte of its user_data */
+#define RING_ACCEPT	(1)
+#define RING_RECV	(2)
+#define RING_SEND	(3)
+#define RING_CANCEL	(4)
+
+typedef struct {
+	unsigned int gen; /* bumped on disconnect, so completions for whoever had the slot before are known */
+
+	int rxarmed;
+	int rxhead, rxtail; /* buffers received and not read yet, linked through bufnext, -1 if none */
+	int rxoff; /* read so far of the first */
+	int rxend; /* 1 once the other end closed, -1 on error */
+
+	char *tx;
+	int txhead; /* start of what's not been sent */
+	int txinflight; /* bytes from txhead being sent now */
+	int txused;
+	int txerror;
+} NetRingSlot;
+
+struct NetRing {
+	Uring *u;
+	int acceptarmed;
+	int accepted[NETRING_ACCEPT_QUEUE];
+	int acceptfirst;
+	int acceptcount;
+	int *bufnext;
+	int *buflen;
+	int slots;
+	NetRingSlot *slot;
+};
+
+/* Shared memory: the ring each way with its header first, then both rings' data. */
+struct NetShm {
+	void *map;
+	ShmRingHeader *rx;
+	ShmRingHeader *tx;
+	char *rxdata;
+	char *txdata;
+	int memfd;
+	int rxevent; /* written to by the other end when it writes while we're sleeping */
+	int txevent; /* and by us the other way */
+	int ownrxevent; /* a server's rxevent is shared by all of its connections */
+	long checked; /* ms, when the socket was last looked at for a hangup */
+};
+
+#define SHM_MAP_SIZE	(2 * sizeof(ShmRingHeader) + 2 * SHM_RING_SIZE)
+
+/* Called whenever a connection is made, measurements from an old one don't apply. */
+static void rtt_reset(Connection *c) {
+	c->pinged = 0;
+	c->pingsent = 0;
+	c->lastping = now_us();
+	c->rtt = 0;
+	c->srtt = 0;
+	c->rttvar = 0;
+	c->rttsamples = 0;
+}
+
+static void connection_refuse(int sock, const char *why);
+
+static uint64_t ring_data(int op, unsigned int gen, int slot) {
+	return(((uint64_t)op << 56) | ((uint64_t)(gen & 0xFFFFFF) << 32) | (uint32_t)slot);
+}
+
+static void ring_free(struct NetRing *r) {
+	int i;
+
+	uring_free(r->u); /* cancels anything still going */
+	for(i = 0; i < r->acceptcount; i++)
+		close(r->accepted[(r->acceptfirst + i) % NETRING_ACCEPT_QUEUE]);
+	for(i = 0; i < r->slots; i++)
+		free(r->slot[i].tx);
+	free(r->slot);
+	free(r->bufnext);
+	free(r->buflen);
+	free(r);
+}
+
+static int ring_accepted(struct NetRing *r) {
+	int sock;
+
+	if(r->acceptcount == 0)
+		return(-1);
+	sock = r->accepted[r->acceptfirst];
+	r->acceptfirst = (r->acceptfirst + 1) % NETRING_ACCEPT_QUEUE;
+	r->acceptcount--;
+
+	return(sock);
+}
+
+static int ring_read(Connection *c, char *buf, int bytes) {
+	struct NetRing *r = c->ring;
+	NetRingSlot *sl = &(r->slot[c->slot]);
+	int n, len, next;
+
+	n = 0;
+	while(n < bytes && sl->rxhead != -1) {
+		len = r->buflen[sl->rxhead] - sl->rxoff;
+		if(len > bytes - n)
+			len = bytes - n;
+		memcpy(&(buf[n]), uring_buf(r->u, sl->rxhead) + sl->rxoff, len);
+		n += len;
+		sl->rxoff += len;
+		if(sl->rxoff == r->buflen[sl->rxhead]) {
+			next = r->bufnext[sl->rxhead];
+			uring_buf_return(r->u, sl->rxhead);
+			sl->rxhead = next;
+			sl->rxoff = 0;
+			if(next == -1)
+				sl->rxtail = -1;
+		}
+	}
+
+	return(n);
+}
+
+static int ring_write(Connection *c, const char *buf, int bytes) {
+	NetRingSlot *sl = &(c->ring->slot[c->slot]);
+
+	if(sl->txerror) {
+		errno = EPIPE;
+		return(-1);
+	}
+	if(sl->txinflight == 0 && sl->txhead > 0) {
+		memmove(sl->tx, &(sl->tx[sl->txhead]), sl->txused - sl->txhead);
+		sl->txused -= sl->txhead;
+		sl->txhead = 0;
+	}
+	/* a full buffer is what a full socket would be, the other end isn't keeping up */
+	if(sl->txused + bytes > NETRING_SEND_SIZE) {
+		errno = EAGAIN;
+		return(-1);
+	}
+	memcpy(&(sl->tx[sl->txused]), buf, bytes);
+	sl->txused += bytes;
+
+	return(bytes);
+}
+
+/* Forgets a connection's requests and anything received, before it's closed. */
+static void ring_release(Connection *c) {
+	struct NetRing *r = c->ring;
+	NetRingSlot *sl = &(r->slot[c->slot]);
+	int next;
+
+	/* the requests hold the socket open, this ends them and tells the other end now */
+	if((sl->rxarmed || sl->txinflight > 0) && c->sock > 2)
+		shutdown(c->sock, SHUT_RDWR);
+	while(sl->rxhead != -1) {
+		next = r->bufnext[sl->rxhead];
+		uring_buf_return(r->u, sl->rxhead);
+		sl->rxhead = next;
+	}
+	sl->rxtail = -1;
+	sl->rxoff = 0;
+	sl->rxarmed = 0;
+	sl->rxend = 0;
+	/* a send in progress still reads from tx until it finishes, so keep that part */
+	sl->txused = sl->txhead + sl->txinflight;
+	sl->txerror = 0;
+	sl->gen++;
+}
+
+/* Queues whatever requests are missing: the accept, receives and sends. */
+static int ring_arm(Server *s, int accepting) {
+	struct NetRing *r = s->ring;
+	struct io_uring_sqe *sqe;
+	NetRingSlot *sl;
+	Connection *c;
+	int i;
+
+	if(accepting && !r->acceptarmed && s->sock > 2) {
+		sqe = uring_sqe(r->u);
+		if(sqe == NULL)
+			return(-1);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = s->sock;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = ring_data(RING_ACCEPT, 0, 0);
+		r->acceptarmed = 1;
+	}
+
+	for(i = 0; i < r->slots; i++) {
+		c = s->connection[i];
+		sl = &(r->slot[i]);
+		if(c->type != CLIENT)
+			continue;
+		if(accepting && !sl->rxarmed && sl->rxend == 0) {
+			sqe = uring_sqe(r->u);
+			if(sqe == NULL)
+				return(-1);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = c->sock;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->user_data = ring_data(RING_RECV, sl->gen, i);
+			sl->rxarmed = 1;
+		}
+		/* one send at a time for each, holding everything written since the last */
+		if(sl->txinflight == 0 && sl->txused > sl->txhead && !sl->txerror) {
+			sqe = uring_sqe(r->u);
+			if(sqe == NULL)
+				return(-1);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = c->sock;
+			sqe->addr = (unsigned long)&(sl->tx[sl->txhead]);
+			sqe->len = sl->txused - sl->txhead;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = ring_data(RING_SEND, sl->gen, i);
+			sl->txinflight = sl->txused - sl->txhead;
+		}
+	}
+
+	return(0);
+}
+
+static void ring_reap(Server *s) {
+	struct NetRing *r = s->ring;
+	struct io_uring_cqe *cqe;
+	NetRingSlot *sl;
+	int op, slot, current, bid;
+
+	while((cqe = uring_cqe(r->u)) != NULL) {
+		op = cqe->user_data >> 56;
+		slot = cqe->user_data & 0xFFFFFFFF;
+		sl = op == RING_RECV || op == RING_SEND ? &(r->slot[slot]) : NULL;
+		current = sl != NULL && ((cqe->user_data >> 32) & 0xFFFFFF) == (sl->gen & 0xFFFFFF);
+
+		if(op == RING_ACCEPT) {
+			if(cqe->res >= 0) {
+				if(r->acceptcount < NETRING_ACCEPT_QUEUE) {
+					r->accepted[(r->acceptfirst + r->acceptcount) % NETRING_ACCEPT_QUEUE] = cqe->res;
+					r->acceptcount++;
+				} else {
+					connection_refuse(cqe->res, ACCEPT_REFUSED_FULL);
+					s->refusedfull++;
+				}
+			}
+			if(!(cqe->flags & IORING_CQE_F_MORE))
+				r->acceptarmed = 0;
+		} else if(op == RING_RECV) {
+			if(cqe->flags & IORING_CQE_F_BUFFER) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if(current && cqe->res > 0) {
+					r->buflen[bid] = cqe->res;
+					r->bufnext[bid] = -1;
+					if(sl->rxtail != -1)
+						r->bufnext[sl->rxtail] = bid;
+					else
+						sl->rxhead = bid;
+					sl->rxtail = bid;
+				} else
+					uring_buf_return(r->u, bid);
+			}
+			if(current) {
+				if(cqe->res == 0)
+					sl->rxend = 1;
+				/* out of buffers or cancelled just means it needs starting again */
+				else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+					sl->rxend = -1;
+				if(!(cqe->flags & IORING_CQE_F_MORE))
+					sl->rxarmed = 0;
+			}
+		} else if(op == RING_SEND) {
+			if(current && cqe->res >= 0)
+				sl->txhead += cqe->res;
+			else if(current)
+				sl->txerror = 1;
+			else
+				sl->txhead += sl->txinflight;
+			sl->txinflight = 0;
+			if(sl->txhead == sl->txused) {
+				sl->txhead = 0;
+				sl->txused = 0;
+			}
+		}
+		uring_cqe_seen(r->u);
+	}
+}
+
+int server_uring_start(Server *s) {
+	struct NetRing *r;
+	int i;
+
+	if(s->ring != NULL)
+		return(0);
+
+	r = malloc(sizeof(struct NetRing));
+	if(r == NULL) {
+		fprintf(stderr, "server_uring_start(): Couldn't allocate memory.\n");
+		goto rerror0;
+	}
+	r->u = uring_init(NETRING_ENTRIES, NETRING_BUFFERS, NETRING_BUFFER_SIZE);
+	if(r->u == NULL)
+		goto rerror1;
+	r->bufnext = malloc(sizeof(int) * NETRING_BUFFERS);
+	r->buflen = malloc(sizeof(int) * NETRING_BUFFERS);
+	r->slot = malloc(sizeof(NetRingSlot) * s->connections);
+	if(r->bufnext == NULL || r->buflen == NULL || r->slot == NULL) {
+		fprintf(stderr, "server_uring_start(): Couldn't allocate memory.\n");
+		goto rerror2;
+	}
+	for(i = 0; i < s->connections; i++) {
+		memset(&(r->slot[i]), 0, sizeof(NetRingSlot));
+		r->slot[i].rxhead = -1;
+		r->slot[i].rxtail = -1;
+		r->slot[i].tx = malloc(NETRING_SEND_SIZE);
+		if(r->slot[i].tx == NULL) {
+			fprintf(stderr, "server_uring_start(): Couldn't allocate memory.\n");
+			break;
+		}
+	}
+	r->slots = i;
+	if(i < s->connections)
+		goto rerror3;
+	r->acceptarmed = 0;
+	r->acceptfirst = 0;
+	r->acceptcount = 0;
+
+	s->ring = r;
+	for(i = 0; i < s->connections; i++) {
+		s->connection[i]->ring = r;
+		s->connection[i]->slot = i;
+	}
+
+	return(0);
+
+rerror3:
+	for(i = 0; i < r->slots; i++)
+		free(r->slot[i].tx);
+rerror2:
+	free(r->slot);
+	free(r->bufnext);
+	free(r->buflen);
+	uring_free(r->u);
+rerror1:
+	free(r);
+rerror0:
+	return(-1);
+}
+
+static int ring_busy(const struct NetRing *r) {
+	int i;
+
+	if(r->acceptarmed)
+		return(1);
+	for(i = 0; i < r->slots; i++) {
+		if(r->slot[i].rxarmed || r->slot[i].txinflight > 0 ||
+		   (r->slot[i].txused > r->slot[i].txhead && !r->slot[i].txerror))
+			return(1);
+	}
+
+	return(0);
+}
+
+void server_uring_stop(Server *s) {
+	struct NetRing *r = s->ring;
+	struct io_uring_sqe *sqe;
+	struct timespec idletime;
+	char chunk[NETRING_BUFFER_SIZE];
+	Connection *c;
+	NetRingSlot *sl;
+	int len, waited;
+	int sock;
+	int i;
+
+	if(r == NULL)
+		return;
+
+	/* stop accepting and receiving */
+	if(r->acceptarmed && (sqe = uring_sqe(r->u)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = ring_data(RING_ACCEPT, 0, 0);
+		sqe->user_data = ring_data(RING_CANCEL, 0, 0);
+	}
+	for(i = 0; i < r->slots; i++) {
+		if(r->slot[i].rxarmed && (sqe = uring_sqe(r->u)) != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = ring_data(RING_RECV, r->slot[i].gen, i);
+			sqe->user_data = ring_data(RING_CANCEL, 0, i);
+		}
+	}
+	/* and let whatever's being sent go */
+	idletime.tv_sec = 0;
+	idletime.tv_nsec = 1000000;
+	for(waited = 0; waited < NETRING_STOP_MS && ring_busy(r); waited++) {
+		if(ring_arm(s, 0) == -1 || uring_submit(r->u, 0) == -1)
+			break;
+		ring_reap(s);
+		if(ring_busy(r))
+			nanosleep(&idletime, NULL);
+	}
+	if(waited == NETRING_STOP_MS)
+		fprintf(stderr, "server_uring_stop(): Gave up waiting for io_uring to finish.\n");
+
+	/* connections accepted too late to be handed to anyone */
+	while((sock = ring_accepted(r)) != -1) {
+		connection_refuse(sock, ACCEPT_REFUSED_FULL);
+		s->refusedfull++;
+	}
+
+	for(i = 0; i < r->slots; i++) {
+		c = s->connection[i];
+		sl = &(r->slot[i]);
+		/* anything received is kept to be read from the plain socket */
+		while(c->type == CLIENT && (len = ring_read(c, chunk, NETRING_BUFFER_SIZE)) > 0) {
+			if(connection_unread(c, chunk, len) == -1)
+				break;
+		}
+		/* and what couldn't be sent goes the slow way */
+		if(c->type == CLIENT && sl->txused > sl->txhead && !sl->txerror) {
+			c->ring = NULL;
+			connection_write(c, &(sl->tx[sl->txhead]), sl->txused - sl->txhead);
+		}
+		c->ring = NULL;
+		c->slot = -1;
+	}
+	s->ring = NULL;
+	ring_free(r);
+}
+
+int server_io(Server *s) {
+	if(s->ring == NULL)
+		return(0);
+
+	if(ring_arm(s, 1) == -1)
+		return(-1);
+	if(uring_submit(s->ring->u, 0) == -1)
+		return(-1);
+	ring_reap(s);
+
+	return(0);
+}
+
+/* Waits for everything queued for a connection to be sent, before anything can go another way. */
+static int ring_flush(Server *s, Connection *c) {
+	NetRingSlot *sl = &(s->ring->slot[c->slot]);
+	struct timespec idletime;
+	int waited;
+
+	idletime.tv_sec = 0;
+	idletime.tv_nsec = 1000000;
+	for(waited = 0; waited < NETRING_STOP_MS; waited++) {
+		if(sl->txerror)
+			return(-1);
+		if(sl->txinflight == 0 && sl->txused == sl->txhead)
+			return(0);
+		if(ring_arm(s, 0) == -1 || uring_submit(s->ring->u, 0) == -1)
+			return(-1);
+		ring_reap(s);
+		if(sl->txinflight > 0 || sl->txused > sl->txhead)
+			nanosleep(&idletime, NULL);
+	}
+
+	return(-1);
+}
+
+/* Maps the rings, the server reads the first and writes the second. */
+static struct NetShm *shm_map(int memfd, int server) {
+	struct NetShm *m;
+	struct stat st;
+	ShmRingHeader *hdr;
+	char *data;
+
+	if(fstat(memfd, &st) == -1 || st.st_size < (off_t)SHM_MAP_SIZE) {
+		fprintf(stderr, "shm_map(): Shared memory is too small.\n");
+		return(NULL);
+	}
+	m = malloc(sizeof(struct NetShm));
+	if(m == NULL) {
+		fprintf(stderr, "shm_map(): Couldn't allocate memory.\n");
+		return(NULL);
+	}
+	m->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(m->map == MAP_FAILED) {
+		perror("shm_map(): mmap()");
+		free(m);
+		return(NULL);
+	}
+	hdr = m->map;
+	data = (char *)m->map + 2 * sizeof(ShmRingHeader);
+	m->rx = &(hdr[server ? 0 : 1]);
+	m->tx = &(hdr[server ? 1 : 0]);
+	m->rxdata = &(data[server ? 0 : SHM_RING_SIZE]);
+	m->txdata = &(data[server ? SHM_RING_SIZE : 0]);
+	m->memfd = memfd;
+	m->rxevent = -1;
+	m->txevent = -1;
+	m->ownrxevent = 0;
+	m->checked = now_us() / 1000;
+
+	return(m);
+}
+
+static void shm_free(struct NetShm *m) {
+	munmap(m->map, SHM_MAP_SIZE);
+	close(m->memfd);
+	if(m->txevent != -1)
+		close(m->txevent);
+	if(m->ownrxevent && m->rxevent != -1)
+		close(m->rxevent);
+	free(m);
+}
+
+/* All or nothing, like ring_write(). */
+static int shm_write(struct NetShm *m, const char *buf, int bytes) {
+	uint32_t head, tail, pos, first;
+	uint64_t wake = 1;
+
+	head = m->tx->head;
+	tail = __atomic_load_n(&(m->tx->tail), __ATOMIC_ACQUIRE);
+	if(SHM_RING_SIZE - (head - tail) < (uint32_t)bytes) {
+		errno = EAGAIN;
+		return(-1);
+	}
+	pos = head & (SHM_RING_SIZE - 1);
+	first = SHM_RING_SIZE - pos < (uint32_t)bytes ? SHM_RING_SIZE - pos : (uint32_t)bytes;
+	memcpy(&(m->txdata[pos]), buf, first);
+	memcpy(m->txdata, &(buf[first]), bytes - first);
+	__atomic_store_n(&(m->tx->head), head + bytes, __ATOMIC_RELEASE);
+
+	/* either the reader sees the new head before sleeping or this sees it asleep, see shm_sleep() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(m->tx->sleeping), __ATOMIC_RELAXED))
+		write(m->txevent, &wake, sizeof(wake));
+
+	return(bytes);
+}
+
+static int shm_read(struct NetShm *m, char *buf, int bytes) {
+	uint32_t head, tail, pos, first, n;
+
+	tail = m->rx->tail;
+	head = __atomic_load_n(&(m->rx->head), __ATOMIC_ACQUIRE);
+	n = head - tail < (uint32_t)bytes ? head - tail : (uint32_t)bytes;
+	pos = tail & (SHM_RING_SIZE - 1);
+	first = SHM_RING_SIZE - pos < n ? SHM_RING_SIZE - pos : n;
+	memcpy(buf, &(m->rxdata[pos]), first);
+	memcpy(&(buf[first]), m->rxdata, n - first);
+	__atomic_store_n(&(m->rx->tail), tail + n, __ATOMIC_RELEASE);
+
+	return(n);
+}
+
+/* Says whether the writer should wake us, returns whether there's already something to read. */
+static int shm_sleep(struct NetShm *m, int sleeping) {
+	__atomic_store_n(&(m->rx->sleeping), sleeping, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return(__atomic_load_n(&(m->rx->head), __ATOMIC_ACQUIRE) != m->rx->tail);
+}
+
+/* The socket is only there to notice the other end going away, it's looked at now and then. */
+static int shm_hungup(Connection *c) {
+	char byte;
+	long now;
+	int retval;
+
+	if(c->ring != NULL)
+		return(c->ring->slot[c->slot].rxend != 0);
+
+	now = now_us() / 1000;
+	if(now - c->shm->checked < SHM_CHECK_MS)
+		return(0);
+	c->shm->checked = now;
+	retval = recv(c->sock, &byte, 1, MSG_DONTWAIT | MSG_PEEK);
+
+	return(retval == 0 || (retval == -1 && errno != EAGAIN && errno != EWOULDBLOCK));
+}
+
 Connection *connection_init(int timeout) {
 	Connection *c;
 
@@ -38,8 +652,16 @@ Connection *connection_init(int timeout) {
 	c->buf = NULL;
 	c->timeout = timeout;
 	c->last_message = 0;
-	c->pinged = 0;
-	memset(&(c->address), 0, sizeof(struct sockaddr));
+	rtt_reset(c);
+	c->attempt = NULL;
+	c->unread = NULL;
+	c->unreadlen = 0;
+	c->unreadpos = 0;
+	c->ring = NULL;
+	c->slot = -1;
+	c->shm = NULL;
+	memset(&(c->address), 0, sizeof(struct sockaddr_storage));
+	c->addrlen = 0;
 
 	return(c);
 }
@@ -55,94 +677,488 @@ void connection_free(Connection *c) {
 	free(c);
 }
 
-int connection_connect(Connection *c, char *host, char *port, int timeout) {
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	int retval;
+static long elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return((now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+static void connect_attempt_free(struct ConnectAttempt *a) {
+	int i;
+
+	if(a->resolving) {
+		/* the lookup can't always be cancelled, if not, it has to be waited out */
+		if(gai_cancel(&(a->req)) == EAI_NOTCANCELED) {
+			const struct gaicb *list[1] = {&(a->req)};
+
+			while(gai_error(&(a->req)) == EAI_INPROGRESS)
+				gai_suspend(list, 1, NULL);
+		}
+	}
+	for(i = 0; i < CONNECT_RACE_MAX; i++) {
+		if(a->fd[i] != -1)
+			close(a->fd[i]);
+	}
+	if(a->req.ar_result != NULL)
+		freeaddrinfo(a->req.ar_result);
+	free(a->host);
+	free(a->port);
+	free(a);
+}
+
+/* Interleave the address families so a broken IPv6 route can't hold up IPv4. */
+static void connect_order_addresses(struct ConnectAttempt *a) {
+	struct addrinfo *first[CONNECT_RACE_MAX], *second[CONNECT_RACE_MAX];
+	struct addrinfo *rp;
+	int nfirst, nsecond;
+	int i;
+
+	nfirst = 0;
+	nsecond = 0;
+	for(rp = a->req.ar_result; rp != NULL; rp = rp->ai_next) {
+		if(rp->ai_family == a->req.ar_result->ai_family) {
+			if(nfirst < CONNECT_RACE_MAX)
+				first[nfirst++] = rp;
+		} else {
+			if(nsecond < CONNECT_RACE_MAX)
+				second[nsecond++] = rp;
+		}
+	}
+
+	a->addrs = 0;
+	for(i = 0; a->addrs < CONNECT_RACE_MAX && (i < nfirst || i < nsecond); i++) {
+		if(i < nfirst)
+			a->addr[a->addrs++] = first[i];
+		if(i < nsecond && a->addrs < CONNECT_RACE_MAX)
+			a->addr[a->addrs++] = second[i];
+	}
+	a->nextaddr = 0;
+}
+
+/* Starts a connect() to the next address which gets as far as EINPROGRESS. */
+static void connect_start_next(struct ConnectAttempt *a) {
+	struct addrinfo *rp;
 	int sfd;
-	int yes = 1; // used for setsockopt
 
-	if(c == NULL) {
-		if(timeout <= 0)
-			return(-1);
-		c = connection_init(timeout);
-		if(c == NULL)
-			goto cerror0;
+	while(a->nextaddr < a->addrs) {
+		rp = a->addr[a->nextaddr];
+		sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+		if(sfd == -1) {
+			a->nextaddr++;
+			continue;
+		}
+		if(connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0 || errno == EINPROGRESS) {
+			a->fd[a->nextaddr] = sfd;
+			a->nextaddr++;
+			clock_gettime(CLOCK_MONOTONIC, &(a->laststart));
+			return;
+		}
+		close(sfd);
+		a->nextaddr++;
 	}
+}
 
-	/* Obtain address(es) matching host/port */
+int connection_connect_start(Connection *c, const char *host, const char *port, int timeout) {
+	struct ConnectAttempt *a;
+	struct gaicb *list[1];
+	int retval;
+	int i;
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-	hints.ai_socktype = SOCK_STREAM; /* TCP socket */
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;          /* Any protocol */
+	if(c->attempt != NULL || c->type != NOTCONNECTED) {
+		fprintf(stderr, "connection_connect_start(): Connection is already in use.\n");
+		goto cerror0;
+	}
 
-	retval = getaddrinfo(host, port, &hints, &result);
-	if (retval != 0) {
-		fprintf(stderr, "connection_connect(): getaddrinfo(): %s\n", gai_strerror(retval));
+	a = malloc(sizeof(struct ConnectAttempt));
+	if(a == NULL) {
+		fprintf(stderr, "connection_connect_start(): Couldn't allocate memory.\n");
 		goto cerror0;
 	}
+	a->host = strdup(host);
+	a->port = strdup(port);
+	if(a->host == NULL || a->port == NULL) {
+		fprintf(stderr, "connection_connect_start(): Couldn't allocate memory.\n");
+		goto cerror1;
+	}
+	for(i = 0; i < CONNECT_RACE_MAX; i++)
+		a->fd[i] = -1;
+	a->addrs = 0;
+	a->nextaddr = 0;
 
-	/* getaddrinfo() returns a list of address structures.
-	Try each address until we successfully connect(2).
-	If socket(2) (or connect(2)) fails, we (close the socket
-	and) try the next address. */
+	/* Obtain address(es) matching host/port */
 
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype,
-		rp->ai_protocol);
-		if (c->sock == -1)
-			continue;
+	memset(&(a->hints), 0, sizeof(struct addrinfo));
+	a->hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+	a->hints.ai_socktype = SOCK_STREAM; /* TCP socket */
+	a->hints.ai_flags = AI_ADDRCONFIG;
+	a->hints.ai_protocol = 0;          /* Any protocol */
+
+	memset(&(a->req), 0, sizeof(struct gaicb));
+	a->req.ar_name = a->host;
+	a->req.ar_service = a->port;
+	a->req.ar_request = &(a->hints);
+	list[0] = &(a->req);
+	retval = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL);
+	if(retval != 0) {
+		fprintf(stderr, "connection_connect_start(): getaddrinfo_a(): %s\n", gai_strerror(retval));
+		goto cerror1;
+	}
+	a->resolving = 1;
 
-		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
-			break;                  /* Success */
+	// override timeout if greater than 0
+	if(timeout > 0)
+		c->timeout = timeout;
 
-		close(sfd);
+	clock_gettime(CLOCK_MONOTONIC, &(a->started));
+	c->attempt = a;
+	c->type = CONNECTING;
+
+	return(0);
+
+cerror1:
+	free(a->host);
+	free(a->port);
+	free(a);
+cerror0:
+	return(-1);
+}
+
+int connection_connect_poll(Connection *c) {
+	struct ConnectAttempt *a = c->attempt;
+	struct pollfd pfd[CONNECT_RACE_MAX];
+	int slot[CONNECT_RACE_MAX];
+	int npfd;
+	int winner;
+	int retval;
+	int err;
+	socklen_t errlen;
+	int yes = 1; // used for setsockopt
+	int i;
+
+	if(a == NULL)
+		return(c->type == SERVER ? 0 : -1);
+
+	if(a->resolving) {
+		retval = gai_error(&(a->req));
+		if(retval == EAI_INPROGRESS) {
+			if(elapsed_ms(&(a->started)) > c->timeout * 1000) {
+				fprintf(stderr, "connection_connect_poll(): Timed out looking up %s.\n", a->host);
+				goto cerror0;
+			}
+			return(-2);
+		}
+		a->resolving = 0;
+		if(retval != 0) {
+			fprintf(stderr, "connection_connect_poll(): getaddrinfo_a(): %s\n", gai_strerror(retval));
+			goto cerror0;
+		}
+		connect_order_addresses(a);
+		connect_start_next(a);
 	}
 
-	freeaddrinfo(result);           /* No longer needed */
+	/* see which attempts have finished */
+	npfd = 0;
+	for(i = 0; i < a->nextaddr; i++) {
+		if(a->fd[i] != -1) {
+			pfd[npfd].fd = a->fd[i];
+			pfd[npfd].events = POLLOUT;
+			slot[npfd] = i;
+			npfd++;
+		}
+	}
+	winner = -1;
+	if(npfd > 0 && poll(pfd, npfd, 0) > 0) {
+		for(i = 0; i < npfd; i++) {
+			if(pfd[i].revents == 0)
+				continue;
+			errlen = sizeof(err);
+			if(getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0) {
+				winner = slot[i];
+				break;
+			}
+			close(a->fd[slot[i]]);
+			a->fd[slot[i]] = -1;
+			connect_start_next(a); /* don't wait for the stagger when one fails */
+		}
+	}
 
-	if (rp == NULL) {               /* No address succeeded */
-		fprintf(stderr, "connection_connect(): Could not connect\n");
-		goto cerror0;
+	if(winner == -1) {
+		if(a->nextaddr < a->addrs && elapsed_ms(&(a->laststart)) >= CONNECT_STAGGER_MS)
+			connect_start_next(a);
+		for(i = 0; i < a->nextaddr; i++) {
+			if(a->fd[i] != -1)
+				break;
+		}
+		if(i == a->nextaddr && a->nextaddr == a->addrs) { /* No address succeeded */
+			fprintf(stderr, "connection_connect_poll(): Could not connect to %s\n", a->host);
+			goto cerror0;
+		}
+		if(elapsed_ms(&(a->started)) > c->timeout * 1000) {
+			fprintf(stderr, "connection_connect_poll(): Timed out connecting to %s\n", a->host);
+			goto cerror0;
+		}
+		return(-2);
 	}
 
 	// Copy socket address info in to connection.
-	c->sock = sfd;
-	memcpy(&(c->address), rp->ai_addr, sizeof(struct sockaddr));
+	c->sock = a->fd[winner];
+	a->fd[winner] = -1;
+	c->addrlen = a->addr[winner]->ai_addrlen < sizeof(struct sockaddr_storage) ? a->addr[winner]->ai_addrlen : sizeof(struct sockaddr_storage);
+	memcpy(&(c->address), a->addr[winner]->ai_addr, c->addrlen);
 
 	if (setsockopt(c->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-		perror("connection_connect(): setsockopt()");
+		perror("connection_connect_poll(): setsockopt()");
 		goto cerror1;
 	}
 
-	if(fd_nonblocking(c->sock))
-		goto cerror1;
+	c->type = SERVER;
+	if(c->hostname != NULL)
+		free(c->hostname);
+	c->hostname = malloc(strlen(a->host) + strlen(a->port) + 2);
+	if(c->hostname != NULL)
+		sprintf(c->hostname, "%s:%s", a->host, a->port);
+	c->last_message = time(NULL);
+	rtt_reset(c);
+
+	c->attempt = NULL;
+	connect_attempt_free(a); /* closes the losers */
+
+	return(0);
+
+cerror1:
+	close(c->sock);
+	c->sock = 0;
+cerror0:
+	c->attempt = NULL;
+	connect_attempt_free(a);
+	c->type = NOTCONNECTED;
+	return(-1);
+}
+
+int connection_connect(Connection *c, char *host, char *port, int timeout) {
+	struct timespec idletime;
+	int retval;
+
+	if(c == NULL) {
+		if(timeout <= 0)
+			return(-1);
+		c = connection_init(timeout);
+		if(c == NULL)
+			return(-1);
+	}
+
+	if(connection_connect_start(c, host, port, timeout) == -1)
+		return(-1);
+
+	while((retval = connection_connect_poll(c)) == -2) {
+		idletime.tv_sec = 0;
+		idletime.tv_nsec = 1000000;
+		nanosleep(&idletime, NULL);
+	}
+
+	return(retval);
+}
+
+int connection_connect_unix(Connection *c, const char *path, int timeout) {
+	struct sockaddr_un addr;
 
-	// override timeout if greater than 0
 	if(timeout > 0)
 		c->timeout = timeout;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "connection_connect_unix(): %s is too long.\n", path);
+		return(-1);
+	}
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(c->sock == -1) {
+		perror("connection_connect_unix(): socket()");
+		goto cerror0;
+	}
+	/* local, so it doesn't take long one way or the other */
+	if(connect(c->sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+		fprintf(stderr, "connection_connect_unix(): Couldn't connect to %s: %s\n", path, strerror(errno));
+		goto cerror1;
+	}
+	if(fd_nonblocking(c->sock))
+		goto cerror1;
+
+	c->type = SERVER;
+	if(c->hostname != NULL)
+		free(c->hostname);
+	c->hostname = strdup(path);
+	memset(&(c->address), 0, sizeof(struct sockaddr_storage));
+	c->address.ss_family = AF_UNIX;
+	c->addrlen = sizeof(sa_family_t);
+	c->last_message = time(NULL);
+	rtt_reset(c);
+
+	return(0);
+
+cerror1:
+	close(c->sock);
+cerror0:
+	c->sock = 0;
+	c->type = NOTCONNECTED;
+	return(-1);
+}
+
+int connection_request_shared_memory(Connection *c) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+		struct cmsghdr align;
+	} control;
+	struct pollfd pfd;
+	struct NetShm *m;
+	char frame[16];
+	char buf[MAX_COMMAND + 1];
+	int fd[3];
+	int fds, used, len, size, n;
+	int retval;
+	int i;
+
+	len = command_generate(frame, sizeof(frame), COMMANDS[CMD_SHAREMEM].name, COMMANDS[CMD_SHAREMEM].length, NULL, 0);
+	if(connection_write(c, frame, len) != len) {
+		perror("connection_request_shared_memory(): write()");
+		return(-1);
+	}
+
+	retval = -1;
+	fds = 0;
+	used = 0;
+	pfd.fd = c->sock;
+	pfd.events = POLLIN;
+	for(;;) {
+		if(poll(&pfd, 1, c->timeout * 1000) != 1) {
+			fprintf(stderr, "connection_request_shared_memory(): No answer from the server.\n");
+			goto rerror0;
+		}
+		iov.iov_base = &(buf[used]);
+		iov.iov_len = MAX_COMMAND - used;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+		if(n <= 0) {
+			if(n == -1 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			fprintf(stderr, "connection_request_shared_memory(): Server went away.\n");
+			goto rerror0;
+		}
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			for(i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++) {
+				if(fds < 3)
+					memcpy(&(fd[fds]), CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				else
+					close(*(int *)(CMSG_DATA(cmsg) + i * sizeof(int)));
+				fds++;
+			}
+		}
+		used += n;
+
+		/* anything before the answer is kept for connection_read() */
+		while(used >= 2 && (len = ntohs(*((unsigned short int *)buf))) <= used) {
+			if(len < 2 + COMMANDS[CMD_SHAREMEM].length ||
+			   memcmp(&(buf[2]), COMMANDS[CMD_SHAREMEM].name, COMMANDS[CMD_SHAREMEM].length) != 0) {
+				if(len < 2 || connection_unread(c, buf, len) == -1)
+					goto rerror0;
+				used -= len;
+				memmove(buf, &(buf[len]), used);
+				continue;
+			}
+			buf[len] = '\0';
+			size = atoi(&(buf[2 + COMMANDS[CMD_SHAREMEM].length]));
+			used -= len;
+			if(connection_unread(c, &(buf[len]), used) == -1)
+				goto rerror0;
+			if(size == 0) {
+				retval = -2;
+				goto rerror0;
+			}
+			if(size != SHM_RING_SIZE || fds != 3) {
+				fprintf(stderr, "connection_request_shared_memory(): Server sent something unexpected.\n");
+				goto rerror0;
+			}
+			m = shm_map(fd[0], 0);
+			if(m == NULL)
+				goto rerror0;
+			m->rxevent = fd[1];
+			m->txevent = fd[2];
+			m->ownrxevent = 1;
+			c->shm = m;
+			return(0);
+		}
+		if(used == MAX_COMMAND) {
+			fprintf(stderr, "connection_request_shared_memory(): Server sent something unexpected.\n");
+			goto rerror0;
+		}
+	}
 
-	c->type = SERVER;
-	if(c->hostname != NULL)
-		free(c->hostname);
-	c->hostname = malloc(strlen(host) + strlen(port) + 2);
-	memcpy(c->hostname, host, strlen(host));
-	c->hostname[strlen(host)] = ':';
-	memcpy(&(c->hostname[strlen(host) + 1]), port, strlen(port));
-	c->last_message = time(NULL);
-	c->pinged = 0;
+rerror0:
+	for(i = 0; i < fds && i < 3; i++)
+		close(fd[i]);
+	return(retval);
+}
 
-	return(0);
+void connection_wait(Connection *c, long ns) {
+	struct timespec wait;
+	struct pollfd pfd[2];
+	uint64_t value;
+
+	if(c->unread != NULL)
+		return;
+	wait.tv_sec = ns / 1000000000;
+	wait.tv_nsec = ns % 1000000000;
+	if(c->shm == NULL) {
+		pfd[0].fd = c->sock;
+		pfd[0].events = POLLIN;
+		ppoll(pfd, 1, &wait, NULL);
+		return;
+	}
 
-cerror1:
-	connection_disconnect(c);
-cerror0:
-	return(-1);
+	if(!shm_sleep(c->shm, 1)) {
+		pfd[0].fd = c->shm->rxevent;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = c->sock; /* hangups only */
+		pfd[1].events = 0;
+		if(ppoll(pfd, 2, &wait, NULL) > 0) {
+			if((pfd[0].revents & POLLIN) && read(c->shm->rxevent, &value, sizeof(value)) == -1)
+				perror("connection_wait(): read()");
+			if(pfd[1].revents & (POLLHUP | POLLERR))
+				c->shm->checked = 0; /* so the next read finds out */
+		}
+	}
+	shm_sleep(c->shm, 0);
 }
 
+static void ring_release(Connection *c);
+
 void connection_disconnect(Connection *c) {
+	if(c->attempt != NULL) {
+		connect_attempt_free(c->attempt);
+		c->attempt = NULL;
+	}
+	if(c->ring != NULL)
+		ring_release(c);
+	if(c->shm != NULL) {
+		shm_free(c->shm);
+		c->shm = NULL;
+	}
+	if(c->unread != NULL) {
+		free(c->unread);
+		c->unread = NULL;
+	}
 	/* Don't close stdin/out/err */
 	if(c->sock > 2) {
 		close(c->sock);
@@ -153,7 +1169,51 @@ void connection_disconnect(Connection *c) {
 		cmdbuffer_reset(c->buf);
 }
 
-Server *server_init(char *port, int max_users, int timeout) {
+static int server_connections_init(Server *s, int max_users, int timeout) {
+	int i;
+
+	/* allocate memory for max connections */
+	s->connection = malloc(sizeof(Connection *) * max_users);
+	if(s->connection == NULL) {
+		fprintf(stderr, "server_init(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+	for(i = 0; i < max_users; i++) {
+		s->connection[i] = connection_init(timeout);
+		if(s->connection[i] == NULL)
+			break;
+	}
+	/* if not all connections could be allocated, free what has been */
+	if(i < max_users) {
+		for(i--; i >= 0; i--)
+			connection_free(s->connection[i]);
+		free(s->connection);
+		return(-1);
+	}
+	s->slot = calloc(ACCEPT_RATE_SLOTS, sizeof(AcceptSlot));
+	if(s->slot == NULL) {
+		fprintf(stderr, "server_init(): Couldn't allocate memory.\n");
+		for(i = 0; i < max_users; i++)
+			connection_free(s->connection[i]);
+		free(s->connection);
+		return(-1);
+	}
+	s->connections = max_users;
+	s->limit = max_users;
+	s->timeout = timeout;
+	s->rate = 0;
+	s->burst = 0;
+	s->accepted = 0;
+	s->refusedfull = 0;
+	s->refusedrate = 0;
+	s->ring = NULL;
+	s->unixsock = -1;
+	s->shmevent = -1;
+
+	return(0);
+}
+
+Server *server_init(char *port, int max_users, int timeout, int backlog) {
 	Server *s;
 	struct addrinfo hints;
 	struct addrinfo *result, *rp; // first item, current item in linked list
@@ -166,6 +1226,7 @@ Server *server_init(char *port, int max_users, int timeout) {
 		fprintf(stderr, "server_init(): Couldn't allocate memory.\n");
 		goto serror0;
 	}
+	s->unixsock = -1;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
@@ -207,30 +1268,11 @@ Server *server_init(char *port, int max_users, int timeout) {
 		goto serror2;
 	}
 
-	/* allocate memory for max connections */
-	s->connection = malloc(sizeof(Connection *) * max_users);
-	if(s->connection == NULL) {
-		fprintf(stderr, "server_init(): Couldn't allocate memory.\n");
+	if(server_connections_init(s, max_users, timeout) == -1)
 		goto serror2;
-	}
-	for(i = 0; i < max_users; i++) {
-		s->connection[i] = connection_init(timeout);
-		if(s->connection[i] == NULL)
-			break;
-	}
-	/* if not all connections could be allocated, free what has been */
-	if(i < max_users - 1 && i > 0) {
-		i--;
-		for(; i >= 0; i--) {
-			connection_free(s->connection[i]);
-		}
-		goto serror3;
-	}
-	s->connections = max_users;
-	s->timeout = timeout;
 
 	/* Start listening */
-	if(listen(s->sock, 10) == -1) {
+	if(listen(s->sock, backlog > 0 ? backlog : LISTEN_BACKLOG) == -1) {
 		perror("server_init(): listen()");
 		goto serror4;
 	}
@@ -244,8 +1286,8 @@ serror4:
 	for(i = 0; i < max_users; i++) {
 		connection_free(s->connection[i]);
 	}
-serror3:
 	free(s->connection);
+	free(s->slot);
 serror2:
 	server_stop(s);
 serror1:
@@ -254,6 +1296,102 @@ serror0:
 	return(NULL);
 }
 
+Server *server_adopt(int sock, int max_users, int timeout, int backlog) {
+	Server *s;
+
+	s = malloc(sizeof(Server));
+	if(s == NULL) {
+		fprintf(stderr, "server_adopt(): Couldn't allocate memory.\n");
+		return(NULL);
+	}
+	s->sock = sock;
+	if(server_connections_init(s, max_users, timeout) == -1) {
+		free(s);
+		return(NULL);
+	}
+	if(fd_nonblocking(s->sock)) {
+		server_free(s);
+		return(NULL);
+	}
+	/* listening again on a socket that's already listening only changes the backlog */
+	if(backlog > 0 && listen(s->sock, backlog) == -1) {
+		perror("server_adopt(): listen()");
+		server_free(s);
+		return(NULL);
+	}
+
+	return(s);
+}
+
+int server_listen_unix(Server *s, const char *path) {
+	struct sockaddr_un addr;
+	int sock;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "server_listen_unix(): %s is too long.\n", path);
+		return(-1);
+	}
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		perror("server_listen_unix(): socket()");
+		return(-1);
+	}
+	unlink(path);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+		perror("server_listen_unix(): bind()");
+		close(sock);
+		return(-1);
+	}
+	if(listen(sock, LISTEN_BACKLOG) == -1) {
+		perror("server_listen_unix(): listen()");
+		close(sock);
+		unlink(path);
+		return(-1);
+	}
+	s->unixsock = sock;
+
+	return(0);
+}
+
+int server_adopt_unix(Server *s, int sock) {
+	if(fd_nonblocking(sock))
+		return(-1);
+	s->unixsock = sock;
+
+	return(0);
+}
+
+void server_limit_rate(Server *s, int rate, int burst) {
+	s->rate = rate;
+	s->burst = burst > 0 ? burst : 1;
+	memset(s->slot, 0, sizeof(AcceptSlot) * ACCEPT_RATE_SLOTS);
+}
+
+void server_limit_connections(Server *s, int limit) {
+	s->limit = limit < s->connections ? limit : s->connections;
+}
+
+void server_set_timeout(Server *s, int timeout) {
+	int i;
+
+	s->timeout = timeout;
+	for(i = 0; i < s->connections; i++)
+		s->connection[i]->timeout = timeout;
+}
+
+int server_set_backlog(Server *s, int backlog) {
+	if(listen(s->sock, backlog) == -1) {
+		perror("server_set_backlog(): listen()");
+		return(-1);
+	}
+
+	return(0);
+}
+
 void server_free(Server *s) {
 	int i;
 
@@ -262,6 +1400,11 @@ void server_free(Server *s) {
 	for(i = 0; i < s->connections; i++)
 		connection_free(s->connection[i]);
 	free(s->connection);
+	free(s->slot);
+	if(s->ring != NULL)
+		ring_free(s->ring);
+	if(s->shmevent != -1)
+		close(s->shmevent);
 	free(s);
 }
 
@@ -271,6 +1414,10 @@ void server_stop(Server *s) {
 		close(s->sock);
 		s->sock = 0;
 	}
+	if(s->unixsock != -1) {
+		close(s->unixsock);
+		s->unixsock = -1;
+	}
 }
 
 void server_close_all(Server *s) {
@@ -280,52 +1427,316 @@ void server_close_all(Server *s) {
 		connection_disconnect(s->connection[i]);
 }
 
-int connection_accept(Server *s) {
-	struct sockaddr address;
+/* IPv4 addresses as they are, IPv6 by their /64 since anyone can have a whole one */
+static uint64_t accept_address_key(const struct sockaddr_storage *address) {
+	const struct sockaddr_in6 *in6;
+	uint64_t key;
+	int i;
+
+	if(address->ss_family == AF_INET)
+		return(0xFFFF00000000ULL | ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr));
+	if(address->ss_family != AF_INET6)
+		return(1);
+
+	in6 = (const struct sockaddr_in6 *)address;
+	if(IN6_IS_ADDR_V4MAPPED(&(in6->sin6_addr))) {
+		key = 0xFFFF00000000ULL;
+		for(i = 12; i < 16; i++)
+			key |= (uint64_t)in6->sin6_addr.s6_addr[i] << ((15 - i) * 8);
+		return(key);
+	}
+	key = 0;
+	for(i = 0; i < 8; i++)
+		key = (key << 8) | in6->sin6_addr.s6_addr[i];
+
+	return(key != 0 ? key : 1);
+}
+
+/*
+ * Generic cell rate algorithm: each address has the time its next connection is
+ * due, pushed back by 1/rate for every one made, and may run up to burst ahead
+ * of it.  Addresses landing in the same slot just forget each other.
+ */
+static int accept_rate_check(Server *s, const struct sockaddr_storage *address) {
+	AcceptSlot *slot;
+	uint64_t key;
+	long now, interval;
+
+	key = accept_address_key(address);
+	slot = &(s->slot[((key * 0x9E3779B97F4A7C15ULL) >> 32) & (ACCEPT_RATE_SLOTS - 1)]);
+	now = now_us();
+	if(slot->key != key || slot->tat < now) {
+		slot->key = key;
+		slot->tat = now;
+	}
+	interval = 1000000 / s->rate;
+	if(slot->tat - now > interval * (s->burst - 1))
+		return(-1);
+	slot->tat += interval;
+
+	return(0);
+}
+
+/* Says why and hangs up, without waiting on anything or logging each one. */
+static void connection_refuse(int sock, const char *why) {
+	char data[64];
+	char buf[80];
+	int len;
+
+	len = snprintf(data, sizeof(data), "SERVER%c%s", '\0', why);
+	len = command_generate(buf, sizeof(buf), COMMANDS[CMD_MSG].name, COMMANDS[CMD_MSG].length, data, len);
+	if(len > 0)
+		send(sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(sock);
+}
+
+static int connections_open(const Server *s) {
+	int open, i;
+
+	open = 0;
+	for(i = 0; i < s->connections; i++) {
+		if(s->connection[i]->type != NOTCONNECTED)
+			open++;
+	}
+
+	return(open);
+}
+
+int connection_accept(Server *s, int *accepted, int max) {
+	struct sockaddr_storage address;
 	socklen_t addrlen;
 	int sock;
 	Connection *c;
+	int listener;
+	int n, tries;
 	int i;
 
-	addrlen = sizeof(struct sockaddr);
-	sock = accept(s->sock, &address, &addrlen);
-	if(sock < 0) {
-		if(errno == EAGAIN || errno == EWOULDBLOCK)
-			return(-2);
-		else {
-			perror("connection_accept(): accept()");
+	n = 0;
+	i = 0; /* connections are taken in order, so the search carries on from the last */
+	listener = s->sock;
+	for(tries = 0; tries < ACCEPT_BATCH && n < max; tries++) {
+		addrlen = sizeof(struct sockaddr_storage);
+		if(listener == s->sock && s->ring != NULL) {
+			/* already accepted by the multishot accept, only the address is needed */
+			sock = ring_accepted(s->ring);
+			if(sock == -1) {
+				errno = EAGAIN;
+			} else if(getpeername(sock, (struct sockaddr *)&address, &addrlen) == -1) {
+				close(sock);
+				continue;
+			}
+		} else
+			sock = accept4(listener, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(sock < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* then anyone waiting locally */
+				if(listener == s->sock && s->unixsock != -1) {
+					listener = s->unixsock;
+					continue;
+				}
+				break;
+			}
+			/* the waiting connection went away, there may be others behind it */
+			if(errno == ECONNABORTED || errno == EINTR || errno == EPROTO)
+				continue;
+			/* out of descriptors or memory, leave the rest queued until there are some */
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				perror("connection_accept(): accept4()");
+				break;
+			}
+			perror("connection_accept(): accept4()");
 			return(-1);
 		}
+
+		if(s->rate > 0 && address.ss_family != AF_UNIX && accept_rate_check(s, &address) == -1) {
+			connection_refuse(sock, ACCEPT_REFUSED_RATE);
+			s->refusedrate++;
+			continue;
+		}
+
+		for(; i < s->connections; i++) {
+			if(s->connection[i]->type == NOTCONNECTED)
+				break;
+		}
+		if(i == s->connections || (s->limit < s->connections && connections_open(s) >= s->limit)) {
+			connection_refuse(sock, ACCEPT_REFUSED_FULL);
+			s->refusedfull++;
+			continue;
+		}
+
+		c = s->connection[i];
+		c->sock = sock;
+		memset(&(c->address), 0, sizeof(struct sockaddr_storage));
+		memcpy(&(c->address), &address, addrlen < sizeof(struct sockaddr_storage) ? addrlen : sizeof(struct sockaddr_storage));
+		c->address.ss_family = address.ss_family; /* unnamed Unix sockets have no more than that */
+		c->addrlen = addrlen < sizeof(sa_family_t) ? sizeof(sa_family_t) : addrlen;
+		c->type = CLIENT;
+		c->timeout = s->timeout;
+		c->last_message = time(NULL);
+		rtt_reset(c);
+
+		s->accepted++;
+		accepted[n] = i;
+		n++;
 	}
 
-	for(i = 0; i < s->connections; i++) {
-		if(s->connection[i]->type == NOTCONNECTED) {
-			c = s->connection[i];
-			break;
+	return(n);
+}
+
+/* Sends SHAREMEM with the ring size, or 0 for no, along with any descriptors. */
+static int shm_answer(Connection *c, int size, const int *fd, int fds) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+		struct cmsghdr align;
+	} control;
+	char data[16];
+	char frame[32];
+	int len;
+
+	len = snprintf(data, sizeof(data), "%i", size);
+	len = command_generate(frame, sizeof(frame), COMMANDS[CMD_SHAREMEM].name, COMMANDS[CMD_SHAREMEM].length, data, len);
+	if(len == -1)
+		return(-1);
+	if(fds == 0)
+		return(connection_write(c, frame, len) == len ? 0 : -1);
+
+	iov.iov_base = frame;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds);
+	memcpy(CMSG_DATA(cmsg), fd, sizeof(int) * fds);
+	if(sendmsg(c->sock, &msg, MSG_NOSIGNAL) != len) {
+		perror("shm_answer(): sendmsg()");
+		return(-1);
+	}
+
+	return(0);
+}
+
+int connection_share_memory(Server *s, Connection *c) {
+	struct NetShm *m;
+	int fd[3];
+	int memfd, event;
+
+	if(c->address.ss_family != AF_UNIX || c->shm != NULL)
+		goto merror0;
+	if(s->shmevent == -1) {
+		s->shmevent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(s->shmevent == -1) {
+			perror("connection_share_memory(): eventfd()");
+			goto merror0;
 		}
 	}
 
-	if(i == s->connections) {
-		fprintf(stderr, "connection_accept(): New connection from %s, but max connections reached (%i).\n",
-		        inet_ntoa(((struct sockaddr_in *)&(address))->sin_addr), s->connections);
-		close(sock);
-		return(-3);
+	memfd = memfd_create("shiritori", MFD_CLOEXEC);
+	if(memfd == -1) {
+		perror("connection_share_memory(): memfd_create()");
+		goto merror0;
+	}
+	if(ftruncate(memfd, SHM_MAP_SIZE) == -1) {
+		perror("connection_share_memory(): ftruncate()");
+		goto merror1;
+	}
+	event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(event == -1) {
+		perror("connection_share_memory(): eventfd()");
+		goto merror1;
+	}
+	m = shm_map(memfd, 1);
+	if(m == NULL)
+		goto merror2;
+	m->rxevent = s->shmevent;
+	m->txevent = event;
+
+	/* everything sent the old way has to be there before the answer */
+	if(c->ring != NULL && ring_flush(s, c) == -1) {
+		fprintf(stderr, "connection_share_memory(): Couldn't finish sending.\n");
+		shm_free(m);
+		return(-1);
 	}
+	fd[0] = memfd;
+	fd[1] = event; /* the peer waits on this */
+	fd[2] = s->shmevent; /* and wakes the server with this */
+	if(shm_answer(c, SHM_RING_SIZE, fd, 3) == -1) {
+		shm_free(m);
+		return(-1);
+	}
+	c->shm = m;
 
-	c->sock = sock;
-	memcpy(&(c->address), &address, addrlen);
-	c->type = CLIENT;
-	c->timeout = s->timeout;
-	c->last_message = time(NULL);
-	c->pinged = 0;
+	return(0);
 
-	if(fd_nonblocking(c->sock)) {
-		fprintf(stderr, "connection_accept(): Couldn't make socket nonblocking.\n");
-		connection_disconnect(c);
+merror2:
+	close(event);
+merror1:
+	close(memfd);
+merror0:
+	if(shm_answer(c, 0, NULL, 0) == -1)
+		return(-1);
+	return(-2);
+}
+
+int connection_adopt_shared_memory(Server *s, Connection *c, int memfd, int event) {
+	struct NetShm *m;
+
+	m = shm_map(memfd, 1);
+	if(m == NULL)
+		return(-1);
+	m->rxevent = s->shmevent;
+	m->txevent = event;
+	c->shm = m;
+
+	return(0);
+}
+
+int connection_shared_memory(const Connection *c, int *memfd, int *event) {
+	if(c->shm == NULL)
 		return(-1);
+	*memfd = c->shm->memfd;
+	*event = c->shm->txevent;
+
+	return(0);
+}
+
+void server_wait(Server *s, long ns) {
+	struct timespec wait;
+	struct pollfd pfd;
+	uint64_t value;
+	int ready;
+	int i;
+
+	wait.tv_sec = ns / 1000000000;
+	wait.tv_nsec = ns % 1000000000;
+	if(s->shmevent == -1) {
+		nanosleep(&wait, NULL);
+		return;
 	}
 
-	return(i);
+	/* local peers wake the server when they write, unless something's already there */
+	ready = 0;
+	for(i = 0; i < s->connections; i++) {
+		if(s->connection[i]->shm != NULL && shm_sleep(s->connection[i]->shm, 1))
+			ready = 1;
+	}
+	if(!ready) {
+		pfd.fd = s->shmevent;
+		pfd.events = POLLIN;
+		if(ppoll(&pfd, 1, &wait, NULL) == 1 && read(s->shmevent, &value, sizeof(value)) == -1)
+			perror("server_wait(): read()");
+	}
+	for(i = 0; i < s->connections; i++) {
+		if(s->connection[i]->shm != NULL)
+			shm_sleep(s->connection[i]->shm, 0);
+	}
 }
 
 int fd_nonblocking(int fd) {
@@ -348,10 +1759,35 @@ int fd_nonblocking(int fd) {
 int connection_read(Connection *c, char *buf, int bytes) {
 	int retval;
 
-	retval = read(c->sock, buf, bytes);
+	if(c->unread != NULL) {
+		retval = c->unreadlen - c->unreadpos < bytes ? c->unreadlen - c->unreadpos : bytes;
+		memcpy(buf, &(c->unread[c->unreadpos]), retval);
+		c->unreadpos += retval;
+		if(c->unreadpos == c->unreadlen) {
+			free(c->unread);
+			c->unread = NULL;
+		}
+	} else if(c->shm != NULL) {
+		retval = shm_read(c->shm, buf, bytes);
+		if(retval == 0 && bytes > 0) {
+			if(!shm_hungup(c))
+				return(0);
+			/* whatever was written before hanging up still counts */
+			retval = shm_read(c->shm, buf, bytes);
+		}
+	} else if(c->ring != NULL) {
+		retval = ring_read(c, buf, bytes);
+		if(retval == 0 && c->ring->slot[c->slot].rxend == 0)
+			return(0);
+	} else
+		retval = read(c->sock, buf, bytes);
 
 	if(retval == 0) {
-		return(0);
+		if(bytes == 0)
+			return(0);
+		/* end of file, the other end closed the connection */
+		connection_disconnect(c);
+		return(-1);
 	} else if(retval > 0) {
 		c->last_message = time(NULL);
 		c->pinged = 0;
@@ -367,9 +1803,126 @@ int connection_read(Connection *c, char *buf, int bytes) {
 }
 
 int connection_write(Connection *c, const char *buf, const int bytes) {
+	if(c->shm != NULL)
+		return(shm_write(c->shm, buf, bytes));
+	if(c->ring != NULL)
+		return(ring_write(c, buf, bytes));
+
 	return(write(c->sock, buf, bytes));
 }
 
+int connection_writev(Connection *c, const struct iovec *iov, int iovcnt) {
+	int written;
+	int i;
+
+	if(c->ring == NULL && c->shm == NULL)
+		return(writev(c->sock, iov, iovcnt));
+
+	written = 0;
+	for(i = 0; i < iovcnt; i++) {
+		if(connection_write(c, iov[i].iov_base, iov[i].iov_len) == -1)
+			return(written > 0 ? written : -1);
+		written += iov[i].iov_len;
+	}
+
+	return(written);
+}
+
+int connection_unread(Connection *c, const char *data, int len) {
+	char *unread;
+	int have;
+
+	if(len <= 0)
+		return(0);
+	have = c->unread != NULL ? c->unreadlen - c->unreadpos : 0;
+	unread = malloc(have + len);
+	if(unread == NULL) {
+		fprintf(stderr, "connection_unread(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+	if(have > 0)
+		memcpy(unread, &(c->unread[c->unreadpos]), have);
+	memcpy(&(unread[have]), data, len);
+	free(c->unread);
+	c->unread = unread;
+	c->unreadlen = have + len;
+	c->unreadpos = 0;
+
+	return(0);
+}
+
+int connection_pending(const Connection *c, const char **data) {
+	if(c->unread == NULL) {
+		*data = NULL;
+		return(0);
+	}
+	*data = &(c->unread[c->unreadpos]);
+
+	return(c->unreadlen - c->unreadpos);
+}
+
+const char *connection_address(const Connection *c, char *buf, int len) {
+	const void *addr;
+
+	if(c->address.ss_family == AF_INET)
+		addr = &(((const struct sockaddr_in *)&(c->address))->sin_addr);
+	else if(c->address.ss_family == AF_INET6)
+		addr = &(((const struct sockaddr_in6 *)&(c->address))->sin6_addr);
+	else
+		addr = NULL;
+	if(addr == NULL || inet_ntop(c->address.ss_family, addr, buf, len) == NULL)
+		snprintf(buf, len, "%s", c->address.ss_family == AF_UNIX ? "local" : "unknown");
+
+	return(buf);
+}
+
+long connection_rto(const Connection *c) {
+	long rto;
+
+	if(c->rttsamples == 0)
+		rto = RTO_INITIAL_MS;
+	else
+		rto = (c->srtt + 4 * c->rttvar) / 1000;
+
+	if(rto < RTO_MIN_MS)
+		rto = RTO_MIN_MS;
+	if(rto > c->timeout * 1000)
+		rto = c->timeout * 1000;
+
+	return(rto);
+}
+
+long connection_latency_allowance(const Connection *c) {
+	long allowance;
+
+	if(c->rttsamples == 0)
+		return(0);
+
+	allowance = (c->srtt / 2 + c->rttvar) / 1000;
+	if(allowance > LATENCY_ALLOWANCE_MAX_MS)
+		allowance = LATENCY_ALLOWANCE_MAX_MS;
+
+	return(allowance);
+}
+
+int connection_liveness_check(Connection *c) {
+	long now;
+
+	now = now_us();
+	if(c->pingsent != 0) {
+		if(now - c->pingsent <= connection_rto(c) * 1000)
+			return(0);
+		/* no PONG, but if something else came since then it's still there */
+		if(c->pinged)
+			return(-2);
+		return(1);
+	}
+	if(now - c->lastping >= PING_INTERVAL_MS * 1000)
+		return(1);
+
+	return(0);
+}
+
 int connection_timeout_check(Connection *c, int timeout) {
 	if(timeout != 0) {
 		if(time(NULL) - c->last_message > timeout) {
@@ -391,7 +1944,8 @@ CMDBuffer *cmdbuffer_init(int bsize) {
 	if(b == NULL)
 		goto berror0;
 
-	b->cmd = malloc(bsize);
+	/* and a byte more, so a full frame's data can still be terminated */
+	b->cmd = malloc(bsize + 1);
 	if(b->cmd == NULL)
 		goto berror1;
 
@@ -478,23 +2032,29 @@ int connection_next_command(Connection *c) {
 }
 
 int connection_ping(Connection *c) {
+	char stamp[24];
+	long now;
 	int len;
 
-	len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_PING].name, COMMANDS[CMD_PING].length, NULL, 0);
+	now = now_us();
+	len = snprintf(stamp, sizeof(stamp), "%li", now);
+	len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_PING].name, COMMANDS[CMD_PING].length, stamp, len);
 	if(len == -1)
 		return(-1);
 	if(connection_write(c, outbuf, len) == -1)
 		return(-1);
 
 	c->pinged = 1;
+	c->pingsent = now;
+	c->lastping = now;
 
 	return(0);
 }
 
-int connection_pong(Connection *c) {
+int connection_pong(Connection *c, const char *data, int datalen) {
 	int len;
 
-	len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_PONG].name, COMMANDS[CMD_PONG].length, NULL, 0);
+	len = command_generate(outbuf, MAX_COMMAND, COMMANDS[CMD_PONG].name, COMMANDS[CMD_PONG].length, data, datalen);
 	if(len == -1)
 		return(-1);
 	if(connection_write(c, outbuf, len) == -1)
@@ -503,6 +2063,36 @@ int connection_pong(Connection *c) {
 	return(0);
 }
 
+int connection_pong_received(Connection *c, const char *data, int datalen) {
+	char stamp[24];
+	long sent, rtt, err;
+	char *end;
+
+	if(c->pingsent == 0 || datalen <= 0 || datalen >= (int)sizeof(stamp))
+		return(-2);
+	memcpy(stamp, data, datalen);
+	stamp[datalen] = '\0';
+	sent = strtol(stamp, &end, 10);
+	/* only the outstanding one counts, an old PONG arriving late would skew it */
+	if(*end != '\0' || sent != c->pingsent)
+		return(-2);
+	c->pingsent = 0;
+
+	rtt = now_us() - sent;
+	c->rtt = rtt;
+	if(c->rttsamples == 0) {
+		c->srtt = rtt;
+		c->rttvar = rtt / 2;
+	} else { /* RFC 6298 gains, 1/4 and 1/8 */
+		err = rtt - c->srtt;
+		c->rttvar += ((err < 0 ? -err : err) - c->rttvar) / 4;
+		c->srtt += err / 8;
+	}
+	c->rttsamples++;
+
+	return(0);
+}
+
 int connection_message(Connection *c, char *msg) {
 	int len;
 
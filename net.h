@@ -1,12 +1,18 @@
 #ifndef __NET_H
 #define __NET_H
 
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 typedef enum {
-	NOTCONNECTED, SERVER, CLIENT
+	NOTCONNECTED, SERVER, CLIENT, CONNECTING
 } connection_type;
 
+struct ConnectAttempt;
+struct NetRing;
+struct NetShm;
+
 typedef struct {
 	char *cmd;
 	int cmdsize;
@@ -19,23 +25,78 @@ typedef struct {
 
 	connection_type type;
 	char *hostname;
-	struct sockaddr address;
+	struct sockaddr_storage address;
+	socklen_t addrlen; /* of address */
 
 	time_t timeout;
 	time_t last_message;
-	int pinged;
+	int pinged; /* cleared by anything received */
+
+	/* round trip time, measured by timestamps sent in PING and echoed in PONG, microseconds */
+	long pingsent; /* timestamp of the outstanding PING, 0 if none */
+	long lastping;
+	long rtt; /* last sample */
+	long srtt; /* smoothed */
+	long rttvar;
+	int rttsamples;
 
 	CMDBuffer *buf;
+	struct ConnectAttempt *attempt; /* state of a connection_connect_start() in progress */
+
+	/* data received but not read yet, read before anything from the socket */
+	char *unread;
+	int unreadlen;
+	int unreadpos;
+
+	struct NetRing *ring; /* the server's io_uring, if it has one */
+	int slot; /* index in the server */
+
+	struct NetShm *shm; /* rings shared with a local peer instead of the socket, NULL if none */
 } Connection;
 
+/* how soon the next connection from an address is allowed, for rate limiting */
+typedef struct {
+	uint64_t key; /* the address, 0 if unused */
+	long tat; /* theoretical arrival time, microseconds */
+} AcceptSlot;
+
 typedef struct {
 	int sock;
 	int connections;
 	Connection **connection;
+	int limit; /* most open at once, connections unless lowered */
 
 	time_t timeout;
+
+	/* connections allowed from each address, 0 for no limit */
+	int rate; /* a second */
+	int burst; /* at once */
+	AcceptSlot *slot;
+
+	long accepted;
+	long refusedfull;
+	long refusedrate;
+
+	struct NetRing *ring; /* NULL for plain nonblocking sockets */
+
+	int unixsock; /* listening for local connections, -1 if not */
+	int shmevent; /* eventfd local peers with shared memory wake the server with, -1 until there are any */
 } Server;
 
+/*
+ * One direction of the shared memory between a local peer and the server: a
+ * byte ring with a single writer and a single reader, carrying frames exactly
+ * as the socket would.  head and tail only ever grow, wrapping at 2^32, and
+ * are on separate cache lines so each side only writes its own.
+ */
+typedef struct {
+	uint32_t head; /* bytes ever written, only the writer changes it */
+	char pad0[60];
+	uint32_t tail; /* bytes ever read, only the reader changes it */
+	uint32_t sleeping; /* set by the reader while it's waiting on its eventfd */
+	char pad1[56];
+} ShmRingHeader;
+
 typedef struct {
 	char name[8];
 	unsigned short int length;
@@ -46,9 +107,48 @@ extern const Command COMMANDS[];
 #define		CMD_PING		(1)
 #define		CMD_PONG		(2)
 #define		CMD_USER		(3)
-#define		CMD_ERROR		(4)
-#define COMMANDS_MAX 		(5)
-#define COMMANDS_MAX_LEN	(5)
+#define		CMD_JOIN		(4)
+#define		CMD_NODE		(5)
+#define		CMD_HERE		(6)
+#define		CMD_GONE		(7)
+#define		CMD_WAIT		(8)
+#define		CMD_ROOM		(9)
+#define		CMD_RMSG		(10)
+#define		CMD_LEFT		(11)
+#define		CMD_PLAY		(12)
+#define		CMD_ERROR		(13)
+#define		CMD_TOKEN		(14)
+#define		CMD_ROUTE		(15)
+#define		CMD_RESUME		(16)
+#define		CMD_COMPLETE	(17)
+#define		CMD_SHAREMEM	(18)
+#define		CMD_RANKINGS	(19)
+#define COMMANDS_MAX 		(20)
+#define COMMANDS_MAX_LEN	(8)
+
+#define CONNECT_STAGGER_MS	(250)
+#define CONNECT_RACE_MAX	(8)
+
+#define LISTEN_BACKLOG		(128) /* when none is given */
+#define ACCEPT_BATCH		(64) /* most connections taken from the queue at once */
+#define ACCEPT_RATE_SLOTS	(1024) /* addresses remembered for rate limiting, a power of 2 */
+#define ACCEPT_REFUSED_FULL	"Server full, try again later."
+#define ACCEPT_REFUSED_RATE	"Too many connections, try again later."
+
+#define NETRING_ENTRIES		(256) /* io_uring submission queue */
+#define NETRING_BUFFERS		(1024) /* provided buffers receives are put in, a power of 2 */
+#define NETRING_BUFFER_SIZE	(2048)
+#define NETRING_SEND_SIZE	(65536) /* bytes each connection may have waiting to be sent */
+#define NETRING_ACCEPT_QUEUE	(256) /* connections accepted but not taken by connection_accept() yet */
+#define NETRING_STOP_MS		(1000) /* longest server_uring_stop() waits for things to finish */
+
+#define SHM_RING_SIZE		(65536) /* bytes each way, a power of 2 */
+#define SHM_CHECK_MS		(250) /* how often a shared memory connection's socket is checked for hangups */
+
+#define PING_INTERVAL_MS	(5000)
+#define RTO_INITIAL_MS		(3000) /* how long to wait for a PONG before there are any samples */
+#define RTO_MIN_MS			(2000)
+#define LATENCY_ALLOWANCE_MAX_MS	(2000)
 
 /*
  * Initializes a new connection structure.
@@ -75,7 +175,8 @@ void connection_add_buffer(Connection *c, CMDBuffer *b);
 void connection_free(Connection *c);
 
 /*
- * Attempts to initiate a connection to a server at host and port.  Optional timeout override.
+ * Connects to a server at host and port, blocking until connected or failed.
+ * Same as connection_connect_start() and connection_connect_poll() until done.
  *
  * c		Connection to use for connection, if c points to NULL, allocate a new Connection; timeout must be set.
  * host		Hostname or IP.
@@ -86,6 +187,62 @@ void connection_free(Connection *c);
  */
 int connection_connect(Connection *c, char *host, char *port, int timeout);
 
+/*
+ * Starts connecting to a server at host and port without blocking.  The name is
+ * resolved in the background, then the addresses found are raced against each
+ * other, alternating IPv6 and IPv4, starting another attempt every
+ * CONNECT_STAGGER_MS or as soon as one fails.  The first to connect wins.
+ * Finish with connection_connect_poll() from the main loop.
+ *
+ * c		Connection to use for connection.
+ * host		Hostname or IP.
+ * port		Port or service to connect to.
+ * timeout	If greater than 0, change timeout in seconds.  Also limits how long connecting may take.
+ *
+ * returns	0 if started, -1 on error.
+ */
+int connection_connect_start(Connection *c, const char *host, const char *port, int timeout);
+
+/*
+ * Continues a connection started with connection_connect_start().
+ *
+ * c		Connection being connected.
+ *
+ * returns	0 once connected, -1 on failure, -2 if still connecting.
+ */
+int connection_connect_poll(Connection *c);
+
+/*
+ * Connects to a server listening on a Unix socket, blocking until connected or
+ * failed.
+ *
+ * c		Connection to use for connection; timeout must be set.
+ * path		Socket path.
+ * timeout	If greater than 0, change timeout in seconds.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int connection_connect_unix(Connection *c, const char *path, int timeout);
+
+/*
+ * Asks a server connected to with connection_connect_unix() to carry on over
+ * shared memory, waiting for the answer.  Frames the server sent before it are
+ * kept to be read first.  Nothing else should be sent until this returns.
+ *
+ * c		Connection to the server.
+ *
+ * returns	0 if everything now goes through shared memory, -2 if the server said no, -1 on error.
+ */
+int connection_request_shared_memory(Connection *c);
+
+/*
+ * Waits until a connection may have something to read, or for a time.
+ *
+ * c		Connection.
+ * ns		Longest to wait.
+ */
+void connection_wait(Connection *c, long ns);
+
 /*
  * Disconnects a currently connected socket or does nothing if it's already disconnected.
  *
@@ -98,10 +255,164 @@ void connection_disconnect(Connection *c);
  *
  * port			Port on which to listen.
  * max_users	Maximum number of connections.
+ * backlog		Connections the kernel may queue before they're accepted, LISTEN_BACKLOG if 0.
+ *
+ * returns		New Server structure or NULL on error.
+ */
+Server *server_init(char *port, int max_users, int timeout, int backlog);
+
+/*
+ * Initializes a server around a socket that's already listening, like one
+ * handed over by another process.  Its connections start out unconnected.
+ *
+ * sock			Listening socket, now owned by the Server.
+ * max_users	Maximum number of connections.
+ * backlog		New length for the queue of connections, unchanged if 0.
  *
  * returns		New Server structure or NULL on error.
  */
-Server *server_init(char *port, int max_users, int timeout);
+Server *server_adopt(int sock, int max_users, int timeout, int backlog);
+
+/*
+ * Also listens for connections on a Unix socket, for bots and tools running on
+ * the same host.  Anything left at the path is removed first.  Local
+ * connections aren't rate limited, and may ask to go over shared memory.
+ *
+ * s		Server.
+ * path		Socket path.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int server_listen_unix(Server *s, const char *path);
+
+/*
+ * Takes a Unix socket that's already listening, like one handed over by
+ * another process, to accept local connections from.
+ *
+ * s		Server.
+ * sock		Listening socket, now owned by the Server.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int server_adopt_unix(Server *s, int sock);
+
+/*
+ * Answers a local connection's SHAREMEM: sets up a pair of rings in a memfd
+ * with an eventfd for each side, sends them over the Unix socket and carries
+ * on over them.  Anything still being sent on the socket goes first.
+ * Connections which aren't local are told no.
+ *
+ * s		Server.
+ * c		Connection which asked.
+ *
+ * returns	0 if the connection now uses shared memory, -2 if it was told no, -1 on error.
+ */
+int connection_share_memory(Server *s, Connection *c);
+
+/*
+ * Puts shared memory from connection_share_memory() back on a connection, as
+ * handed over by another process.
+ *
+ * s		Server, which should have its shmevent.
+ * c		Connection.
+ * memfd	The rings, now owned by the connection.
+ * event	eventfd the peer waits on, now owned by the connection.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int connection_adopt_shared_memory(Server *s, Connection *c, int memfd, int event);
+
+/*
+ * Gets what's needed to hand a connection's shared memory to another process.
+ *
+ * c		Connection.
+ * memfd	Set to the memfd with the rings.
+ * event	Set to the eventfd the peer waits on.
+ *
+ * returns	0 if the connection uses shared memory, -1 if not.
+ */
+int connection_shared_memory(const Connection *c, int *memfd, int *event);
+
+/*
+ * Waits until a connection may have something to read, or for a time: sleeps,
+ * or with local peers on shared memory, until one of them writes.
+ *
+ * s		Server.
+ * ns		Longest to wait.
+ */
+void server_wait(Server *s, long ns);
+
+/*
+ * Limits how often each address may connect.  Connections beyond that are sent
+ * ACCEPT_REFUSED_RATE and closed.  IPv6 addresses are limited by their /64.
+ *
+ * s		Server to limit.
+ * rate		Connections a second, 0 for no limit.
+ * burst	Connections which may be made at once before the rate applies.
+ */
+void server_limit_rate(Server *s, int rate, int burst);
+
+/*
+ * Limits how many connections may be open at once, within the number the
+ * Server was made with.  Anyone connecting beyond that is sent
+ * ACCEPT_REFUSED_FULL and closed, anyone already connected stays.
+ *
+ * s		Server to limit.
+ * limit	Most connections, no more than s->connections.
+ */
+void server_limit_connections(Server *s, int limit);
+
+/*
+ * Changes how long connections may go without sending anything before
+ * they're dropped, for everyone already connected as well.
+ *
+ * s		Server.
+ * timeout	Seconds.
+ */
+void server_set_timeout(Server *s, int timeout);
+
+/*
+ * Changes how many connections the kernel queues before they're accepted.
+ *
+ * s		Server.
+ * backlog	New length for the queue.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int server_set_backlog(Server *s, int backlog);
+
+/*
+ * Switches a server over to io_uring.  A multishot accept stays armed on the
+ * listening socket, each connection has a multishot receive in to a ring of
+ * provided buffers, and writes are kept until server_io() sends them all in
+ * one submission, so connection_accept(), connection_read() and
+ * connection_write() don't make system calls of their own.
+ *
+ * s		Server to switch over.
+ *
+ * returns	0 on success, -1 if io_uring isn't available and the server carries on as it was.
+ */
+int server_uring_start(Server *s);
+
+/*
+ * Switches a server back from io_uring to plain nonblocking sockets, waiting for
+ * anything being sent to go and keeping anything received to be read.  Does
+ * nothing if the server isn't using io_uring.
+ *
+ * s		Server to switch back.
+ */
+void server_uring_stop(Server *s);
+
+/*
+ * Does a server's I/O for a pass of the main loop: submits everything queued
+ * since the last call, then collects what's finished.  Does nothing for plain
+ * sockets.
+ *
+ * s		Server.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int server_io(Server *s);
 
 /*
  * Close server and all connections, then free all resources associated with a server.
@@ -125,13 +436,18 @@ void server_stop(Server *s);
 void server_close_all(Server *s);
 
 /*
- * Check for and accept a connection on an open server.
+ * Accepts connections waiting on an open server, up to ACCEPT_BATCH at a time.
+ * Any which can't be taken, because every connection is in use or the address
+ * is connecting too often, are sent a message saying so and closed straight
+ * away, and counted in the Server.
  *
- * s		Server to accept a connection on.
+ * s		Server to accept connections on.
+ * accepted	Filled with the number of each new connection (index in to connections[]).
+ * max		Room in accepted.
  *
- * returns	The number of the connection (index in to connections[]) on new connection, -1 on error, -2 on no new connection, -3 on max connections reached.
+ * returns	The number of new connections, -1 on error.
  */
-int connection_accept(Server *s);
+int connection_accept(Server *s, int *accepted, int max);
 
 /*
  * Makes a file descriptor nonblocking.
@@ -143,7 +459,7 @@ int connection_accept(Server *s);
 int fd_nonblocking(int fd);
 
 /*
- * Read data from a socket.  On error, connection is closed.
+ * Read data from a socket.  On error or if the other end closed it, connection is closed.
  *
  * c		Connection to read data from.
  * buf		buffer to write data in to.
@@ -154,7 +470,52 @@ int fd_nonblocking(int fd);
 int connection_read(Connection *c, char *buf, int bytes);
 
 /*
- * Write data to a socket. (Wraps write)
+ * Write data from several buffers to a socket in one go. (Wraps writev)
+ *
+ * c		Connection to write data to.
+ * iov		Buffers.
+ * iovcnt	Number of buffers.
+ *
+ * returns	amount of bytes written or -1 on error.
+ */
+int connection_writev(Connection *c, const struct iovec *iov, int iovcnt);
+
+/*
+ * Gives a connection data to read before anything more from its socket, like
+ * data received by another process.
+ *
+ * c		Connection.
+ * data		Data.
+ * len		Length of data.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int connection_unread(Connection *c, const char *data, int len);
+
+/*
+ * Gets what a connection has been given to read by connection_unread() or kept
+ * from server_uring_stop() that hasn't been read yet.
+ *
+ * c		Connection.
+ * data		Set to the data, not copied.
+ *
+ * returns	Length of data.
+ */
+int connection_pending(const Connection *c, const char **data);
+
+/*
+ * Writes a connection's peer address as text, IPv4 or IPv6, for logging.
+ *
+ * c		Connection.
+ * buf		Written here, terminated.
+ * len		Size of buf, INET6_ADDRSTRLEN is always enough.
+ *
+ * returns	buf
+ */
+const char *connection_address(const Connection *c, char *buf, int len);
+
+/*
+ * Write data to a socket. (Wraps write, or queues it for server_io() with io_uring)
  *
  * c		Connection to write data to.
  * buf		buffer to read data from.
@@ -164,6 +525,39 @@ int connection_read(Connection *c, char *buf, int bytes);
  */
 int connection_write(Connection *c, const char *buf, const int bytes);
 
+/*
+ * Checks whether a connection should be pinged or has stopped answering.  A
+ * PING is due every PING_INTERVAL_MS, and the connection is considered dead if
+ * nothing at all has come back within connection_rto() of one.
+ *
+ * c		Connection to check.
+ *
+ * returns	0 if nothing needs doing, 1 if a PING is due, -2 if the connection is dead.
+ */
+int connection_liveness_check(Connection *c);
+
+/*
+ * How long to wait for an answer to a PING, from the smoothed round trip time
+ * and its variance like TCP's retransmission timeout, limited to RTO_MIN_MS
+ * and the connection's timeout.
+ *
+ * c		Connection.
+ *
+ * returns	Timeout in milliseconds.
+ */
+long connection_rto(const Connection *c);
+
+/*
+ * How much longer a turn clock should give a player to make up for the time
+ * their moves spend on the wire: half the round trip plus its variance, at most
+ * LATENCY_ALLOWANCE_MAX_MS.
+ *
+ * c		Connection.
+ *
+ * returns	Allowance in milliseconds, 0 if nothing has been measured.
+ */
+long connection_latency_allowance(const Connection *c);
+
 /*
  * Checks a connection for timeout and disconnects it if so.
  *
@@ -175,7 +569,9 @@ int connection_write(Connection *c, const char *buf, const int bytes);
 int connection_timeout_check(Connection *c, int timeout);
 
 /*
- * Initializes a new CMDBuffer.
+ * Initializes a new CMDBuffer.  There's always room for one byte past the
+ * largest command, so the data of any command read in to it can be terminated
+ * in place.
  *
  * bsize	Size of command buffer.
  */
@@ -199,7 +595,8 @@ void cmdbuffer_free(CMDBuffer *b);
 int connection_next_command(Connection *c);
 
 /*
- * Ping a Connection.
+ * Ping a Connection.  The PING carries a timestamp which should be echoed back in
+ * the PONG.
  *
  * c		Connection to ping.
  *
@@ -208,13 +605,27 @@ int connection_next_command(Connection *c);
 int connection_ping(Connection *c);
 
 /*
- * Pong a Connection.
+ * Pong a Connection, echoing the data from its PING.
  *
  * c		Connection to pong.
+ * data		Data from the PING.
+ * datalen	Length of data.
  *
  * returns	0 on success, -1 on error.
  */
-int connection_pong(Connection *c);
+int connection_pong(Connection *c, const char *data, int datalen);
+
+/*
+ * Handles a PONG, updating the round trip time if it answers the outstanding
+ * PING.
+ *
+ * c		Connection PONG came from.
+ * data		Data from the PONG.
+ * datalen	Length of data.
+ *
+ * returns	0 if a round trip time was measured, -2 if not.
+ */
+int connection_pong_received(Connection *c, const char *data, int datalen);
 
 /*
  * Send a message to a connection.
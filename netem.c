@@ -0,0 +1,496 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include "util.h"
+
+#define NETEM_SEGMENT		(1448) /* most bytes held as one piece, about what fits in a TCP segment */
+#define NETEM_SEGMENTS		(256) /* pieces held each way before reading stops */
+#define NETEM_LINKS			(1024) /* most connections at once */
+#define NETEM_POLL_MS		(100) /* longest to wait with nothing due */
+#define DEFAULT_RTO_MS		(200) /* how long a lost segment takes to be sent again */
+
+/* A piece of what was read, held until it's due and then written by itself. */
+typedef struct {
+	int64_t due; /* us */
+	int len;
+	int off; /* written so far */
+	char data[NETEM_SEGMENT];
+} Segment;
+
+/* One direction of a connection, read from in and written to out. */
+typedef struct {
+	int in;
+	int out;
+	Segment *seg; /* ring of NETEM_SEGMENTS */
+	int head;
+	int count;
+	int64_t last; /* us, when the newest piece is due, they all go out in order */
+	int eof; /* in has been closed */
+	int shut; /* and that's been passed on to out */
+
+	long bytes;
+	long segments;
+	long lost;
+	long short_writes;
+	int maxcount;
+} Pipe;
+
+typedef struct {
+	int client;
+	int server;
+	int connecting;
+	Pipe up; /* client to server */
+	Pipe down; /* server to client */
+} Link;
+
+int running;
+void signalhandler(int signum);
+
+static int64_t delay; /* us */
+static int64_t jitter; /* us */
+static long bandwidth; /* bytes a second each way, 0 for any */
+static int split; /* most bytes read in to a piece, 0 for as much as there is */
+static int loss; /* pieces in a thousand lost */
+static int64_t rto; /* us */
+static int64_t stallevery; /* us */
+static int64_t stall; /* us */
+static int sockbuf; /* bytes, 0 to leave it to the kernel */
+static uint64_t rng;
+
+static Link *links_open[NETEM_LINKS];
+static long links;
+static Pipe totalup, totaldown;
+
+static int64_t random_below(int64_t n) {
+	return(n > 0 ? (int64_t)(splitmix64(&rng) % n) : 0);
+}
+
+static void set_socket_options(int fd) {
+	int one = 1;
+
+	/* each piece goes out as it's written, so the other end sees the splits */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+	if(sockbuf > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(int));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(int));
+	}
+}
+
+static int pipe_init(Pipe *p, int in, int out) {
+	memset(p, 0, sizeof(Pipe));
+	p->seg = malloc(sizeof(Segment) * NETEM_SEGMENTS);
+	if(p->seg == NULL)
+		return(-1);
+	p->in = in;
+	p->out = out;
+
+	return(0);
+}
+
+/* When a piece read now can go out: after the delay, any retransmission and stall, and everything before it. */
+static int64_t pipe_due(Pipe *p, int len, int64_t now) {
+	int64_t due, phase;
+
+	due = now + delay + random_below(jitter + 1);
+	if(random_below(1000) < loss) {
+		due += rto;
+		p->lost++;
+	}
+	if(stallevery > 0) {
+		phase = due % stallevery;
+		if(phase < stall)
+			due += stall - phase;
+	}
+	if(bandwidth > 0 && due < p->last + (int64_t)len * 1000000 / bandwidth)
+		due = p->last + (int64_t)len * 1000000 / bandwidth;
+	if(due < p->last)
+		due = p->last;
+	p->last = due;
+
+	return(due);
+}
+
+/*
+ * Reads whatever's waiting, in pieces of up to split bytes.
+ *
+ * returns	0 on success, -1 if the connection's gone.
+ */
+static int pipe_read(Pipe *p, int64_t now) {
+	Segment *s;
+	int want, n;
+
+	while(!p->eof && p->count < NETEM_SEGMENTS) {
+		s = &(p->seg[(p->head + p->count) % NETEM_SEGMENTS]);
+		want = split > 0 ? 1 + random_below(split) : NETEM_SEGMENT;
+		n = read(p->in, s->data, want);
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			return(-1);
+		}
+		if(n == 0) {
+			p->eof = 1;
+			break;
+		}
+		s->len = n;
+		s->off = 0;
+		s->due = pipe_due(p, n, now);
+		p->count++;
+		p->bytes += n;
+		p->segments++;
+		if(p->count > p->maxcount)
+			p->maxcount = p->count;
+	}
+
+	return(0);
+}
+
+/*
+ * Writes every piece that's due, one write each.
+ *
+ * returns	0 on success, -1 if the connection's gone.
+ */
+static int pipe_write(Pipe *p, int64_t now) {
+	Segment *s;
+	int n;
+
+	while(p->count > 0) {
+		s = &(p->seg[p->head]);
+		if(s->due > now)
+			break;
+		n = write(p->out, &(s->data[s->off]), s->len - s->off);
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			return(-1);
+		}
+		s->off += n;
+		if(s->off < s->len) {
+			p->short_writes++;
+			break;
+		}
+		p->head = (p->head + 1) % NETEM_SEGMENTS;
+		p->count--;
+	}
+
+	if(p->eof && p->count == 0 && !p->shut) {
+		shutdown(p->out, SHUT_WR);
+		p->shut = 1;
+	}
+
+	return(0);
+}
+
+static void pipe_add(Pipe *total, const Pipe *p) {
+	total->bytes += p->bytes;
+	total->segments += p->segments;
+	total->lost += p->lost;
+	total->short_writes += p->short_writes;
+	if(p->maxcount > total->maxcount)
+		total->maxcount = p->maxcount;
+}
+
+static void link_free(int i) {
+	Link *l = links_open[i];
+
+	pipe_add(&totalup, &(l->up));
+	pipe_add(&totaldown, &(l->down));
+	close(l->client);
+	close(l->server);
+	free(l->up.seg);
+	free(l->down.seg);
+	free(l);
+	links_open[i] = NULL;
+}
+
+/* Accepts a client and starts connecting to the server for it. */
+static int link_open(int listener, const struct addrinfo *server) {
+	Link *l;
+	int client, fd, i;
+
+	client = accept(listener, NULL, NULL);
+	if(client == -1)
+		return(errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+
+	for(i = 0; i < NETEM_LINKS && links_open[i] != NULL; i++);
+	if(i == NETEM_LINKS) {
+		fprintf(stderr, "Too many connections, one refused.\n");
+		close(client);
+		return(0);
+	}
+
+	fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd == -1) {
+		perror("link_open(): socket()");
+		goto lerror0;
+	}
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	set_socket_options(client);
+	set_socket_options(fd);
+	if(connect(fd, server->ai_addr, server->ai_addrlen) == -1 && errno != EINPROGRESS) {
+		perror("link_open(): connect()");
+		goto lerror1;
+	}
+
+	l = malloc(sizeof(Link));
+	if(l == NULL)
+		goto lerror1;
+	if(pipe_init(&(l->up), client, fd) == -1)
+		goto lerror2;
+	if(pipe_init(&(l->down), fd, client) == -1)
+		goto lerror3;
+	l->client = client;
+	l->server = fd;
+	l->connecting = 1;
+	links_open[i] = l;
+	links++;
+
+	return(1);
+
+lerror3:
+	free(l->up.seg);
+lerror2:
+	free(l);
+lerror1:
+	close(fd);
+lerror0:
+	close(client);
+	return(0);
+}
+
+/* Events to wait for on a connection being read by in and written by out. */
+static short int want_events(const Pipe *in, const Pipe *out, int64_t now) {
+	short int events = 0;
+
+	if(!in->eof && in->count < NETEM_SEGMENTS)
+		events |= POLLIN;
+	if(out->count > 0 && out->seg[out->head].due <= now)
+		events |= POLLOUT;
+
+	return(events);
+}
+
+/* Whether a connection might take a write: it said so, or it wasn't asked because nothing was due yet. */
+static int ready(const struct pollfd *pfd) {
+	return(!(pfd->events & POLLOUT) || (pfd->revents & (POLLOUT | POLLHUP | POLLERR)));
+}
+
+int main(int argc, char **argv) {
+	struct sigaction sa;
+	struct addrinfo hints, *server;
+	struct sockaddr_in addr;
+	struct pollfd pfd[NETEM_LINKS * 2 + 1];
+	struct pollfd *client, *srv;
+	int idx[NETEM_LINKS * 2 + 1];
+	int listener, fds, opt, err, one;
+	int64_t now, next, timeout;
+	socklen_t len;
+	Link *l;
+	int i;
+
+	delay = 0;
+	jitter = 0;
+	bandwidth = 0;
+	split = 0;
+	loss = 0;
+	rto = DEFAULT_RTO_MS * 1000;
+	stallevery = 0;
+	stall = 0;
+	sockbuf = 0;
+	rng = time(NULL);
+	while((opt = getopt(argc, argv, "d:j:b:m:l:r:p:P:w:s:")) != -1) {
+		switch(opt) {
+			case 'd':
+				delay = atol(optarg) * 1000;
+				break;
+			case 'j':
+				jitter = atol(optarg) * 1000;
+				break;
+			case 'b':
+				bandwidth = atol(optarg);
+				break;
+			case 'm':
+				split = atoi(optarg);
+				break;
+			case 'l':
+				loss = atoi(optarg);
+				break;
+			case 'r':
+				rto = atol(optarg) * 1000;
+				break;
+			case 'p':
+				stallevery = atol(optarg) * 1000;
+				break;
+			case 'P':
+				stall = atol(optarg) * 1000;
+				break;
+			case 'w':
+				sockbuf = atoi(optarg);
+				break;
+			case 's':
+				rng = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if(argc - optind != 3 || delay < 0 || jitter < 0 || bandwidth < 0 || split < 0 || split > NETEM_SEGMENT ||
+	   loss < 0 || loss > 1000 || rto < 0 || stallevery < 0 || stall < 0 || stall > stallevery || sockbuf < 0)
+		goto usage;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &server);
+	if(err != 0) {
+		fprintf(stderr, "main(): %s:%s: %s\n", argv[optind + 1], argv[optind + 2], gai_strerror(err));
+		goto error0;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(listener == -1) {
+		perror("main(): socket()");
+		goto error1;
+	}
+	one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(argv[optind]));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(listener, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1 || listen(listener, 128) == -1) {
+		perror("main(): bind()");
+		goto error2;
+	}
+
+	sa.sa_handler = signalhandler;
+	sigemptyset(&(sa.sa_mask));
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	fprintf(stderr, "Passing 127.0.0.1:%s on to %s:%s.\n", argv[optind], argv[optind + 1], argv[optind + 2]);
+
+	running = 1;
+	while(running) {
+		now = now_us();
+
+		/* sleep until something can be read or written, or a piece held back is due */
+		next = now + NETEM_POLL_MS * 1000;
+		pfd[0].fd = listener;
+		pfd[0].events = POLLIN;
+		fds = 1;
+		for(i = 0; i < NETEM_LINKS; i++) {
+			l = links_open[i];
+			if(l == NULL)
+				continue;
+			if(l->connecting) {
+				pfd[fds].fd = l->server;
+				pfd[fds].events = POLLOUT;
+				idx[fds++] = i;
+				continue;
+			}
+			pfd[fds].fd = l->client;
+			pfd[fds].events = want_events(&(l->up), &(l->down), now);
+			idx[fds++] = i;
+			pfd[fds].fd = l->server;
+			pfd[fds].events = want_events(&(l->down), &(l->up), now);
+			idx[fds++] = i;
+			if(l->up.count > 0 && l->up.seg[l->up.head].due < next)
+				next = l->up.seg[l->up.head].due;
+			if(l->down.count > 0 && l->down.seg[l->down.head].due < next)
+				next = l->down.seg[l->down.head].due;
+		}
+		timeout = next > now ? (next - now + 999) / 1000 : 0;
+		if(poll(pfd, fds, timeout) == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("main(): poll()");
+			break;
+		}
+		now = now_us();
+
+		if(pfd[0].revents & POLLIN) {
+			while(link_open(listener, server) == 1);
+		}
+
+		for(i = 1; i < fds; i++) {
+			l = links_open[idx[i]];
+			if(l == NULL)
+				continue;
+			if(l->connecting) {
+				if(pfd[i].revents == 0)
+					continue;
+				len = sizeof(int);
+				if(getsockopt(l->server, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+					fprintf(stderr, "Couldn't connect to the server: %s\n", strerror(err));
+					link_free(idx[i]);
+					continue;
+				}
+				l->connecting = 0;
+				continue;
+			}
+			/* the client's entry, then the server's */
+			client = &(pfd[i]);
+			srv = &(pfd[++i]);
+			if(((client->revents & (POLLIN | POLLHUP | POLLERR)) && pipe_read(&(l->up), now) == -1) ||
+			   ((srv->revents & (POLLIN | POLLHUP | POLLERR)) && pipe_read(&(l->down), now) == -1) ||
+			   (ready(srv) && pipe_write(&(l->up), now) == -1) ||
+			   (ready(client) && pipe_write(&(l->down), now) == -1) ||
+			   (l->up.shut && l->down.shut)) {
+				link_free(idx[i]);
+				continue;
+			}
+		}
+	}
+
+	for(i = 0; i < NETEM_LINKS; i++) {
+		if(links_open[i] != NULL)
+			link_free(i);
+	}
+	fprintf(stderr, "%li connections passed on.\n", links);
+	fprintf(stderr, "To the server: %li bytes in %li pieces, %li lost and sent again, %li short writes, at most %i pieces held.\n",
+	        totalup.bytes, totalup.segments, totalup.lost, totalup.short_writes, totalup.maxcount);
+	fprintf(stderr, "To clients: %li bytes in %li pieces, %li lost and sent again, %li short writes, at most %i pieces held.\n",
+	        totaldown.bytes, totaldown.segments, totaldown.lost, totaldown.short_writes, totaldown.maxcount);
+	close(listener);
+	freeaddrinfo(server);
+	exit(EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "Usage: %s [-d delay ms] [-j jitter ms] [-b bytes a second] [-m most bytes a read] [-l lost in a thousand] [-r retransmit ms] [-p stall every ms] [-P stall ms] [-w socket buffer bytes] [-s seed] <port> <server host> <server port>\n", argv[0]);
+	goto error0;
+error2:
+	close(listener);
+error1:
+	freeaddrinfo(server);
+error0:
+	exit(EXIT_FAILURE);
+}
+
+void signalhandler(int signum) {
+	fprintf(stderr, "\n\nSignal %i received.\n", signum);
+	running = 0;
+	return;
+}
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "normalize.h"
+#include "normtables.h"
+
+static const char *LANGUAGES[LANGS_MAX] = {"latin", "japanese"};
+
+/*
+ * Returns the length of the run of ASCII at the start of s.  Nearly every word
+ * is entirely ASCII, so this is what decides how fast normalization is.
+ */
+static int ascii_run(const unsigned char *s, int len) {
+	int i;
+	uint64_t w;
+
+	i = 0;
+#ifdef __SSE2__
+	for(; i + 16 <= len; i += 16) {
+		int mask;
+
+		mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&(s[i])));
+		if(mask != 0)
+			return(i + __builtin_ctz(mask));
+	}
+#endif
+	for(; i + 8 <= len; i += 8) {
+		memcpy(&w, &(s[i]), 8);
+		if(w & 0x8080808080808080ULL)
+			break;
+	}
+	for(; i < len && s[i] < 0x80; i++);
+
+	return(i);
+}
+
+/*
+ * Decodes one UTF-8 sequence, returns its length or -1 if it's invalid.
+ */
+static int utf8_decode(const unsigned char *s, int len, unsigned int *cp) {
+	unsigned int c;
+
+	c = s[0];
+	if(c < 0x80) {
+		*cp = c;
+		return(1);
+	} else if(c < 0xC2) { /* continuation byte or overlong 2 byte form */
+		return(-1);
+	} else if(c < 0xE0) {
+		if(len < 2 || (s[1] & 0xC0) != 0x80)
+			return(-1);
+		*cp = ((c & 0x1F) << 6) | (s[1] & 0x3F);
+		return(2);
+	} else if(c < 0xF0) {
+		if(len < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
+			return(-1);
+		c = ((c & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+		if(c < 0x800 || (c >= 0xD800 && c <= 0xDFFF)) /* overlong or surrogate */
+			return(-1);
+		*cp = c;
+		return(3);
+	} else if(c < 0xF5) {
+		if(len < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80)
+			return(-1);
+		c = ((c & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+		if(c < 0x10000 || c > 0x10FFFF)
+			return(-1);
+		*cp = c;
+		return(4);
+	}
+
+	return(-1);
+}
+
+int norm_unit_encode(char *buf, unsigned int unit) {
+	unsigned char *b = (unsigned char *)buf;
+
+	if(unit < 0x80) {
+		b[0] = unit;
+		return(1);
+	} else if(unit < 0x800) {
+		b[0] = 0xC0 | (unit >> 6);
+		b[1] = 0x80 | (unit & 0x3F);
+		return(2);
+	} else if(unit < 0x10000) {
+		b[0] = 0xE0 | (unit >> 12);
+		b[1] = 0x80 | ((unit >> 6) & 0x3F);
+		b[2] = 0x80 | (unit & 0x3F);
+		return(3);
+	}
+	b[0] = 0xF0 | (unit >> 18);
+	b[1] = 0x80 | ((unit >> 12) & 0x3F);
+	b[2] = 0x80 | ((unit >> 6) & 0x3F);
+	b[3] = 0x80 | (unit & 0x3F);
+	return(4);
+}
+
+int utf8_validate(const char *buf, int len) {
+	const unsigned char *s = (const unsigned char *)buf;
+	unsigned int cp;
+	int i, retval;
+
+	i = 0;
+	while(i < len) {
+		i += ascii_run(&(s[i]), len - i);
+		if(i == len)
+			break;
+		retval = utf8_decode(&(s[i]), len - i, &cp);
+		if(retval == -1)
+			return(-1);
+		i += retval;
+	}
+
+	return(0);
+}
+
+static unsigned int fold_unit(unsigned int cp) {
+	if(cp < NORM_LATIN_MAX)
+		return(norm_latin_fold[cp]);
+	if(cp >= 0x30A1 && cp <= 0x30F6) /* katakana to hiragana */
+		return(cp - 0x60);
+	if(cp == 0x30FD || cp == 0x30FE) /* katakana iteration marks */
+		return(cp - 0x60);
+	if(cp >= 0xFF21 && cp <= 0xFF3A) /* fullwidth upper case */
+		return(cp - 0xFF21 + 'a');
+	if(cp >= 0xFF01 && cp <= 0xFF5E) /* rest of fullwidth ASCII */
+		return(cp - 0xFF01 + 0x21);
+
+	return(cp);
+}
+
+int norm_word(char *out, int outsize, const char *in, int inlen) {
+	const unsigned char *s = (const unsigned char *)in;
+	unsigned char *o = (unsigned char *)out;
+	unsigned int cp;
+	char enc[4];
+	int i, j, run, retval;
+
+	i = 0;
+	j = 0;
+	while(i < inlen) {
+		run = ascii_run(&(s[i]), inlen - i);
+		if(j + run > outsize)
+			return(-1);
+		for(; run > 0; run--, i++, j++)
+			o[j] = s[i] + ((unsigned char)(s[i] - 'A') < 26 ? 0x20 : 0);
+		if(i == inlen)
+			break;
+
+		retval = utf8_decode(&(s[i]), inlen - i, &cp);
+		if(retval == -1)
+			return(-1);
+		i += retval;
+		/* folding never makes a character longer, so this never overtakes i */
+		retval = norm_unit_encode(enc, fold_unit(cp));
+		if(j + retval > outsize)
+			return(-1);
+		memcpy(&(o[j]), enc, retval);
+		j += retval;
+	}
+
+	return(j);
+}
+
+int norm_fold_ascii(char *buf, int len) {
+	unsigned char *s = (unsigned char *)buf;
+	int i;
+
+	i = 0;
+#ifdef __SSE2__
+	for(; i + 16 <= len; i += 16) {
+		__m128i v, upper;
+
+		v = _mm_loadu_si128((const __m128i *)&(s[i]));
+		if(_mm_movemask_epi8(v) != 0)
+			break;
+		upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+		v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+		_mm_storeu_si128((__m128i *)&(s[i]), v);
+	}
+#endif
+	for(; i < len && s[i] < 0x80; i++)
+		s[i] += (unsigned char)(s[i] - 'A') < 26 ? 0x20 : 0;
+
+	return(i);
+}
+
+/*
+ * Looks up the unit a codepoint counts as, 0 if it should be skipped over.
+ */
+static unsigned int lookup_unit(unsigned int cp, norm_language lang, int last, int *flags) {
+	if(cp < NORM_LATIN_MAX)
+		return(last ? norm_latin_last[cp] : norm_latin_first[cp]);
+
+	if(lang == LANG_JAPANESE && cp >= NORM_KANA_BASE && cp < NORM_KANA_BASE + NORM_KANA_MAX) {
+		if(norm_kana_flags[cp - NORM_KANA_BASE] & NORM_KANA_LOSING && flags != NULL)
+			*flags |= NORM_LOSING;
+		return(norm_kana_unit[cp - NORM_KANA_BASE]);
+	}
+
+	if((cp >= 0x2000 && cp <= 0x206F) || (cp >= 0x3000 && cp <= 0x303F)) /* general and CJK punctuation */
+		return(0);
+
+	return(cp);
+}
+
+int norm_first_units(const char *word, int len, norm_language lang, unsigned int *units, int max) {
+	const unsigned char *s = (const unsigned char *)word;
+	unsigned int cp, unit;
+	int i, n, retval;
+
+	n = 0;
+	for(i = 0; i < len && n < max; i += retval) {
+		retval = utf8_decode(&(s[i]), len - i, &cp);
+		if(retval == -1)
+			break;
+		unit = lookup_unit(cp, lang, 0, NULL);
+		if(unit != 0)
+			units[n++] = unit;
+	}
+
+	return(n);
+}
+
+unsigned int norm_first_unit(const char *word, int len, norm_language lang) {
+	unsigned int unit;
+
+	return(norm_first_units(word, len, lang, &unit, 1) == 1 ? unit : 0);
+}
+
+int norm_last_units(const char *word, int len, norm_language lang, unsigned int *units, int max, int *flags) {
+	const unsigned char *s = (const unsigned char *)word;
+	unsigned int cp, unit;
+	int i, n, start;
+
+	if(flags != NULL)
+		*flags = 0;
+
+	n = 0;
+	i = len;
+	while(i > 0 && n < max) {
+		start = i - 1;
+		while(start > 0 && (s[start] & 0xC0) == 0x80) /* back up to start of sequence */
+			start--;
+		if(utf8_decode(&(s[start]), i - start, &cp) == -1)
+			break;
+		/* only the last unit says anything about how the word ends */
+		unit = lookup_unit(cp, lang, 1, n == 0 ? flags : NULL);
+		if(unit != 0)
+			units[n++] = unit;
+		i = start;
+	}
+
+	return(n);
+}
+
+unsigned int norm_last_unit(const char *word, int len, norm_language lang, int *flags) {
+	unsigned int unit;
+
+	return(norm_last_units(word, len, lang, &unit, 1, flags) == 1 ? unit : 0);
+}
+
+int norm_language_find(const char *name) {
+	int i;
+
+	for(i = 0; i < LANGS_MAX; i++) {
+		if(strcmp(LANGUAGES[i], name) == 0)
+			return(i);
+	}
+
+	return(-1);
+}
@@ -0,0 +1,123 @@
+#ifndef __NORMALIZE_H
+#define __NORMALIZE_H
+
+typedef enum {
+	LANG_LATIN, LANG_JAPANESE
+} norm_language;
+#define LANGS_MAX		(2)
+
+/* Flags set by norm_last_unit() */
+#define NORM_LOSING		(1) /* Word ends on a unit no word can start with, like ん. */
+
+/*
+ * Checks that a buffer contains only valid UTF-8: no overlong forms, surrogates
+ * or codepoints past U+10FFFF.
+ *
+ * buf		Buffer to check.
+ * len		Length of buffer.
+ *
+ * returns	0 if valid, -1 if not.
+ */
+int utf8_validate(const char *buf, int len);
+
+/*
+ * Normalizes a word so words which should compare equal are bytewise equal.
+ * Latin letters are case folded and katakana is folded to hiragana, fullwidth
+ * ASCII is folded to ASCII.  The output is never longer than the input, so out
+ * may be the same buffer as in.
+ *
+ * out		Buffer to write normalized word in to.
+ * outsize	Space in out.
+ * in		Word to normalize.
+ * inlen	Length of word.
+ *
+ * returns	Length of normalized word, -1 on invalid UTF-8 or not enough space.
+ */
+int norm_word(char *out, int outsize, const char *in, int inlen);
+
+/*
+ * Case folds ASCII in place, stopping at the first byte which isn't ASCII.  For
+ * ASCII this is the whole of norm_word(), but it works over many packed words
+ * at once, so batches can be folded in one pass and only the words that aren't
+ * ASCII need to go through norm_word().
+ *
+ * buf		Buffer to fold.
+ * len		Length of buffer.
+ *
+ * returns	Number of bytes folded, len if it was all ASCII.
+ */
+int norm_fold_ascii(char *buf, int len);
+
+/*
+ * Finds the unit (letter or kana) a word starts with according to a language's
+ * rules.  Word should already be normalized.
+ *
+ * word		Normalized word.
+ * len		Length of word.
+ * lang		Language rules to apply.
+ *
+ * returns	Unit as a codepoint, 0 if the word has none.
+ */
+unsigned int norm_first_unit(const char *word, int len, norm_language lang);
+
+/*
+ * Finds the first few units a word starts with, as norm_first_unit() finds
+ * the first.
+ *
+ * word		Normalized word.
+ * len		Length of word.
+ * lang		Language rules to apply.
+ * units	Units are written here, in order.
+ * max		Most units to find.
+ *
+ * returns	Number of units found, fewer than max if the word is short.
+ */
+int norm_first_units(const char *word, int len, norm_language lang, unsigned int *units, int max);
+
+/*
+ * Finds the unit the next word must start with according to a language's
+ * rules.  Word should already be normalized.
+ *
+ * word		Normalized word.
+ * len		Length of word.
+ * lang		Language rules to apply.
+ * flags	If not NULL, NORM_* flags for the unit are written here.
+ *
+ * returns	Unit as a codepoint, 0 if the word has none.
+ */
+unsigned int norm_last_unit(const char *word, int len, norm_language lang, int *flags);
+
+/*
+ * Finds the last few units of a word, as norm_last_unit() finds the last.
+ *
+ * word		Normalized word.
+ * len		Length of word.
+ * lang		Language rules to apply.
+ * units	Units are written here, the last first.
+ * max		Most units to find.
+ * flags	If not NULL, NORM_* flags for the last unit are written here.
+ *
+ * returns	Number of units found, fewer than max if the word is short.
+ */
+int norm_last_units(const char *word, int len, norm_language lang, unsigned int *units, int max, int *flags);
+
+/*
+ * Looks up a language by name.
+ *
+ * name		Name of language ("latin" or "japanese").
+ *
+ * returns	Language number or -1 if not found.
+ */
+int norm_language_find(const char *name);
+
+/*
+ * Encodes a unit (codepoint) as UTF-8.
+ *
+ * buf		Buffer to write in to, needs room for 4 bytes.
+ * unit		Codepoint to encode.
+ *
+ * returns	Number of bytes written.
+ */
+int norm_unit_encode(char *buf, unsigned int unit);
+
+#endif
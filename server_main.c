@@ -11,41 +11,197 @@
 
 #include "net.h"
 #include "game.h"
+#include "lobby.h"
+#include "cluster.h"
+#include "complete.h"
+#include "upgrade.h"
+#include "trace.h"
+#include "stats.h"
+#include "admin.h"
+#include "util.h"
 
 #ifndef MAX_COMMAND
 #error MAX_COMMAND must be defined!
 #endif
 
 #define MAX_USERS (8)
-#define MAX_NAME_LEN (32)
 #define TIMEOUT (60)
+#define RESUME_GRACE (120) /* seconds a disconnected player keeps their seat */
+#define LOBBY_TICK_MS (250)
+#define CLUSTER_WAIT_MS (LOBBY_WIDEN_MS * 2) /* when the lobby gives up and asks the broker to match a player */
+#define CONNECT_RATE (10) /* connections a second allowed from each address */
+#define CONNECT_BURST (20)
+#define IDLE_NS (1000000) /* main loop sleep */
+#define TRACE_FILE "shiritori_server.trace.json" /* where SIGUSR1 writes the flight recorder */
 
 int running;
+int reload;
+int dump;
 void signalhandler(int signum);
+int server_message(Connection *c, const char *text);
+void token_to_hex(char *hex, const unsigned char *token);
+int hex_to_token(unsigned char *token, const char *hex);
+void player_expired(Player *p, void *priv);
+void game_over(Room *r, void *priv);
+int cluster_tick(Cluster *cl, Game *g, Lobby *l);
+void config_apply(const Config *cfg, Config *live, Server *s, Lobby *l);
 
 int main(int argc, char **argv) {
 	Game *g;
+	Lobby *l;
+	Room *r;
 	Server *s;
+	Connection *c;
+	DictStore *ds;
+	Cluster *cl;
+	Completer *cm;
+	Tracer *tr;
+	TraceLoop tl;
+	StatsStore *st;
+	const StatsRecord *rec;
+	const StatsRecord *top[STATS_TOP];
+	Plays *ps;
+	Admin *ad;
+	Config defaults, live;
+	const Config *cfg;
+	Dict *d;
+	Player *p, *q;
 	int retval;
-	int i;
+	int i, j;
 	struct sigaction sa;
-	struct timespec idletime;
 	CMDBuffer **bufs;
 	char outbuf[MAX_COMMAND];
+	char frame[MAX_COMMAND];
+	char addrtext[INET6_ADDRSTRLEN];
 	char *cmdbuf;
 	char *databuf;
 	int command;
 	short unsigned int cmdlen, datalen;
+	int namelen, msglen, len;
+	int identified;
+	char token[RESUME_TOKEN_LEN * 2];
+	unsigned char rawtoken[RESUME_TOKEN_LEN];
+	char oldname[MAX_NAME_LEN + 1];
+	char *broker, *brokerport;
+	char *upgradepath;
+	char *tracepath;
+	char *unixpath;
+	char *statspath;
+	char *adminpath;
+	Upgrade *u;
+	int up, ul, tookover;
+	int backlog, rate, overlap, uring;
+	int accepted[ACCEPT_BATCH];
+	int n;
+	int64_t started;
+	long now;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+	broker = NULL;
+	upgradepath = NULL;
+	tracepath = TRACE_FILE;
+	unixpath = NULL;
+	statspath = NULL;
+	adminpath = NULL;
+	backlog = 0;
+	rate = CONNECT_RATE;
+	overlap = 1;
+	uring = 0;
+	while((retval = getopt(argc, argv, "b:U:l:r:o:ut:L:S:A:")) != -1) {
+		if(retval == 'b')
+			broker = optarg;
+		else if(retval == 'U')
+			upgradepath = optarg;
+		else if(retval == 'l')
+			backlog = atoi(optarg);
+		else if(retval == 'r')
+			rate = atoi(optarg);
+		else if(retval == 'o')
+			overlap = atoi(optarg);
+		else if(retval == 'u')
+			uring = 1;
+		else if(retval == 't')
+			tracepath = optarg;
+		else if(retval == 'L')
+			unixpath = optarg;
+		else if(retval == 'S')
+			statspath = optarg;
+		else if(retval == 'A')
+			adminpath = optarg;
+		else
+			break;
+	}
+	if(retval != -1 || (argc - optind != 1 && argc - optind != 2) || backlog < 0 || rate < 0 || overlap < 1 || overlap > DICT_GRAM_MAX) {
+		fprintf(stderr, "Usage: %s [-b <broker host>:<port> or <broker socket>] [-U <upgrade socket>] [-l <listen backlog>] [-r <connections a second from an address, 0 for any>] [-o <letters words chain on, 1 to 3>] [-u] [-t <flight recorder file>] [-L <local socket>] [-S <statistics file>] [-A <admin socket>] <port> [dictionary]\n", argv[0]);
 		goto error0;
 	}
+	brokerport = NULL;
+	/* anything with a slash in it is the broker's Unix socket */
+	if(broker != NULL && strchr(broker, '/') == NULL) {
+		brokerport = strrchr(broker, ':');
+		if(brokerport == NULL) {
+			fprintf(stderr, "main(): broker should be given as host:port or a socket path.\n");
+			goto error0;
+		}
+		*brokerport = '\0';
+		brokerport++;
+	}
+
+	ds = NULL;
+	if(argc - optind == 2) {
+		ds = dict_store_init(argv[optind + 1]);
+		if(ds == NULL) {
+			fprintf(stderr, "main(): couldn't load dictionary.\n");
+			goto error0;
+		}
+		fprintf(stderr, "Loaded %i words from %s.\n", ds->current->words, ds->path);
+	}
+
+	/* if a server is already running, take over from it instead of starting fresh */
+	u = NULL;
+	up = -2;
+	if(upgradepath != NULL) {
+		up = upgrade_connect(upgradepath);
+		if(up == -1)
+			goto error5;
+		if(up >= 0) {
+			fprintf(stderr, "Taking over from the server at %s.\n", upgradepath);
+			u = upgrade_receive(up);
+			if(u == NULL)
+				goto error5;
+		}
+	}
 
-	s = server_init(argv[1], MAX_USERS, TIMEOUT);
+	if(u != NULL)
+		s = server_adopt(upgrade_listener(u), MAX_USERS, TIMEOUT, backlog);
+	else
+		s = server_init(argv[optind], MAX_USERS, TIMEOUT, backlog);
 	if(s == NULL) {
 		fprintf(stderr, "main(): couldn't initialize server.\n");
-		goto error0;
+		goto error5;
+	}
+	server_limit_rate(s, rate, rate * CONNECT_BURST / CONNECT_RATE);
+
+	/* what can be changed while running starts out as built and given */
+	defaults.generation = 1;
+	defaults.value[CONFIG_TIMEOUT] = TIMEOUT;
+	defaults.value[CONFIG_MAXUSERS] = s->connections;
+	defaults.value[CONFIG_GRACE] = RESUME_GRACE;
+	defaults.value[CONFIG_RATE] = s->rate;
+	defaults.value[CONFIG_BURST] = s->burst;
+	defaults.value[CONFIG_BACKLOG] = backlog > 0 ? backlog : LISTEN_BACKLOG;
+	defaults.value[CONFIG_LOBBYTICK] = LOBBY_TICK_MS;
+	defaults.value[CONFIG_SLEEP] = IDLE_NS / 1000;
+	defaults.value[CONFIG_OVERLAP] = overlap;
+	defaults.retired = NULL;
+	memcpy(&live, &defaults, sizeof(Config));
+
+	if(uring) {
+		if(server_uring_start(s) == 0) {
+			fprintf(stderr, "Using io_uring.\n");
+		} else {
+			fprintf(stderr, "io_uring isn't available, using plain sockets.\n");
+			uring = 0;
+		}
 	}
 
 	sa.sa_handler = signalhandler;
@@ -54,10 +210,10 @@ int main(int argc, char **argv) {
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL); /* reload dictionary */
+	sigaction(SIGUSR1, &sa, NULL); /* dump flight recorder */
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, NULL);
-	sigaction(SIGHUP, &sa, NULL);
-	sigaction(SIGUSR1, &sa, NULL);
 	sigaction(SIGUSR2, &sa, NULL);
 
 	/* We'll need command buffers, so initialize all of them */
@@ -77,120 +233,578 @@ int main(int argc, char **argv) {
 		goto error2;
 	}
 
-	g = game_init(MAX_USERS, MAX_NAME_LEN);
+	g = game_init(MAX_USERS, MAX_NAME_LEN, s->connections);
 	if(g == NULL)
 		goto error3;
 
+	l = lobby_init(MAX_USERS, MAX_USERS / ROOM_SIZE, ROOM_SIZE, LOBBY_TICK_MS);
+	if(l == NULL)
+		goto error4;
+
+	cm = completer_init(s->connections);
+	if(cm == NULL)
+		goto error6;
+
+	tr = trace_init();
+	if(tr == NULL)
+		goto error10;
+
+	tookover = 0;
+	if(u != NULL) {
+		if(upgrade_restore(u, s, g, l, ds != NULL ? ds->current : NULL) == -1) {
+			fprintf(stderr, "main(): couldn't take over from the old server.\n");
+			goto error8;
+		}
+		upgrade_free(u);
+		u = NULL;
+		/* returns once the old server is gone */
+		retval = upgrade_finish(up);
+		up = -2;
+		if(retval == -1)
+			goto error8;
+		tookover = 1;
+		fprintf(stderr, "Took over from the old server.\n");
+	}
+
+	/* a server taken over from may have been listening already */
+	if(unixpath != NULL && s->unixsock == -1) {
+		if(server_listen_unix(s, unixpath) == -1) {
+			fprintf(stderr, "main(): couldn't listen on %s.\n", unixpath);
+			goto error8;
+		}
+		fprintf(stderr, "Listening for local connections on %s.\n", unixpath);
+	}
+
+	/* only once any server taken over from is done writing to it */
+	st = NULL;
+	if(statspath != NULL) {
+		st = stats_open(statspath);
+		if(st == NULL) {
+			fprintf(stderr, "main(): couldn't open statistics.\n");
+			goto error8;
+		}
+		fprintf(stderr, "Loaded statistics for %i players from %s.\n", st->used, statspath);
+	}
+
+	ps = plays_init(s->connections, l->maxrooms, game_over, st);
+	if(ps == NULL)
+		goto error11;
+	/* games taken over carry on against their deadlines, full rooms get a new one */
+	now = now_ms();
+	for(j = 0; j < l->maxrooms; j++) {
+		r = l->room[j];
+		if(r->players > 0)
+			plays_schedule(ps, r, r->playing ? now : now + GAME_BREAK_MS);
+	}
+
+	ad = NULL;
+	if(adminpath != NULL) {
+		ad = admin_init(adminpath, &defaults, s->connections);
+		if(ad == NULL) {
+			fprintf(stderr, "main(): couldn't listen for admin connections.\n");
+			goto error13;
+		}
+		admin_bound(ad, CONFIG_MAXUSERS, 0, s->connections);
+		if(admin_start(ad) == -1)
+			goto error12;
+		fprintf(stderr, "Listening for admin connections on %s.\n", adminpath);
+	}
+
+	ul = -1;
+	if(upgradepath != NULL) {
+		ul = upgrade_listen(upgradepath);
+		if(ul == -1) {
+			fprintf(stderr, "main(): couldn't listen for upgrades.\n");
+			goto error12;
+		}
+	}
+
+	cl = NULL;
+	if(broker != NULL) {
+		cl = cluster_connect(broker, brokerport, TIMEOUT);
+		if(cl == NULL) {
+			fprintf(stderr, "main(): couldn't join cluster.\n");
+			goto error9;
+		}
+		fprintf(stderr, "Connected to broker at %s%s%s.\n", broker, brokerport != NULL ? ":" : "", brokerport != NULL ? brokerport : "");
+		if(tookover) {
+			for(i = 0; i < g->maxplayers; i++) {
+				if(g->player[i]->state != PLAYER_EMPTY)
+					cluster_send(cl, CMD_HERE, g->player[i]->name, strlen(g->player[i]->name));
+			}
+		}
+	}
+
+	reload = 0;
+	dump = 0;
 	running = 1;
+	trace_loop_init(&tl, trace_ring(tr, "main"));
 	while(running) {
-		retval = connection_accept(s);
-		if(retval >= 0) {
-			fprintf(stderr, "New connection from %s.\n", inet_ntoa(((struct sockaddr_in *)&(s->connection[retval]->address))->sin_addr));
-			if(connection_message(s->connection[retval], "SERVER\0Connection established, please identify.") == -1) {
+		now = now_ms();
+
+		/* settings changed through the admin socket are picked up here, without locking */
+		cfg = ad != NULL ? admin_config(ad) : &defaults;
+		if(cfg->generation != live.generation) {
+			config_apply(cfg, &live, s, l);
+			admin_applied(ad, cfg->generation);
+		}
+		if(ad != NULL)
+			admin_answer_rtt(ad, s);
+
+		if(ul != -1) {
+			up = accept(ul, NULL, NULL);
+			if(up >= 0) {
+				fprintf(stderr, "A new server is taking over.\n");
+				started = now_ns();
+				server_uring_stop(s);
+				if(upgrade_handoff(up, s, g, l) == 0)
+					break;
+				fprintf(stderr, "Carrying on.\n");
+				trace_record(tl.r, TRACE_UPGRADE, started, now_ns() - started, -1, NULL);
+				if(uring && server_uring_start(s) == -1) {
+					fprintf(stderr, "Couldn't go back to io_uring, using plain sockets.\n");
+					uring = 0;
+				}
+				close(up);
+				up = -2;
+			}
+		}
+
+		n = connection_accept(s, accepted, ACCEPT_BATCH);
+		if(n == -1) {
+			fprintf(stderr, "Error accepting connection.\n");
+			goto error7;
+		}
+		for(j = 0; j < n; j++) {
+			i = accepted[j];
+			trace_instant(tl.r, TRACE_CONNECT, i);
+			completer_cancel(cm, i); /* anything left from whoever had it before */
+			if(s->connection[i]->address.ss_family == AF_UNIX)
+				fprintf(stderr, "New local connection.\n");
+			else
+				fprintf(stderr, "New connection from %s.\n", connection_address(s->connection[i], addrtext, sizeof(addrtext)));
+			if(server_message(s->connection[i], "Connection established, please identify.") == -1) {
 				fprintf(stderr, "Failed to send message to %i.\n", i);
 				connection_disconnect(s->connection[i]);
 			}
-		} else if(retval == -1) {
-			fprintf(stderr, "Error accepting connection.\n");
-			goto error4;
 		}
+		trace_loop_phase(&tl, TRACE_ACCEPT, n);
 
 		for(i = 0; i < s->connections; i++) {
 			if(s->connection[i]->type == CLIENT) {
 				retval = connection_next_command(s->connection[i]);
+				trace_loop_phase(&tl, TRACE_READ, i);
 				if(retval == -1) { /* socket read error */
-					connection_disconnect(s->connection[i]);
+					game_connection_lost(g, i, s->connection[i]);
+					trace_instant(tl.r, TRACE_DISCONNECT, i);
 					fprintf(stderr, "Error reading from socket, disconnected.\n");
 				} else if(retval == 0) { /* full command received */
 					command = command_parse(&cmdbuf, &cmdlen, &databuf, &datalen, s->connection[i]->buf->cmd, s->connection[i]->buf->cmdhave);
 					switch(command) {
 						case -2:
-							if(g->player[i]->c == s->connection[i]) {
-								player_disconnect(g->player[i]);
-							} else { /* not identified */
-								connection_disconnect(s->connection[i]);
-							}
+							game_connection_lost(g, i, s->connection[i]);
 							fprintf(stderr, "Unknown command received from %i, disconnected.\n", i);
 							break;
 						case -1:
-							if(g->player[i]->c == s->connection[i]) {
-								player_disconnect(g->player[i]);
-							} else { /* not identified */
-								connection_disconnect(s->connection[i]);
-							}
+							game_connection_lost(g, i, s->connection[i]);
 							fprintf(stderr, "Parse error from %i, disconnected.\n", i);
 							break;
 						case CMD_ERROR:
 							fprintf(stderr, "A command from %i has been dropped.\n", i);
 							break;
 						case CMD_PING:
-							if(connection_pong(s->connection[i]) == -1) {
+							if(connection_pong(s->connection[i], databuf, datalen) == -1) {
 								fprintf(stderr, "Failed to pong %i.\n", i);
-								if(g->player[i]->c == s->connection[i]) {
-									player_disconnect(g->player[i]);
-								} else { /* not identified */
-									connection_disconnect(s->connection[i]);
-								}
+								game_connection_lost(g, i, s->connection[i]);
 							} else {
 								fprintf(stderr, "Ponged %i.\n", i);
 							}
 							break;
-						case CMD_PONG:
-							s->connection[i]->pinged = 0;
-							fprintf(stderr, "Pong received from %i.\n", i);
+						case CMD_PONG: /* round trip times are kept for the admin socket's rtt */
+							connection_pong_received(s->connection[i], databuf, datalen);
+							break;
+						case CMD_MSG:
+							p = g->conn[i];
+							if(p == NULL) {
+								server_message(s->connection[i], "Please identify first.");
+								break;
+							}
+							/* name\0message, no name for everyone */
+							databuf[datalen] = '\0';
+							namelen = strlen(databuf);
+							if(namelen == datalen) {
+								fprintf(stderr, "Malformed message from %i dropped.\n", i);
+								break;
+							}
+							msglen = datalen - namelen - 1;
+							len = strlen(p->name) + 1 + msglen;
+							if(len > MAX_COMMAND - 2 - COMMANDS[CMD_MSG].length) {
+								fprintf(stderr, "Message from %i too long to forward.\n", i);
+								break;
+							}
+							memcpy(outbuf, p->name, strlen(p->name) + 1);
+							memcpy(&(outbuf[strlen(p->name) + 1]), &(databuf[namelen + 1]), msglen);
+							if(namelen == 0) {
+								/* everyone in the same room, kept for anyone joining later, or everyone waiting in the lobby */
+								if(p->room != NULL) {
+									room_send_command(p->room, CMD_MSG, outbuf, len);
+								} else {
+									for(j = 0; j < g->maxplayers; j++) {
+										if(g->player[j]->state != PLAYER_EMPTY && g->player[j]->room == NULL)
+											player_send_command(g->player[j], CMD_MSG, outbuf, len);
+									}
+								}
+								if(cl != NULL && p->room != NULL && p->room->cluster != 0) {
+									/* room\0name\0message for the other nodes */
+									len = snprintf(outbuf, MAX_COMMAND, "%u%c%s%c%.*s", p->room->cluster, '\0', p->name, '\0', msglen, &(databuf[namelen + 1]));
+									if(len < MAX_COMMAND)
+										cluster_send(cl, CMD_RMSG, outbuf, len);
+								}
+							} else {
+								q = game_find_player(g, databuf);
+								if(q != NULL) {
+									player_send_command(q, CMD_MSG, outbuf, len);
+								} else if(cl != NULL) {
+									/* maybe they're on another node, to\0from\0message */
+									len = snprintf(outbuf, MAX_COMMAND, "%s%c%s%c%.*s", databuf, '\0', p->name, '\0', msglen, &(databuf[namelen + 1]));
+									if(len < MAX_COMMAND)
+										cluster_send(cl, CMD_ROUTE, outbuf, len);
+								} else {
+									server_message(s->connection[i], "No such player.");
+								}
+							}
+							break;
 						case CMD_USER:
 							databuf[datalen] = '\0';
-							if(datalen <= MAX_NAME_LEN || memcmp(databuf, "SERVER", 6) != 0) {
+							if(datalen > 0 && datalen <= MAX_NAME_LEN && strlen(databuf) == datalen && strcmp(databuf, "SERVER") != 0) {
+								identified = g->conn[i] != NULL;
+								if(identified)
+									strcpy(oldname, g->conn[i]->name);
+								p = game_identify(g, i, s->connection[i], databuf);
+								if(p == NULL && game_find_player(g, databuf) != NULL) {
+									fprintf(stderr, "Connection %i asked for %s, which is taken.\n", i, databuf);
+									server_message(s->connection[i], "That name is taken!");
+									break;
+								} else if(p == NULL) {
+									fprintf(stderr, "Connection %i can't be seated, server is full.\n", i);
+									server_message(s->connection[i], "Server is full!");
+									break;
+								}
 								fprintf(stderr, "Connection %i username is now %s.\n", i, databuf);
-								g->player[i]->c = s->connection[i];
-								memcpy(g->player[i]->name, databuf, datalen + 1);
+								/* whoever's played before under this name picks up where they left off */
+								if(st != NULL && (rec = stats_find(st, p->name, 0)) != NULL)
+									p->rating = rec->rating;
+								if(cl != NULL) {
+									if(identified)
+										cluster_send(cl, CMD_GONE, oldname, strlen(oldname));
+									cluster_send(cl, CMD_HERE, p->name, strlen(p->name));
+								}
+								if(!identified) {
+									/* new player, give them a way back in */
+									token_to_hex(token, p->token);
+									if(player_send_command(p, CMD_TOKEN, token, RESUME_TOKEN_LEN * 2) == -1)
+										fprintf(stderr, "Failed to send token to %i.\n", i);
+									p->language = ds != NULL ? ds->current->language : LANG_LATIN;
+									if(lobby_enqueue(l, p) == -1)
+										server_message(s->connection[i], "Lobby is full, try JOIN later.");
+								}
 							} else { /* username is too long or equals "SERVER" */
-								fprintf(stderr, "Connection %i specified invalid username %s.", i, databuf);
-								if(connection_message(s->connection[i], "SERVER\0Invalid username!") == -1) {
+								fprintf(stderr, "Connection %i specified invalid username %s.\n", i, databuf);
+								if(server_message(s->connection[i], "Invalid username!") == -1) {
 									fprintf(stderr, "Failed to send message to %i.\n", i);
-									connection_disconnect(s->connection[i]);
+									game_connection_lost(g, i, s->connection[i]);
 								}
 							}
 							break;
+						case CMD_JOIN:
+							p = g->conn[i];
+							if(p == NULL) {
+								server_message(s->connection[i], "Please identify first.");
+								break;
+							}
+							if(datalen > 0) {
+								databuf[datalen] = '\0';
+								retval = norm_language_find(databuf);
+								if(retval == -1) {
+									server_message(s->connection[i], "Unknown language!");
+									break;
+								}
+								p->language = retval;
+							}
+							room_leave(p);
+							if(lobby_enqueue(l, p) == -1) {
+								server_message(s->connection[i], "Lobby is full, try again later.");
+								break;
+							}
+							fprintf(stderr, "%s is waiting for a room.\n", p->name);
+							server_message(s->connection[i], "Waiting for a room.");
+							break;
+						case CMD_RESUME:
+							if(datalen != RESUME_TOKEN_LEN * 2 || hex_to_token(rawtoken, databuf) == -1) {
+								server_message(s->connection[i], "Invalid resume token!");
+								break;
+							}
+							p = game_resume(g, i, s->connection[i], rawtoken);
+							if(p == NULL) {
+								server_message(s->connection[i], "Unknown or expired resume token, please identify.");
+								break;
+							}
+							fprintf(stderr, "Connection %i resumed as %s in seat %i.\n", i, p->name, p->seat);
+							server_message(s->connection[i], "Welcome back.");
+							/* what happened in the room up to losing the connection, then everything missed since */
+							if(p->room != NULL && room_catch_up(p->room, p, p->historyseen, ROOM_CATCHUP_EVENTS) == -1)
+								fprintf(stderr, "Failed to catch %i up on room %i.\n", i, p->room->id);
+							if(player_replay(p) == -1)
+								fprintf(stderr, "Failed to replay missed commands to %i.\n", i);
+							break;
+						case CMD_COMPLETE:
+							if(g->conn[i] == NULL) {
+								server_message(s->connection[i], "Please identify first.");
+								break;
+							}
+							if(completer_request(cm, i, databuf, datalen) == -1)
+								fprintf(stderr, "Completion request from %i dropped.\n", i);
+							break;
+						case CMD_PLAY:
+							p = g->conn[i];
+							if(p == NULL) {
+								server_message(s->connection[i], "Please identify first.");
+								break;
+							}
+							/* played when it was sent, as near as can be told */
+							if(plays_queue(ps, p, databuf, datalen, now - connection_latency_allowance(s->connection[i])) == -1)
+								server_message(s->connection[i], "Too many words at once, try again.");
+							break;
+						case CMD_RANKINGS:
+							if(st == NULL) {
+								server_message(s->connection[i], "There's no leaderboard on this server.");
+								break;
+							}
+							databuf[datalen] = '\0';
+							n = datalen > 0 ? atoi(databuf) : STATS_TOP;
+							if(n < 1 || n > STATS_TOP)
+								n = STATS_TOP;
+							n = stats_top(st, top, n);
+							/* name\0rating\0games\0wins\0longest for each, as many as fit */
+							len = 0;
+							for(j = 0; j < n; j++) {
+								retval = snprintf(&(outbuf[len]), MAX_COMMAND - 2 - COMMANDS[CMD_RANKINGS].length - len, "%s%c%i%c%u%c%u%c%u",
+								                  top[j]->name, '\0', top[j]->rating, '\0', top[j]->games, '\0', top[j]->wins, '\0', top[j]->longest);
+								if(retval >= MAX_COMMAND - 2 - COMMANDS[CMD_RANKINGS].length - len)
+									break;
+								len += retval + 1; /* each ends in \0, the last one's is left off */
+							}
+							len = command_generate(frame, MAX_COMMAND, COMMANDS[CMD_RANKINGS].name, COMMANDS[CMD_RANKINGS].length, outbuf, len > 0 ? len - 1 : 0);
+							if(len == -1 || connection_write(s->connection[i], frame, len) == -1)
+								fprintf(stderr, "Failed to send leaderboard to %i.\n", i);
+							break;
+						case CMD_SHAREMEM:
+							retval = connection_share_memory(s, s->connection[i]);
+							if(retval == 0) {
+								fprintf(stderr, "Connection %i switched to shared memory.\n", i);
+							} else if(retval == -1) {
+								fprintf(stderr, "Failed to set up shared memory for %i.\n", i);
+								game_connection_lost(g, i, s->connection[i]);
+							}
+							break;
 						default:
 							fprintf(stderr, "Unimplemented command %s!\n", COMMANDS[command].name);
 					}
 					cmdbuffer_reset(s->connection[i]->buf);
+					trace_loop_phase(&tl, TRACE_DISPATCH, i);
+				}
+			}
+			if(s->connection[i]->type == CLIENT && completer_due(cm, i)) {
+				/* complete from the dictionary and game the player is in */
+				p = g->conn[i];
+				r = p != NULL ? p->room : NULL;
+				if(r != NULL && r->dict == NULL)
+					r = NULL;
+				d = r != NULL ? r->dict : (ds != NULL ? ds->current : NULL);
+				if(p == NULL || d == NULL) {
+					completer_cancel(cm, i);
+				} else {
+					len = completer_answer(cm, i, d, r != NULL ? r->id : -1, r != NULL ? r->match : NULL,
+					                       outbuf, MAX_COMMAND - 2 - COMMANDS[CMD_COMPLETE].length);
+					if(len != -1)
+						len = command_generate(frame, MAX_COMMAND, COMMANDS[CMD_COMPLETE].name, COMMANDS[CMD_COMPLETE].length, outbuf, len);
+					if(len == -1 || connection_write(s->connection[i], frame, len) == -1)
+						fprintf(stderr, "Failed to send completions to %i.\n", i);
 				}
+				trace_loop_phase(&tl, TRACE_DISPATCH, i);
 			}
 			if(s->connection[i]->type == CLIENT) { /* make sure we didn't disconnect it already */
-				if(connection_timeout_check(s->connection[i], 0)) {
+				c = s->connection[i];
+				retval = connection_liveness_check(c);
+				if(retval == -2) {
+					/* pinged and nothing came back in a lot longer than a round trip usually takes */
+					fprintf(stderr, "Connection %i didn't answer a ping in %li ms, disconnected.\n", i, connection_rto(c));
+					game_connection_lost(g, i, c);
+				} else if(connection_timeout_check(c, 0)) {
 					/* disconnect connection who hasn't responded or sent any data in a while */
-					connection_disconnect(s->connection[i]);
-					fprintf(stderr, "Connection %i had no activity in %lu seconds, disconnected.\n", i, time(NULL) - s->connection[i]->last_message);
-				} else if(s->connection[i]->pinged == 0 &&
-				          connection_timeout_check(s->connection[i], s->connection[i]->timeout / 2)) {
-					/* ping the connection to create some activity and reset timeout timer */
-					if(connection_ping(s->connection[i]) == -1) {
+					game_connection_lost(g, i, c);
+					fprintf(stderr, "Connection %i had no activity in %lu seconds, disconnected.\n", i, time(NULL) - c->last_message);
+				} else if(retval == 1) {
+					if(connection_ping(c) == -1) {
 						fprintf(stderr, "Failed to ping %i.\n", i);
-						if(g->player[i]->c == s->connection[i]) {
-							player_disconnect(g->player[i]);
-						} else { /* not identified */
-							connection_disconnect(s->connection[i]);
-						}
+						game_connection_lost(g, i, c);
 					}
-					fprintf(stderr, "Pinged %i.\n", i);
+				}
+				if(c->type != CLIENT)
+					trace_instant(tl.r, TRACE_DISCONNECT, i);
+				trace_loop_phase(&tl, TRACE_TIMEOUTS, i);
+			}
+		}
+
+		/* everything played this pass together */
+		n = plays_run(ps, now);
+		trace_loop_phase(&tl, TRACE_DISPATCH, n);
+
+		retval = game_expire(g, cfg->value[CONFIG_GRACE], player_expired, cl);
+		if(retval > 0)
+			fprintf(stderr, "%i detached players didn't come back in time, seats freed.\n", retval);
+		plays_expire(ps, now);
+		trace_loop_phase(&tl, TRACE_TIMEOUTS, -1);
+
+		retval = lobby_tick(l);
+		if(retval > 0) {
+			fprintf(stderr, "%i rooms formed.\n", retval);
+			for(j = 0; j < l->maxrooms; j++) {
+				r = l->room[j];
+				if(r->players > 0 && !r->playing && r->timer == -1) {
+					r->overlap = cfg->value[CONFIG_OVERLAP];
+					plays_schedule(ps, r, now + GAME_BREAK_MS);
+				}
+			}
+		}
+
+		if(cl != NULL && cluster_tick(cl, g, l) == -1) {
+			/* carry on alone, rooms shared with other nodes just stop hearing from them */
+			fprintf(stderr, "Lost the broker, no longer part of a cluster.\n");
+			cluster_free(cl);
+			cl = NULL;
+		}
+
+		if(ds != NULL) {
+			if(reload) {
+				reload = 0;
+				retval = dict_store_reload(ds);
+				if(retval == 0)
+					fprintf(stderr, "Reloading dictionary from %s.\n", ds->path);
+				else if(retval == -2)
+					fprintf(stderr, "Dictionary reload already in progress.\n");
+			}
+			retval = dict_store_poll(ds);
+			if(retval != 0)
+				trace_instant(tl.r, TRACE_RELOAD, retval == -1);
+			if(retval == 1)
+				fprintf(stderr, "Dictionary reloaded, now using generation %u with %i words.\n", ds->current->generation, ds->current->words);
+			else if(retval == -1)
+				fprintf(stderr, "Dictionary reload failed, still using generation %u.\n", ds->current->generation);
+			/* games in progress finish on the dictionary they started with */
+			for(j = 0; j < l->maxrooms; j++) {
+				r = l->room[j];
+				if(r->players > 0 && !r->playing && r->dict != ds->current) {
+					if(room_set_dict(r, dict_acquire(ds)) == -1)
+						fprintf(stderr, "Couldn't set up a game for room %i.\n", r->id);
 				}
 			}
 		}
 
-		idletime.tv_sec = 0;
-		idletime.tv_nsec = 1000000;
-		nanosleep(&idletime, NULL);
+		if(dump) {
+			dump = 0;
+			retval = trace_dump(tr, tracepath);
+			if(retval == -2)
+				fprintf(stderr, "Flight recorder is still being written.\n");
+			else if(retval == -1)
+				fprintf(stderr, "Couldn't write flight recorder.\n");
+		}
+		retval = trace_poll(tr);
+		if(retval == 1)
+			fprintf(stderr, "Flight recorder written to %s, %i events.\n", tracepath, tr->dumped);
+		else if(retval == -1)
+			fprintf(stderr, "Writing flight recorder to %s failed.\n", tracepath);
+		trace_loop_phase(&tl, TRACE_TICK, -1);
+
+		/* with io_uring, everything written this pass goes out here */
+		if(server_io(s) == -1) {
+			fprintf(stderr, "Error with io_uring.\n");
+			goto error7;
+		}
+		trace_loop_phase(&tl, TRACE_WRITE, -1);
+
+		/* local peers on shared memory cut it short */
+		server_wait(s, cfg->value[CONFIG_SLEEP] * 1000L);
+		trace_loop_phase(&tl, TRACE_SLEEP, -1);
+		trace_loop_end(&tl, cfg->value[CONFIG_SLEEP] * 1000L);
 	}
 
+	if(cl != NULL)
+		cluster_free(cl);
+	fprintf(stderr, "%li completion requests, %li answered, %li from cache.\n", cm->requests, cm->answered, cm->hits);
+	fprintf(stderr, "%li connections accepted, %li refused while full, %li refused for connecting too often.\n",
+	        s->accepted, s->refusedfull, s->refusedrate);
+	fprintf(stderr, "%li loop iterations, %li ran over %i ms, worst over by %.1f ms.\n",
+	        tl.iterations, tl.late, TRACE_SLOW_US / 1000, tl.worst / 1000000.0);
+	fprintf(stderr, "%li words played, %li turned away, in %li batches, %li games finished.\n",
+	        ps->accepted, ps->rejected, ps->batches, ps->games);
+	if(ps->batches > 0) {
+		fprintf(stderr, "Time for each word, median and 99th percentile:");
+		for(i = 0; i < PLAY_STAGES; i++)
+			fprintf(stderr, "%s %s %.1f/%.1f us", i == 0 ? "" : ",", play_stage_name(i),
+			        plays_quantile(ps, i, 0.5) / 1000.0, plays_quantile(ps, i, 0.99) / 1000.0);
+		fprintf(stderr, ".\n");
+	}
+	if(ad != NULL) {
+		fprintf(stderr, "%li settings changed through the admin socket.\n", ad->changes);
+		admin_free(ad, up < 0);
+	}
+	plays_free(ps);
+	if(st != NULL)
+		stats_close(st);
+	trace_free(tr);
+	completer_free(cm);
+	lobby_free(l);
 	game_free(g);
 	for(i = 0; i < s->connections; i++)
 		free(bufs[i]);
 	free(bufs);
 	server_free(s);
+	if(ds != NULL)
+		dict_store_free(ds);
+	if(ul != -1) {
+		close(ul);
+		if(up < 0) /* the new server will take the path over */
+			unlink(upgradepath);
+	}
+	if(unixpath != NULL && up < 0)
+		unlink(unixpath);
+	if(up >= 0) /* lets the new server know we're gone */
+		close(up);
 	exit(EXIT_SUCCESS);
 
+error7:
+	if(cl != NULL)
+		cluster_free(cl);
+error9:
+	if(ul != -1) {
+		close(ul);
+		unlink(upgradepath);
+	}
+error12:
+	if(ad != NULL)
+		admin_free(ad, 1);
+error13:
+	plays_free(ps);
+error11:
+	if(st != NULL)
+		stats_close(st);
+error8:
+	trace_free(tr);
+error10:
+	completer_free(cm);
+error6:
+	lobby_free(l);
 error4:
 	game_free(g);
 error3:
@@ -200,12 +814,291 @@ error2:
 	free(bufs);
 error1:
 	server_free(s);
+error5:
+	if(u != NULL)
+		upgrade_free(u);
+	if(up >= 0)
+		close(up);
+	if(ds != NULL)
+		dict_store_free(ds);
 error0:
 	exit(EXIT_FAILURE);
 }
 
 void signalhandler(int signum) {
+	if(signum == SIGHUP) {
+		reload = 1;
+		return;
+	}
+	if(signum == SIGUSR1) {
+		dump = 1;
+		return;
+	}
+
 	fprintf(stderr, "\n\nSignal %i received.\n", signum);
 	running = 0;
 	return;
 }
+
+/* Sends a message from SERVER.  Unlike connection_message(), this keeps the name separate from the text. */
+int server_message(Connection *c, const char *text) {
+	char data[MAX_COMMAND];
+	char buf[MAX_COMMAND];
+	int len;
+
+	len = snprintf(data, MAX_COMMAND, "SERVER%c%s", '\0', text);
+	if(len >= MAX_COMMAND)
+		return(-1);
+	len = command_generate(buf, MAX_COMMAND, COMMANDS[CMD_MSG].name, COMMANDS[CMD_MSG].length, data, len);
+	if(len == -1)
+		return(-1);
+	if(connection_write(c, buf, len) == -1)
+		return(-1);
+
+	return(0);
+}
+
+void token_to_hex(char *hex, const unsigned char *token) {
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for(i = 0; i < RESUME_TOKEN_LEN; i++) {
+		hex[i * 2] = digits[token[i] >> 4];
+		hex[i * 2 + 1] = digits[token[i] & 0xF];
+	}
+}
+
+/* One lowercase hex digit, as token_to_hex() writes them, or -1. */
+static int hex_digit(char c) {
+	if(c >= '0' && c <= '9')
+		return(c - '0');
+	if(c >= 'a' && c <= 'f')
+		return(c - 'a' + 10);
+
+	return(-1);
+}
+
+int hex_to_token(unsigned char *token, const char *hex) {
+	int i, hi, lo;
+
+	for(i = 0; i < RESUME_TOKEN_LEN; i++) {
+		hi = hex_digit(hex[i * 2]);
+		lo = hex_digit(hex[i * 2 + 1]);
+		if(hi == -1 || lo == -1)
+			return(-1);
+		token[i] = (hi << 4) | lo;
+	}
+
+	return(0);
+}
+
+/* Called by game_expire(), priv is the Cluster or NULL. */
+void player_expired(Player *p, void *priv) {
+	Cluster *cl = priv;
+
+	if(cl != NULL)
+		cluster_send(cl, CMD_GONE, p->name, strlen(p->name));
+}
+
+/* Called by plays_expire() when a game ends, priv is the StatsStore or NULL. */
+void game_over(Room *r, void *priv) {
+	StatsStore *st = priv;
+	const char *name[r->orders];
+	int rating[r->orders];
+	char msg[MAX_COMMAND];
+	int len, i;
+
+	fprintf(stderr, "Game in room %i over after %i words.\n", r->id, r->match->moves);
+	if(st == NULL)
+		return;
+
+	for(i = 0; i < r->orders; i++)
+		name[i] = &(r->ordername[(MAX_NAME_LEN + 1) * i]);
+	if(stats_game(st, name, r->orders, r->match->loser, r->match->moves, rating) == -1)
+		fprintf(stderr, "Couldn't record the game in room %i for everyone.\n", r->id);
+
+	len = snprintf(msg, MAX_COMMAND, "SERVER%cRatings are now", '\0');
+	for(i = 0; i < r->orders; i++) {
+		if(r->order[i] != NULL)
+			r->order[i]->rating = rating[i];
+		if(len < MAX_COMMAND)
+			len += snprintf(&(msg[len]), MAX_COMMAND - len, "%s %s %i", i == 0 ? "" : ",", name[i], rating[i]);
+	}
+	if(len >= MAX_COMMAND)
+		len = MAX_COMMAND - 1;
+	if(r->players > 0)
+		room_send_command(r, CMD_MSG, msg, len);
+}
+
+/* Puts changed settings in to effect, anything read every pass is just read from cfg. */
+void config_apply(const Config *cfg, Config *live, Server *s, Lobby *l) {
+	if(cfg->value[CONFIG_TIMEOUT] != live->value[CONFIG_TIMEOUT])
+		server_set_timeout(s, cfg->value[CONFIG_TIMEOUT]);
+	if(cfg->value[CONFIG_MAXUSERS] != live->value[CONFIG_MAXUSERS])
+		server_limit_connections(s, cfg->value[CONFIG_MAXUSERS]);
+	if(cfg->value[CONFIG_RATE] != live->value[CONFIG_RATE] || cfg->value[CONFIG_BURST] != live->value[CONFIG_BURST])
+		server_limit_rate(s, cfg->value[CONFIG_RATE], cfg->value[CONFIG_BURST]);
+	if(cfg->value[CONFIG_BACKLOG] != live->value[CONFIG_BACKLOG])
+		server_set_backlog(s, cfg->value[CONFIG_BACKLOG]);
+	l->tickms = cfg->value[CONFIG_LOBBYTICK];
+
+	memcpy(live, cfg, sizeof(Config));
+}
+
+/* Tells the local members of a shared room who they're playing with. */
+static void announce_shared(Room *r, char **name, int names) {
+	char msg[MAX_COMMAND];
+	int len, i, j;
+
+	for(i = 0; i < r->players; i++) {
+		len = snprintf(msg, MAX_COMMAND, "SERVER%cYou're in shared room %u with", '\0', r->cluster);
+		for(j = 0; j < names; j++) {
+			if(strcmp(name[j], r->player[i]->name) != 0 && len < MAX_COMMAND)
+				len += snprintf(&(msg[len]), MAX_COMMAND - len, " %s", name[j]);
+		}
+		if(len >= MAX_COMMAND)
+			len = MAX_COMMAND - 1;
+		player_send_command(r->player[i], CMD_MSG, msg, len);
+	}
+}
+
+/*
+ * Exchanges everything with the broker for this tick: shared rooms given up,
+ * players who need matching elsewhere, then whatever the broker sent.
+ *
+ * returns	0 on success, -1 if the broker is gone.
+ */
+int cluster_tick(Cluster *cl, Game *g, Lobby *l) {
+	Player *waiting[MAX_USERS];
+	Player *p;
+	Room *r;
+	char data[MAX_COMMAND];
+	char *databuf;
+	unsigned short int datalen;
+	char *field[2 + ROOM_SIZE];
+	unsigned int id;
+	int command, fields, len, n, i;
+
+	for(i = 0; i < l->maxrooms; i++) {
+		r = l->room[i];
+		if(r->cluster != 0 && r->players == 0) {
+			len = snprintf(data, MAX_COMMAND, "%u", r->cluster);
+			cluster_send(cl, CMD_LEFT, data, len);
+			r->cluster = 0;
+		}
+	}
+
+	/* withdraw offers for anyone who's since gone back to the lobby, been put
+	 * in a room or left, before the broker pairs them with someone */
+	for(i = 0; i < g->maxplayers; i++) {
+		p = g->player[i];
+		if(!p->offered || (p->state != PLAYER_EMPTY && p->room == NULL && p->offerseq == p->queueseq))
+			continue;
+		/* leaving already sent GONE */
+		if(p->state != PLAYER_EMPTY)
+			cluster_send(cl, CMD_WAIT, p->name, strlen(p->name));
+		p->offered = 0;
+	}
+
+	n = lobby_take_waiting(l, CLUSTER_WAIT_MS, waiting, MAX_USERS);
+	for(i = 0; i < n; i++) {
+		p = waiting[i];
+		p->offerseq = p->queueseq;
+		p->offered = 1;
+		len = snprintf(data, MAX_COMMAND, "%s%c%i", p->name, '\0', p->language);
+		cluster_send(cl, CMD_WAIT, data, len);
+	}
+
+	while((command = cluster_next(cl, &databuf, &datalen)) >= 0) {
+		switch(command) {
+			case CMD_NODE:
+				if(cluster_fields(databuf, datalen, field, 2) != 1 || field[0][0] < '0' || field[0][0] > '9') {
+					fprintf(stderr, "Malformed NODE from broker.\n");
+					return(-1);
+				}
+				cl->node = atoi(field[0]);
+				fprintf(stderr, "Joined cluster as node %i.\n", cl->node);
+				break;
+			case CMD_PING:
+				cluster_send(cl, CMD_PONG, databuf, datalen);
+				break;
+			case CMD_PONG:
+				connection_pong_received(cl->c, databuf, datalen);
+				break;
+			case CMD_ROUTE: /* to\0from\0message */
+				if(cluster_fields(databuf, datalen, field, 3) != 3)
+					break;
+				p = game_find_player(g, field[0]);
+				if(p == NULL)
+					break;
+				len = snprintf(data, MAX_COMMAND, "%s%c%s", field[1], '\0', field[2]);
+				if(len < MAX_COMMAND)
+					player_send_command(p, CMD_MSG, data, len);
+				break;
+			case CMD_RMSG: /* room\0from\0message */
+				if(cluster_fields(databuf, datalen, field, 3) != 3)
+					break;
+				id = strtoul(field[0], NULL, 10);
+				len = snprintf(data, MAX_COMMAND, "%s%c%s", field[1], '\0', field[2]);
+				if(len >= MAX_COMMAND)
+					break;
+				for(i = 0; i < l->maxrooms; i++) {
+					r = l->room[i];
+					if(r->cluster != id)
+						continue;
+					room_send_command(r, CMD_MSG, data, len);
+				}
+				break;
+			case CMD_ROOM: /* room\0language\0name... */
+				fields = cluster_fields(databuf, datalen, field, 2 + ROOM_SIZE);
+				if(fields < 3)
+					break;
+				id = strtoul(field[0], NULL, 10);
+				r = lobby_free_room(l);
+				if(r == NULL) {
+					/* the players offered are stuck with the broker otherwise */
+					fprintf(stderr, "No room free for shared room %u.\n", id);
+					for(i = 2; i < fields; i++) {
+						p = game_find_player(g, field[i]);
+						if(p != NULL && p->room == NULL && p->offerseq == p->queueseq) {
+							p->offered = 0; /* the broker's done with them */
+							lobby_enqueue(l, p);
+						}
+					}
+					len = snprintf(data, MAX_COMMAND, "%u", id);
+					cluster_send(cl, CMD_LEFT, data, len);
+					break;
+				}
+				r->cluster = id;
+				r->language = atoi(field[1]);
+				for(i = 2; i < fields; i++) {
+					p = game_find_player(g, field[i]);
+					/* only if they're still waiting, not if they've since gone back to the lobby */
+					if(p != NULL && p->room == NULL && p->offerseq == p->queueseq) {
+						p->offered = 0;
+						room_join(r, p);
+					}
+				}
+				fprintf(stderr, "Shared room %u formed with %i players here.\n", id, r->players);
+				announce_shared(r, &(field[2]), fields - 2);
+				break;
+			default:
+				fprintf(stderr, "Unexpected command %s from broker.\n", COMMANDS[command].name);
+		}
+		cmdbuffer_reset(cl->in);
+	}
+	if(command == -1)
+		return(-1);
+
+	if(cluster_flush(cl) == -1)
+		return(-1);
+
+	command = connection_liveness_check(cl->c);
+	if(command == -2 || connection_timeout_check(cl->c, 0))
+		return(-1);
+	/* pings don't go through the batch, so only when nothing's half sent */
+	if(command == 1 && cl->out->used == 0 && connection_ping(cl->c) == -1)
+		return(-1);
+
+	return(0);
+}
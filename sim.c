@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "game.h"
+#include "solvetable.h"
+#include "util.h"
+
+#define DEFAULT_GAMES		(100000)
+#define DEFAULT_TURN_MS		(10000)
+#define DEFAULT_THINK_MS	(2000)
+#define GAMES_CHUNK			(256) /* games a thread takes at a time */
+#define BOTS_MAX			(2)
+
+typedef struct Sim Sim;
+
+typedef struct {
+	const char *name;
+	int (*move)(Sim *s); /* returns a word ID, or -1 to resign */
+} Bot;
+
+/* Everything a thread needs for its games, allocated once up front. */
+struct Sim {
+	pthread_t thread;
+
+	Match *m;
+	int *taken; /* words played this game starting with each of the dictionary's head grams */
+	uint64_t rng;
+
+	long games;
+	long moves;
+	long wins[BOTS_MAX];
+	long firstwins;
+	long reasons[PLAY_OVER + 1];
+	uint64_t digest;
+};
+
+/* the dictionary's grams each word starts with and leaves, found once up front
+ * so bots only ever index arrays */
+static const Dict *d;
+static const DictGram **opening; /* every unit a word starts with, for first moves */
+static int openings;
+static int overlap;
+static int32_t *headslot; /* headgram slot of each word's first 1 to overlap units, -1 past its end */
+static int32_t *needslot; /* headgram slot of the units each word leaves, -1 if no word starts with them */
+static int *needlen; /* number of units each word leaves */
+static SolveTable *table; /* from -T, for the solved bot */
+
+static const Bot *bot[BOTS_MAX];
+static long games;
+static long nextgame; /* atomic */
+static uint64_t seed;
+static long thinkms;
+static long turnms;
+
+static int index_build() {
+	const DictGram *g;
+	const uint32_t *head;
+	uint32_t need[DICT_GRAM_MAX];
+	int i, k;
+
+	opening = malloc(sizeof(DictGram *) * (d->words + 1));
+	headslot = malloc(sizeof(int32_t) * overlap * (d->words + 1));
+	needslot = malloc(sizeof(int32_t) * (d->words + 1));
+	needlen = malloc(sizeof(int) * (d->words + 1));
+	if(opening == NULL || headslot == NULL || needslot == NULL || needlen == NULL) {
+		fprintf(stderr, "index_build(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+
+	/* words in order of how they start, so each unit's come together */
+	openings = 0;
+	for(i = 0; i < d->words; i++) {
+		head = &(d->heads[d->byhead[i] * DICT_GRAM_MAX]);
+		if(openings == 0 || opening[openings - 1]->unit[0] != head[0])
+			opening[openings++] = dict_starting(d, head, 1);
+	}
+
+	for(i = 0; i < d->words; i++) {
+		head = &(d->heads[i * DICT_GRAM_MAX]);
+		for(k = 0; k < overlap; k++)
+			headslot[i * overlap + k] = head[k] != 0 ? dict_starting(d, head, k + 1) - d->headgram : -1;
+		needlen[i] = dict_need(d, i, overlap, need);
+		g = dict_starting(d, need, needlen[i]);
+		needslot[i] = g != NULL ? g - d->headgram : -1;
+	}
+
+	return(0);
+}
+
+/* Range of byhead a move can come from right now. */
+static int move_range(Sim *s, int *start, int *end) {
+	const DictGram *g;
+
+	if(s->m->needlen == 0) /* first move, start anywhere */
+		g = opening[splitmix64(&(s->rng)) % openings];
+	else
+		g = dict_starting(d, s->m->need, s->m->needlen);
+	if(g == NULL)
+		return(-1);
+	*start = g->lo;
+	*end = g->hi;
+
+	return(0);
+}
+
+/* Counts a word as played, or not, in every gram it starts with that a move can need. */
+static void take(Sim *s, int id, int n) {
+	int k;
+
+	for(k = 0; k < overlap && headslot[id * overlap + k] != -1; k++)
+		s->taken[headslot[id * overlap + k]] += n;
+}
+
+/* Any word that can be played, but not one that loses on the spot if there's anything else. */
+static int bot_random(Sim *s) {
+	int start, end, len, off, i, id, fallback;
+
+	if(move_range(s, &start, &end) == -1)
+		return(-1);
+	len = end - start;
+	if(len == 0)
+		return(-1);
+
+	fallback = -1;
+	off = splitmix64(&(s->rng)) % len;
+	for(i = 0; i < len; i++) {
+		id = d->byhead[start + (off + i) % len];
+		if(match_used(s->m, id))
+			continue;
+		if(d->units[id * 2 + 1] & DICT_UNIT_LOSING) {
+			fallback = id;
+			continue;
+		}
+		return(id);
+	}
+
+	return(fallback);
+}
+
+/* The word from a range of byhead that leaves the next player the fewest words
+ * to answer with. */
+static int squeeze(Sim *s, int start, int end) {
+	const DictGram *g;
+	int len, off, i, id, best, bestleft, left, fallback;
+
+	len = end - start;
+	if(len == 0)
+		return(-1);
+
+	best = -1;
+	bestleft = 0;
+	fallback = -1;
+	off = splitmix64(&(s->rng)) % len;
+	for(i = 0; i < len; i++) {
+		id = d->byhead[start + (off + i) % len];
+		if(match_used(s->m, id))
+			continue;
+		if(d->units[id * 2 + 1] & DICT_UNIT_LOSING) {
+			fallback = id;
+			continue;
+		}
+		if(needslot[id] == -1) /* nothing can follow it */
+			return(id);
+		g = &(d->headgram[needslot[id]]);
+		left = g->hi - g->lo - s->taken[needslot[id]] - (headslot[id * overlap + needlen[id] - 1] == needslot[id]);
+		if(left == 0)
+			return(id);
+		if(best == -1 || left < bestleft) {
+			best = id;
+			bestleft = left;
+		}
+	}
+
+	return(best != -1 ? best : fallback);
+}
+
+/* The word that leaves the next player the fewest words to answer with. */
+static int bot_squeeze(Sim *s) {
+	int start, end;
+
+	if(move_range(s, &start, &end) == -1)
+		return(-1);
+
+	return(squeeze(s, start, end));
+}
+
+/* On the first move, a word the solved table says wins from the unit it has to
+ * start with, and like squeeze after that.  The table is only exact with every
+ * word still there, which is only true for the first move. */
+static int bot_solved(Sim *s) {
+	const SolveEntry *e;
+	unsigned int want;
+	int start, end, len, off, i, id;
+
+	if(move_range(s, &start, &end) == -1)
+		return(-1);
+	len = end - start;
+	if(len == 0)
+		return(-1);
+
+	if(s->m->needlen == 0) {
+		e = solvetable_lookup(table, d->heads[d->byhead[start] * DICT_GRAM_MAX]);
+		want = e != NULL && e->result == SOLVE_WIN ? e->move : 0;
+		off = splitmix64(&(s->rng)) % len;
+		for(i = 0; want != 0 && i < len; i++) {
+			id = d->byhead[start + (off + i) % len];
+			if(!(d->units[id * 2 + 1] & DICT_UNIT_LOSING) && (d->units[id * 2 + 1] & DICT_UNIT_MASK) == want)
+				return(id);
+		}
+	}
+
+	return(squeeze(s, start, end));
+}
+
+static const Bot BOTS[] = {{"random", bot_random},
+                           {"squeeze", bot_squeeze},
+                           {"solved", bot_solved}};
+#define BOT_TYPES	(sizeof(BOTS) / sizeof(Bot))
+
+static void play_game(Sim *s, long game) {
+	Match *m = s->m;
+	uint64_t state;
+	long now;
+	int first, id, i;
+	play_result result;
+
+	/* each game's randomness only depends on the seed and which game it is,
+	 * so results don't depend on how games were split between threads */
+	state = seed ^ (game * 0xD1B54A32D192ED03ULL);
+	s->rng = splitmix64(&state);
+	first = game % BOTS_MAX; /* take turns going first */
+
+	/* only what the last game played needs putting back */
+	for(i = 0; i < m->moves; i++)
+		take(s, m->history[i], -1);
+	now = 0;
+	m->overlap = overlap;
+	match_start(m, now);
+
+	while(!m->over) {
+		id = bot[(m->turn + first) % BOTS_MAX]->move(s);
+		if(thinkms > 0)
+			now += splitmix64(&(s->rng)) % (thinkms + 1);
+		if(id == -1) {
+			if(!match_check_time(m, now))
+				match_resign(m);
+			break;
+		}
+		result = match_play_id(m, id, now);
+		if(result == PLAY_OK || result == PLAY_LOSING)
+			take(s, id, 1);
+	}
+
+	s->games++;
+	s->moves += m->moves;
+	s->wins[(1 - m->loser + first) % BOTS_MAX]++;
+	if(m->loser != 0)
+		s->firstwins++;
+	s->reasons[m->reason]++;
+	state = game ^ ((uint64_t)m->moves << 32) ^ ((uint64_t)m->loser << 56) ^ (uint64_t)m->reason;
+	s->digest += splitmix64(&state);
+}
+
+static void *run(void *arg) {
+	Sim *s = arg;
+	long game, last;
+
+	for(;;) {
+		game = __atomic_fetch_add(&nextgame, GAMES_CHUNK, __ATOMIC_RELAXED);
+		if(game >= games)
+			break;
+		last = game + GAMES_CHUNK < games ? game + GAMES_CHUNK : games;
+		for(; game < last; game++)
+			play_game(s, game);
+	}
+
+	return(NULL);
+}
+
+static const Bot *bot_find(const char *name) {
+	unsigned int i;
+
+	for(i = 0; i < BOT_TYPES; i++) {
+		if(strcmp(BOTS[i].name, name) == 0)
+			return(&(BOTS[i]));
+	}
+
+	return(NULL);
+}
+
+int main(int argc, char **argv) {
+	Dict *dict;
+	Sim *sim;
+	struct timespec start, end;
+	double elapsed;
+	long moves, wins[BOTS_MAX], firstwins, reasons[PLAY_OVER + 1];
+	uint64_t digest;
+	const char *tablepath;
+	int threads, opt, i, j;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	games = DEFAULT_GAMES;
+	seed = 1;
+	turnms = DEFAULT_TURN_MS;
+	thinkms = DEFAULT_THINK_MS;
+	overlap = 1;
+	tablepath = NULL;
+	while((opt = getopt(argc, argv, "j:g:s:t:k:o:T:")) != -1) {
+		switch(opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'g':
+				games = atol(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 't':
+				turnms = atol(optarg);
+				break;
+			case 'k':
+				thinkms = atol(optarg);
+				break;
+			case 'o':
+				overlap = atoi(optarg);
+				break;
+			case 'T':
+				tablepath = optarg;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if(argc - optind < 1 || argc - optind > 3 || threads < 1 || games < 1 || turnms < 0 || thinkms < 0 || overlap < 1 || overlap > DICT_GRAM_MAX)
+		goto usage;
+
+	bot[0] = bot_find(argc - optind > 1 ? argv[optind + 1] : "random");
+	bot[1] = bot_find(argc - optind > 2 ? argv[optind + 2] : "squeeze");
+	if(bot[0] == NULL || bot[1] == NULL) {
+		fprintf(stderr, "main(): Bots are:");
+		for(i = 0; i < (int)BOT_TYPES; i++)
+			fprintf(stderr, " %s", BOTS[i].name);
+		fprintf(stderr, "\n");
+		goto error0;
+	}
+	if((bot[0]->move == bot_solved || bot[1]->move == bot_solved) && (tablepath == NULL || overlap != 1)) {
+		fprintf(stderr, "main(): The solved bot needs a table from shiritori_solve, given with -T, and words chaining on one letter.\n");
+		goto error0;
+	}
+
+	dict = dict_load(argv[optind]);
+	if(dict == NULL) {
+		fprintf(stderr, "main(): Couldn't load dictionary.\n");
+		goto error0;
+	}
+	d = dict;
+	if(tablepath != NULL) {
+		table = solvetable_load(tablepath, d);
+		if(table == NULL) {
+			fprintf(stderr, "main(): Couldn't load solved table.\n");
+			goto error1;
+		}
+	}
+	if(index_build() == -1)
+		goto error1;
+	if(openings == 0) {
+		fprintf(stderr, "main(): Dictionary has no playable words.\n");
+		goto error1;
+	}
+
+	sim = calloc(threads, sizeof(Sim));
+	if(sim == NULL) {
+		fprintf(stderr, "main(): Couldn't allocate memory.\n");
+		goto error1;
+	}
+	for(i = 0; i < threads; i++) {
+		sim[i].m = match_init(d, BOTS_MAX, turnms);
+		sim[i].taken = calloc(d->headmask + 1, sizeof(int));
+		if(sim[i].m == NULL || sim[i].taken == NULL) {
+			fprintf(stderr, "main(): Couldn't allocate memory.\n");
+			goto error2;
+		}
+	}
+
+	nextgame = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&(sim[i].thread), NULL, run, &(sim[i])) != 0) {
+			fprintf(stderr, "main(): Couldn't start thread.\n");
+			games = 0; /* stop the ones that did start */
+			for(i--; i >= 0; i--)
+				pthread_join(sim[i].thread, NULL);
+			goto error2;
+		}
+	}
+	for(i = 0; i < threads; i++)
+		pthread_join(sim[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	moves = 0;
+	firstwins = 0;
+	digest = 0;
+	memset(wins, 0, sizeof(wins));
+	memset(reasons, 0, sizeof(reasons));
+	for(i = 0; i < threads; i++) {
+		moves += sim[i].moves;
+		firstwins += sim[i].firstwins;
+		digest += sim[i].digest;
+		for(j = 0; j < BOTS_MAX; j++)
+			wins[j] += sim[i].wins[j];
+		for(j = 0; j <= PLAY_OVER; j++)
+			reasons[j] += sim[i].reasons[j];
+	}
+
+	printf("%li games, %li moves in %.3f seconds on %i threads (%.0f games/s, %.0f moves/s).\n",
+	       games, moves, elapsed, threads, games / elapsed, moves / elapsed);
+	printf("%s won %li (%.1f%%), %s won %li (%.1f%%).\n",
+	       bot[0]->name, wins[0], 100.0 * wins[0] / games, bot[1]->name, wins[1], 100.0 * wins[1] / games);
+	printf("First player won %.1f%%, games lasted %.1f moves on average.\n", 100.0 * firstwins / games, (double)moves / games);
+	printf("Lost by running out of words %li, playing a losing word %li, running out of time %li.\n",
+	       reasons[PLAY_RESIGN], reasons[PLAY_LOSING], reasons[PLAY_TIMEOUT]);
+	printf("Digest %016llx\n", (unsigned long long)digest);
+
+	for(i = 0; i < threads; i++) {
+		match_free(sim[i].m);
+		free(sim[i].taken);
+	}
+	free(sim);
+	if(table != NULL)
+		solvetable_free(table);
+	dict_free(dict);
+	exit(EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "Usage: %s [-j threads] [-g games] [-s seed] [-t turn ms] [-k most think ms] [-o letters words chain on] [-T solved table] <dictionary> [bot] [bot]\n", argv[0]);
+	goto error0;
+error2:
+	for(i = 0; i < threads; i++) {
+		if(sim[i].m != NULL)
+			match_free(sim[i].m);
+		free(sim[i].taken);
+	}
+	free(sim);
+error1:
+	if(table != NULL)
+		solvetable_free(table);
+	dict_free(dict);
+error0:
+	exit(EXIT_FAILURE);
+}
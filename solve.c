@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dict.h"
+#include "solvetable.h"
+#include "util.h"
+
+#define DEFAULT_BUDGET	(1000000) /* positions searched per first move before giving up */
+#define DEFAULT_TABLE_MB	(64)
+#define MAX_DEPTH		(65536)
+#define THREAD_STACK	(MAX_DEPTH * 1024)
+
+/*
+ * The game is played on a multigraph with a vertex for each unit and an edge
+ * from a word's first unit to its last.  Words with the same first and last
+ * unit are interchangeable, so a position is just how many of each edge are
+ * left and where play is.  Words which lose as soon as they're played aren't
+ * edges at all, playing one is no better than having nothing to play.
+ */
+static int verts;
+static uint32_t *vunit; /* sorted */
+static int *outdeg0;
+static int *estart; /* first edge from each vertex, edges are sorted by where they're from */
+static int edges;
+static int *efrom;
+static int *eto;
+static int *ecount0;
+
+/* positions are hashed as sum(count * zedge) + zvert, so playing a word is one subtraction */
+static uint64_t *zedge;
+static uint64_t *zvert;
+static uint64_t hash0;
+
+/* shared between threads, each entry is the hash with the result in the low 2 bits */
+static uint64_t *tt;
+static uint64_t ttmask;
+
+typedef struct {
+	int vert;
+	int edge;
+	int result; /* for the player who has to answer the edge */
+	long nodes;
+} Task;
+
+typedef struct {
+	int *task;
+	int top; /* thieves take from here */
+	int bottom; /* the owner takes from here */
+	pthread_mutex_t lock;
+} Deque;
+
+typedef struct {
+	pthread_t thread;
+	int id;
+
+	int *count;
+	int *outdeg;
+	uint64_t hash;
+	long nodes;
+	long budget;
+	int depth;
+
+	Deque deque;
+} Worker;
+
+static Task *task;
+static int tasks;
+static Worker *worker;
+static int workers;
+
+static int u32_compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+static int u64_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+static int vert_find(uint32_t unit) {
+	uint32_t *v;
+
+	v = bsearch(&unit, vunit, verts, sizeof(uint32_t), u32_compare);
+
+	return(v - vunit);
+}
+
+static int graph_build(const Dict *d) {
+	uint64_t *pair;
+	uint64_t seed;
+	uint32_t first, last;
+	int npairs, i, j, from, to, same, count;
+
+	vunit = malloc(sizeof(uint32_t) * d->words * 2);
+	pair = malloc(sizeof(uint64_t) * d->words);
+	if(vunit == NULL || pair == NULL)
+		goto gerror0;
+
+	verts = 0;
+	npairs = 0;
+	for(i = 0; i < d->words; i++) {
+		first = d->units[i * 2];
+		last = d->units[i * 2 + 1];
+		if(first == 0)
+			continue;
+		vunit[verts++] = first;
+		if((last & DICT_UNIT_LOSING) || (last & DICT_UNIT_MASK) == 0)
+			continue;
+		vunit[verts++] = last & DICT_UNIT_MASK;
+		pair[npairs++] = ((uint64_t)first << 32) | (last & DICT_UNIT_MASK);
+	}
+	qsort(vunit, verts, sizeof(uint32_t), u32_compare);
+	for(i = 0, j = 0; i < verts; i++) {
+		if(j == 0 || vunit[j - 1] != vunit[i])
+			vunit[j++] = vunit[i];
+	}
+	verts = j;
+
+	/* same units in the same order as the vertices, so sorting pairs sorts edges by vertex */
+	qsort(pair, npairs, sizeof(uint64_t), u64_compare);
+	efrom = malloc(sizeof(int) * (npairs + 1));
+	eto = malloc(sizeof(int) * (npairs + 1));
+	ecount0 = malloc(sizeof(int) * (npairs + 1));
+	estart = malloc(sizeof(int) * (verts + 1));
+	outdeg0 = malloc(sizeof(int) * (verts + 1));
+	if(efrom == NULL || eto == NULL || ecount0 == NULL || estart == NULL || outdeg0 == NULL)
+		goto gerror0;
+
+	edges = 0;
+	for(i = 0; i < npairs; i += same) {
+		for(same = 1; i + same < npairs && pair[i + same] == pair[i]; same++);
+		count = same;
+		from = vert_find(pair[i] >> 32);
+		to = vert_find(pair[i] & 0xFFFFFFFF);
+		/* two words from a unit back to itself cancel out: whoever wins without
+		 * them answers one with the other and carries on */
+		if(from == to)
+			count %= 2;
+		if(count == 0)
+			continue;
+		efrom[edges] = from;
+		eto[edges] = to;
+		ecount0[edges] = count;
+		edges++;
+	}
+	for(i = 0; i <= verts; i++) {
+		estart[i] = edges;
+		outdeg0[i] = 0;
+	}
+	for(i = edges - 1; i >= 0; i--) {
+		estart[efrom[i]] = i;
+		outdeg0[efrom[i]] += ecount0[i];
+	}
+	for(i = verts - 1; i >= 0; i--) { /* vertices with no edges start where the next one does */
+		if(estart[i] > estart[i + 1])
+			estart[i] = estart[i + 1];
+	}
+
+	zedge = malloc(sizeof(uint64_t) * (edges + 1));
+	zvert = malloc(sizeof(uint64_t) * (verts + 1));
+	if(zedge == NULL || zvert == NULL)
+		goto gerror0;
+	seed = 0x5348524953484952ULL;
+	hash0 = 0;
+	for(i = 0; i < edges; i++) {
+		zedge[i] = splitmix64(&seed);
+		hash0 += zedge[i] * (uint64_t)ecount0[i];
+	}
+	for(i = 0; i < verts; i++)
+		zvert[i] = splitmix64(&seed);
+
+	free(pair);
+	return(0);
+
+gerror0:
+	fprintf(stderr, "graph_build(): Couldn't allocate memory.\n");
+	free(pair);
+	return(-1);
+}
+
+static void play(Worker *w, int e) {
+	w->count[e]--;
+	w->outdeg[efrom[e]]--;
+	w->hash -= zedge[e];
+}
+
+static void unplay(Worker *w, int e) {
+	w->count[e]++;
+	w->outdeg[efrom[e]]++;
+	w->hash += zedge[e];
+}
+
+static void tt_store(uint64_t key, int result) {
+	__atomic_store_n(&(tt[key & ttmask]), (key & ~(uint64_t)3) | result, __ATOMIC_RELAXED);
+}
+
+/* Result for the player who has to play from v. */
+static int search(Worker *w, int v) {
+	uint64_t key, entry;
+	int e, to, result, unknown;
+
+	if(++(w->nodes) > w->budget || w->depth >= MAX_DEPTH)
+		return(SOLVE_UNKNOWN);
+	if(w->outdeg[v] == 0)
+		return(SOLVE_LOSS);
+
+	key = w->hash ^ zvert[v];
+	entry = __atomic_load_n(&(tt[key & ttmask]), __ATOMIC_RELAXED);
+	if((entry & ~(uint64_t)3) == (key & ~(uint64_t)3) && (entry & 3) != SOLVE_UNKNOWN)
+		return(entry & 3);
+
+	/* look for a word that leaves nothing to answer with before trying anything deeper */
+	for(e = estart[v]; e < estart[v + 1]; e++) {
+		to = eto[e];
+		if(w->count[e] > 0 && w->outdeg[to] - (to == v) == 0) {
+			tt_store(key, SOLVE_WIN);
+			return(SOLVE_WIN);
+		}
+	}
+
+	unknown = 0;
+	w->depth++;
+	for(e = estart[v]; e < estart[v + 1]; e++) {
+		if(w->count[e] == 0)
+			continue;
+		play(w, e);
+		result = search(w, eto[e]);
+		unplay(w, e);
+		if(result == SOLVE_LOSS) {
+			w->depth--;
+			tt_store(key, SOLVE_WIN);
+			return(SOLVE_WIN);
+		}
+		if(result == SOLVE_UNKNOWN)
+			unknown = 1;
+	}
+	w->depth--;
+
+	if(unknown)
+		return(SOLVE_UNKNOWN);
+	tt_store(key, SOLVE_LOSS);
+	return(SOLVE_LOSS);
+}
+
+static int deque_take(Deque *q, int steal) {
+	int t;
+
+	pthread_mutex_lock(&(q->lock));
+	if(q->top == q->bottom)
+		t = -1;
+	else if(steal)
+		t = q->task[q->top++];
+	else
+		t = q->task[--(q->bottom)];
+	pthread_mutex_unlock(&(q->lock));
+
+	return(t);
+}
+
+static void *work(void *arg) {
+	Worker *w = arg;
+	Task *t;
+	int i, next;
+
+	for(;;) {
+		next = deque_take(&(w->deque), 0);
+		/* nothing of our own left, help whoever's still busy */
+		for(i = 1; next == -1 && i < workers; i++)
+			next = deque_take(&(worker[(w->id + i) % workers].deque), 1);
+		if(next == -1) /* tasks never make more tasks, so everything's been taken */
+			break;
+
+		t = &(task[next]);
+		memcpy(w->count, ecount0, sizeof(int) * edges);
+		memcpy(w->outdeg, outdeg0, sizeof(int) * verts);
+		w->hash = hash0;
+		w->nodes = 0;
+		w->depth = 0;
+		play(w, t->edge);
+		t->result = search(w, eto[t->edge]);
+		t->nodes = w->nodes;
+	}
+
+	return(NULL);
+}
+
+static const char *result_name(int result) {
+	switch(result) {
+		case SOLVE_WIN:
+			return("win");
+		case SOLVE_LOSS:
+			return("loss");
+		default:
+			return("unknown");
+	}
+}
+
+int main(int argc, char **argv) {
+	Dict *d;
+	SolveEntry *entry;
+	pthread_attr_t attr;
+	struct timespec start, end;
+	char unit[5], move[5];
+	long budget, tablemb, nodes;
+	int opt, result, best, v, e, i, j;
+	int wins, losses;
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	budget = DEFAULT_BUDGET;
+	tablemb = DEFAULT_TABLE_MB;
+	while((opt = getopt(argc, argv, "j:n:m:")) != -1) {
+		switch(opt) {
+			case 'j':
+				workers = atoi(optarg);
+				break;
+			case 'n':
+				budget = atol(optarg);
+				break;
+			case 'm':
+				tablemb = atol(optarg);
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if(argc - optind != 2 || workers < 1 || budget < 1 || tablemb < 1)
+		goto usage;
+
+	d = dict_load(argv[optind]);
+	if(d == NULL) {
+		fprintf(stderr, "main(): Couldn't load dictionary.\n");
+		goto error0;
+	}
+	if(graph_build(d) == -1)
+		goto error1;
+	fprintf(stderr, "%i words make %i units and %i distinct edges.\n", d->words, verts, edges);
+
+	for(ttmask = 1; ttmask * 2 * sizeof(uint64_t) <= (uint64_t)tablemb * 1024 * 1024; ttmask *= 2);
+	tt = calloc(ttmask, sizeof(uint64_t));
+	task = malloc(sizeof(Task) * (edges + 1));
+	worker = malloc(sizeof(Worker) * workers);
+	entry = malloc(sizeof(SolveEntry) * (verts + 1));
+	if(tt == NULL || task == NULL || worker == NULL || entry == NULL) {
+		fprintf(stderr, "main(): Couldn't allocate memory.\n");
+		goto error1;
+	}
+	ttmask--;
+
+	/* one task for every first move, dealt out round robin; the big ones get stolen from */
+	tasks = 0;
+	for(i = 0; i < workers; i++) {
+		worker[i].id = i;
+		worker[i].budget = budget;
+		worker[i].count = malloc(sizeof(int) * (edges + 1));
+		worker[i].outdeg = malloc(sizeof(int) * (verts + 1));
+		worker[i].deque.task = malloc(sizeof(int) * (edges / workers + 1));
+		if(worker[i].count == NULL || worker[i].outdeg == NULL || worker[i].deque.task == NULL) {
+			fprintf(stderr, "main(): Couldn't allocate memory.\n");
+			goto error1;
+		}
+		worker[i].deque.top = 0;
+		worker[i].deque.bottom = 0;
+		pthread_mutex_init(&(worker[i].deque.lock), NULL);
+	}
+	for(e = 0; e < edges; e++) {
+		task[tasks].vert = efrom[e];
+		task[tasks].edge = e;
+		task[tasks].result = SOLVE_UNKNOWN;
+		task[tasks].nodes = 0;
+		i = tasks % workers;
+		worker[i].deque.task[worker[i].deque.bottom++] = tasks;
+		tasks++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK);
+	for(i = 0; i < workers; i++) {
+		if(pthread_create(&(worker[i].thread), &attr, work, &(worker[i])) != 0) {
+			fprintf(stderr, "main(): Couldn't start thread.\n");
+			for(i--; i >= 0; i--)
+				pthread_join(worker[i].thread, NULL);
+			goto error1;
+		}
+	}
+	for(i = 0; i < workers; i++)
+		pthread_join(worker[i].thread, NULL);
+	pthread_attr_destroy(&attr);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* tasks are in edge order, so each vertex's are together */
+	nodes = 0;
+	wins = 0;
+	losses = 0;
+	for(v = 0, j = 0; v < verts; v++) {
+		result = SOLVE_LOSS;
+		best = -1;
+		for(; j < tasks && task[j].vert == v; j++) {
+			nodes += task[j].nodes;
+			if(task[j].result == SOLVE_LOSS) {
+				result = SOLVE_WIN;
+				best = task[j].edge;
+			} else if(task[j].result == SOLVE_UNKNOWN && result != SOLVE_WIN) {
+				result = SOLVE_UNKNOWN;
+				best = task[j].edge;
+			} else if(best == -1) { /* losing anyway, but something has to be played */
+				best = task[j].edge;
+			}
+		}
+		entry[v].unit = vunit[v];
+		entry[v].result = result;
+		entry[v].move = best == -1 ? 0 : vunit[eto[best]];
+		if(result == SOLVE_WIN)
+			wins++;
+		else if(result == SOLVE_LOSS)
+			losses++;
+
+		unit[norm_unit_encode(unit, entry[v].unit)] = '\0';
+		move[entry[v].move == 0 ? 0 : norm_unit_encode(move, entry[v].move)] = '\0';
+		printf("%s\t%s\t%s\n", unit, result_name(result), move);
+	}
+	fprintf(stderr, "%i wins, %i losses, %i unknown, %li positions in %.3f seconds on %i threads.\n",
+	        wins, losses, verts - wins - losses, nodes,
+	        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, workers);
+
+	if(solvetable_write(argv[optind + 1], d, entry, verts) == -1)
+		goto error1;
+
+	dict_free(d);
+	exit(EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "Usage: %s [-j threads] [-n positions per move] [-m table MB] <dictionary> <output>\n", argv[0]);
+	goto error0;
+error1:
+	dict_free(d);
+error0:
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "solvetable.h"
+
+SolveTable *solvetable_load(const char *path, const Dict *d) {
+	SolveTable *t;
+	struct stat st;
+	int fd;
+	void *map;
+
+	t = malloc(sizeof(SolveTable));
+	if(t == NULL) {
+		fprintf(stderr, "solvetable_load(): Couldn't allocate memory.\n");
+		goto serror0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		perror("solvetable_load(): open()");
+		goto serror1;
+	}
+	if(fstat(fd, &st) == -1) {
+		perror("solvetable_load(): fstat()");
+		goto serror2;
+	}
+	if((size_t)st.st_size < sizeof(SolveHeader)) {
+		fprintf(stderr, "solvetable_load(): %s is too small.\n", path);
+		goto serror2;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("solvetable_load(): mmap()");
+		goto serror2;
+	}
+
+	t->hdr = map;
+	t->mapsize = st.st_size;
+	t->entry = (const SolveEntry *)((const char *)map + sizeof(SolveHeader));
+	t->entries = t->hdr->entries;
+
+	if(memcmp(t->hdr->magic, SOLVE_MAGIC, sizeof(SOLVE_MAGIC)) != 0 || t->hdr->version != SOLVE_VERSION) {
+		fprintf(stderr, "solvetable_load(): Not a solved table or unsupported version.\n");
+		goto serror3;
+	}
+	if(t->mapsize != sizeof(SolveHeader) + (uint64_t)t->hdr->entries * sizeof(SolveEntry)) {
+		fprintf(stderr, "solvetable_load(): Bad size.\n");
+		goto serror3;
+	}
+	if(d != NULL && (d->hdr->checksum != t->hdr->dictchecksum || (uint32_t)d->language != t->hdr->language)) {
+		fprintf(stderr, "solvetable_load(): Table was solved for a different dictionary.\n");
+		goto serror3;
+	}
+	close(fd);
+
+	return(t);
+
+serror3:
+	munmap(map, st.st_size);
+serror2:
+	close(fd);
+serror1:
+	free(t);
+serror0:
+	return(NULL);
+}
+
+void solvetable_free(SolveTable *t) {
+	munmap((void *)t->hdr, t->mapsize);
+	free(t);
+}
+
+const SolveEntry *solvetable_lookup(const SolveTable *t, unsigned int unit) {
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = t->entries - 1;
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		if(t->entry[mid].unit == unit)
+			return(&(t->entry[mid]));
+		if(t->entry[mid].unit < unit)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return(NULL);
+}
+
+int solvetable_write(const char *path, const Dict *d, const SolveEntry *entry, int entries) {
+	SolveHeader hdr;
+	FILE *out;
+
+	memset(&hdr, 0, sizeof(SolveHeader));
+	memcpy(hdr.magic, SOLVE_MAGIC, sizeof(SOLVE_MAGIC));
+	hdr.version = SOLVE_VERSION;
+	hdr.language = d->language;
+	hdr.dictchecksum = d->hdr->checksum;
+	hdr.entries = entries;
+
+	out = fopen(path, "wb");
+	if(out == NULL) {
+		perror("solvetable_write(): fopen()");
+		return(-1);
+	}
+	if(fwrite(&hdr, sizeof(SolveHeader), 1, out) != 1 ||
+	   fwrite(entry, sizeof(SolveEntry), entries, out) != (size_t)entries) {
+		perror("solvetable_write(): fwrite()");
+		fclose(out);
+		return(-1);
+	}
+	if(fclose(out) != 0) {
+		perror("solvetable_write(): fclose()");
+		return(-1);
+	}
+
+	return(0);
+}
@@ -0,0 +1,76 @@
+#ifndef __SOLVETABLE_H
+#define __SOLVETABLE_H
+
+#include <stdint.h>
+
+#include "dict.h"
+
+/*
+ * Solved table file layout, made by shiritori_solve.  Host byte order, used
+ * straight from mmap().  Entries follow the header, sorted by unit.
+ */
+#define SOLVE_MAGIC			"SHRSOLV"
+#define SOLVE_VERSION		(1)
+
+typedef enum {
+	SOLVE_UNKNOWN, SOLVE_WIN, SOLVE_LOSS
+} solve_result;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t language;
+	uint64_t dictchecksum; /* checksum of the dictionary it was solved for */
+	uint32_t entries;
+	uint32_t reserved;
+} SolveHeader;
+
+typedef struct {
+	uint32_t unit; /* unit the player to move must start with */
+	uint32_t result; /* solve_result for the player to move, with no words used yet */
+	uint32_t move; /* unit a word should end in to play it, 0 if there's none */
+} SolveEntry;
+
+typedef struct {
+	const SolveHeader *hdr;
+	size_t mapsize;
+
+	const SolveEntry *entry;
+	int entries;
+} SolveTable;
+
+/*
+ * Maps and checks a solved table.
+ *
+ * path		File to load.
+ * d		Dictionary it should have been solved for, or NULL to not check.
+ *
+ * returns	New SolveTable or NULL on error.
+ */
+SolveTable *solvetable_load(const char *path, const Dict *d);
+
+void solvetable_free(SolveTable *t);
+
+/*
+ * Finds the entry for a unit.
+ *
+ * t		Table to search.
+ * unit		Unit to find.
+ *
+ * returns	Entry or NULL if the unit isn't in the table.
+ */
+const SolveEntry *solvetable_lookup(const SolveTable *t, unsigned int unit);
+
+/*
+ * Writes a solved table.
+ *
+ * path		File to write.
+ * d		Dictionary it was solved for.
+ * entry	Entries, sorted by unit.
+ * entries	Number of entries.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int solvetable_write(const char *path, const Dict *d, const SolveEntry *entry, int entries);
+
+#endif
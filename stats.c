@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "game.h"
+#include "util.h"
+
+#define STATS_ELO_K		(32) /* most a rating moves in one game */
+
+static uint32_t record_checksum(const StatsRecord *r) {
+	return(fnv1a(&(r->checksum) + 1, sizeof(StatsRecord) - offsetof(StatsRecord, name)) ^ r->generation);
+}
+
+static int record_valid(const StatsRecord *r) {
+	return(r->generation != 0 && r->checksum == record_checksum(r) && memchr(r->name, '\0', MAX_NAME_LEN + 1) != NULL);
+}
+
+static const StatsRecord *stats_record(const StatsStore *s, int slot) {
+	return(&(s->slot[slot].copy[s->latest[slot]]));
+}
+
+/* Higher rating first, then more wins, then whoever got there first. */
+static int stats_before(const StatsStore *s, int a, int b) {
+	const StatsRecord *ra, *rb;
+
+	ra = stats_record(s, a);
+	rb = stats_record(s, b);
+	if(ra->rating != rb->rating)
+		return(ra->rating > rb->rating);
+	if(ra->wins != rb->wins)
+		return(ra->wins > rb->wins);
+
+	return(a < b);
+}
+
+/* Finds the last node on each level before where slot goes. */
+static void rank_search(const StatsStore *s, int slot, int *update) {
+	int x, i;
+
+	x = s->head;
+	for(i = s->levels - 1; i >= 0; i--) {
+		while(s->node[x].next[i] != -1 && stats_before(s, s->node[x].next[i], slot))
+			x = s->node[x].next[i];
+		update[i] = x;
+	}
+}
+
+static void rank_insert(StatsStore *s, int slot) {
+	int update[STATS_LEVELS];
+	int levels, i;
+
+	/* each level has a quarter of the one below */
+	for(levels = 1; levels < STATS_LEVELS; levels++) {
+		s->seed ^= s->seed << 13;
+		s->seed ^= s->seed >> 17;
+		s->seed ^= s->seed << 5;
+		if(s->seed & 3)
+			break;
+	}
+	rank_search(s, slot, update);
+	for(i = s->levels; i < levels; i++)
+		update[i] = s->head;
+	if(levels > s->levels)
+		s->levels = levels;
+
+	s->node[slot].levels = levels;
+	for(i = 0; i < levels; i++) {
+		s->node[slot].next[i] = s->node[update[i]].next[i];
+		s->node[update[i]].next[i] = slot;
+	}
+}
+
+/* Must be called before the slot's record changes, while it can still be found. */
+static void rank_remove(StatsStore *s, int slot) {
+	int update[STATS_LEVELS];
+	int i;
+
+	rank_search(s, slot, update);
+	for(i = 0; i < s->node[slot].levels; i++)
+		s->node[update[i]].next[i] = s->node[slot].next[i];
+}
+
+static int stats_create(const char *path) {
+	StatsHeader hdr;
+	char *temp;
+	int fd;
+
+	temp = malloc(strlen(path) + 5);
+	if(temp == NULL) {
+		fprintf(stderr, "stats_create(): Couldn't allocate memory.\n");
+		goto cerror0;
+	}
+	sprintf(temp, "%s.new", path);
+
+	memset(&hdr, 0, sizeof(StatsHeader));
+	memcpy(hdr.magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+	hdr.version = STATS_VERSION;
+	hdr.slots = STATS_SLOTS;
+
+	/* made in full beside it, so there's never half a file there */
+	fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd == -1) {
+		perror("stats_create(): open()");
+		goto cerror1;
+	}
+	if(write(fd, &hdr, sizeof(StatsHeader)) != sizeof(StatsHeader) ||
+	   ftruncate(fd, sizeof(StatsHeader) + sizeof(StatsSlot) * STATS_SLOTS) == -1 ||
+	   fsync(fd) == -1) {
+		perror("stats_create(): write()");
+		goto cerror2;
+	}
+	close(fd);
+	if(rename(temp, path) == -1) {
+		perror("stats_create(): rename()");
+		goto cerror1;
+	}
+	free(temp);
+
+	return(0);
+
+cerror2:
+	close(fd);
+cerror1:
+	unlink(temp);
+	free(temp);
+cerror0:
+	return(-1);
+}
+
+StatsStore *stats_open(const char *path) {
+	StatsStore *s;
+	struct stat st;
+	const StatsRecord *r;
+	unsigned int i;
+	int fd;
+	void *map;
+
+	s = malloc(sizeof(StatsStore));
+	if(s == NULL) {
+		fprintf(stderr, "stats_open(): Couldn't allocate memory.\n");
+		goto serror0;
+	}
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd == -1 && errno == ENOENT) {
+		if(stats_create(path) == -1)
+			goto serror1;
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if(fd == -1) {
+		perror("stats_open(): open()");
+		goto serror1;
+	}
+	if(fstat(fd, &st) == -1) {
+		perror("stats_open(): fstat()");
+		goto serror2;
+	}
+	if((size_t)st.st_size < sizeof(StatsHeader)) {
+		fprintf(stderr, "stats_open(): %s is too small.\n", path);
+		goto serror2;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("stats_open(): mmap()");
+		goto serror2;
+	}
+	s->hdr = map;
+	s->mapsize = st.st_size;
+	s->slot = (StatsSlot *)((char *)map + sizeof(StatsHeader));
+
+	if(memcmp(s->hdr->magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0 || s->hdr->version != STATS_VERSION) {
+		fprintf(stderr, "stats_open(): Not a statistics file or unsupported version.\n");
+		goto serror3;
+	}
+	if(s->hdr->slots == 0 || (s->hdr->slots & (s->hdr->slots - 1)) != 0 ||
+	   s->mapsize != sizeof(StatsHeader) + (uint64_t)s->hdr->slots * sizeof(StatsSlot)) {
+		fprintf(stderr, "stats_open(): Bad size.\n");
+		goto serror3;
+	}
+	s->mask = s->hdr->slots - 1;
+
+	s->latest = malloc(s->hdr->slots);
+	if(s->latest == NULL) {
+		fprintf(stderr, "stats_open(): Couldn't allocate memory.\n");
+		goto serror3;
+	}
+	s->node = malloc(sizeof(StatsNode) * (s->hdr->slots + 1));
+	if(s->node == NULL) {
+		fprintf(stderr, "stats_open(): Couldn't allocate memory.\n");
+		goto serror4;
+	}
+	s->head = s->hdr->slots;
+	for(i = 0; i < STATS_LEVELS; i++)
+		s->node[s->head].next[i] = -1;
+	s->levels = 1;
+	s->seed = time(NULL) | 1;
+
+	/* whichever copy of each is the latest good one, then rank everyone */
+	s->used = 0;
+	for(i = 0; i < s->hdr->slots; i++) {
+		s->latest[i] = -1;
+		if(record_valid(&(s->slot[i].copy[0])))
+			s->latest[i] = 0;
+		if(record_valid(&(s->slot[i].copy[1])) &&
+		   (s->latest[i] == -1 || s->slot[i].copy[1].generation > s->slot[i].copy[0].generation))
+			s->latest[i] = 1;
+		if(s->latest[i] == -1)
+			continue;
+		r = stats_record(s, i);
+		if(r->name[0] == '\0') {
+			s->latest[i] = -1;
+			continue;
+		}
+		s->used++;
+		rank_insert(s, i);
+	}
+	close(fd);
+
+	return(s);
+
+serror4:
+	free(s->latest);
+serror3:
+	munmap(map, st.st_size);
+serror2:
+	close(fd);
+serror1:
+	free(s);
+serror0:
+	return(NULL);
+}
+
+void stats_close(StatsStore *s) {
+	if(msync(s->hdr, s->mapsize, MS_SYNC) == -1)
+		perror("stats_close(): msync()");
+	munmap(s->hdr, s->mapsize);
+	free(s->node);
+	free(s->latest);
+	free(s);
+}
+
+/* Writes a record over whichever copy isn't the latest, which then becomes it. */
+static void stats_write(StatsStore *s, int slot, const StatsRecord *r) {
+	StatsRecord *to;
+	uint32_t generation;
+	int copy;
+
+	copy = s->latest[slot] == -1 ? 0 : !s->latest[slot];
+	generation = s->latest[slot] == -1 ? 1 : stats_record(s, slot)->generation + 1;
+	to = &(s->slot[slot].copy[copy]);
+	memcpy(to, r, sizeof(StatsRecord));
+	to->generation = generation;
+	to->checksum = record_checksum(to);
+	s->latest[slot] = copy;
+}
+
+static int stats_slot(StatsStore *s, const char *name, int create) {
+	StatsRecord r;
+	unsigned int i, probes;
+	size_t len;
+
+	len = strlen(name);
+	if(len == 0 || len > MAX_NAME_LEN)
+		return(-1);
+
+	/* linear probing in the file itself, no slot is ever emptied */
+	i = fnv1a(name, len) & s->mask;
+	for(probes = 0; probes <= s->mask && s->latest[i] != -1; probes++) {
+		if(strcmp(stats_record(s, i)->name, name) == 0)
+			return(i);
+		i = (i + 1) & s->mask;
+	}
+	if(!create || probes > s->mask || (unsigned int)s->used >= s->mask) /* always leave one empty */
+		return(-1);
+
+	memset(&r, 0, sizeof(StatsRecord));
+	memcpy(r.name, name, len);
+	r.rating = DEFAULT_RATING;
+	stats_write(s, i, &r);
+	s->used++;
+	rank_insert(s, i);
+
+	return(i);
+}
+
+const StatsRecord *stats_find(StatsStore *s, const char *name, int create) {
+	int slot;
+
+	slot = stats_slot(s, name, create);
+	if(slot == -1)
+		return(NULL);
+
+	return(stats_record(s, slot));
+}
+
+/* Expected score of a against b, out of 1. */
+static double elo_expected(int a, int b) {
+	return(1.0 / (1.0 + pow(10.0, (b - a) / 400.0)));
+}
+
+int stats_game(StatsStore *s, const char *const *name, int players, int loser, int chain, int *rating) {
+	StatsRecord r;
+	const StatsRecord *l;
+	int slot[players];
+	double change[players];
+	double e;
+	int retval;
+	int i;
+
+	retval = 0;
+	for(i = 0; i < players; i++) {
+		slot[i] = stats_slot(s, name[i], 1);
+		if(slot[i] == -1)
+			retval = -1;
+		change[i] = 0.0;
+	}
+
+	/* each winner beat the loser, every other result doesn't count */
+	if(slot[loser] != -1) {
+		l = stats_record(s, slot[loser]);
+		for(i = 0; i < players; i++) {
+			if(i == loser || slot[i] == -1)
+				continue;
+			e = elo_expected(stats_record(s, slot[i])->rating, l->rating);
+			change[i] += STATS_ELO_K * (1.0 - e);
+			change[loser] -= STATS_ELO_K * (1.0 - e);
+		}
+	}
+
+	for(i = 0; i < players; i++) {
+		if(slot[i] == -1) {
+			if(rating != NULL)
+				rating[i] = DEFAULT_RATING;
+			continue;
+		}
+		memcpy(&r, stats_record(s, slot[i]), sizeof(StatsRecord));
+		r.games++;
+		if(i != loser)
+			r.wins++;
+		if((uint32_t)chain > r.longest)
+			r.longest = chain;
+		r.rating += (int32_t)lround(change[i]);
+
+		rank_remove(s, slot[i]);
+		stats_write(s, slot[i], &r);
+		rank_insert(s, slot[i]);
+		if(rating != NULL)
+			rating[i] = r.rating;
+	}
+
+	return(retval);
+}
+
+int stats_top(const StatsStore *s, const StatsRecord **record, int max) {
+	int x, n;
+
+	n = 0;
+	for(x = s->node[s->head].next[0]; x != -1 && n < max; x = s->node[x].next[0])
+		record[n++] = stats_record(s, x);
+
+	return(n);
+}
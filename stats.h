@@ -0,0 +1,125 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cluster.h"
+
+/*
+ * Player statistics file layout.  Host byte order, used straight from mmap()
+ * and written in place.
+ *
+ * The file is a hash table of names, so a name is only ever stored once and
+ * found again by probing from its hash.  Each slot has two copies of its
+ * record, and an update goes in to whichever isn't the latest, with a higher
+ * generation and a checksum over the lot.  A write cut short by a crash leaves
+ * a copy whose checksum doesn't match, and the other one is used.
+ */
+#define STATS_MAGIC			"SHRSTAT"
+#define STATS_VERSION		(1)
+#define STATS_SLOTS			(65536) /* players a new file has room for, a power of 2 */
+#define STATS_LEVELS		(16) /* skip list levels, enough for 4^16 players */
+#define STATS_TOP			(10) /* players sent for RANKINGS, unless fewer are asked for */
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint64_t reserved;
+} StatsHeader;
+
+typedef struct {
+	uint32_t generation; /* the copy with the higher one is the latest, 0 if never written */
+	uint32_t checksum; /* 32 bit FNV-1a of everything after it */
+	char name[MAX_NAME_LEN + 1];
+	char pad[3];
+	uint32_t games;
+	uint32_t wins;
+	uint32_t longest; /* most words played in one game */
+	int32_t rating;
+	uint32_t reserved;
+} StatsRecord;
+
+typedef struct {
+	StatsRecord copy[2];
+} StatsSlot;
+
+/*
+ * Players ranked by rating, best first, as a skip list of slots so a rating
+ * changing moves one player without looking at anyone else.
+ */
+typedef struct {
+	int32_t next[STATS_LEVELS];
+	int levels;
+} StatsNode;
+
+typedef struct {
+	StatsHeader *hdr;
+	StatsSlot *slot;
+	size_t mapsize;
+	unsigned int mask;
+
+	int8_t *latest; /* copy in use for each slot, -1 for none */
+	int used;
+
+	StatsNode *node; /* one for each slot, then the head */
+	int head;
+	int levels;
+	unsigned int seed;
+} StatsStore;
+
+/*
+ * Maps a statistics file, making a new one if there isn't one.
+ *
+ * path		File to use.
+ *
+ * returns	New StatsStore or NULL on error.
+ */
+StatsStore *stats_open(const char *path);
+
+/*
+ * Writes everything out and unmaps the file.
+ *
+ * s		StatsStore to close.
+ */
+void stats_close(StatsStore *s);
+
+/*
+ * Finds a player's record by name, making one if asked to.
+ *
+ * s		StatsStore.
+ * name		Player's name, terminated.
+ * create	Make a record with DEFAULT_RATING if there isn't one.
+ *
+ * returns	Record or NULL if there isn't one, or no room for one.
+ */
+const StatsRecord *stats_find(StatsStore *s, const char *name, int create);
+
+/*
+ * Records how a game went for everyone in it.  Ratings are Elo, each winner
+ * having beaten the loser.
+ *
+ * s		StatsStore.
+ * name		Everyone who played, terminated.
+ * players	Number of players.
+ * loser	Index in name of the player who lost.
+ * chain	Words played in the game.
+ * rating	If not NULL, everyone's new rating is written here.
+ *
+ * returns	0 on success, -1 if anyone couldn't be recorded.
+ */
+int stats_game(StatsStore *s, const char *const *name, int players, int loser, int chain, int *rating);
+
+/*
+ * Gets the best players from the leaderboard.
+ *
+ * s		StatsStore.
+ * record	Records are written here, best first.
+ * max		Most to get.
+ *
+ * returns	Number of records written.
+ */
+int stats_top(const StatsStore *s, const StatsRecord **record, int max);
+
+#endif
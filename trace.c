@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "util.h"
+
+static const struct {
+	const char *name;
+	const char *arg; /* what arg is, NULL if nothing */
+} TRACE_TYPE[TRACE_TYPES] = {
+	{"accept", "accepted"},
+	{"read", "connection"},
+	{"dispatch", "connection"},
+	{"timeouts", "connection"},
+	{"tick", NULL},
+	{"write", NULL},
+	{"sleep", NULL},
+	{"loop", NULL},
+	{"connect", "connection"},
+	{"disconnect", "connection"},
+	{"reload", "failed"},
+	{"upgrade", NULL},
+	{"dump", "events"}
+};
+
+Tracer *trace_init(void) {
+	Tracer *t;
+
+	t = malloc(sizeof(Tracer));
+	if(t == NULL) {
+		fprintf(stderr, "trace_init(): Couldn't allocate memory.\n");
+		return(NULL);
+	}
+	memset(t->ring, 0, sizeof(t->ring));
+	t->rings = 0;
+	t->state = TRACE_IDLE;
+	t->dumperring = NULL;
+	t->path = NULL;
+	t->dumped = 0;
+
+	return(t);
+}
+
+void trace_free(Tracer *t) {
+	int i;
+
+	if(__atomic_load_n(&(t->state), __ATOMIC_SEQ_CST) != TRACE_IDLE)
+		pthread_join(t->dumper, NULL);
+	for(i = 0; i < TRACE_THREADS; i++)
+		free(t->ring[i].event);
+	free(t->path);
+	free(t);
+}
+
+TraceRing *trace_ring(Tracer *t, const char *name) {
+	TraceRing *r;
+	int i;
+
+	i = __atomic_fetch_add(&(t->rings), 1, __ATOMIC_SEQ_CST);
+	if(i >= TRACE_THREADS)
+		return(NULL);
+
+	r = &(t->ring[i]);
+	r->event = malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+	if(r->event == NULL) {
+		fprintf(stderr, "trace_ring(): Couldn't allocate memory.\n");
+		return(NULL);
+	}
+	strncpy(r->name, name, TRACE_NAME_LEN);
+	r->name[TRACE_NAME_LEN] = '\0';
+	r->tid = syscall(SYS_gettid);
+	r->head = 0;
+	__atomic_store_n(&(r->ready), 1, __ATOMIC_RELEASE);
+
+	return(r);
+}
+
+void trace_record(TraceRing *r, trace_type type, int64_t start, int64_t duration, int arg, const int32_t *phase) {
+	TraceEvent *e;
+	uint64_t head;
+
+	if(r == NULL)
+		return;
+
+	head = r->head;
+	/* a reader seeing any of this event also sees head moved on past the last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e = &(r->event[head & (TRACE_EVENTS - 1)]);
+	e->start = start;
+	e->duration = duration;
+	e->type = type;
+	e->arg = arg;
+	if(phase != NULL)
+		memcpy(e->phase, phase, sizeof(e->phase));
+	else
+		memset(e->phase, 0, sizeof(e->phase));
+	__atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_instant(TraceRing *r, trace_type type, int arg) {
+	trace_record(r, type, now_ns(), -1, arg, NULL);
+}
+
+/*
+ * Copies a ring's events, oldest first, leaving out any which could have been
+ * written over while copying.
+ *
+ * returns	Number of events copied.
+ */
+static int trace_copy(TraceRing *r, TraceEvent *out) {
+	uint64_t head, after, first, i;
+
+	head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+	first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+	for(i = first; i < head; i++)
+		out[i - first] = r->event[i & (TRACE_EVENTS - 1)];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* the slot for after is being written, and everything before it has been */
+	after = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	if(after + 1 > first + TRACE_EVENTS) {
+		i = after + 1 - TRACE_EVENTS;
+		if(i >= head)
+			return(0);
+		memmove(out, &(out[i - first]), sizeof(TraceEvent) * (head - i));
+		first = i;
+	}
+
+	return(head - first);
+}
+
+static void trace_write_event(FILE *f, const TraceRing *r, const TraceEvent *e, pid_t pid, int comma) {
+	int i;
+
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%i,\"tid\":%i,\"ts\":%lli.%03lli",
+	        comma ? "," : "", TRACE_TYPE[e->type].name, e->type < TRACE_PHASES ? "phase" : "server",
+	        (int)pid, (int)r->tid, (long long)(e->start / 1000), (long long)(e->start % 1000));
+	if(e->duration >= 0)
+		fprintf(f, ",\"ph\":\"X\",\"dur\":%lli.%03lli", (long long)(e->duration / 1000), (long long)(e->duration % 1000));
+	else
+		fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"");
+	fprintf(f, ",\"args\":{");
+	if(e->type == TRACE_LOOP) {
+		for(i = 0; i < TRACE_PHASES; i++)
+			fprintf(f, "%s\"%s_us\":%i", i > 0 ? "," : "", TRACE_TYPE[i].name, e->phase[i]);
+	} else if(TRACE_TYPE[e->type].arg != NULL && e->arg != -1) {
+		fprintf(f, "\"%s\":%i", TRACE_TYPE[e->type].arg, e->arg);
+	}
+	fprintf(f, "}}");
+}
+
+static void *trace_dumper(void *arg) {
+	Tracer *t = arg;
+	TraceEvent *copy;
+	TraceRing *r;
+	FILE *f;
+	pid_t pid;
+	int64_t start;
+	int events, written, threads;
+	int i, j;
+
+	start = now_ns();
+	if(t->dumperring == NULL)
+		t->dumperring = trace_ring(t, "recorder");
+	else /* a new thread each time, only ever one at once */
+		t->dumperring->tid = syscall(SYS_gettid);
+
+	copy = malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+	if(copy == NULL) {
+		fprintf(stderr, "trace_dumper(): Couldn't allocate memory.\n");
+		goto derror0;
+	}
+	f = fopen(t->path, "w");
+	if(f == NULL) {
+		perror("trace_dumper(): fopen()");
+		goto derror1;
+	}
+
+	pid = getpid();
+	written = 0;
+	threads = 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for(i = 0; i < TRACE_THREADS; i++) {
+		r = &(t->ring[i]);
+		if(!__atomic_load_n(&(r->ready), __ATOMIC_ACQUIRE))
+			continue;
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":\"%s\"}}",
+		        threads > 0 ? "," : "", (int)pid, (int)r->tid, r->name);
+		threads++;
+		events = trace_copy(r, copy);
+		for(j = 0; j < events; j++)
+			trace_write_event(f, r, &(copy[j]), pid, 1);
+		written += events;
+	}
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0) {
+		perror("trace_dumper(): fclose()");
+		goto derror1;
+	}
+	free(copy);
+
+	t->dumped = written;
+	trace_record(t->dumperring, TRACE_DUMP, start, now_ns() - start, written, NULL);
+	__atomic_store_n(&(t->state), TRACE_DUMPED, __ATOMIC_SEQ_CST);
+	return(NULL);
+
+derror1:
+	free(copy);
+derror0:
+	__atomic_store_n(&(t->state), TRACE_FAILED, __ATOMIC_SEQ_CST);
+	return(NULL);
+}
+
+int trace_dump(Tracer *t, const char *path) {
+	char *temp;
+
+	if(__atomic_load_n(&(t->state), __ATOMIC_SEQ_CST) != TRACE_IDLE)
+		return(-2);
+
+	temp = strdup(path);
+	if(temp == NULL) {
+		fprintf(stderr, "trace_dump(): Couldn't allocate memory.\n");
+		return(-1);
+	}
+	free(t->path);
+	t->path = temp;
+
+	__atomic_store_n(&(t->state), TRACE_DUMPING, __ATOMIC_SEQ_CST);
+	if(pthread_create(&(t->dumper), NULL, trace_dumper, t) != 0) {
+		fprintf(stderr, "trace_dump(): Couldn't start dump thread.\n");
+		__atomic_store_n(&(t->state), TRACE_IDLE, __ATOMIC_SEQ_CST);
+		return(-1);
+	}
+
+	return(0);
+}
+
+int trace_poll(Tracer *t) {
+	switch(__atomic_load_n(&(t->state), __ATOMIC_SEQ_CST)) {
+		case TRACE_DUMPED:
+			pthread_join(t->dumper, NULL);
+			__atomic_store_n(&(t->state), TRACE_IDLE, __ATOMIC_SEQ_CST);
+			return(1);
+		case TRACE_FAILED:
+			pthread_join(t->dumper, NULL);
+			__atomic_store_n(&(t->state), TRACE_IDLE, __ATOMIC_SEQ_CST);
+			return(-1);
+		default:
+			return(0);
+	}
+}
+
+void trace_loop_init(TraceLoop *l, TraceRing *r) {
+	l->r = r;
+	l->start = now_ns();
+	l->mark = l->start;
+	memset(l->phase, 0, sizeof(l->phase));
+	l->iterations = 0;
+	l->late = 0;
+	l->worst = 0;
+}
+
+void trace_loop_phase(TraceLoop *l, trace_type phase, int arg) {
+	int64_t now;
+
+	now = now_ns();
+	l->phase[phase] += now - l->mark;
+	/* sleeping too long shows up in the whole iteration */
+	if(phase != TRACE_SLEEP && now - l->mark > TRACE_SPAN_US * 1000)
+		trace_record(l->r, phase, l->mark, now - l->mark, arg, NULL);
+	l->mark = now;
+}
+
+void trace_loop_end(TraceLoop *l, int64_t sleep) {
+	int32_t phase[TRACE_PHASES];
+	int64_t over;
+	int i;
+
+	/* everything but the sleep it asked for, including oversleeping */
+	over = l->mark - l->start - sleep;
+	l->iterations++;
+	if(over > l->worst)
+		l->worst = over;
+	if(over > TRACE_SLOW_US * 1000) {
+		l->late++;
+		for(i = 0; i < TRACE_PHASES; i++)
+			phase[i] = l->phase[i] / 1000;
+		trace_record(l->r, TRACE_LOOP, l->start, l->mark - l->start, -1, phase);
+	}
+
+	l->start = l->mark;
+	memset(l->phase, 0, sizeof(l->phase));
+}
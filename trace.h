@@ -0,0 +1,176 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define TRACE_EVENTS		(4096) /* kept by each thread, a power of 2 */
+#define TRACE_THREADS		(8)
+#define TRACE_NAME_LEN		(15)
+#define TRACE_SLOW_US		(2000) /* a loop iteration running this far past its sleep is kept */
+#define TRACE_SPAN_US		(500) /* a single step taking this long is kept */
+
+/*
+ * What each event is.  The first TRACE_PHASES are the parts of a main loop
+ * iteration, the rest happen by themselves.
+ */
+typedef enum {
+	TRACE_ACCEPT, TRACE_READ, TRACE_DISPATCH, TRACE_TIMEOUTS, TRACE_TICK, TRACE_WRITE, TRACE_SLEEP,
+	TRACE_PHASES,
+	TRACE_LOOP = TRACE_PHASES, TRACE_CONNECT, TRACE_DISCONNECT, TRACE_RELOAD, TRACE_UPGRADE, TRACE_DUMP,
+	TRACE_TYPES
+} trace_type;
+
+typedef struct {
+	int64_t start; /* ns, CLOCK_MONOTONIC */
+	int64_t duration; /* ns, -1 for something with no length */
+	int32_t type;
+	int32_t arg; /* connection or count, depending on type, -1 for none */
+	int32_t phase[TRACE_PHASES]; /* us spent in each part, for TRACE_LOOP */
+} TraceEvent;
+
+/*
+ * The latest events from one thread.  Only that thread writes to it and it
+ * never waits, anything can read it at the same time: events are written in
+ * to the slot at head, which is moved on after, so a reader copying the ring
+ * and then looking at head again knows which slots could have changed under
+ * it.
+ */
+typedef struct {
+	int ready; /* set once the rest is filled in */
+	char name[TRACE_NAME_LEN + 1];
+	pid_t tid;
+	uint64_t head; /* events ever written */
+	TraceEvent *event; /* TRACE_EVENTS */
+} TraceRing;
+
+typedef enum {
+	TRACE_IDLE, TRACE_DUMPING, TRACE_DUMPED, TRACE_FAILED
+} trace_state;
+
+/*
+ * A flight recorder: a ring for each thread taking part, which can be written
+ * to a file in the background as a Chrome trace (Trace Event Format JSON, for
+ * chrome://tracing or Perfetto) while everything carries on.
+ */
+typedef struct {
+	TraceRing ring[TRACE_THREADS];
+	int rings; /* claimed */
+
+	trace_state state;
+	pthread_t dumper;
+	TraceRing *dumperring;
+	char *path;
+	int dumped; /* events written by the last dump */
+} Tracer;
+
+/*
+ * Times each part of a loop iteration, keeping any part or whole iteration that
+ * took too long.
+ */
+typedef struct {
+	TraceRing *r;
+	int64_t start; /* ns, when this iteration started */
+	int64_t mark; /* ns, when the last part ended */
+	int64_t phase[TRACE_PHASES]; /* ns spent in each part this iteration */
+
+	long iterations;
+	long late; /* iterations kept for running past TRACE_SLOW_US */
+	int64_t worst; /* ns the slowest iteration ran past its sleep */
+} TraceLoop;
+
+/*
+ * Initializes a new Tracer.
+ *
+ * returns	New Tracer or NULL on error.
+ */
+Tracer *trace_init(void);
+
+/*
+ * Frees a Tracer, waiting for any dump to finish.  Nothing should be recording
+ * in to it.
+ *
+ * t		Tracer to free.
+ */
+void trace_free(Tracer *t);
+
+/*
+ * Gets a ring for the calling thread to record in to.
+ *
+ * t		Tracer.
+ * name		Thread name shown in the trace.
+ *
+ * returns	Ring or NULL if there are already TRACE_THREADS.
+ */
+TraceRing *trace_ring(Tracer *t, const char *name);
+
+/*
+ * Records an event, only from the ring's own thread.
+ *
+ * r		Ring to record in to.
+ * type		What happened.
+ * start	When it started, from now_ns().
+ * duration	How long it took in ns, -1 for something with no length.
+ * arg		Connection or count, depending on type, -1 for none.
+ * phase	us spent in each part of a loop iteration, may be NULL.
+ */
+void trace_record(TraceRing *r, trace_type type, int64_t start, int64_t duration, int arg, const int32_t *phase);
+
+/*
+ * Records something happening now, with no length.
+ *
+ * r		Ring to record in to.
+ * type		What happened.
+ * arg		Connection or count, depending on type, -1 for none.
+ */
+void trace_instant(TraceRing *r, trace_type type, int arg);
+
+/*
+ * Starts writing every ring to a file in the background.
+ *
+ * t		Tracer.
+ * path		File to write, replaced.
+ *
+ * returns	0 if started, -2 if a dump is still in progress, -1 on error.
+ */
+int trace_dump(Tracer *t, const char *path);
+
+/*
+ * Checks on a dump started by trace_dump().
+ *
+ * t		Tracer.
+ *
+ * returns	1 if one finished, -1 if one failed, 0 otherwise.
+ */
+int trace_poll(Tracer *t);
+
+/*
+ * Starts timing loop iterations.
+ *
+ * l		TraceLoop to set up.
+ * r		Ring to keep slow iterations and steps in.
+ */
+void trace_loop_init(TraceLoop *l, TraceRing *r);
+
+/*
+ * Ends a step of the current iteration, adding the time since the last one
+ * ended to a part.  Steps other than sleeping which take longer than
+ * TRACE_SPAN_US are kept.
+ *
+ * l		TraceLoop.
+ * phase	Part the step belongs to.
+ * arg		Connection or count, kept with the step.
+ */
+void trace_loop_phase(TraceLoop *l, trace_type phase, int arg);
+
+/*
+ * Ends an iteration, which should end with its TRACE_SLEEP step, and starts
+ * the next.
+ *
+ * l		TraceLoop.
+ * sleep	ns the iteration was meant to sleep for.
+ */
+void trace_loop_end(TraceLoop *l, int64_t sleep);
+
+#endif
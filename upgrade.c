@@ -0,0 +1,818 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "upgrade.h"
+
+#define UPGRADE_MAX_STATE	(64 * 1024 * 1024)
+#define UPGRADE_ACK			('K')
+
+static void buf_put(UpgradeBuffer *b, const void *data, int len) {
+	char *newdata;
+	int newsize;
+
+	if(b->error)
+		return;
+	if(b->used + len > b->size) {
+		for(newsize = b->size > 0 ? b->size : 4096; newsize < b->used + len; newsize *= 2);
+		newdata = realloc(b->data, newsize);
+		if(newdata == NULL) {
+			b->error = 1;
+			return;
+		}
+		b->data = newdata;
+		b->size = newsize;
+	}
+	memcpy(&(b->data[b->used]), data, len);
+	b->used += len;
+}
+
+static void put_u32(UpgradeBuffer *b, uint32_t v) {
+	buf_put(b, &v, sizeof(v));
+}
+
+static void put_i64(UpgradeBuffer *b, int64_t v) {
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_get(UpgradeBuffer *b, void *data, int len) {
+	if(b->error || len < 0 || b->pos + len > b->used) {
+		b->error = 1;
+		memset(data, 0, len > 0 ? len : 0);
+		return;
+	}
+	memcpy(data, &(b->data[b->pos]), len);
+	b->pos += len;
+}
+
+static uint32_t get_u32(UpgradeBuffer *b) {
+	uint32_t v;
+
+	buf_get(b, &v, sizeof(v));
+
+	return(v);
+}
+
+static int64_t get_i64(UpgradeBuffer *b) {
+	int64_t v;
+
+	buf_get(b, &v, sizeof(v));
+
+	return(v);
+}
+
+static int write_all(int fd, const void *buf, int len) {
+	const char *p = buf;
+	int retval;
+
+	while(len > 0) {
+		retval = write(fd, p, len);
+		if(retval == -1) {
+			if(errno == EINTR)
+				continue;
+			return(-1);
+		}
+		p += retval;
+		len -= retval;
+	}
+
+	return(0);
+}
+
+static int read_all(int fd, void *buf, int len) {
+	char *p = buf;
+	int retval;
+
+	while(len > 0) {
+		retval = read(fd, p, len);
+		if(retval == -1) {
+			if(errno == EINTR)
+				continue;
+			return(-1);
+		}
+		if(retval == 0)
+			return(-1);
+		p += retval;
+		len -= retval;
+	}
+
+	return(0);
+}
+
+static void set_timeout(int fd, int seconds) {
+	struct timeval tv;
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_fds(int sock, const int *fd, int fds) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FD_BATCH)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char dummy = 0;
+	int count, i;
+
+	for(i = 0; i < fds; i += count) {
+		count = fds - i < UPGRADE_FD_BATCH ? fds - i : UPGRADE_FD_BATCH;
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &dummy; /* has to carry at least a byte */
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), &(fd[i]), sizeof(int) * count);
+
+		if(sendmsg(sock, &msg, 0) == -1) {
+			perror("send_fds(): sendmsg()");
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+static int recv_fds(int sock, int *fd, int fds) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FD_BATCH)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char dummy;
+	int have, count;
+
+	for(have = 0; have < fds; have += count) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &dummy;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+			perror("recv_fds(): recvmsg()");
+			return(-1);
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+			fprintf(stderr, "recv_fds(): Expected descriptors.\n");
+			return(-1);
+		}
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if(count > fds - have) {
+			fprintf(stderr, "recv_fds(): Too many descriptors.\n");
+			return(-1);
+		}
+		memcpy(&(fd[have]), CMSG_DATA(cmsg), sizeof(int) * count);
+	}
+
+	return(0);
+}
+
+static int unix_address(struct sockaddr_un *addr, const char *path) {
+	if(strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "unix_address(): %s is too long.\n", path);
+		return(-1);
+	}
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	return(0);
+}
+
+int upgrade_listen(const char *path) {
+	struct sockaddr_un addr;
+	int sock;
+
+	if(unix_address(&addr, path) == -1)
+		return(-1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		perror("upgrade_listen(): socket()");
+		return(-1);
+	}
+	if(unlink(path) == -1 && errno != ENOENT) {
+		perror("upgrade_listen(): unlink()");
+		goto error;
+	}
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("upgrade_listen(): bind()");
+		goto error;
+	}
+	if(listen(sock, 1) == -1) {
+		perror("upgrade_listen(): listen()");
+		goto error;
+	}
+	if(fd_nonblocking(sock) == -1)
+		goto error;
+
+	return(sock);
+
+error:
+	close(sock);
+	return(-1);
+}
+
+int upgrade_connect(const char *path) {
+	struct sockaddr_un addr;
+	int sock, err;
+
+	if(unix_address(&addr, path) == -1)
+		return(-1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		perror("upgrade_connect(): socket()");
+		return(-1);
+	}
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err = errno; /* before close() can change it */
+		close(sock);
+		if(err == ENOENT || err == ECONNREFUSED)
+			return(-2);
+		fprintf(stderr, "upgrade_connect(): connect(): %s\n", strerror(err));
+		return(-1);
+	}
+	set_timeout(sock, UPGRADE_TIMEOUT);
+
+	return(sock);
+}
+
+static void save_connection(UpgradeBuffer *b, Connection *c) {
+	CMDBuffer *buf = c->buf;
+	const char *pending;
+	int len;
+
+	put_u32(b, c->addrlen);
+	buf_put(b, &(c->address), c->addrlen);
+	put_i64(b, c->timeout);
+	put_i64(b, c->last_message);
+	put_u32(b, c->pinged);
+	put_i64(b, c->pingsent);
+	put_i64(b, c->lastping);
+	put_i64(b, c->rtt);
+	put_i64(b, c->srtt);
+	put_i64(b, c->rttvar);
+	put_u32(b, c->rttsamples);
+
+	/* whatever of a frame has been read so far */
+	put_u32(b, buf->cmdneeded);
+	put_u32(b, buf->cmdhave);
+	buf_put(b, buf->cmd, buf->cmdhave < buf->cmdsize ? buf->cmdhave : buf->cmdsize);
+
+	/* and what's been received after it */
+	len = connection_pending(c, &pending);
+	put_u32(b, len);
+	if(len > 0)
+		buf_put(b, pending, len);
+}
+
+static void save_player(UpgradeBuffer *b, Player *p) {
+	int first;
+
+	put_u32(b, p->state);
+	if(p->state == PLAYER_EMPTY)
+		return;
+
+	put_u32(b, strlen(p->name));
+	buf_put(b, p->name, strlen(p->name));
+	buf_put(b, p->token, RESUME_TOKEN_LEN);
+	put_u32(b, p->conn);
+	put_i64(b, p->detached);
+	put_u32(b, p->rating);
+	put_u32(b, p->language);
+	put_u32(b, p->historyseen);
+
+	/* the backlog ring, unwrapped */
+	put_u32(b, p->backlogused);
+	first = PLAYER_BACKLOG - p->backlogstart < p->backlogused ? PLAYER_BACKLOG - p->backlogstart : p->backlogused;
+	buf_put(b, &(p->backlog[p->backlogstart]), first);
+	buf_put(b, p->backlog, p->backlogused - first);
+}
+
+static void save_room(UpgradeBuffer *b, Room *r) {
+	Match *m = r->match;
+	RoomEvent *e;
+	int i;
+
+	put_u32(b, r->players);
+	for(i = 0; i < r->players; i++)
+		put_u32(b, r->player[i]->seat);
+	put_u32(b, r->language);
+	put_u32(b, r->overlap);
+	put_u32(b, r->playing);
+	put_i64(b, r->dict != NULL ? (int64_t)r->dict->hdr->checksum : 0);
+	put_u32(b, r->orders);
+	for(i = 0; i < r->orders; i++) {
+		put_u32(b, r->order[i] != NULL ? r->order[i]->seat : -1);
+		buf_put(b, &(r->ordername[(MAX_NAME_LEN + 1) * i]), MAX_NAME_LEN + 1);
+	}
+
+	/* the frames kept for catching up, oldest first */
+	put_u32(b, r->eventseq);
+	put_u32(b, r->events);
+	for(i = 0; i < r->events; i++) {
+		e = ROOM_EVENT(r, i);
+		put_u32(b, e->len);
+		buf_put(b, &(r->history[e->offset]), e->len);
+	}
+
+	put_u32(b, m != NULL);
+	if(m == NULL)
+		return;
+	put_u32(b, m->turn);
+	put_u32(b, m->overlap);
+	put_u32(b, m->needlen);
+	for(i = 0; i < DICT_GRAM_MAX; i++)
+		put_u32(b, m->need[i]);
+	put_i64(b, m->deadline);
+	put_u32(b, m->over);
+	put_u32(b, m->loser);
+	put_u32(b, m->reason);
+	put_u32(b, m->serial);
+	put_u32(b, m->moves);
+	buf_put(b, m->history, sizeof(int32_t) * m->moves);
+}
+
+int upgrade_handoff(int sock, Server *s, Game *g, Lobby *l) {
+	UpgradeBuffer b;
+	UpgradeHeader hdr;
+	Connection *c;
+	int *fd;
+	int fds, i;
+	int memfd, event;
+	char ack;
+
+	memset(&b, 0, sizeof(b));
+	/* the listeners and server's eventfd, then each connection with its shared memory */
+	fd = malloc(sizeof(int) * (s->connections * 3 + 3));
+	if(fd == NULL) {
+		fprintf(stderr, "upgrade_handoff(): Couldn't allocate memory.\n");
+		goto error0;
+	}
+	set_timeout(sock, UPGRADE_TIMEOUT);
+
+	fds = 0;
+	fd[fds++] = s->sock;
+
+	put_u32(&b, s->connections);
+	put_u32(&b, g->maxplayers);
+	put_u32(&b, g->maxname);
+	put_u32(&b, l->maxrooms);
+	put_u32(&b, l->roomsize);
+	put_u32(&b, s->connection[0]->buf->cmdsize);
+
+	put_u32(&b, s->unixsock != -1);
+	if(s->unixsock != -1) {
+		put_u32(&b, fds);
+		fd[fds++] = s->unixsock;
+	}
+	put_u32(&b, s->shmevent != -1);
+	if(s->shmevent != -1) {
+		put_u32(&b, fds);
+		fd[fds++] = s->shmevent;
+	}
+
+	for(i = 0; i < s->connections; i++) {
+		c = s->connection[i];
+		put_u32(&b, c->type == CLIENT);
+		if(c->type != CLIENT)
+			continue;
+		put_u32(&b, fds);
+		fd[fds++] = c->sock;
+		save_connection(&b, c);
+		put_u32(&b, connection_shared_memory(c, &memfd, &event) == 0);
+		if(c->shm != NULL) {
+			put_u32(&b, fds);
+			fd[fds++] = memfd;
+			put_u32(&b, fds);
+			fd[fds++] = event;
+		}
+	}
+	for(i = 0; i < g->maxplayers; i++)
+		save_player(&b, g->player[i]);
+	for(i = 0; i < l->maxrooms; i++)
+		save_room(&b, l->room[i]);
+	if(b.error) {
+		fprintf(stderr, "upgrade_handoff(): Couldn't allocate memory.\n");
+		goto error1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC));
+	hdr.version = UPGRADE_VERSION;
+	hdr.fds = fds;
+	hdr.statelen = b.used;
+	if(write_all(sock, &hdr, sizeof(hdr)) == -1 ||
+	   send_fds(sock, fd, fds) == -1 ||
+	   write_all(sock, b.data, b.used) == -1) {
+		perror("upgrade_handoff(): write()");
+		goto error1;
+	}
+
+	/* nothing can be touched until the new one says whether it took over */
+	if(read_all(sock, &ack, 1) == -1 || ack != UPGRADE_ACK) {
+		fprintf(stderr, "upgrade_handoff(): New server didn't take over.\n");
+		goto error1;
+	}
+
+	free(b.data);
+	free(fd);
+	return(0);
+
+error1:
+	free(b.data);
+	free(fd);
+error0:
+	return(-1);
+}
+
+Upgrade *upgrade_receive(int sock) {
+	Upgrade *u;
+	UpgradeHeader hdr;
+	int i;
+
+	if(read_all(sock, &hdr, sizeof(hdr)) == -1) {
+		perror("upgrade_receive(): read()");
+		goto error0;
+	}
+	if(memcmp(hdr.magic, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC)) != 0 || hdr.version != UPGRADE_VERSION) {
+		fprintf(stderr, "upgrade_receive(): Old server sent an unsupported version.\n");
+		goto error0;
+	}
+	if(hdr.fds < 1 || hdr.fds > 65536 || hdr.statelen > UPGRADE_MAX_STATE) {
+		fprintf(stderr, "upgrade_receive(): Bad header.\n");
+		goto error0;
+	}
+
+	u = malloc(sizeof(Upgrade));
+	if(u == NULL) {
+		fprintf(stderr, "upgrade_receive(): Couldn't allocate memory.\n");
+		goto error0;
+	}
+	memset(&(u->state), 0, sizeof(UpgradeBuffer));
+	u->fds = 0;
+	u->fd = malloc(sizeof(int) * hdr.fds);
+	u->taken = calloc(hdr.fds, sizeof(int));
+	u->state.data = malloc(hdr.statelen > 0 ? hdr.statelen : 1);
+	if(u->fd == NULL || u->taken == NULL || u->state.data == NULL) {
+		fprintf(stderr, "upgrade_receive(): Couldn't allocate memory.\n");
+		goto error1;
+	}
+
+	if(recv_fds(sock, u->fd, hdr.fds) == -1)
+		goto error1;
+	u->fds = hdr.fds;
+	u->state.size = hdr.statelen;
+	if(read_all(sock, u->state.data, hdr.statelen) == -1) {
+		perror("upgrade_receive(): read()");
+		goto error1;
+	}
+	u->state.used = hdr.statelen;
+
+	return(u);
+
+error1:
+	for(i = 0; i < u->fds; i++)
+		close(u->fd[i]);
+	free(u->fd);
+	free(u->taken);
+	free(u->state.data);
+	free(u);
+error0:
+	return(NULL);
+}
+
+int upgrade_listener(Upgrade *u) {
+	u->taken[0] = 1;
+
+	return(u->fd[0]);
+}
+
+/* Gets the descriptor at the index read next, -1 if it's not there or already taken. */
+static int get_fd(Upgrade *u) {
+	uint32_t idx;
+
+	idx = get_u32(&(u->state));
+	if(u->state.error || idx < 1 || idx >= (uint32_t)u->fds || u->taken[idx])
+		return(-1);
+
+	return(idx);
+}
+
+static int restore_connection(Upgrade *u, Connection *c) {
+	UpgradeBuffer *b = &(u->state);
+	CMDBuffer *buf = c->buf;
+	uint32_t idx, len;
+
+	idx = get_u32(b);
+	if(b->error || idx < 1 || idx >= (uint32_t)u->fds || u->taken[idx])
+		return(-1);
+	u->taken[idx] = 1;
+	c->sock = u->fd[idx];
+	c->type = CLIENT;
+
+	c->addrlen = get_u32(b);
+	if(b->error || c->addrlen < sizeof(sa_family_t) || c->addrlen > sizeof(struct sockaddr_storage))
+		return(-1);
+	memset(&(c->address), 0, sizeof(struct sockaddr_storage));
+	buf_get(b, &(c->address), c->addrlen);
+	c->timeout = get_i64(b);
+	c->last_message = get_i64(b);
+	c->pinged = get_u32(b);
+	c->pingsent = get_i64(b);
+	c->lastping = get_i64(b);
+	c->rtt = get_i64(b);
+	c->srtt = get_i64(b);
+	c->rttvar = get_i64(b);
+	c->rttsamples = get_u32(b);
+
+	buf->cmdneeded = get_u32(b);
+	buf->cmdhave = get_u32(b);
+	if(buf->cmdneeded > 65535 || buf->cmdhave > 65535)
+		return(-1);
+	buf_get(b, buf->cmd, buf->cmdhave < buf->cmdsize ? buf->cmdhave : buf->cmdsize);
+
+	len = get_u32(b);
+	if(b->error || len > (uint32_t)(b->used - b->pos))
+		return(-1);
+	if(connection_unread(c, &(b->data[b->pos]), len) == -1)
+		return(-1);
+	b->pos += len;
+
+	return(b->error ? -1 : 0);
+}
+
+static int restore_player(UpgradeBuffer *b, Server *s, Game *g, Player *p) {
+	uint32_t len;
+	int conn;
+
+	p->state = get_u32(b);
+	if(p->state == PLAYER_EMPTY)
+		return(b->error ? -1 : 0);
+	if(p->state != PLAYER_ACTIVE && p->state != PLAYER_DETACHED)
+		return(-1);
+
+	len = get_u32(b);
+	if(len > (uint32_t)g->maxname)
+		return(-1);
+	buf_get(b, p->name, len);
+	p->name[len] = '\0';
+	buf_get(b, p->token, RESUME_TOKEN_LEN);
+	conn = (int32_t)get_u32(b);
+	p->detached = get_i64(b);
+	p->rating = (int32_t)get_u32(b);
+	p->language = get_u32(b);
+	if(p->language >= LANGS_MAX)
+		return(-1);
+	p->historyseen = get_u32(b);
+
+	p->backlogstart = 0;
+	p->backlogused = get_u32(b);
+	if(p->backlogused < 0 || p->backlogused > PLAYER_BACKLOG)
+		return(-1);
+	buf_get(b, p->backlog, p->backlogused);
+
+	p->c = NULL;
+	p->conn = -1;
+	if(p->state == PLAYER_ACTIVE) {
+		if(conn < 0 || conn >= s->connections || s->connection[conn]->type != CLIENT)
+			return(-1);
+		p->c = s->connection[conn];
+		p->conn = conn;
+	}
+
+	return(b->error ? -1 : 0);
+}
+
+static int restore_room(UpgradeBuffer *b, Game *g, Room *r, Dict *d) {
+	Match *m;
+	int64_t checksum;
+	uint32_t players, seat, hasmatch, moves, orders, eventseq, events, len;
+	int i;
+
+	players = get_u32(b);
+	if(players > (uint32_t)r->maxplayers)
+		return(-1);
+	for(i = 0; i < (int)players; i++) {
+		seat = get_u32(b);
+		if(seat >= (uint32_t)g->maxplayers || g->player[seat]->state == PLAYER_EMPTY)
+			return(-1);
+		room_join(r, g->player[seat]);
+	}
+	r->language = get_u32(b);
+	r->overlap = get_u32(b);
+	if(r->overlap < 1 || r->overlap > DICT_GRAM_MAX)
+		return(-1);
+	r->playing = get_u32(b);
+	r->cluster = 0; /* the broker only knows the old process */
+	checksum = get_i64(b);
+	orders = get_u32(b);
+	if(orders > (uint32_t)r->maxplayers)
+		return(-1);
+	for(i = 0; i < (int)orders; i++) {
+		seat = get_u32(b);
+		r->order[i] = seat < (uint32_t)g->maxplayers && g->player[seat]->state != PLAYER_EMPTY ? g->player[seat] : NULL;
+		buf_get(b, &(r->ordername[(MAX_NAME_LEN + 1) * i]), MAX_NAME_LEN + 1);
+		r->ordername[(MAX_NAME_LEN + 1) * i + MAX_NAME_LEN] = '\0';
+	}
+	r->orders = orders;
+
+	/* recorded again they're packed from the start, which they fit in as they did before */
+	eventseq = get_u32(b);
+	events = get_u32(b);
+	if(events > ROOM_HISTORY_EVENTS)
+		return(-1);
+	for(i = 0; i < (int)events; i++) {
+		len = get_u32(b);
+		if(b->error || len > ROOM_HISTORY_BYTES || len > (uint32_t)(b->used - b->pos))
+			return(-1);
+		room_record(r, &(b->data[b->pos]), len);
+		b->pos += len;
+	}
+	if(r->events != (int)events)
+		return(-1);
+	r->eventseq = eventseq;
+
+	/* a game can only carry on with the same words */
+	m = NULL;
+	if(d != NULL && r->players > 0 && checksum == (int64_t)d->hdr->checksum) {
+		if(room_set_dict(r, dict_ref(d)) == -1)
+			return(-1);
+		m = r->match;
+	} else {
+		r->playing = 0;
+		r->orders = 0;
+	}
+
+	hasmatch = get_u32(b);
+	if(!hasmatch)
+		return(b->error ? -1 : 0);
+	if(m == NULL) { /* skip over it */
+		for(i = 0; i < 3 + DICT_GRAM_MAX; i++)
+			get_u32(b);
+		get_i64(b);
+		for(i = 0; i < 4; i++)
+			get_u32(b);
+		moves = get_u32(b);
+		b->pos += sizeof(int32_t) * moves;
+		if(b->pos > b->used)
+			b->error = 1;
+		return(b->error ? -1 : 0);
+	}
+
+	m->turn = get_u32(b);
+	m->overlap = get_u32(b);
+	m->needlen = get_u32(b);
+	for(i = 0; i < DICT_GRAM_MAX; i++)
+		m->need[i] = get_u32(b);
+	if(m->overlap < 1 || m->overlap > DICT_GRAM_MAX || m->needlen < 0 || m->needlen > DICT_GRAM_MAX)
+		return(-1);
+	m->deadline = get_i64(b);
+	m->over = get_u32(b);
+	m->loser = (int32_t)get_u32(b);
+	m->reason = get_u32(b);
+	m->serial = get_u32(b);
+	moves = get_u32(b);
+	if(moves > (uint32_t)d->words)
+		return(-1);
+	buf_get(b, m->history, sizeof(int32_t) * moves);
+	if(b->error)
+		return(-1);
+	for(i = 0; i < (int)moves; i++) {
+		if(m->history[i] < 0 || m->history[i] >= d->words)
+			return(-1);
+		m->used[m->history[i] / 64] |= (uint64_t)1 << (m->history[i] % 64);
+	}
+	m->moves = moves;
+	if(r->orders > 0)
+		m->players = r->orders;
+
+	return(0);
+}
+
+int upgrade_restore(Upgrade *u, Server *s, Game *g, Lobby *l, Dict *d) {
+	UpgradeBuffer *b = &(u->state);
+	Player *p;
+	int idx, memfd, event;
+	int i;
+
+	if(get_u32(b) != (uint32_t)s->connections ||
+	   get_u32(b) != (uint32_t)g->maxplayers ||
+	   get_u32(b) != (uint32_t)g->maxname ||
+	   get_u32(b) != (uint32_t)l->maxrooms ||
+	   get_u32(b) != (uint32_t)l->roomsize ||
+	   get_u32(b) != (uint32_t)s->connection[0]->buf->cmdsize) {
+		fprintf(stderr, "upgrade_restore(): Old server was built with different limits.\n");
+		return(-1);
+	}
+
+	if(get_u32(b)) {
+		idx = get_fd(u);
+		if(idx == -1 || server_adopt_unix(s, u->fd[idx]) == -1) {
+			fprintf(stderr, "upgrade_restore(): Bad local listening socket.\n");
+			return(-1);
+		}
+		u->taken[idx] = 1;
+	}
+	if(get_u32(b)) {
+		idx = get_fd(u);
+		if(idx == -1) {
+			fprintf(stderr, "upgrade_restore(): Bad shared memory eventfd.\n");
+			return(-1);
+		}
+		u->taken[idx] = 1;
+		s->shmevent = u->fd[idx];
+	}
+
+	for(i = 0; i < s->connections; i++) {
+		if(get_u32(b) && restore_connection(u, s->connection[i]) == -1) {
+			fprintf(stderr, "upgrade_restore(): Bad connection %i.\n", i);
+			return(-1);
+		}
+		if(s->connection[i]->type == CLIENT && get_u32(b)) {
+			memfd = get_fd(u);
+			event = memfd != -1 ? get_fd(u) : -1;
+			if(s->shmevent == -1 || event == -1 || memfd == event ||
+			   connection_adopt_shared_memory(s, s->connection[i], u->fd[memfd], u->fd[event]) == -1) {
+				fprintf(stderr, "upgrade_restore(): Bad shared memory for connection %i.\n", i);
+				return(-1);
+			}
+			u->taken[memfd] = 1;
+			u->taken[event] = 1;
+		}
+	}
+	for(i = 0; i < g->maxplayers; i++) {
+		if(restore_player(b, s, g, g->player[i]) == -1) {
+			fprintf(stderr, "upgrade_restore(): Bad player in seat %i.\n", i);
+			return(-1);
+		}
+	}
+	game_reindex(g);
+	for(i = 0; i < l->maxrooms; i++) {
+		if(restore_room(b, g, l->room[i], d) == -1) {
+			fprintf(stderr, "upgrade_restore(): Bad room %i.\n", i);
+			return(-1);
+		}
+	}
+
+	/* waiting times start over, but everyone without a room keeps waiting */
+	for(i = 0; i < g->maxplayers; i++) {
+		p = g->player[i];
+		if(p->state != PLAYER_EMPTY && p->room == NULL)
+			lobby_enqueue(l, p);
+	}
+
+	return(0);
+}
+
+int upgrade_finish(int sock) {
+	char ack = UPGRADE_ACK;
+	char dummy;
+
+	if(write_all(sock, &ack, 1) == -1) {
+		perror("upgrade_finish(): write()");
+		close(sock);
+		return(-1);
+	}
+	/* the old server closes its end as it exits */
+	while(read(sock, &dummy, 1) > 0);
+	close(sock);
+
+	return(0);
+}
+
+void upgrade_free(Upgrade *u) {
+	int i;
+
+	for(i = 0; i < u->fds; i++) {
+		if(!u->taken[i])
+			close(u->fd[i]);
+	}
+	free(u->fd);
+	free(u->taken);
+	free(u->state.data);
+	free(u);
+}
@@ -0,0 +1,131 @@
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#include <stdint.h>
+
+#include "net.h"
+#include "game.h"
+#include "lobby.h"
+
+/*
+ * Handing a running server over to a new process.  The old server listens on a
+ * Unix socket; a new one started with the same path connects to it and is sent
+ * the listening sockets and every client connection with SCM_RIGHTS, along
+ * with everything needed to carry on: partly received frames, shared memory,
+ * players, rooms and games.  Clients see a pause of a few milliseconds and
+ * nothing else.
+ *
+ * The state is written field by field with a version, so it doesn't depend on
+ * both binaries laying out their structures the same.
+ */
+#define UPGRADE_MAGIC		"SHRUPGR"
+#define UPGRADE_VERSION		(8)
+#define UPGRADE_FD_BATCH	(64) /* descriptors sent in each message */
+#define UPGRADE_TIMEOUT		(5) /* seconds either side waits for the other */
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t fds;
+	uint32_t statelen;
+} UpgradeHeader;
+
+typedef struct {
+	char *data;
+	int size;
+	int used;
+	int pos; /* where reading is up to */
+	int error; /* set by running out of memory or reading past the end */
+} UpgradeBuffer;
+
+/*
+ * Everything received from the old server.
+ */
+typedef struct {
+	int *fd; /* the listening socket first, then the rest as the state says */
+	int fds;
+	int *taken; /* set for each descriptor handed on to something that will close it */
+	UpgradeBuffer state;
+} Upgrade;
+
+/*
+ * Listens for a new server wanting to take over.  Anything left at the path is
+ * removed first.
+ *
+ * path		Unix socket path.
+ *
+ * returns	Nonblocking listening socket, -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/*
+ * Connects to a server already running at a path, to take over from it.
+ *
+ * path		Unix socket path.
+ *
+ * returns	Connected socket, -2 if nothing is running there, -1 on error.
+ */
+int upgrade_connect(const char *path);
+
+/*
+ * Sends everything to a new server and waits for it to take over.  On success
+ * nothing more should be done with any connection, only closing them.
+ *
+ * sock		Socket accepted from upgrade_listen().
+ * s		Server to hand over.
+ * g		Game to hand over.
+ * l		Lobby with the rooms to hand over.
+ *
+ * returns	0 if the new server took over, -1 if it didn't and this one should carry on.
+ */
+int upgrade_handoff(int sock, Server *s, Game *g, Lobby *l);
+
+/*
+ * Receives everything from the old server.
+ *
+ * sock		Socket from upgrade_connect().
+ *
+ * returns	New Upgrade or NULL on error.
+ */
+Upgrade *upgrade_receive(int sock);
+
+/*
+ * Takes the listening socket out of an Upgrade, for server_adopt().
+ *
+ * u		Upgrade to take it from.
+ *
+ * returns	Listening socket.
+ */
+int upgrade_listener(Upgrade *u);
+
+/*
+ * Puts the connections, players, rooms and games back.  Everything should be
+ * freshly initialized and the same sizes as in the old server.
+ *
+ * u		Upgrade received.
+ * s		Server from server_adopt().
+ * g		Game to fill in.
+ * l		Lobby with rooms to fill in.
+ * d		Dictionary rooms should use, games carry on only if it's the same one as before.  May be NULL.
+ *
+ * returns	0 on success, -1 on error.
+ */
+int upgrade_restore(Upgrade *u, Server *s, Game *g, Lobby *l, Dict *d);
+
+/*
+ * Tells the old server everything was taken over and waits for it to exit.
+ *
+ * sock		Socket from upgrade_connect(), closed.
+ *
+ * returns	0 on success, -1 if the old server couldn't be told.
+ */
+int upgrade_finish(int sock);
+
+/*
+ * Frees an Upgrade, closing any descriptors that weren't taken.
+ *
+ * u		Upgrade to free.
+ */
+void upgrade_free(Upgrade *u);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags) {
+	return(syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0));
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int args) {
+	return(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+/* Multishot receive came with 6.0, the same as zero copy send, which can be asked about. */
+static int uring_supported(int fd) {
+	struct io_uring_probe *probe;
+	int ops, supported;
+
+	ops = IORING_OP_SEND_ZC + 1;
+	probe = calloc(1, sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+	if(probe == NULL)
+		return(0);
+	supported = uring_register(fd, IORING_REGISTER_PROBE, probe, ops) == 0 &&
+	            probe->last_op >= IORING_OP_SEND_ZC &&
+	            (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+
+	return(supported);
+}
+
+Uring *uring_init(unsigned int entries, unsigned int bufs, int bufsize) {
+	Uring *u;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	u = malloc(sizeof(Uring));
+	if(u == NULL) {
+		fprintf(stderr, "uring_init(): Couldn't allocate memory.\n");
+		goto uerror0;
+	}
+
+	memset(&p, 0, sizeof(struct io_uring_params));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+	u->fd = uring_setup(entries, &p);
+	if(u->fd == -1) {
+		/* not built in to the kernel, turned off or not allowed */
+		if(errno != ENOSYS && errno != EPERM)
+			perror("uring_init(): io_uring_setup()");
+		goto uerror1;
+	}
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) || !uring_supported(u->fd))
+		goto uerror2;
+
+	u->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(u->cqmapsize > u->sqmapsize)
+		u->sqmapsize = u->cqmapsize;
+	u->sqmap = mmap(NULL, u->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sqmap == MAP_FAILED) {
+		perror("uring_init(): mmap()");
+		goto uerror2;
+	}
+	u->cqmap = u->sqmap; /* IORING_FEAT_SINGLE_MMAP */
+	u->cqmapsize = 0;
+	u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqe = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqe == MAP_FAILED) {
+		perror("uring_init(): mmap()");
+		goto uerror3;
+	}
+
+	u->sqhead = (unsigned int *)((char *)u->sqmap + p.sq_off.head);
+	u->sqtail = (unsigned int *)((char *)u->sqmap + p.sq_off.tail);
+	u->sqmask = *(unsigned int *)((char *)u->sqmap + p.sq_off.ring_mask);
+	u->sqarray = (unsigned int *)((char *)u->sqmap + p.sq_off.array);
+	u->sqlocal = *(u->sqtail);
+	u->sqsubmitted = u->sqlocal;
+	u->cqhead = (unsigned int *)((char *)u->cqmap + p.cq_off.head);
+	u->cqtail = (unsigned int *)((char *)u->cqmap + p.cq_off.tail);
+	u->cqmask = *(unsigned int *)((char *)u->cqmap + p.cq_off.ring_mask);
+	u->cqe = (struct io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+
+	/* the buffer ring has to be page aligned, which mmap() gives */
+	u->bufs = bufs;
+	u->bufsize = bufsize;
+	u->brsize = bufs * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->brsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(u->br == MAP_FAILED) {
+		perror("uring_init(): mmap()");
+		goto uerror4;
+	}
+	u->buf = malloc((size_t)bufs * bufsize);
+	if(u->buf == NULL) {
+		fprintf(stderr, "uring_init(): Couldn't allocate memory.\n");
+		goto uerror5;
+	}
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = bufs;
+	reg.bgid = 0;
+	if(uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		perror("uring_init(): io_uring_register()");
+		goto uerror6;
+	}
+	u->brtail = 0;
+	for(i = 0; i < bufs; i++)
+		uring_buf_return(u, i);
+
+	return(u);
+
+uerror6:
+	free(u->buf);
+uerror5:
+	munmap(u->br, u->brsize);
+uerror4:
+	munmap(u->sqe, u->sqesize);
+uerror3:
+	munmap(u->sqmap, u->sqmapsize);
+uerror2:
+	close(u->fd);
+uerror1:
+	free(u);
+uerror0:
+	return(NULL);
+}
+
+void uring_free(Uring *u) {
+	close(u->fd);
+	munmap(u->sqe, u->sqesize);
+	munmap(u->sqmap, u->sqmapsize);
+	munmap(u->br, u->brsize);
+	free(u->buf);
+	free(u);
+}
+
+struct io_uring_sqe *uring_sqe(Uring *u) {
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if(u->sqlocal - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) > u->sqmask) {
+		if(uring_submit(u, 0) == -1)
+			return(NULL);
+		if(u->sqlocal - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) > u->sqmask)
+			return(NULL);
+	}
+
+	idx = u->sqlocal & u->sqmask;
+	sqe = &(u->sqe[idx]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->sqarray[idx] = idx;
+	u->sqlocal++;
+
+	return(sqe);
+}
+
+int uring_submit(Uring *u, int wait) {
+	unsigned int submit;
+	int retval;
+
+	submit = u->sqlocal - u->sqsubmitted;
+	if(submit == 0 && !wait)
+		return(0);
+
+	__atomic_store_n(u->sqtail, u->sqlocal, __ATOMIC_RELEASE);
+	do {
+		retval = uring_enter(u->fd, submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while(retval == -1 && errno == EINTR);
+	if(retval == -1) {
+		/* the completion queue is full, it has to be emptied before anything more goes in */
+		if(errno == EBUSY || errno == EAGAIN)
+			return(0);
+		perror("uring_submit(): io_uring_enter()");
+		return(-1);
+	}
+	u->sqsubmitted += retval;
+
+	return(retval);
+}
+
+struct io_uring_cqe *uring_cqe(Uring *u) {
+	unsigned int head;
+
+	head = *(u->cqhead);
+	if(head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+		return(NULL);
+
+	return(&(u->cqe[head & u->cqmask]));
+}
+
+void uring_cqe_seen(Uring *u) {
+	__atomic_store_n(u->cqhead, *(u->cqhead) + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buf(Uring *u, int bid) {
+	return(&(u->buf[(size_t)bid * u->bufsize]));
+}
+
+void uring_buf_return(Uring *u, int bid) {
+	struct io_uring_buf *b;
+
+	b = &(u->br->bufs[u->brtail & (u->bufs - 1)]);
+	b->addr = (unsigned long)uring_buf(u, bid);
+	b->len = u->bufsize;
+	b->bid = bid;
+	u->brtail++;
+	__atomic_store_n(&(u->br->tail), u->brtail, __ATOMIC_RELEASE);
+}
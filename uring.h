@@ -0,0 +1,119 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls so nothing beyond the
+ * kernel headers is needed.  It has one group of provided buffers (group 0)
+ * which receives can pick from.  Nothing here is thread safe.
+ */
+typedef struct {
+	int fd;
+
+	/* submission queue */
+	void *sqmap;
+	size_t sqmapsize;
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int sqmask;
+	unsigned int *sqarray;
+	struct io_uring_sqe *sqe;
+	size_t sqesize;
+	unsigned int sqlocal; /* tail including entries not yet handed to the kernel */
+	unsigned int sqsubmitted; /* tail as far as the kernel's been told */
+
+	/* completion queue */
+	void *cqmap;
+	size_t cqmapsize;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int cqmask;
+	struct io_uring_cqe *cqe;
+
+	/* provided buffers */
+	struct io_uring_buf_ring *br;
+	size_t brsize;
+	unsigned int bufs; /* power of 2 */
+	int bufsize;
+	char *buf;
+	unsigned short int brtail;
+} Uring;
+
+/*
+ * Sets up an io_uring with provided buffers, if the kernel can do everything
+ * wanted here: multishot accept and receive and provided buffer rings, so
+ * Linux 6.0 or later.
+ *
+ * entries	Submission queue size, the completion queue is 4 times it.
+ * bufs		Number of provided buffers, a power of 2.
+ * bufsize	Size of each.
+ *
+ * returns	New Uring, or NULL if io_uring isn't available or on error.
+ */
+Uring *uring_init(unsigned int entries, unsigned int bufs, int bufsize);
+
+/*
+ * Frees a Uring.  Anything still in progress is cancelled.
+ *
+ * u		Uring to free.
+ */
+void uring_free(Uring *u);
+
+/*
+ * Gets the next submission queue entry to fill in, cleared.  If the queue is
+ * full, what's in it is submitted first.
+ *
+ * u		Uring.
+ *
+ * returns	Entry, or NULL if the queue couldn't be submitted.
+ */
+struct io_uring_sqe *uring_sqe(Uring *u);
+
+/*
+ * Hands everything queued to the kernel in one system call, if there's
+ * anything, and optionally waits for a completion.
+ *
+ * u		Uring.
+ * wait		Nonzero to wait for at least one completion.
+ *
+ * returns	Entries submitted, -1 on error.
+ */
+int uring_submit(Uring *u, int wait);
+
+/*
+ * Gets the next completion, without a system call.
+ *
+ * u		Uring.
+ *
+ * returns	Completion, NULL if there are none.  Call uring_cqe_seen() when done with it.
+ */
+struct io_uring_cqe *uring_cqe(Uring *u);
+
+/*
+ * Finishes with the completion from uring_cqe().
+ *
+ * u		Uring.
+ */
+void uring_cqe_seen(Uring *u);
+
+/*
+ * Gets a provided buffer picked by a receive.
+ *
+ * u		Uring.
+ * bid		Buffer ID from the completion's flags.
+ *
+ * returns	The buffer.
+ */
+char *uring_buf(Uring *u, int bid);
+
+/*
+ * Gives a provided buffer back to be picked again.
+ *
+ * u		Uring.
+ * bid		Buffer ID.
+ */
+void uring_buf_return(Uring *u, int bid);
+
+#endif
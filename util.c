@@ -0,0 +1,42 @@
+#include <time.h>
+
+#include "util.h"
+
+uint64_t splitmix64(uint64_t *state) {
+	uint64_t z;
+
+	z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return(z ^ (z >> 31));
+}
+
+uint32_t fnv1a(const void *buf, size_t len) {
+	const unsigned char *b = buf;
+	uint32_t h = 0x811C9DC5;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= b[i];
+		h *= 0x01000193;
+	}
+
+	return(h);
+}
+
+int64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return((int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+int64_t now_us(void) {
+	return(now_ns() / 1000);
+}
+
+int64_t now_ms(void) {
+	return(now_ns() / 1000000);
+}
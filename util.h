@@ -0,0 +1,34 @@
+#ifndef __UTIL_H
+#define __UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Next number from a splitmix64 sequence, the same from the same seed
+ * wherever it runs.
+ *
+ * state	Seed, moved on by each call.
+ *
+ * returns	64 well mixed bits.
+ */
+uint64_t splitmix64(uint64_t *state);
+
+/*
+ * 32 bit FNV-1a, what names and anything else short are hashed with.
+ *
+ * buf		Bytes to hash.
+ * len		Length of buf.
+ *
+ * returns	Hash.
+ */
+uint32_t fnv1a(const void *buf, size_t len);
+
+/*
+ * The time now from CLOCK_MONOTONIC, in ns, us or ms.
+ */
+int64_t now_ns(void);
+int64_t now_us(void);
+int64_t now_ms(void);
+
+#endif
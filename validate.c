@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dict.h"
+
+#define BATCH_WORDS	(65536)
+#define BATCH_DATA	(BATCH_WORDS * 16)
+#define SUGGESTIONS	(5)
+#define SUGGEST_DIST	(2)
+
+static int quiet, suggest;
+static long total, found, invalid;
+
+static void print_suggestions(const Dict *d, const char *word, int len) {
+	int32_t ids[SUGGESTIONS];
+	const char *s;
+	int count, slen, i;
+
+	count = dict_suggest(d, word, len, SUGGEST_DIST, NULL, 0, NULL, ids, SUGGESTIONS);
+	for(i = 0; i < count; i++) {
+		s = dict_word(d, ids[i], &slen);
+		printf("%s%.*s", i == 0 ? "\t" : " ", slen, s);
+	}
+}
+
+static void run_batch(const Dict *d, WordArena *a, int32_t *ids) {
+	int i;
+
+	found += dict_validate_batch(d, a, ids);
+	total += a->words;
+	for(i = 0; i < a->words; i++) {
+		if(ids[i] == DICT_WORD_INVALID)
+			invalid++;
+		if(!quiet) {
+			printf("%i\t%.*s", ids[i], (int)a->len[i], &(a->data[a->offset[i]]));
+			if(suggest && ids[i] == -1)
+				print_suggestions(d, &(a->data[a->offset[i]]), a->len[i]);
+			printf("\n");
+		}
+	}
+	wordarena_reset(a);
+}
+
+int main(int argc, char **argv) {
+	Dict *d;
+	WordArena *a;
+	int32_t *ids;
+	FILE *in;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t linelen;
+	struct timespec start, end;
+	double elapsed;
+	int arg;
+
+	arg = 1;
+	quiet = 0;
+	suggest = 0;
+	for(; arg < argc; arg++) {
+		if(strcmp(argv[arg], "-q") == 0)
+			quiet = 1;
+		else if(strcmp(argv[arg], "-s") == 0)
+			suggest = 1;
+		else
+			break;
+	}
+	if(argc - arg != 1 && argc - arg != 2) {
+		fprintf(stderr, "Usage: %s [-q] [-s] <dictionary> [word list]\n", argv[0]);
+		goto error0;
+	}
+
+	d = dict_load(argv[arg]);
+	if(d == NULL) {
+		fprintf(stderr, "main(): Couldn't load dictionary.\n");
+		goto error0;
+	}
+
+	in = stdin;
+	if(argc - arg == 2) {
+		in = fopen(argv[arg + 1], "r");
+		if(in == NULL) {
+			perror("main(): fopen()");
+			goto error1;
+		}
+	}
+
+	a = wordarena_init(BATCH_WORDS, BATCH_DATA);
+	if(a == NULL) {
+		fprintf(stderr, "main(): Couldn't allocate memory.\n");
+		goto error2;
+	}
+	ids = malloc(sizeof(int32_t) * BATCH_WORDS);
+	if(ids == NULL) {
+		fprintf(stderr, "main(): Couldn't allocate memory.\n");
+		goto error3;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while((linelen = getline(&line, &linesize, in)) != -1) {
+		while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+			linelen--;
+		if(linelen > BATCH_DATA)
+			linelen = BATCH_DATA;
+		if(wordarena_add(a, line, linelen) == -1) {
+			run_batch(d, a, ids);
+			wordarena_add(a, line, linelen);
+		}
+	}
+	run_batch(d, a, ids);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "%li words, %li found, %li not found, %li invalid in %.3f seconds (%.0f words/s).\n",
+	        total, found, total - found - invalid, invalid, elapsed, elapsed > 0 ? total / elapsed : 0);
+
+	free(line);
+	free(ids);
+	wordarena_free(a);
+	if(in != stdin)
+		fclose(in);
+	dict_free(d);
+	exit(EXIT_SUCCESS);
+
+error3:
+	wordarena_free(a);
+error2:
+	if(in != stdin)
+		fclose(in);
+error1:
+	dict_free(d);
+error0:
+	exit(EXIT_FAILURE);
+}